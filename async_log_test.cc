@@ -0,0 +1,231 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/async_log.h"
+
+#include <stdlib.h>
+
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+constexpr char kPluginName[] = "async_log_test_plugin";
+constexpr char kBatchPluginName[] = "async_log_test_batch_plugin";
+
+// Values of the "path" request header seen by proxy_on_log and the threads it ran on.
+std::mutex logged_mutex;
+std::vector<std::pair<std::string, std::thread::id>> logged;
+
+// Batches of "path" request headers seen by proxy_on_log_batch and the deleted context ids.
+std::vector<std::vector<std::string>> logged_batches;
+std::vector<uint32_t> deleted;
+
+class AsyncLogNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_log") {
+      *f = [](ContextBase *context, Word) {
+        std::string_view path;
+        context->getHeaderMapValue(WasmHeaderMapType::RequestHeaders, "path", &path);
+        std::lock_guard<std::mutex> lock(logged_mutex);
+        logged.emplace_back(std::string(path), std::this_thread::get_id());
+      };
+    }
+  }
+};
+
+class BatchNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_delete") {
+      *f = [](ContextBase *, Word context_id) { deleted.push_back(context_id.u32()); };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallVoid<2> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_log_batch") {
+      *f = [](ContextBase *context, Word context_ids_ptr, Word count) {
+        auto context_ids = reinterpret_cast<uint32_t *>(context_ids_ptr.u64_);
+        std::vector<std::string> paths;
+        for (uint32_t i = 0; i < count.u32(); i++) {
+          // As if selected with proxy_set_effective_context.
+          auto stream = context->wasm()->getContext(context_ids[i]);
+          std::string_view path;
+          stream->getHeaderMapValue(WasmHeaderMapType::RequestHeaders, "path", &path);
+          paths.emplace_back(path);
+        }
+        logged_batches.push_back(paths);
+        ::free(context_ids);
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_test_plugin(kPluginName, []() {
+  return std::make_unique<AsyncLogNullVmPlugin>();
+});
+RegisterNullVmPluginFactory register_test_batch_plugin(kBatchPluginName, []() {
+  return std::make_unique<BatchNullVmPlugin>();
+});
+
+TEST(AsyncLog, SnapshotContext) {
+  TestContext stream;
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/snapshot");
+  stream.properties_[std::string("request\0id", 10)] = "42";
+  auto snapshot = StreamSnapshot::capture(&stream, {std::string("request\0id", 10), "missing"});
+  SnapshotContext context(nullptr, 0, nullptr, std::move(snapshot));
+
+  std::string_view value;
+  EXPECT_EQ(context.getHeaderMapValue(WasmHeaderMapType::RequestHeaders, "path", &value),
+            WasmResult::Ok);
+  EXPECT_EQ(value, "/snapshot");
+  EXPECT_EQ(context.getHeaderMapValue(WasmHeaderMapType::ResponseHeaders, "path", &value),
+            WasmResult::NotFound);
+  uint32_t size = 0;
+  EXPECT_EQ(context.getHeaderMapSize(WasmHeaderMapType::RequestHeaders, &size), WasmResult::Ok);
+  EXPECT_EQ(size, 13);
+
+  std::string property;
+  EXPECT_EQ(context.getProperty(std::string_view("request\0id", 10), &property), WasmResult::Ok);
+  EXPECT_EQ(property, "42");
+  EXPECT_EQ(context.getProperty("missing", &property), WasmResult::NotFound);
+  EXPECT_EQ(context.addHeaderMapValue(WasmHeaderMapType::RequestHeaders, "a", "b"),
+            WasmResult::Unimplemented);
+}
+
+TEST(AsyncLog, RunsOnExecutorThread) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->async_log_ = true;
+  auto factory = [](std::string_view vm_key) {
+    return std::make_shared<WasmHandleBase>(
+        std::make_shared<TestWasm<>>(createTestVm(), "vm", "", vm_key));
+  };
+  auto clone_factory = [](std::shared_ptr<WasmHandleBase> base_wasm) {
+    return std::make_shared<WasmHandleBase>(std::make_shared<TestWasm<>>(base_wasm, createTestVm));
+  };
+  auto base_wasm = createWasm(makeVmKey("vm", "", kPluginName), kPluginName, plugin, factory,
+                              clone_factory, false);
+  ASSERT_TRUE(base_wasm);
+  auto wasm_handle = getOrCreateThreadLocalWasm(base_wasm, plugin, clone_factory);
+  ASSERT_TRUE(wasm_handle);
+  auto wasm = wasm_handle->wasm().get();
+  auto root_id = wasm->getRootContext("root")->id();
+  logged.clear();
+
+  // No executor: the log is run synchronously.
+  EXPECT_FALSE(AsyncLogExecutor::accepting(wasm->vm_key()));
+  {
+    TestContext stream(wasm, root_id, plugin);
+    stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/sync");
+    stream.onCreate();
+    stream.onLog();
+    stream.onDelete();
+  }
+  ASSERT_EQ(logged.size(), 1);
+  EXPECT_EQ(logged[0].first, "/sync");
+  EXPECT_EQ(logged[0].second, std::this_thread::get_id());
+
+  {
+    // No room: likewise.
+    AsyncLogExecutor executor(base_wasm, clone_factory, 0);
+    EXPECT_FALSE(AsyncLogExecutor::accepting(wasm->vm_key()));
+  }
+  {
+    AsyncLogExecutor executor(base_wasm, clone_factory);
+    EXPECT_TRUE(AsyncLogExecutor::accepting(wasm->vm_key()));
+    TestContext stream(wasm, root_id, plugin);
+    stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/async");
+    stream.onCreate();
+    stream.onLog();
+    stream.onDelete();
+  }
+  // The executor has finished all pending logs once it is destroyed.
+  ASSERT_EQ(logged.size(), 2);
+  EXPECT_EQ(logged[1].first, "/async");
+  EXPECT_NE(logged[1].second, std::this_thread::get_id());
+}
+
+TEST(AsyncLog, Batched) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->log_batch_size_ = 3;
+  auto wasm = createTestWasm(kBatchPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  auto root_id = wasm->getRootContext("root")->id();
+  logged_batches.clear();
+  deleted.clear();
+  takePosted();
+
+  auto logStream = [&](std::string path) {
+    TestContext stream(wasm.get(), root_id, plugin);
+    stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", path);
+    stream.onCreate();
+    stream.onLog();
+    stream.onDelete();
+    return stream.id();
+  };
+
+  // Logs wait for the next event loop iteration.
+  auto first = logStream("/a");
+  auto second = logStream("/b");
+  EXPECT_TRUE(logged_batches.empty());
+  EXPECT_TRUE(deleted.empty());
+  auto posted = takePosted();
+  ASSERT_EQ(posted.size(), 1);
+  posted[0]();
+  ASSERT_EQ(logged_batches.size(), 1);
+  EXPECT_EQ(logged_batches[0], (std::vector<std::string>{"/a", "/b"}));
+  EXPECT_EQ(deleted, (std::vector<uint32_t>{first, second}));
+  EXPECT_EQ(wasm->getContext(first), nullptr);
+
+  // A full batch is flushed immediately.
+  logStream("/c");
+  logStream("/d");
+  logStream("/e");
+  ASSERT_EQ(logged_batches.size(), 2);
+  EXPECT_EQ(logged_batches[1], (std::vector<std::string>{"/c", "/d", "/e"}));
+  EXPECT_EQ(deleted.size(), 5);
+}
+
+TEST(AsyncLog, BatchedWithoutThreadFunction) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->log_batch_size_ = 3;
+  auto wasm = createTestWasm(kBatchPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  wasm->post_ = false;
+  logged_batches.clear();
+  deleted.clear();
+
+  // Nothing could flush a partial batch later, so each stream is logged straight away.
+  TestContext stream(wasm.get(), wasm->getRootContext("root")->id(), plugin);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/a");
+  stream.onCreate();
+  stream.onLog();
+  stream.onDelete();
+  ASSERT_EQ(logged_batches.size(), 1);
+  EXPECT_EQ(logged_batches[0], std::vector<std::string>{"/a"});
+  EXPECT_EQ(deleted, std::vector<uint32_t>{stream.id()});
+}
+
+} // namespace
+} // namespace proxy_wasm
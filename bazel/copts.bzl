@@ -0,0 +1,14 @@
+# Compiler options shared by the library, tests and benchmarks.
+COPTS = select({
+    "@bazel_tools//src/conditions:windows": [
+        "/std:c++17",
+    ],
+    "//conditions:default": [
+        "-std=c++17",
+    ],
+}) + select({
+    "//:zlib": [],
+    "//conditions:default": [
+        "-DWITHOUT_ZLIB",
+    ],
+})
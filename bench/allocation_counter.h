@@ -0,0 +1,28 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+namespace proxy_wasm {
+namespace bench {
+
+// The number of operator new allocations made so far by the process. Linking this library replaces
+// the global operator new and delete. The replacements live in their own translation unit so that
+// the compiler can not see malloc and free through them and pair them with new and delete.
+uint64_t allocationCount();
+
+} // namespace bench
+} // namespace proxy_wasm
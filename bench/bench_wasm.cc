@@ -0,0 +1,235 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bench/bench_wasm.h"
+
+#include <stdlib.h>
+
+#include <iostream>
+
+#include "include/proxy-wasm/null.h"
+#if defined(PROXY_WASM_HAS_RUNTIME_V8)
+#include "include/proxy-wasm/v8.h"
+#endif
+#if defined(PROXY_WASM_HAS_RUNTIME_WAVM)
+#include "include/proxy-wasm/wavm.h"
+#endif
+
+namespace proxy_wasm {
+namespace bench {
+
+const char kBenchNullVmPlugin[] = "bench_null_vm_plugin";
+
+namespace {
+
+RegisterNullVmPluginFactory register_bench_null_vm_plugin(kBenchNullVmPlugin, []() {
+  return std::make_unique<BenchNullVmPlugin>();
+});
+
+} // namespace
+
+void BenchNullVmPlugin::getFunction(std::string_view function_name, WasmCallWord<1> *f) {
+  if (function_name == "malloc") {
+    *f = [](ContextBase *, Word size) -> Word {
+      return Word(reinterpret_cast<uint64_t>(::malloc(size.u64_)));
+    };
+    return;
+  }
+  *f = nullptr;
+}
+
+void BenchVmIntegration::error(std::string_view message) { std::cerr << message << "\n"; }
+
+WasmResult BenchContext::defineMetric(uint32_t type, std::string_view name,
+                                      uint32_t *metric_id_ptr) {
+  auto root = static_cast<BenchContext *>(root_context());
+  if (root != this) {
+    return root->defineMetric(type, name, metric_id_ptr);
+  }
+  auto it = metric_ids_.find(std::string(name));
+  if (it != metric_ids_.end()) {
+    *metric_id_ptr = it->second;
+    return WasmResult::Ok;
+  }
+  uint32_t id;
+  if (type == static_cast<uint32_t>(MetricType::Counter)) {
+    id = wasm_->nextCounterMetricId();
+  } else if (type == static_cast<uint32_t>(MetricType::Gauge)) {
+    id = wasm_->nextGaugeMetricId();
+  } else if (type == static_cast<uint32_t>(MetricType::Histogram)) {
+    id = wasm_->nextHistogramMetricId();
+  } else {
+    return WasmResult::BadArgument;
+  }
+  metric_ids_[std::string(name)] = id;
+  metrics_[id] = 0;
+  *metric_id_ptr = id;
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::incrementMetric(uint32_t metric_id, int64_t offset) {
+  auto root = static_cast<BenchContext *>(root_context());
+  if (root != this) {
+    return root->incrementMetric(metric_id, offset);
+  }
+  auto it = metrics_.find(metric_id);
+  if (it == metrics_.end()) {
+    return WasmResult::NotFound;
+  }
+  it->second += offset;
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::recordMetric(uint32_t metric_id, uint64_t value) {
+  auto root = static_cast<BenchContext *>(root_context());
+  if (root != this) {
+    return root->recordMetric(metric_id, value);
+  }
+  auto it = metrics_.find(metric_id);
+  if (it == metrics_.end()) {
+    return WasmResult::NotFound;
+  }
+  it->second = value;
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::getMetric(uint32_t metric_id, uint64_t *value_ptr) {
+  auto root = static_cast<BenchContext *>(root_context());
+  if (root != this) {
+    return root->getMetric(metric_id, value_ptr);
+  }
+  auto it = metrics_.find(metric_id);
+  if (it == metrics_.end()) {
+    return WasmResult::NotFound;
+  }
+  *value_ptr = it->second;
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::addHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                                           std::string_view value) {
+  headerMap(type).emplace_back(std::string(key), std::string(value));
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::getHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                                           std::string_view *result) {
+  for (auto &p : headerMap(type)) {
+    if (p.first == key) {
+      *result = p.second;
+      return WasmResult::Ok;
+    }
+  }
+  return WasmResult::NotFound;
+}
+
+WasmResult BenchContext::getHeaderMapPairs(WasmHeaderMapType type, Pairs *result) {
+  auto &map = headerMap(type);
+  result->reserve(map.size());
+  for (auto &p : map) {
+    result->emplace_back(p.first, p.second);
+  }
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::setHeaderMapPairs(WasmHeaderMapType type, const Pairs &pairs) {
+  auto &map = headerMap(type);
+  map.clear();
+  for (auto &p : pairs) {
+    map.emplace_back(std::string(p.first), std::string(p.second));
+  }
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::removeHeaderMapValue(WasmHeaderMapType type, std::string_view key) {
+  auto &map = headerMap(type);
+  for (auto it = map.begin(); it != map.end();) {
+    if (it->first == key) {
+      it = map.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return WasmResult::Ok;
+}
+
+WasmResult BenchContext::replaceHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                                               std::string_view value) {
+  for (auto &p : headerMap(type)) {
+    if (p.first == key) {
+      p.second = std::string(value);
+      return WasmResult::Ok;
+    }
+  }
+  return addHeaderMapValue(type, key, value);
+}
+
+WasmResult BenchContext::getHeaderMapSize(WasmHeaderMapType type, uint32_t *result) {
+  uint32_t size = 0;
+  for (auto &p : headerMap(type)) {
+    size += p.first.size() + p.second.size();
+  }
+  *result = size;
+  return WasmResult::Ok;
+}
+
+std::unique_ptr<WasmVm> createBenchNullVm() { return createBenchVm("null"); }
+
+std::unique_ptr<WasmVm> createBenchVm(std::string_view runtime) {
+  std::unique_ptr<WasmVm> vm;
+  if (runtime == "null") {
+    vm = createNullVm();
+  }
+#if defined(PROXY_WASM_HAS_RUNTIME_V8)
+  if (runtime == "v8") {
+    vm = createV8Vm();
+  }
+#endif
+#if defined(PROXY_WASM_HAS_RUNTIME_WAVM)
+  if (runtime == "wavm") {
+    vm = createWavmVm();
+  }
+#endif
+  if (vm) {
+    vm->integration().reset(new BenchVmIntegration());
+  }
+  return vm;
+}
+
+WasmHandleFactory benchWasmHandleFactory(std::string runtime, std::string vm_id) {
+  return [runtime, vm_id](std::string_view vm_key) -> std::shared_ptr<WasmHandleBase> {
+    auto wasm = std::make_shared<BenchWasm>(createBenchVm(runtime), vm_id, "", vm_key);
+    return std::make_shared<WasmHandleBase>(wasm);
+  };
+}
+
+WasmHandleCloneFactory benchWasmHandleCloneFactory(std::string runtime) {
+  return [runtime](std::shared_ptr<WasmHandleBase> base_wasm) -> std::shared_ptr<WasmHandleBase> {
+    auto wasm =
+        std::make_shared<BenchWasm>(base_wasm, [runtime]() { return createBenchVm(runtime); });
+    return std::make_shared<WasmHandleBase>(wasm);
+  };
+}
+
+std::shared_ptr<BenchWasm> createBenchWasm(const std::shared_ptr<PluginBase> &plugin) {
+  auto wasm = std::make_shared<BenchWasm>(createBenchNullVm(), plugin->vm_id_, "",
+                                          makeVmKey(plugin->vm_id_, "", kBenchNullVmPlugin));
+  if (!wasm->initialize(kBenchNullVmPlugin) || !wasm->start(plugin)) {
+    return nullptr;
+  }
+  return wasm;
+}
+
+} // namespace bench
+} // namespace proxy_wasm
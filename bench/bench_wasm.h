@@ -0,0 +1,151 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "include/proxy-wasm/null_vm_plugin.h"
+#include "include/proxy-wasm/wasm.h"
+
+namespace proxy_wasm {
+namespace bench {
+
+// Name of the NullVm plugin registered by this library, used as the "code" of a NullVm.
+extern const char kBenchNullVmPlugin[];
+
+// A NullVm plugin which only exports malloc (backed by the native heap), which is all that is
+// required to drive the host side of the ABI directly from a benchmark.
+class BenchNullVmPlugin : public NullVmPlugin {
+public:
+  using NullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override;
+};
+
+// Integration which reports errors on stderr and provides no NullPlugin functions.
+struct BenchVmIntegration : public WasmVmIntegration {
+  WasmVmIntegration *clone() override { return new BenchVmIntegration(); }
+  void error(std::string_view message) override;
+  bool getNullVmFunction(std::string_view, bool, int, NullPlugin *, void *) override {
+    return false;
+  }
+};
+
+// A ContextBase with in-memory header maps, buffers and metrics, standing in for a proxy.
+class BenchContext : public ContextBase {
+public:
+  using HeaderMap = std::vector<std::pair<std::string, std::string>>;
+
+  BenchContext(WasmBase *wasm) : ContextBase(wasm) {}
+  BenchContext(WasmBase *wasm, const std::shared_ptr<PluginBase> &plugin)
+      : ContextBase(wasm, plugin) {}
+  BenchContext(WasmBase *wasm, uint32_t parent_context_id,
+               const std::shared_ptr<PluginBase> &plugin)
+      : ContextBase(wasm, parent_context_id, plugin) {}
+
+  HeaderMap &headerMap(WasmHeaderMapType type) {
+    return header_maps_[static_cast<size_t>(type)];
+  }
+  BufferBase &buffer(WasmBufferType type) { return buffers_[static_cast<size_t>(type)]; }
+  uint64_t log_bytes() const { return log_bytes_; }
+
+  // General
+  WasmResult log(uint32_t, std::string_view message) override {
+    log_bytes_ += message.size();
+    return WasmResult::Ok;
+  }
+  uint32_t getLogLevel() override { return static_cast<uint32_t>(LogLevel::trace); }
+  WasmResult getProperty(std::string_view, std::string *) override {
+    return WasmResult::NotFound;
+  }
+
+  // Buffer
+  BufferInterface *getBuffer(WasmBufferType type) override { return &buffer(type); }
+  bool endOfStream(WasmStreamType) override { return true; }
+
+  // Stream
+  WasmResult continueStream(WasmStreamType) override { return WasmResult::Ok; }
+  WasmResult closeStream(WasmStreamType) override { return WasmResult::Ok; }
+  void clearRouteCache() override {}
+
+  // Metrics, kept in the root context so that they are shared by its streams.
+  WasmResult defineMetric(uint32_t type, std::string_view name, uint32_t *metric_id_ptr) override;
+  WasmResult incrementMetric(uint32_t metric_id, int64_t offset) override;
+  WasmResult recordMetric(uint32_t metric_id, uint64_t value) override;
+  WasmResult getMetric(uint32_t metric_id, uint64_t *value_ptr) override;
+
+  // Header/Trailer/Metadata Maps
+  WasmResult addHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                               std::string_view value) override;
+  WasmResult getHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                               std::string_view *result) override;
+  WasmResult getHeaderMapPairs(WasmHeaderMapType type, Pairs *result) override;
+  WasmResult setHeaderMapPairs(WasmHeaderMapType type, const Pairs &pairs) override;
+  WasmResult removeHeaderMapValue(WasmHeaderMapType type, std::string_view key) override;
+  WasmResult replaceHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                                   std::string_view value) override;
+  WasmResult getHeaderMapSize(WasmHeaderMapType type, uint32_t *result) override;
+
+private:
+  HeaderMap header_maps_[static_cast<size_t>(WasmHeaderMapType::MAX) + 1];
+  BufferBase buffers_[static_cast<size_t>(WasmBufferType::MAX) + 1];
+  std::unordered_map<std::string, uint32_t> metric_ids_;
+  std::unordered_map<uint32_t, uint64_t> metrics_;
+  uint64_t log_bytes_ = 0;
+};
+
+// A WasmBase whose contexts are BenchContexts. Cross-thread callbacks (e.g. shared queue
+// notifications) are run inline.
+class BenchWasm : public WasmBase {
+public:
+  BenchWasm(std::unique_ptr<WasmVm> wasm_vm, std::string_view vm_id,
+            std::string_view vm_configuration, std::string_view vm_key)
+      : WasmBase(std::move(wasm_vm), vm_id, vm_configuration, vm_key) {}
+  BenchWasm(const std::shared_ptr<WasmHandleBase> &base_wasm_handle, WasmVmFactory factory)
+      : WasmBase(base_wasm_handle, factory) {}
+
+  CallOnThreadFunction callOnThreadFunction() override {
+    return [](std::function<void()> f) { f(); };
+  }
+  ContextBase *createVmContext() override { return new BenchContext(this); }
+  ContextBase *createRootContext(const std::shared_ptr<PluginBase> &plugin) override {
+    return new BenchContext(this, plugin);
+  }
+  ContextBase *createContext(const std::shared_ptr<PluginBase> &plugin) override {
+    return new BenchContext(this, plugin);
+  }
+};
+
+// Creates a NullVm running BenchNullVmPlugin with an integration installed.
+std::unique_ptr<WasmVm> createBenchNullVm();
+
+// Creates a VM for 'runtime' ("null", and "v8" or "wavm" when the binary is built with
+// PROXY_WASM_HAS_RUNTIME_V8 or PROXY_WASM_HAS_RUNTIME_WAVM) with an integration installed. Returns
+// nullptr if the runtime is not available.
+std::unique_ptr<WasmVm> createBenchVm(std::string_view runtime);
+
+// Factories for createWasm() and getOrCreateThreadLocalWasm() which create BenchWasms.
+WasmHandleFactory benchWasmHandleFactory(std::string runtime, std::string vm_id);
+WasmHandleCloneFactory benchWasmHandleCloneFactory(std::string runtime);
+
+// Creates a started BenchWasm (NullVm running BenchNullVmPlugin) with a root context for 'plugin'.
+// Returns nullptr on failure.
+std::shared_ptr<BenchWasm> createBenchWasm(const std::shared_ptr<PluginBase> &plugin);
+
+} // namespace bench
+} // namespace proxy_wasm
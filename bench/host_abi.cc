@@ -0,0 +1,252 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the host side of the ABI (src/exports.cc). The functions are called exactly
+// as a Wasm module would call them, through a NullVm whose "guest memory" is the native heap, so
+// the numbers measure marshalling and ContextBase dispatch rather than any runtime's trampolines.
+//
+//   bazel run -c opt //bench:host_abi
+//
+// Besides ns/op, every benchmark reports allocs/op: the number of operator new allocations made by
+// the host per call. The guest-side malloc of returned data is not included.
+
+#include <stdlib.h>
+
+#include <string>
+
+#include "benchmark/benchmark.h"
+#include "bench/allocation_counter.h"
+#include "bench/bench_wasm.h"
+
+namespace proxy_wasm {
+namespace bench {
+namespace {
+
+uint64_t ptr(const void *p) { return reinterpret_cast<uint64_t>(p); }
+uint64_t ptr(std::string_view s) { return reinterpret_cast<uint64_t>(s.data()); }
+
+// Owns a BenchWasm plus a stream context and makes it current for calls into exports::.
+class AbiFixture {
+public:
+  AbiFixture()
+      : plugin_(std::make_shared<PluginBase>("bench", "bench_root", "bench_vm", "null", "",
+                                             false)),
+        wasm_(createBenchWasm(plugin_)),
+        context_(std::make_unique<BenchContext>(
+            wasm_.get(), wasm_->getRootContext(plugin_->root_id_)->id(), plugin_)),
+        save_(context_.get()) {}
+
+  BenchContext *context() { return context_.get(); }
+
+  void addHeaders(WasmHeaderMapType type, int count) {
+    for (int i = 0; i < count; i++) {
+      context_->headerMap(type).emplace_back("x-header-name-" + std::to_string(i),
+                                             "header-value-" + std::to_string(i));
+    }
+  }
+
+private:
+  std::shared_ptr<PluginBase> plugin_;
+  std::shared_ptr<BenchWasm> wasm_;
+  std::unique_ptr<BenchContext> context_;
+  SaveRestoreContext save_;
+};
+
+class AllocationCounter {
+public:
+  explicit AllocationCounter(benchmark::State &state)
+      : state_(state), start_(allocationCount()) {}
+  ~AllocationCounter() {
+    auto count = allocationCount() - start_;
+    state_.counters["allocs/op"] =
+        benchmark::Counter(static_cast<double>(count), benchmark::Counter::kAvgIterations);
+  }
+
+private:
+  benchmark::State &state_;
+  const uint64_t start_;
+};
+
+const auto kRequestHeaders = static_cast<uint64_t>(WasmHeaderMapType::RequestHeaders);
+
+void BM_GetHeaderMapValue(benchmark::State &state) {
+  AbiFixture f;
+  f.addHeaders(WasmHeaderMapType::RequestHeaders, state.range(0));
+  // The last header is the worst case for a linear header map.
+  std::string key = "x-header-name-" + std::to_string(state.range(0) - 1);
+  uint64_t value_ptr = 0, value_size = 0;
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::get_header_map_value(nullptr, kRequestHeaders, ptr(key), key.size(),
+                                                ptr(&value_ptr), ptr(&value_size));
+    benchmark::DoNotOptimize(result);
+    free(reinterpret_cast<void *>(value_ptr));
+  }
+}
+BENCHMARK(BM_GetHeaderMapValue)->Arg(8)->Arg(32)->Arg(128);
+
+void BM_AddHeaderMapValue(benchmark::State &state) {
+  AbiFixture f;
+  f.addHeaders(WasmHeaderMapType::RequestHeaders, state.range(0));
+  auto &map = f.context()->headerMap(WasmHeaderMapType::RequestHeaders);
+  std::string key = "x-added-header";
+  std::string value = "added-header-value";
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::add_header_map_value(nullptr, kRequestHeaders, ptr(key), key.size(),
+                                                ptr(value), value.size());
+    benchmark::DoNotOptimize(result);
+    // Keep the map at its original size. This is not an ABI call and frees what was added.
+    map.pop_back();
+  }
+}
+BENCHMARK(BM_AddHeaderMapValue)->Arg(8)->Arg(32)->Arg(128);
+
+void BM_ReplaceHeaderMapValue(benchmark::State &state) {
+  AbiFixture f;
+  f.addHeaders(WasmHeaderMapType::RequestHeaders, state.range(0));
+  std::string key = "x-header-name-0";
+  std::string value = "replaced-header-value";
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::replace_header_map_value(nullptr, kRequestHeaders, ptr(key), key.size(),
+                                                    ptr(value), value.size());
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_ReplaceHeaderMapValue)->Arg(8)->Arg(32)->Arg(128);
+
+void BM_GetHeaderMapPairs(benchmark::State &state) {
+  AbiFixture f;
+  f.addHeaders(WasmHeaderMapType::RequestHeaders, state.range(0));
+  uint64_t pairs_ptr = 0, pairs_size = 0;
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result =
+        exports::get_header_map_pairs(nullptr, kRequestHeaders, ptr(&pairs_ptr), ptr(&pairs_size));
+    benchmark::DoNotOptimize(result);
+    free(reinterpret_cast<void *>(pairs_ptr));
+  }
+  state.SetBytesProcessed(state.iterations() * pairs_size);
+}
+BENCHMARK(BM_GetHeaderMapPairs)->Arg(8)->Arg(32)->Arg(128);
+
+void BM_GetBufferBytes(benchmark::State &state) {
+  AbiFixture f;
+  std::string body(state.range(0), 'b');
+  f.context()->buffer(WasmBufferType::HttpRequestBody).set(body);
+  uint64_t data_ptr = 0, data_size = 0;
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::get_buffer_bytes(
+        nullptr, static_cast<uint64_t>(WasmBufferType::HttpRequestBody), 0, body.size(),
+        ptr(&data_ptr), ptr(&data_size));
+    benchmark::DoNotOptimize(result);
+    free(reinterpret_cast<void *>(data_ptr));
+  }
+  state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_GetBufferBytes)->Arg(1 << 10)->Arg(16 << 10)->Arg(256 << 10)->Arg(1 << 20);
+
+void BM_SetSharedData(benchmark::State &state) {
+  AbiFixture f;
+  std::string key = "shared-key";
+  std::string value(state.range(0), 'v');
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result =
+        exports::set_shared_data(nullptr, ptr(key), key.size(), ptr(value), value.size(), 0);
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_SetSharedData)->Arg(16)->Arg(1 << 10);
+
+void BM_GetSharedData(benchmark::State &state) {
+  AbiFixture f;
+  std::string key = "shared-key";
+  std::string value(state.range(0), 'v');
+  exports::set_shared_data(nullptr, ptr(key), key.size(), ptr(value), value.size(), 0);
+  uint64_t value_ptr = 0, value_size = 0;
+  uint32_t cas = 0;
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::get_shared_data(nullptr, ptr(key), key.size(), ptr(&value_ptr),
+                                           ptr(&value_size), ptr(&cas));
+    benchmark::DoNotOptimize(result);
+    free(reinterpret_cast<void *>(value_ptr));
+  }
+}
+BENCHMARK(BM_GetSharedData)->Arg(16)->Arg(1 << 10);
+
+void BM_SharedQueueEnqueueDequeue(benchmark::State &state) {
+  AbiFixture f;
+  std::string queue_name = "bench_queue";
+  uint32_t token = 0;
+  exports::register_shared_queue(nullptr, ptr(queue_name), queue_name.size(), ptr(&token));
+  std::string message(state.range(0), 'm');
+  uint64_t data_ptr = 0, data_size = 0;
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    exports::enqueue_shared_queue(nullptr, token, ptr(message), message.size());
+    auto result = exports::dequeue_shared_queue(nullptr, token, ptr(&data_ptr), ptr(&data_size));
+    benchmark::DoNotOptimize(result);
+    free(reinterpret_cast<void *>(data_ptr));
+  }
+}
+BENCHMARK(BM_SharedQueueEnqueueDequeue)->Arg(16)->Arg(1 << 10);
+
+void BM_Log(benchmark::State &state) {
+  AbiFixture f;
+  std::string message(state.range(0), 'l');
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::log(nullptr, static_cast<uint64_t>(LogLevel::info), ptr(message),
+                               message.size());
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_Log)->Arg(64)->Arg(1 << 10);
+
+void BM_IncrementMetric(benchmark::State &state) {
+  AbiFixture f;
+  std::string name = "bench_counter";
+  uint32_t metric_id = 0;
+  exports::define_metric(nullptr, static_cast<uint64_t>(MetricType::Counter), ptr(name),
+                         name.size(), ptr(&metric_id));
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::increment_metric(nullptr, metric_id, 1);
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_IncrementMetric);
+
+void BM_DefineMetric(benchmark::State &state) {
+  AbiFixture f;
+  std::string name = "bench_counter";
+  uint32_t metric_id = 0;
+  AllocationCounter counter(state);
+  for (auto _ : state) {
+    auto result = exports::define_metric(nullptr, static_cast<uint64_t>(MetricType::Counter),
+                                         ptr(name), name.size(), ptr(&metric_id));
+    benchmark::DoNotOptimize(result);
+  }
+}
+BENCHMARK(BM_DefineMetric);
+
+} // namespace
+} // namespace bench
+} // namespace proxy_wasm
+
+BENCHMARK_MAIN();
@@ -0,0 +1,353 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end load harness for an HTTP filter plugin. A base VM is created with createWasm() and
+// each of N threads runs a thread-local clone, pushing synthetic streams through the full
+// lifecycle: onCreate, request headers/body, response headers/body, onDone, onLog and onDelete.
+// Bodies are delivered in --chunk_size pieces, with end_of_stream set only on the last one.
+// Throughput and per-stream latency percentiles are reported for the selected runtime.
+//
+//   bazel run -c opt //bench:http_filter_load -- --runtime=null --threads=4 --streams=100000
+//   bazel run -c opt //bench:http_filter_load -- --runtime=v8 --wasm=/path/to/filter.wasm
+//
+// The "null" runtime runs a built-in filter which exercises a typical mix of ABI calls. The "v8"
+// and "wavm" runtimes run the given module and are available when the binary is built with
+// PROXY_WASM_HAS_RUNTIME_V8 or PROXY_WASM_HAS_RUNTIME_WAVM and linked with that runtime.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench/bench_wasm.h"
+
+namespace proxy_wasm {
+namespace bench {
+namespace {
+
+const char kHttpFilterPlugin[] = "bench_http_filter";
+
+uint64_t ptr(std::string_view s) { return reinterpret_cast<uint64_t>(s.data()); }
+uint64_t ptr(const void *p) { return reinterpret_cast<uint64_t>(p); }
+
+// Guest side of the built-in filter, written against exports:: the same way the NullVm SDK calls
+// the host (including making the calling context current). It reads and mutates headers, reads
+// each body chunk as it arrives and updates a counter on each log.
+class HttpFilterPlugin : public BenchNullVmPlugin {
+public:
+  using BenchNullVmPlugin::getFunction;
+
+  void getFunction(std::string_view function_name, WasmCallVoid<2> *f) override {
+    if (function_name == "proxy_on_context_create") {
+      *f = [this](ContextBase *context, Word, Word parent_context_id) {
+        SaveRestoreContext saved_context(context);
+        if (parent_context_id == 0) {
+          std::string_view name = "bench_requests_total";
+          exports::define_metric(nullptr, static_cast<uint64_t>(MetricType::Counter), ptr(name),
+                                 name.size(), ptr(&requests_metric_));
+        }
+      };
+      return;
+    }
+    *f = nullptr;
+  }
+
+  void getFunction(std::string_view function_name, WasmCallWord<3> *f) override {
+    if (function_name == "proxy_on_request_headers") {
+      *f = [](ContextBase *context, Word, Word, Word) -> Word {
+        SaveRestoreContext saved_context(context);
+        getHeader(WasmHeaderMapType::RequestHeaders, ":path");
+        getHeader(WasmHeaderMapType::RequestHeaders, "user-agent");
+        std::string_view key = "x-bench-filter", value = "1";
+        exports::add_header_map_value(nullptr, headerType(WasmHeaderMapType::RequestHeaders),
+                                      ptr(key), key.size(), ptr(value), value.size());
+        return static_cast<uint64_t>(FilterHeadersStatus::Continue);
+      };
+    } else if (function_name == "proxy_on_request_body") {
+      *f = [](ContextBase *context, Word, Word body_size, Word) -> Word {
+        SaveRestoreContext saved_context(context);
+        getBody(WasmBufferType::HttpRequestBody, body_size);
+        return static_cast<uint64_t>(FilterDataStatus::Continue);
+      };
+    } else if (function_name == "proxy_on_response_headers") {
+      *f = [](ContextBase *context, Word, Word, Word) -> Word {
+        SaveRestoreContext saved_context(context);
+        getHeader(WasmHeaderMapType::ResponseHeaders, ":status");
+        std::string_view key = "server", value = "bench";
+        exports::replace_header_map_value(nullptr, headerType(WasmHeaderMapType::ResponseHeaders),
+                                          ptr(key), key.size(), ptr(value), value.size());
+        return static_cast<uint64_t>(FilterHeadersStatus::Continue);
+      };
+    } else if (function_name == "proxy_on_response_body") {
+      *f = [](ContextBase *context, Word, Word body_size, Word) -> Word {
+        SaveRestoreContext saved_context(context);
+        getBody(WasmBufferType::HttpResponseBody, body_size);
+        return static_cast<uint64_t>(FilterDataStatus::Continue);
+      };
+    } else {
+      *f = nullptr;
+    }
+  }
+
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override {
+    if (function_name == "proxy_on_done") {
+      *f = [](ContextBase *, Word) -> Word { return 1; };
+      return;
+    }
+    BenchNullVmPlugin::getFunction(function_name, f);
+  }
+
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    if (function_name == "proxy_on_log") {
+      *f = [this](ContextBase *context, Word) {
+        SaveRestoreContext saved_context(context);
+        getHeader(WasmHeaderMapType::RequestHeaders, ":authority");
+        getHeader(WasmHeaderMapType::ResponseHeaders, "content-length");
+        exports::increment_metric(nullptr, requests_metric_, 1);
+      };
+    } else if (function_name == "proxy_on_delete") {
+      *f = [](ContextBase *, Word) {};
+    } else {
+      *f = nullptr;
+    }
+  }
+
+private:
+  static uint64_t headerType(WasmHeaderMapType type) { return static_cast<uint64_t>(type); }
+
+  static void getHeader(WasmHeaderMapType type, std::string_view key) {
+    uint64_t value_ptr = 0, value_size = 0;
+    if (exports::get_header_map_value(nullptr, headerType(type), ptr(key), key.size(),
+                                      ptr(&value_ptr), ptr(&value_size)) ==
+        static_cast<uint64_t>(WasmResult::Ok)) {
+      free(reinterpret_cast<void *>(value_ptr));
+    }
+  }
+
+  static void getBody(WasmBufferType type, Word size) {
+    uint64_t data_ptr = 0, data_size = 0;
+    if (exports::get_buffer_bytes(nullptr, static_cast<uint64_t>(type), 0, size, ptr(&data_ptr),
+                                  ptr(&data_size)) == static_cast<uint64_t>(WasmResult::Ok)) {
+      free(reinterpret_cast<void *>(data_ptr));
+    }
+  }
+
+  uint32_t requests_metric_ = 0;
+};
+
+RegisterNullVmPluginFactory register_http_filter_plugin(kHttpFilterPlugin, []() {
+  return std::make_unique<HttpFilterPlugin>();
+});
+
+struct Options {
+  std::string runtime = "null";
+  std::string wasm_path;
+  std::string root_id;
+  int threads = 1;
+  int streams = 100000; // Per thread.
+  int headers = 16;
+  int body_size = 1024;
+  int chunk_size = 16384; // 0 delivers each body in one call.
+};
+
+bool parseOptions(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    auto eq = arg.find('=');
+    if (arg.substr(0, 2) != "--" || eq == std::string_view::npos) {
+      return false;
+    }
+    auto name = arg.substr(2, eq - 2);
+    auto value = std::string(arg.substr(eq + 1));
+    if (name == "runtime") {
+      options->runtime = value;
+    } else if (name == "wasm") {
+      options->wasm_path = value;
+    } else if (name == "root_id") {
+      options->root_id = value;
+    } else if (name == "threads") {
+      options->threads = atoi(value.c_str());
+    } else if (name == "streams") {
+      options->streams = atoi(value.c_str());
+    } else if (name == "headers") {
+      options->headers = atoi(value.c_str());
+    } else if (name == "body_size") {
+      options->body_size = atoi(value.c_str());
+    } else if (name == "chunk_size") {
+      options->chunk_size = atoi(value.c_str());
+    } else {
+      return false;
+    }
+  }
+  return options->threads > 0 && options->streams > 0 && options->headers >= 0 &&
+         options->body_size >= 0 && options->chunk_size >= 0 &&
+         (options->runtime == "null" || !options->wasm_path.empty());
+}
+
+// Delivers 'body' to 'context' as a request or response body, in chunks of at most 'chunk_size'
+// bytes (all of it if 0). Each chunk replaces the contents of the buffer, as a proxy would pass on
+// the data which arrived since the last call.
+void sendBody(BenchContext &context, WasmBufferType type, std::string_view body,
+              size_t chunk_size) {
+  if (chunk_size == 0) {
+    chunk_size = body.size();
+  }
+  for (size_t offset = 0; offset < body.size(); offset += chunk_size) {
+    auto chunk = body.substr(offset, chunk_size);
+    bool end_of_stream = offset + chunk.size() == body.size();
+    context.buffer(type).set(chunk);
+    if (type == WasmBufferType::HttpRequestBody) {
+      context.onRequestBody(chunk.size(), end_of_stream);
+    } else {
+      context.onResponseBody(chunk.size(), end_of_stream);
+    }
+  }
+}
+
+// Runs 'options.streams' streams through a thread-local clone of 'base_wasm', returning the
+// latency of each one in nanoseconds.
+std::vector<uint64_t> runWorker(const Options &options, std::shared_ptr<WasmHandleBase> base_wasm,
+                                std::shared_ptr<PluginBase> plugin) {
+  std::vector<uint64_t> latencies;
+  auto wasm_handle = getOrCreateThreadLocalWasm(base_wasm, plugin,
+                                                benchWasmHandleCloneFactory(options.runtime));
+  if (!wasm_handle) {
+    fprintf(stderr, "failed to create thread-local VM\n");
+    return latencies;
+  }
+  auto wasm = wasm_handle->wasm();
+  auto root_context_id = wasm->getRootContext(plugin->root_id_)->id();
+
+  BenchContext::HeaderMap request_headers = {
+      {":method", "POST"}, {":path", "/bench"}, {":authority", "bench.local"}, {"user-agent", "b"}};
+  BenchContext::HeaderMap response_headers = {
+      {":status", "200"}, {"content-length", std::to_string(options.body_size)}};
+  for (int i = 0; i < options.headers; i++) {
+    request_headers.emplace_back("x-request-header-" + std::to_string(i), "value");
+    response_headers.emplace_back("x-response-header-" + std::to_string(i), "value");
+  }
+  std::string body(options.body_size, 'b');
+
+  latencies.reserve(options.streams);
+  for (int i = 0; i < options.streams; i++) {
+    auto start = std::chrono::steady_clock::now();
+    {
+      BenchContext context(wasm.get(), root_context_id, plugin);
+      context.headerMap(WasmHeaderMapType::RequestHeaders) = request_headers;
+      context.headerMap(WasmHeaderMapType::ResponseHeaders) = response_headers;
+
+      context.onCreate();
+      context.onRequestHeaders(request_headers.size(), body.empty());
+      sendBody(context, WasmBufferType::HttpRequestBody, body, options.chunk_size);
+      context.onResponseHeaders(response_headers.size(), body.empty());
+      sendBody(context, WasmBufferType::HttpResponseBody, body, options.chunk_size);
+      context.onDone();
+      context.onLog();
+      context.onDelete();
+    }
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+  }
+  return latencies;
+}
+
+double percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1));
+  return sorted[index] / 1000.0;
+}
+
+int run(int argc, char **argv) {
+  Options options;
+  if (!parseOptions(argc, argv, &options)) {
+    fprintf(stderr,
+            "usage: %s [--runtime=null|v8|wavm] [--wasm=<file>] [--root_id=<id>] "
+            "[--threads=N] [--streams=N] [--headers=N] [--body_size=BYTES] [--chunk_size=BYTES]\n",
+            argv[0]);
+    return 1;
+  }
+
+  std::string code = kHttpFilterPlugin;
+  if (options.runtime != "null") {
+    std::ifstream file(options.wasm_path, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    code = contents.str();
+    if (!file || code.empty()) {
+      fprintf(stderr, "unable to read %s\n", options.wasm_path.c_str());
+      return 1;
+    }
+  }
+  if (!createBenchVm(options.runtime)) {
+    fprintf(stderr, "runtime %s is not available in this build\n", options.runtime.c_str());
+    return 1;
+  }
+
+  auto plugin = std::make_shared<PluginBase>("bench", options.root_id, "bench_vm",
+                                             options.runtime, "", false);
+  auto vm_key = makeVmKey(plugin->vm_id_, "", code);
+  auto base_wasm = createWasm(vm_key, code, plugin,
+                              benchWasmHandleFactory(options.runtime, plugin->vm_id_),
+                              benchWasmHandleCloneFactory(options.runtime), false);
+  if (!base_wasm) {
+    fprintf(stderr, "failed to create the base VM\n");
+    return 1;
+  }
+
+  std::vector<std::vector<uint64_t>> results(options.threads);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < options.threads; i++) {
+    threads.emplace_back([&, i]() { results[i] = runWorker(options, base_wasm, plugin); });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::vector<uint64_t> latencies;
+  for (auto &result : results) {
+    latencies.insert(latencies.end(), result.begin(), result.end());
+  }
+  if (latencies.size() != static_cast<size_t>(options.threads) * options.streams) {
+    fprintf(stderr, "some workers failed\n");
+    return 1;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("runtime=%s threads=%d streams=%zu headers=%d body_size=%d chunk_size=%d\n",
+         options.runtime.c_str(), options.threads, latencies.size(), options.headers,
+         options.body_size, options.chunk_size);
+  printf("throughput: %.0f streams/s\n", latencies.size() / elapsed.count());
+  printf("latency (us): p50=%.2f p90=%.2f p99=%.2f p99.9=%.2f max=%.2f\n",
+         percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+         percentile(latencies, 99.9), percentile(latencies, 100));
+  return 0;
+}
+
+} // namespace
+} // namespace bench
+} // namespace proxy_wasm
+
+int main(int argc, char **argv) { return proxy_wasm::bench::run(argc, argv); }
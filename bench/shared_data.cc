@@ -0,0 +1,159 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contention on the process-wide shared data and shared queue store (see SharedData in
+// src/context.cc) from 1..N threads.
+//
+//   bazel run -c opt //bench:shared_data -- --benchmark_counters_tabular=true
+//
+// Every thread owns its own BenchWasm and root context with the same vm_id, as a worker thread
+// would, so all threads hit the same key space. Throughput is reported as items_per_second summed
+// over threads against wall-clock time; comparing it across the thread counts of one argument set
+// gives the scaling curve. Arguments are:
+//   - BM_SharedData: read percentage, number of distinct keys, value size in bytes;
+//   - BM_SharedQueue: number of queues shared by the threads, message size in bytes. Each item is
+//     one enqueue followed by one dequeue. Queue-ready notifications run inline and find no
+//     thread-local VM, so the host side of the notification is not included.
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "bench/bench_wasm.h"
+
+namespace proxy_wasm {
+namespace bench {
+namespace {
+
+// Per-thread fast PRNG (xorshift64*) so that key selection does not itself contend.
+class Random {
+public:
+  explicit Random(uint64_t seed) : state_(seed * 0x9e3779b97f4a7c15ULL + 1) {}
+  uint64_t next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 0x2545f4914f6cdd1dULL;
+  }
+
+private:
+  uint64_t state_;
+};
+
+std::shared_ptr<PluginBase> makePlugin() {
+  return std::make_shared<PluginBase>("bench", "bench_root", "bench_shared_vm", "null", "", false);
+}
+
+// Distinct small index per benchmark thread, used for seeding and spreading threads over queues.
+std::atomic<uint32_t> next_thread_index{0};
+
+void threadCounts(benchmark::internal::Benchmark *b) {
+  int max_threads = std::max(2u, std::thread::hardware_concurrency());
+  for (int threads = 1; threads < max_threads; threads *= 2) {
+    b->Threads(threads);
+  }
+  b->Threads(max_threads);
+}
+
+void sharedDataArgs(benchmark::internal::Benchmark *b) {
+  for (int read_percent : {100, 90, 50, 0}) {
+    for (int keys : {1, 1024}) {
+      for (int value_size : {16, 4096}) {
+        b->Args({read_percent, keys, value_size});
+      }
+    }
+  }
+  threadCounts(b);
+}
+
+void sharedQueueArgs(benchmark::internal::Benchmark *b) {
+  for (int queues : {1, 16}) {
+    for (int message_size : {16, 4096}) {
+      b->Args({queues, message_size});
+    }
+  }
+  threadCounts(b);
+}
+
+void BM_SharedData(benchmark::State &state) {
+  const int read_percent = state.range(0);
+  const int keys = state.range(1);
+  const std::string value(state.range(2), 'v');
+
+  auto plugin = makePlugin();
+  auto wasm = createBenchWasm(plugin);
+  if (!wasm) {
+    state.SkipWithError("createBenchWasm failed");
+    return;
+  }
+  auto context = wasm->getRootContext(plugin->root_id_);
+  std::vector<std::string> key_names;
+  for (int i = 0; i < keys; i++) {
+    key_names.push_back("shared-key-" + std::to_string(i));
+    context->setSharedData(key_names.back(), value, 0);
+  }
+
+  Random random(++next_thread_index);
+  std::pair<std::string, uint32_t> data;
+  for (auto _ : state) {
+    auto r = random.next();
+    auto &key = key_names[(r >> 8) % keys];
+    if (static_cast<int>(r % 100) < read_percent) {
+      benchmark::DoNotOptimize(context->getSharedData(key, &data));
+    } else {
+      benchmark::DoNotOptimize(context->setSharedData(key, value, 0));
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SharedData)
+    ->ArgNames({"read_pct", "keys", "value_size"})
+    ->Apply(sharedDataArgs)
+    ->UseRealTime();
+
+void BM_SharedQueue(benchmark::State &state) {
+  const int queues = state.range(0);
+  const std::string message(state.range(1), 'm');
+
+  auto plugin = makePlugin();
+  auto wasm = createBenchWasm(plugin);
+  if (!wasm) {
+    state.SkipWithError("createBenchWasm failed");
+    return;
+  }
+  auto context = wasm->getRootContext(plugin->root_id_);
+  SharedQueueDequeueToken token = 0;
+  context->registerSharedQueue("shared-queue-" + std::to_string(next_thread_index++ % queues),
+                               &token);
+
+  std::string data;
+  for (auto _ : state) {
+    context->enqueueSharedQueue(token, message);
+    benchmark::DoNotOptimize(context->dequeueSharedQueue(token, &data));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SharedQueue)
+    ->ArgNames({"queues", "msg_size"})
+    ->Apply(sharedQueueArgs)
+    ->UseRealTime();
+
+} // namespace
+} // namespace bench
+} // namespace proxy_wasm
+
+BENCHMARK_MAIN();
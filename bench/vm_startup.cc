@@ -0,0 +1,305 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// VM startup and clone latency across module sizes.
+//
+//   bazel run -c opt //bench:vm_startup
+//
+// Modules are generated in-process with a configurable number of functions, imports and exports,
+// so no .wasm files need to be checked in. For each available runtime this reports:
+//   - BM_CreateWasm: createWasm() for a new vm_key, i.e. load, link, start and the configuration
+//     canary clone;
+//   - BM_CreateThreadLocalWasm: cloning the base VM for a worker, then start and configure.
+// The per-phase split (load, link, startVm, clone, configure) comes from the lifecycle trace
+// spans and is reported as microseconds per iteration, along with the RSS growth per VM while
+// the VM is alive. The "null" runtime does not load modules and is included as a floor.
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "bench/bench_wasm.h"
+#include "include/proxy-wasm/trace.h"
+
+namespace proxy_wasm {
+namespace bench {
+namespace {
+
+// Minimal encoder for the subset of the binary format needed to build proxy-wasm modules.
+class ModuleBuilder {
+public:
+  // A module exporting memory, malloc and the 0.2.1 ABI marker, with 'imports' imports of
+  // env.proxy_log and 'functions' internal functions of roughly 'instructions' instructions each,
+  // the first 'exports' of which are exported as f0, f1...
+  static std::string build(int functions, int imports, int exports, int instructions) {
+    std::string types;
+    u32(&types, 3);
+    types += "\x60\x01\x7f\x01\x7f";         // 0: (i32) -> i32
+    types += std::string("\x60\x00\x00", 3); // 1: () -> ()
+    types += "\x60\x03\x7f\x7f\x7f\x01\x7f"; // 2: (i32, i32, i32) -> i32
+
+    std::string import_section;
+    u32(&import_section, imports);
+    for (int i = 0; i < imports; i++) {
+      name(&import_section, "env");
+      name(&import_section, "proxy_log");
+      import_section += std::string("\x00\x02", 2); // func, type 2
+    }
+
+    std::string function_section;
+    u32(&function_section, functions + 2);
+    function_section += std::string("\x00\x01", 2); // malloc, proxy_abi_version_0_2_1
+    for (int i = 0; i < functions; i++) {
+      function_section += '\x01';
+    }
+
+    std::string memory_section;
+    u32(&memory_section, 1);
+    memory_section += std::string("\x00\x02", 2); // min 2 pages, no max
+
+    std::string export_section;
+    u32(&export_section, exports + 3);
+    name(&export_section, "memory");
+    export_section += std::string("\x02\x00", 2);
+    name(&export_section, "malloc");
+    export_section += '\x00';
+    u32(&export_section, imports);
+    name(&export_section, "proxy_abi_version_0_2_1");
+    export_section += '\x00';
+    u32(&export_section, imports + 1);
+    for (int i = 0; i < exports; i++) {
+      name(&export_section, "f" + std::to_string(i));
+      export_section += '\x00';
+      u32(&export_section, imports + 2 + i);
+    }
+
+    std::string code_section;
+    u32(&code_section, functions + 2);
+    body(&code_section, "\x41\x80\x08\x0b"); // malloc: i32.const 1024
+    body(&code_section, "\x0b");
+    for (int i = 0; i < functions; i++) {
+      std::string code;
+      for (int j = 0; j + 4 <= instructions; j += 4) {
+        code += '\x41'; // i32.const
+        s32(&code, i + j);
+        code += '\x41'; // i32.const
+        s32(&code, j);
+        code += "\x6a\x1a"; // i32.add, drop
+      }
+      code += '\x0b';
+      body(&code_section, code);
+    }
+
+    std::string module("\0asm\x01\0\0\0", 8);
+    section(&module, 1, types);
+    section(&module, 2, import_section);
+    section(&module, 3, function_section);
+    section(&module, 5, memory_section);
+    section(&module, 7, export_section);
+    section(&module, 10, code_section);
+    return module;
+  }
+
+private:
+  static void u32(std::string *out, uint32_t value) {
+    do {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      if (value) {
+        byte |= 0x80;
+      }
+      *out += static_cast<char>(byte);
+    } while (value);
+  }
+  static void s32(std::string *out, int32_t value) {
+    while (true) {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+        *out += static_cast<char>(byte);
+        return;
+      }
+      *out += static_cast<char>(byte | 0x80);
+    }
+  }
+  static void name(std::string *out, std::string_view s) {
+    u32(out, s.size());
+    *out += s;
+  }
+  static void body(std::string *out, std::string_view code) {
+    u32(out, code.size() + 1);
+    *out += '\x00'; // No locals.
+    *out += code;
+  }
+  static void section(std::string *out, uint8_t id, const std::string &contents) {
+    *out += static_cast<char>(id);
+    u32(out, contents.size());
+    *out += contents;
+  }
+};
+
+size_t residentBytes() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) {
+    return 0;
+  }
+  size_t size = 0, resident = 0;
+  if (fscanf(f, "%zu %zu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Collects the lifecycle spans recorded during a benchmark and reports them as counters.
+class PhaseCounters {
+public:
+  PhaseCounters() : sink_(std::make_shared<ChromeTraceSink>()) { setTraceSink(sink_); }
+  ~PhaseCounters() { setTraceSink(nullptr); }
+
+  void report(benchmark::State &state) {
+    std::map<std::string, double> totals;
+    for (auto &span : sink_->spans()) {
+      totals[span.name] += std::chrono::duration<double, std::micro>(span.duration).count();
+    }
+    for (auto &phase : {"load", "link", "startVm", "clone", "configure"}) {
+      state.counters[std::string(phase) + "_us"] =
+          benchmark::Counter(totals[phase], benchmark::Counter::kAvgIterations);
+    }
+  }
+
+private:
+  std::shared_ptr<ChromeTraceSink> sink_;
+};
+
+struct ModuleParams {
+  std::string runtime;
+  int functions;
+  int imports;
+  int exports;
+};
+
+std::string codeFor(const ModuleParams &params) {
+  if (params.runtime == "null") {
+    return kBenchNullVmPlugin;
+  }
+  return ModuleBuilder::build(params.functions, params.imports, params.exports, 32);
+}
+
+std::shared_ptr<PluginBase> makePlugin(const ModuleParams &params) {
+  return std::make_shared<PluginBase>("bench", "", "bench_vm", params.runtime, "", false);
+}
+
+void BM_CreateWasm(benchmark::State &state, ModuleParams params) {
+  auto code = codeFor(params);
+  auto plugin = makePlugin(params);
+  auto vm_key = makeVmKey(plugin->vm_id_, "", code);
+  double rss_delta = 0;
+  state.counters["module_bytes"] = code.size();
+  PhaseCounters phases;
+  for (auto _ : state) {
+    state.PauseTiming();
+    clearWasmCachesForTesting();
+    auto rss_before = residentBytes();
+    state.ResumeTiming();
+    auto wasm = createWasm(vm_key, code, plugin, benchWasmHandleFactory(params.runtime, "bench_vm"),
+                           benchWasmHandleCloneFactory(params.runtime), false);
+    state.PauseTiming();
+    if (!wasm) {
+      state.SkipWithError("createWasm failed");
+      break;
+    }
+    rss_delta += static_cast<double>(residentBytes()) - rss_before;
+    wasm.reset();
+    state.ResumeTiming();
+  }
+  phases.report(state);
+  state.counters["rss_delta_kb"] =
+      benchmark::Counter(rss_delta / 1024, benchmark::Counter::kAvgIterations);
+}
+
+void BM_CreateThreadLocalWasm(benchmark::State &state, ModuleParams params) {
+  auto code = codeFor(params);
+  auto plugin = makePlugin(params);
+  clearWasmCachesForTesting();
+  auto base_wasm = createWasm(makeVmKey(plugin->vm_id_, "", code), code, plugin,
+                              benchWasmHandleFactory(params.runtime, "bench_vm"),
+                              benchWasmHandleCloneFactory(params.runtime), false);
+  if (!base_wasm) {
+    state.SkipWithError("createWasm failed");
+    return;
+  }
+  auto clone_factory = benchWasmHandleCloneFactory(params.runtime);
+  double rss_delta = 0;
+  PhaseCounters phases;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto rss_before = residentBytes();
+    state.ResumeTiming();
+    auto wasm = getOrCreateThreadLocalWasm(base_wasm, plugin, clone_factory);
+    state.PauseTiming();
+    if (!wasm) {
+      state.SkipWithError("getOrCreateThreadLocalWasm failed");
+      break;
+    }
+    rss_delta += static_cast<double>(residentBytes()) - rss_before;
+    wasm.reset();
+    // Drop the thread-local cache so that the next iteration clones again.
+    clearWasmCachesForTesting();
+    state.ResumeTiming();
+  }
+  phases.report(state);
+  state.counters["rss_delta_kb"] =
+      benchmark::Counter(rss_delta / 1024, benchmark::Counter::kAvgIterations);
+}
+
+void registerBenchmarks() {
+  for (std::string runtime : {"null", "v8", "wavm"}) {
+    if (!createBenchVm(runtime)) {
+      continue;
+    }
+    // {functions, imports, exports}
+    std::vector<std::array<int, 3>> shapes = {
+        {10, 1, 1}, {100, 10, 10}, {1000, 50, 100}, {10000, 100, 1000}};
+    if (runtime == "null") {
+      shapes = {{0, 0, 0}};
+    }
+    for (auto &shape : shapes) {
+      ModuleParams params{runtime, shape[0], shape[1], shape[2]};
+      auto suffix = "/" + runtime + "/functions:" + std::to_string(shape[0]) +
+                    "/imports:" + std::to_string(shape[1]) + "/exports:" + std::to_string(shape[2]);
+      benchmark::RegisterBenchmark(("BM_CreateWasm" + suffix).c_str(), BM_CreateWasm, params)
+          ->Unit(benchmark::kMicrosecond);
+      benchmark::RegisterBenchmark(("BM_CreateThreadLocalWasm" + suffix).c_str(),
+                                   BM_CreateThreadLocalWasm, params)
+          ->Unit(benchmark::kMicrosecond);
+    }
+  }
+}
+
+} // namespace
+} // namespace bench
+} // namespace proxy_wasm
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  proxy_wasm::bench::registerBenchmarks();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,114 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/clock.h"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/exports.h"
+#include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/wasm.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+TEST(EventLoopClock, CachesUntilReset) {
+  auto realtime = EventLoopClock::realtimeNanoseconds();
+  auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  EXPECT_LE(realtime, now);
+  EXPECT_GT(realtime, now - 1000000000);
+  auto monotonic = EventLoopClock::monotonicNanoseconds();
+  EXPECT_GE(EventLoopClock::monotonicNanoseconds(), monotonic);
+
+  EventLoopClock::update(1000, 2000);
+  EXPECT_EQ(EventLoopClock::realtimeNanoseconds(), 1000);
+  EXPECT_EQ(EventLoopClock::monotonicNanoseconds(), 2000);
+  ContextBase context;
+  EXPECT_EQ(context.getCurrentTimeNanoseconds(), 1000);
+  EXPECT_EQ(context.getMonotonicTimeNanoseconds(), 2000);
+  // The cache is per thread.
+  std::thread([] { EXPECT_GT(EventLoopClock::realtimeNanoseconds(), 1000); }).join();
+
+  EventLoopClock::update();
+  EXPECT_GE(EventLoopClock::monotonicNanoseconds(), monotonic);
+  EXPECT_GE(EventLoopClock::realtimeNanoseconds(), realtime);
+
+  EventLoopClock::reset();
+  EXPECT_GT(EventLoopClock::realtimeNanoseconds(), 1000);
+}
+
+// Memory allocated by the guest, released at the end of the test.
+std::vector<std::unique_ptr<char[]>> guest_heap;
+// The time page as read by the guest in proxy_on_tick.
+std::vector<std::pair<uint64_t, uint64_t>> ticks;
+
+class ClockNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override {
+    *f = nullptr;
+    if (function_name == "malloc") {
+      *f = [](ContextBase *, Word size) -> Word {
+        guest_heap.emplace_back(new char[size.u64_]);
+        return Word(reinterpret_cast<uint64_t>(guest_heap.back().get()));
+      };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_tick") {
+      *f = [](ContextBase *context, Word) {
+        // The Null VM's "linear memory" is the host heap.
+        SaveRestoreContext saved_context(context);
+        const uint64_t *page = nullptr;
+        ASSERT_EQ(exports::get_time_page(context, Word(reinterpret_cast<uint64_t>(&page))).u64_,
+                  static_cast<uint64_t>(WasmResult::Ok));
+        ticks.emplace_back(page[0], page[1]);
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_clock_plugin("clock_test_plugin", []() {
+  return std::make_unique<ClockNullVmPlugin>();
+});
+
+TEST(EventLoopClock, TimePage) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto wasm = createTestWasm<WasmBase>("clock_test_plugin", plugin);
+  ASSERT_TRUE(wasm);
+  auto root_context = wasm->getRootContext("root");
+
+  EventLoopClock::update(10, 20);
+  root_context->onTick(0);
+  // The page is refreshed on entry to each callback.
+  EventLoopClock::update(11, 21);
+  root_context->onTick(0);
+  EventLoopClock::reset();
+  ASSERT_EQ(ticks.size(), 2);
+  EXPECT_EQ(ticks[0], std::make_pair(uint64_t(10), uint64_t(20)));
+  EXPECT_EQ(ticks[1], std::make_pair(uint64_t(11), uint64_t(21)));
+  wasm.reset();
+  guest_heap.clear();
+}
+
+} // namespace
+} // namespace proxy_wasm
@@ -0,0 +1,382 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/thread_pool.h"
+#include "include/proxy-wasm/wasm.h"
+#include "src/sha256.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+std::shared_ptr<WasmBase> makeWasm() {
+  return std::make_shared<WasmBase>(createTestVm(), "vm", "", "vm_key");
+}
+
+// Call a foreign function, returning its result in 'result'.
+WasmResult call(WasmBase &wasm, std::string_view name, std::string_view arguments,
+                std::string *result) {
+  auto f = wasm.getForeignFunction(name);
+  if (!f) {
+    return WasmResult::NotFound;
+  }
+  result->clear();
+  return f(wasm, arguments, [result](size_t size) {
+    result->resize(size);
+    return result->data();
+  });
+}
+
+// Threads which ran "foreign_test_reverse".
+std::mutex reverse_threads_mutex;
+std::vector<std::thread::id> reverse_threads;
+
+RegisterAsyncForeignFunction register_reverse("foreign_test_reverse",
+                                              [](std::string_view arguments, std::string *result) {
+                                                {
+                                                  std::lock_guard<std::mutex> lock(
+                                                      reverse_threads_mutex);
+                                                  reverse_threads.push_back(
+                                                      std::this_thread::get_id());
+                                                }
+                                                if (arguments.empty()) {
+                                                  return WasmResult::BadArgument;
+                                                }
+                                                result->assign(arguments.rbegin(),
+                                                               arguments.rend());
+                                                return WasmResult::Ok;
+                                              });
+
+// (context id, token, CallData) seen by proxy_on_foreign_function.
+std::vector<std::tuple<uint32_t, uint32_t, std::string>> delivered;
+
+class AsyncNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallVoid<3> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_foreign_function") {
+      *f = [](ContextBase *context, Word context_id, Word token, Word data_size) {
+        // The Null VM's "linear memory" is the host heap.
+        char *data = nullptr;
+        size_t size = 0;
+        auto buffer = context->foreignFunctionResult();
+        if (data_size.u64_ > 0) {
+          EXPECT_EQ(buffer->copyTo(context->wasm(), 0, data_size.u64_,
+                                   reinterpret_cast<uint64_t>(&data),
+                                   reinterpret_cast<uint64_t>(&size)),
+                    WasmResult::Ok);
+        }
+        delivered.emplace_back(context_id.u32(), token.u32(), std::string(data, size));
+        ::free(data);
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_async_plugin("foreign_test_async_plugin", []() {
+  return std::make_unique<AsyncNullVmPlugin>();
+});
+
+// The CallData of an asynchronous foreign function.
+std::string callData(WasmResult status, std::string result = "") {
+  auto code = static_cast<uint32_t>(status);
+  return std::string(reinterpret_cast<const char *>(&code), sizeof(code)) + result;
+}
+
+std::string hex(std::string_view bytes) {
+  static const char digits[] = "0123456789abcdef";
+  std::string result;
+  for (unsigned char c : bytes) {
+    result += digits[c >> 4];
+    result += digits[c & 15];
+  }
+  return result;
+}
+
+TEST(Foreign, Sha256) {
+  auto wasm = makeWasm();
+  std::string output;
+  ASSERT_EQ(call(*wasm, "sha256", "", &output), WasmResult::Ok);
+  EXPECT_EQ(hex(output), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  ASSERT_EQ(call(*wasm, "sha256", "abc", &output), WasmResult::Ok);
+  EXPECT_EQ(hex(output), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  ASSERT_EQ(call(*wasm, "sha256", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                 &output),
+            WasmResult::Ok);
+  EXPECT_EQ(hex(output), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  ASSERT_EQ(call(*wasm, "sha256", std::string(1000000, 'a'), &output), WasmResult::Ok);
+  EXPECT_EQ(hex(output), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST(Foreign, HmacSha256) {
+  auto wasm = makeWasm();
+  auto arguments = [](std::string key, std::string message) {
+    uint32_t size = key.size();
+    return std::string(reinterpret_cast<char *>(&size), sizeof(size)) + key + message;
+  };
+  std::string output;
+  // RFC 4231 test cases 2 and 6.
+  ASSERT_EQ(call(*wasm, "hmac_sha256", arguments("Jefe", "what do ya want for nothing?"),
+                 &output),
+            WasmResult::Ok);
+  EXPECT_EQ(hex(output), "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+  ASSERT_EQ(call(*wasm, "hmac_sha256",
+                 arguments(std::string(131, '\xaa'),
+                           "Test Using Larger Than Block-Size Key - Hash Key First"),
+                 &output),
+            WasmResult::Ok);
+  EXPECT_EQ(hex(output), "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54");
+  EXPECT_EQ(call(*wasm, "hmac_sha256", arguments("key", "").substr(0, 5), &output),
+            WasmResult::BadArgument);
+}
+
+TEST(Foreign, Sha256Portable) {
+  if (!Sha256::accelerated()) {
+    GTEST_SKIP() << "no hardware implementation to compare against";
+  }
+  // Hash the same random inputs, fed in random pieces, with both implementations.
+  std::mt19937 random(1);
+  auto hash = [&random](const std::string &data, bool portable) {
+    auto was_portable = Sha256::forcePortable(portable);
+    Sha256 sha;
+    Sha256::forcePortable(was_portable);
+    size_t offset = 0;
+    while (offset < data.size()) {
+      auto n = std::min<size_t>(random() % 200, data.size() - offset);
+      sha.update(std::string_view(data).substr(offset, n));
+      offset += n;
+    }
+    return sha.finish();
+  };
+  for (int i = 0; i < 1000; i++) {
+    std::string data(random() % 1000, '\0');
+    for (auto &c : data) {
+      c = static_cast<char>(random());
+    }
+    EXPECT_EQ(hex(hash(data, true)), hex(hash(data, false))) << data.size();
+  }
+  EXPECT_FALSE(Sha256::forcePortable(false));
+}
+
+TEST(Foreign, Encoding) {
+  auto wasm = makeWasm();
+  std::string output;
+  // RFC 4648 test vectors.
+  std::vector<std::pair<std::string, std::string>> vectors = {
+      {"", ""},         {"f", "Zg=="},         {"fo", "Zm8="},        {"foo", "Zm9v"},
+      {"foob", "Zm9vYg=="}, {"fooba", "Zm9vYmE="}, {"foobar", "Zm9vYmFy"}};
+  for (auto &v : vectors) {
+    ASSERT_EQ(call(*wasm, "base64_encode", v.first, &output), WasmResult::Ok);
+    EXPECT_EQ(output, v.second);
+    ASSERT_EQ(call(*wasm, "base64_decode", v.second, &output), WasmResult::Ok);
+    EXPECT_EQ(output, v.first);
+  }
+  EXPECT_EQ(call(*wasm, "base64_decode", "Zg", &output), WasmResult::BadArgument);
+  EXPECT_EQ(call(*wasm, "base64_decode", "Z===", &output), WasmResult::BadArgument);
+  EXPECT_EQ(call(*wasm, "base64_decode", "Zm9-", &output), WasmResult::BadArgument);
+
+  ASSERT_EQ(call(*wasm, "base64_encode", "\xfb\xff", &output), WasmResult::Ok);
+  EXPECT_EQ(output, "+/8=");
+  ASSERT_EQ(call(*wasm, "base64url_encode", "\xfb\xff", &output), WasmResult::Ok);
+  EXPECT_EQ(output, "-_8");
+  ASSERT_EQ(call(*wasm, "base64url_decode", "-_8", &output), WasmResult::Ok);
+  EXPECT_EQ(output, "\xfb\xff");
+  ASSERT_EQ(call(*wasm, "base64url_decode", "-_8=", &output), WasmResult::Ok);
+  EXPECT_EQ(output, "\xfb\xff");
+  EXPECT_EQ(call(*wasm, "base64url_decode", "+/8=", &output), WasmResult::BadArgument);
+
+  ASSERT_EQ(call(*wasm, "hex_encode", std::string("\x00\x7f\xa5\xff", 4), &output),
+            WasmResult::Ok);
+  EXPECT_EQ(output, "007fa5ff");
+  ASSERT_EQ(call(*wasm, "hex_decode", "007FA5ff", &output), WasmResult::Ok);
+  EXPECT_EQ(output, std::string("\x00\x7f\xa5\xff", 4));
+  EXPECT_EQ(call(*wasm, "hex_decode", "abc", &output), WasmResult::BadArgument);
+  EXPECT_EQ(call(*wasm, "hex_decode", "zz", &output), WasmResult::BadArgument);
+}
+
+#ifndef WITHOUT_ZLIB
+
+std::string withHandle(const std::string &handle, std::string_view data) {
+  return handle + std::string(data);
+}
+
+TEST(Foreign, StreamingRoundTrip) {
+  auto wasm = makeWasm();
+  std::string body;
+  for (int i = 0; i < 100000; i++) {
+    body += std::to_string(i * 7919 % 1000);
+  }
+
+  std::string handle;
+  int32_t level = 9;
+  ASSERT_EQ(call(*wasm, "deflate_init", std::string_view(reinterpret_cast<char *>(&level), 4),
+                 &handle),
+            WasmResult::Ok);
+  ASSERT_EQ(handle.size(), 4);
+  std::string compressed;
+  std::string output;
+  for (size_t pos = 0; pos < body.size(); pos += 10000) {
+    ASSERT_EQ(call(*wasm, "deflate_chunk", withHandle(handle, body.substr(pos, 10000)), &output),
+              WasmResult::Ok);
+    compressed += output;
+  }
+  ASSERT_EQ(call(*wasm, "deflate_finish", handle, &output), WasmResult::Ok);
+  compressed += output;
+  EXPECT_LT(compressed.size(), body.size() / 2);
+  // Finished streams are closed.
+  EXPECT_EQ(call(*wasm, "deflate_chunk", handle, &output), WasmResult::NotFound);
+
+  ASSERT_EQ(call(*wasm, "inflate_init", "", &handle), WasmResult::Ok);
+  // Not a deflate stream.
+  EXPECT_EQ(call(*wasm, "deflate_chunk", handle, &output), WasmResult::NotFound);
+  std::string inflated;
+  for (size_t pos = 0; pos < compressed.size(); pos += 1000) {
+    auto last = pos + 1000 >= compressed.size();
+    ASSERT_EQ(call(*wasm, last ? "inflate_finish" : "inflate_chunk",
+                   withHandle(handle, compressed.substr(pos, 1000)), &output),
+              WasmResult::Ok);
+    inflated += output;
+  }
+  EXPECT_EQ(inflated, body);
+
+  // The one-shot functions produce the same format.
+  ASSERT_EQ(call(*wasm, "uncompress", compressed, &output), WasmResult::Ok);
+  EXPECT_EQ(output, body);
+  std::string zeros(1 << 20, '\0');
+  std::string compressed_zeros;
+  ASSERT_EQ(call(*wasm, "compress", zeros, &compressed_zeros), WasmResult::Ok);
+  ASSERT_EQ(call(*wasm, "uncompress", compressed_zeros, &output), WasmResult::Ok);
+  EXPECT_EQ(output, zeros);
+}
+
+TEST(Foreign, StreamingErrors) {
+  auto wasm = makeWasm();
+  auto other_wasm = makeWasm();
+  std::string handle;
+  std::string output;
+  int32_t level = 10;
+  EXPECT_EQ(call(*wasm, "deflate_init", std::string_view(reinterpret_cast<char *>(&level), 4),
+                 &handle),
+            WasmResult::BadArgument);
+  EXPECT_EQ(call(*wasm, "inflate_chunk", "", &output), WasmResult::BadArgument);
+
+  // Handles belong to the VM which opened them.
+  ASSERT_EQ(call(*wasm, "inflate_init", "", &handle), WasmResult::Ok);
+  EXPECT_EQ(call(*other_wasm, "inflate_chunk", handle, &output), WasmResult::NotFound);
+
+  // Truncated and corrupt input fail and close the stream.
+  std::string compressed;
+  ASSERT_EQ(call(*wasm, "compress", "hello world", &compressed), WasmResult::Ok);
+  EXPECT_EQ(call(*wasm, "inflate_finish", withHandle(handle, compressed.substr(0, 5)), &output),
+            WasmResult::SerializationFailure);
+  EXPECT_EQ(call(*wasm, "inflate_chunk", handle, &output), WasmResult::NotFound);
+  ASSERT_EQ(call(*wasm, "inflate_init", "", &handle), WasmResult::Ok);
+  EXPECT_EQ(call(*wasm, "inflate_chunk", withHandle(handle, "not zlib data"), &output),
+            WasmResult::SerializationFailure);
+  EXPECT_EQ(call(*wasm, "uncompress", compressed.substr(0, 5), &output),
+            WasmResult::SerializationFailure);
+
+  // Streams left open are dropped with their VM.
+  ASSERT_EQ(call(*other_wasm, "deflate_init", "", &handle), WasmResult::Ok);
+  other_wasm.reset();
+  EXPECT_EQ(call(*wasm, "deflate_chunk", handle, &output), WasmResult::NotFound);
+}
+
+#else
+
+TEST(Foreign, WithoutZlib) {
+  auto wasm = makeWasm();
+  std::string output;
+  EXPECT_EQ(call(*wasm, "deflate_init", "", &output), WasmResult::NotFound);
+  EXPECT_EQ(call(*wasm, "compress", "", &output), WasmResult::NotFound);
+}
+
+#endif
+
+TEST(Foreign, Async) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto wasm = createTestWasm("foreign_test_async_plugin", plugin);
+  ASSERT_TRUE(wasm);
+  auto root_context = wasm->getRootContext("root");
+  delivered.clear();
+  reverse_threads.clear();
+  takePosted();
+
+  uint32_t token = 0;
+  EXPECT_EQ(wasm->callAsyncForeignFunction(root_context, "missing", "", &token),
+            WasmResult::NotFound);
+
+  // Without a pool the function runs on the calling thread, but the result is still delivered
+  // later.
+  ASSERT_EQ(wasm->callAsyncForeignFunction(root_context, "foreign_test_reverse", "abc", &token),
+            WasmResult::Ok);
+  EXPECT_TRUE(delivered.empty());
+  for (auto &f : takePosted()) {
+    f();
+  }
+  ASSERT_EQ(delivered.size(), 1);
+  EXPECT_EQ(delivered[0], std::make_tuple(root_context->id(), token,
+                                          callData(WasmResult::Ok, "cba")));
+  EXPECT_EQ(reverse_threads.back(), std::this_thread::get_id());
+
+  {
+    ForeignFunctionThreadPool pool(2);
+    uint32_t failed_token = 0;
+    ASSERT_EQ(wasm->callAsyncForeignFunction(root_context, "foreign_test_reverse", "xyz", &token),
+              WasmResult::Ok);
+    ASSERT_EQ(wasm->callAsyncForeignFunction(root_context, "foreign_test_reverse", "",
+                                             &failed_token),
+              WasmResult::Ok);
+    EXPECT_NE(token, failed_token);
+  }
+  // The pool has finished all pending work once it is destroyed.
+  EXPECT_EQ(delivered.size(), 1);
+  auto work = takePosted();
+  ASSERT_EQ(work.size(), 2);
+  for (auto &f : work) {
+    f();
+  }
+  ASSERT_EQ(delivered.size(), 3);
+  EXPECT_NE(reverse_threads.back(), std::this_thread::get_id());
+  for (size_t i = 1; i < 3; i++) {
+    // Failures are delivered with their status and no data.
+    auto expected = std::get<1>(delivered[i]) == token ? callData(WasmResult::Ok, "zyx")
+                                                       : callData(WasmResult::BadArgument);
+    EXPECT_EQ(std::get<2>(delivered[i]), expected);
+  }
+
+  // Results for a context which is gone are dropped.
+  {
+    ContextBase stream(wasm.get(), root_context->id(), plugin);
+    ASSERT_EQ(wasm->callAsyncForeignFunction(&stream, "foreign_test_reverse", "abc", &token),
+              WasmResult::Ok);
+  }
+  for (auto &f : takePosted()) {
+    f();
+  }
+  EXPECT_EQ(delivered.size(), 3);
+}
+
+} // namespace
+} // namespace proxy_wasm
@@ -0,0 +1,225 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/fuel.h"
+
+#include <memory>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/null_vm.h"
+#include "include/proxy-wasm/wasm.h"
+#include "test_wasm.h"
+#if defined(PROXY_WASM_HAS_RUNTIME_V8)
+#include "include/proxy-wasm/v8.h"
+#elif defined(PROXY_WASM_HAS_RUNTIME_WAVM)
+#include "include/proxy-wasm/wavm.h"
+#endif
+
+namespace proxy_wasm {
+namespace {
+
+using namespace std::string_literals;
+
+const std::string kHeader = "\0asm\x01\0\0\0"s;
+// (type (func))
+const std::string kTypeSection = "\x01\x04\x01\x60\x00\x00"s;
+// One function of type 0.
+const std::string kFunctionSection = "\x03\x02\x01\x00"s;
+
+std::string codeSection(const std::string &body) {
+  std::string function = "\x00"s + body; // No locals.
+  std::string contents = "\x01"s + static_cast<char>(function.size()) + function;
+  return "\x0a"s + static_cast<char>(contents.size()) + contents;
+}
+
+// fuel -= cost; if (fuel < 0) unreachable; with the fuel in global 'index'.
+std::string charge(char index, char cost) {
+  return "\x23"s + index + "\x42"s + cost + "\x7d\x24"s + index + "\x23"s + index +
+         "\x42\x00\x53\x04\x40\x00\x0b"s;
+}
+
+// (global (mut i64) (i64.const kUnmeteredFuel))
+const std::string kFuelGlobal = "\x7e\x01\x42"s + std::string(9, '\xff') + "\x00\x0b"s;
+
+std::string fuelExport(char index) {
+  return "\x19proxy_wasm_fuel_remaining\x03"s + index;
+}
+
+TEST(Fuel, InstrumentsStraightLineCode) {
+  // i32.const 1; drop; end
+  auto code = kHeader + kTypeSection + kFunctionSection + codeSection("\x41\x01\x1a\x0b"s);
+  std::string instrumented;
+  ASSERT_TRUE(instrumentForFuel(code, &instrumented));
+
+  auto global_section = "\x06"s + static_cast<char>(kFuelGlobal.size() + 1) + "\x01"s + kFuelGlobal;
+  auto exports = "\x01"s + fuelExport(0);
+  auto export_section = "\x07"s + static_cast<char>(exports.size()) + exports;
+  auto expected = kHeader + kTypeSection + kFunctionSection + global_section + export_section +
+                  codeSection(charge(0, 3) + "\x41\x01\x1a\x0b"s);
+  EXPECT_EQ(instrumented, expected);
+}
+
+TEST(Fuel, ChargesEachRunOfInstructions) {
+  // loop; br 0; end; end
+  auto code = kHeader + kTypeSection + kFunctionSection + codeSection("\x03\x40\x0c\x00\x0b\x0b"s);
+  std::string instrumented;
+  ASSERT_TRUE(instrumentForFuel(code, &instrumented));
+  auto body = charge(0, 1) + "\x03\x40"s + charge(0, 1) + "\x0c\x00"s + charge(0, 1) + "\x0b"s +
+              charge(0, 1) + "\x0b"s;
+  EXPECT_NE(instrumented.find(codeSection(body)), std::string::npos);
+}
+
+TEST(Fuel, AppendsToExistingGlobalsAndExports) {
+  // (import "env" "g" (global i32)) (global (mut i32) (i32.const 5)) (export "f" (func 0))
+  auto import_section = "\x02\x0a\x01\x03\x65\x6e\x76\x01\x67\x03\x7f\x00"s;
+  auto global_section = "\x06\x06\x01\x7f\x01\x41\x05\x0b"s;
+  auto export_section = "\x07\x05\x01\x01\x66\x00\x00"s;
+  auto code = kHeader + kTypeSection + import_section + kFunctionSection + global_section +
+              export_section + codeSection("\x0b"s);
+  std::string instrumented;
+  ASSERT_TRUE(instrumentForFuel(code, &instrumented));
+
+  auto globals = "\x02\x7f\x01\x41\x05\x0b"s + kFuelGlobal;
+  auto exports = "\x02\x01\x66\x00\x00"s + fuelExport(2);
+  auto expected = kHeader + kTypeSection + import_section + kFunctionSection + "\x06"s +
+                  static_cast<char>(globals.size()) + globals + "\x07"s +
+                  static_cast<char>(exports.size()) + exports + codeSection(charge(2, 1) + "\x0b"s);
+  EXPECT_EQ(instrumented, expected);
+}
+
+TEST(Fuel, RejectsUnsupportedCode) {
+  std::string instrumented;
+  EXPECT_FALSE(instrumentForFuel("not wasm", &instrumented));
+  // v128.const is SIMD.
+  auto simd = kHeader + kTypeSection + kFunctionSection +
+              codeSection("\xfd\x0c"s + std::string(16, '\0') + "\x1a\x0b"s);
+  EXPECT_FALSE(instrumentForFuel(simd, &instrumented));
+  // Missing the final end.
+  auto truncated = kHeader + kTypeSection + kFunctionSection + codeSection("\x41\x01\x1a"s);
+  EXPECT_FALSE(instrumentForFuel(truncated, &instrumented));
+}
+
+// A NullVm with a fuel global, which the plugin consumes explicitly.
+struct FueledNullVm : public NullVm {
+  bool setFuel(int64_t fuel) override {
+    fuel_ = fuel;
+    return true;
+  }
+  bool getFuel(int64_t *fuel) override {
+    *fuel = fuel_;
+    return true;
+  }
+
+  int64_t fuel_ = kUnmeteredFuel;
+};
+
+class FuelNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallVoid<2> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_context_create") {
+      *f = [](ContextBase *context, Word, Word) {
+        int64_t fuel = 0;
+        context->wasmVm()->getFuel(&fuel);
+        context->wasmVm()->setFuel(fuel - 7);
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_fuel_plugin("fuel_test_plugin", []() {
+  return std::make_unique<FuelNullVmPlugin>();
+});
+
+TEST(Fuel, RestoresUnmeteredFuelAfterMeteredCalls) {
+  auto vm = std::make_unique<FueledNullVm>();
+  auto *fueled_vm = vm.get();
+  vm->integration().reset(new TestIntegration());
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->fuel_budget_ = 100;
+  auto wasm = std::make_shared<TestWasm<>>(std::move(vm), "vm", "", "vm_key");
+  ASSERT_TRUE(wasm->initialize("fuel_test_plugin", false));
+  auto *root_context = wasm->start(plugin);
+  ASSERT_TRUE(root_context);
+  EXPECT_EQ(root_context->lastCallFuelConsumed(), 7u);
+  // Calls without a budget, e.g. from the VM context, do not run on what is left of it.
+  EXPECT_EQ(fueled_vm->fuel_, kUnmeteredFuel);
+}
+
+// A VM of the runtime linked into the test, or nullptr for none.
+std::unique_ptr<WasmVm> createRuntimeVm() {
+#if defined(PROXY_WASM_HAS_RUNTIME_V8)
+  return createV8Vm();
+#elif defined(PROXY_WASM_HAS_RUNTIME_WAVM)
+  return createWavmVm();
+#else
+  return nullptr;
+#endif
+}
+
+std::string section(char id, const std::string &contents) {
+  return id + (static_cast<char>(contents.size()) + contents);
+}
+
+std::string exportEntry(const std::string &name, char kind, char index) {
+  return static_cast<char>(name.size()) + name + kind + index;
+}
+
+std::string function(const std::string &body) { return static_cast<char>(body.size()) + body; }
+
+// (local i32) (loop (br_if 0 (i32.lt_u (local.tee n (i32.add (local.get n) (i32.const 1)))
+// (i32.const 1000)))) with the counter in local 'n'.
+std::string countToThousand(char n) {
+  return "\x01\x01\x7f\x03\x40\x20"s + n + "\x41\x01\x6a\x22"s + n +
+         "\x41\xe8\x07\x49\x0d\x00\x0b\x0b"s;
+}
+
+// The loop instruction, 1000 iterations of 7 instructions and the two ends.
+constexpr uint64_t kCountToThousandFuel = 7003;
+
+// A module whose _start (its constructors) and proxy_on_context_create each count to 1000.
+const std::string kModuleWithCtors =
+    kHeader + section(0x01, "\x02\x60\x00\x00\x60\x02\x7f\x7f\x00"s) +
+    section(0x03, "\x03\x00\x00\x01"s) + section(0x05, "\x01\x00\x01"s) +
+    section(0x07, "\x04"s + exportEntry("_start", 0x00, 0) +
+                      exportEntry("proxy_abi_version_0_2_1", 0x00, 1) +
+                      exportEntry("proxy_on_context_create", 0x00, 2) +
+                      exportEntry("memory", 0x02, 0)) +
+    section(0x0a, "\x03"s + function(countToThousand(0)) + function("\x00\x0b"s) +
+                      function(countToThousand(2)));
+
+TEST(Fuel, MetersWasmWithConstructors) {
+  auto vm = createRuntimeVm();
+  if (!vm) {
+    GTEST_SKIP() << "No Wasm runtime";
+  }
+  vm->integration().reset(new TestIntegration());
+  vm->enableFuelMetering();
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", vm->runtime(), "", false);
+  plugin->fuel_budget_ = 10000;
+  auto wasm = std::make_shared<TestWasm<>>(std::move(vm), "vm", "", "vm_key");
+  // _start runs without a budget, so it must not trap.
+  ASSERT_TRUE(wasm->initialize(kModuleWithCtors, false));
+  auto *root_context = wasm->start(plugin);
+  ASSERT_TRUE(root_context);
+  EXPECT_EQ(root_context->lastCallFuelConsumed(), kCountToThousandFuel);
+  int64_t fuel = 0;
+  ASSERT_TRUE(wasm->wasm_vm()->getFuel(&fuel));
+  EXPECT_EQ(fuel, kUnmeteredFuel);
+}
+
+} // namespace
+} // namespace proxy_wasm
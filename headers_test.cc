@@ -0,0 +1,111 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+constexpr char kPluginName[] = "headers_test_plugin";
+
+// The headers passed to proxy_on_{request,response}_headers_with_pairs, as "key: value" lines.
+std::vector<std::string> passed;
+// Calls to the plain proxy_on_request_headers.
+int plain_calls = 0;
+
+std::string unmarshal(Word ptr, Word size) {
+  if (!ptr.u64_) {
+    return "none";
+  }
+  auto b = reinterpret_cast<const char *>(ptr.u64_);
+  uint32_t n;
+  memcpy(&n, b, sizeof(n));
+  auto sizes = b + sizeof(n);
+  auto data = sizes + n * 2 * sizeof(uint32_t);
+  std::string result;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t key_size, value_size;
+    memcpy(&key_size, sizes + i * 2 * sizeof(uint32_t), sizeof(key_size));
+    memcpy(&value_size, sizes + (i * 2 + 1) * sizeof(uint32_t), sizeof(value_size));
+    result += std::string(data, key_size) + ": ";
+    data += key_size + 1;
+    result += std::string(data, value_size) + "\n";
+    data += value_size + 1;
+  }
+  EXPECT_EQ(data - b, size.u64_);
+  ::free(reinterpret_cast<void *>(ptr.u64_));
+  return result;
+}
+
+class HeadersNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<3> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_request_headers") {
+      *f = [](ContextBase *, Word, Word, Word) -> Word {
+        plain_calls++;
+        return Word(0);
+      };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallWord<5> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_request_headers_with_pairs" ||
+        function_name == "proxy_on_response_headers_with_pairs") {
+      *f = [](ContextBase *, Word, Word, Word, Word ptr, Word size) -> Word {
+        passed.push_back(unmarshal(ptr, size));
+        return Word(static_cast<uint64_t>(FilterHeadersStatus::StopIteration));
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_test_plugin(kPluginName, []() {
+  return std::make_unique<HeadersNullVmPlugin>();
+});
+
+TEST(HeadersWithPairs, Passed) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto wasm = createTestWasm(kPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  EXPECT_TRUE(wasm->hasCapability(Capability::ResponseHeaders));
+  passed.clear();
+  plain_calls = 0;
+
+  TestContext stream(wasm.get(), wasm->getRootContext("root")->id(), plugin);
+  stream.header_maps_[WasmHeaderMapType::RequestHeaders] = {{":path", "/a"},
+                                                           {"host", "example.com"}};
+  stream.header_maps_[WasmHeaderMapType::ResponseHeaders] = {};
+  stream.onCreate();
+  EXPECT_EQ(stream.onRequestHeaders(2, false), FilterHeadersStatus::StopIteration);
+  // An empty map is passed as such, and a map which can not be had as no memory.
+  EXPECT_EQ(stream.onResponseHeaders(0, false), FilterHeadersStatus::StopIteration);
+  stream.header_maps_.erase(WasmHeaderMapType::ResponseHeaders);
+  EXPECT_EQ(stream.onResponseHeaders(0, true), FilterHeadersStatus::StopIteration);
+  EXPECT_EQ(passed, (std::vector<std::string>{":path: /a\nhost: example.com\n", "", "none"}));
+  EXPECT_EQ(plain_calls, 0);
+  stream.onDelete();
+}
+
+} // namespace
+} // namespace proxy_wasm
@@ -0,0 +1,186 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "include/proxy-wasm/context.h"
+#include "include/proxy-wasm/wasm.h"
+
+namespace proxy_wasm {
+
+/**
+ * StreamSnapshot is a copy of the stream state which proxy_on_log may read: the request and
+ * response header and trailer maps and the properties listed in PluginBase::log_properties_.
+ * It is captured on the worker thread when the stream ends so that the stream itself can be
+ * released before the log callback runs.
+ */
+struct StreamSnapshot {
+  static std::unique_ptr<StreamSnapshot> capture(ContextBase *context,
+                                                 const std::vector<std::string> &properties);
+
+  // Replaces any earlier capture of the same map or properties.
+  void captureHeaderMap(ContextBase *context, WasmHeaderMapType type);
+  void captureProperties(ContextBase *context, const std::vector<std::string> &properties);
+  // Returns false if the buffer can not be copied, in which case 'body_' is the buffer itself.
+  bool captureBody(ContextBase *context, WasmBufferType type);
+
+  // Indexed by WasmHeaderMapType, RequestHeaders through ResponseTrailers.
+  std::vector<std::pair<std::string, std::string>> header_maps_[4];
+  std::unordered_map<std::string, std::string> properties_;
+  // The body or data given to an observe-only callback, see ContextBase::observe().
+  WasmBufferType body_type_ = WasmBufferType::HttpRequestBody;
+  BufferInterface *body_ = nullptr;
+  std::string body_data_;
+  BufferBase body_copy_;
+};
+
+/**
+ * SnapshotContext is the stream context used to run proxy_on_log on an AsyncLogExecutor, which
+ * stands in for a finished stream awaiting proxy_on_log_batch, and in which the callbacks of an
+ * observe-only plugin are run. Header map, property and body reads are served from the snapshot,
+ * logging and metrics are forwarded to the root context and calls which would act on the stream
+ * return WasmResult::Unimplemented.
+ */
+class SnapshotContext : public ContextBase {
+public:
+  SnapshotContext(WasmBase *wasm, uint32_t parent_context_id, std::shared_ptr<PluginBase> plugin,
+                  std::unique_ptr<StreamSnapshot> snapshot)
+      : ContextBase(wasm, parent_context_id, plugin), snapshot_(std::move(snapshot)) {}
+  // Takes over 'stream', including its id, after it has been logged or to run an observed call,
+  // in which case the body the call was given is served from 'body'.
+  SnapshotContext(ContextBase *stream, std::shared_ptr<const StreamSnapshot> snapshot,
+                  std::unique_ptr<StreamSnapshot> body = nullptr)
+      : ContextBase(stream), snapshot_(std::move(snapshot)), body_(std::move(body)) {}
+
+  WasmResult unimplemented() override { return WasmResult::Unimplemented; }
+
+  // General
+  WasmResult log(uint32_t level, std::string_view message) override {
+    return root_context()->log(level, message);
+  }
+  uint32_t getLogLevel() override { return root_context()->getLogLevel(); }
+  uint64_t getCurrentTimeNanoseconds() override {
+    return root_context()->getCurrentTimeNanoseconds();
+  }
+  uint64_t getMonotonicTimeNanoseconds() override {
+    return root_context()->getMonotonicTimeNanoseconds();
+  }
+
+  // Metrics
+  WasmResult defineMetric(uint32_t type, std::string_view name, uint32_t *metric_id_ptr) override {
+    return root_context()->defineMetric(type, name, metric_id_ptr);
+  }
+  WasmResult incrementMetric(uint32_t metric_id, int64_t offset) override {
+    return root_context()->incrementMetric(metric_id, offset);
+  }
+  WasmResult recordMetric(uint32_t metric_id, uint64_t value) override {
+    return root_context()->recordMetric(metric_id, value);
+  }
+  WasmResult getMetric(uint32_t metric_id, uint64_t *value_ptr) override {
+    return root_context()->getMetric(metric_id, value_ptr);
+  }
+
+  // Properties and Header/Trailer Maps
+  WasmResult getProperty(std::string_view path, std::string *result) override;
+  WasmResult getHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                               std::string_view *result) override;
+  WasmResult getHeaderMapPairs(WasmHeaderMapType type, Pairs *result) override;
+  WasmResult getHeaderMapSize(WasmHeaderMapType type, uint32_t *result) override;
+
+  // Buffers
+  BufferInterface *getBuffer(WasmBufferType type) override;
+
+protected:
+  bool deferLog() override { return false; }
+  bool batchLog() override { return false; }
+
+private:
+  const std::vector<std::pair<std::string, std::string>> *headerMap(WasmHeaderMapType type);
+
+  std::shared_ptr<const StreamSnapshot> snapshot_;
+  std::unique_ptr<StreamSnapshot> body_;
+};
+
+/**
+ * AsyncLogExecutor runs proxy_on_log off the request path for plugins with
+ * PluginBase::async_log_ set. It owns a background thread with its own clone of 'base_wasm', and
+ * while it exists ContextBase::onLog() on any VM with the same vm_key hands a StreamSnapshot to
+ * the executor rather than calling into the VM, so request completion does not wait for logging.
+ *
+ * On the executor the plugin sees a fresh stream context: proxy_on_context_create, proxy_on_log
+ * and proxy_on_delete are called back to back, so per-stream state kept inside the VM during the
+ * request is not available and only the snapshot may be relied upon. Timers, queues and outgoing
+ * calls are not available to the executor's VM.
+ *
+ * When more than 'max_pending' logs are waiting the log is run synchronously instead. The
+ * destructor runs any pending logs before returning.
+ */
+class AsyncLogExecutor {
+public:
+  AsyncLogExecutor(std::shared_ptr<WasmHandleBase> base_wasm,
+                   WasmHandleCloneFactory clone_factory, size_t max_pending = 4096);
+  ~AsyncLogExecutor();
+
+  AsyncLogExecutor(const AsyncLogExecutor &) = delete;
+  AsyncLogExecutor &operator=(const AsyncLogExecutor &) = delete;
+
+  // Whether there is an executor registered for 'vm_key' with room for another log, so that a
+  // snapshot is only captured when it will be used. submit() may still fail if it fills up.
+  static bool accepting(std::string_view vm_key);
+  // Queue 'snapshot' to be logged by 'plugin' using the executor registered for 'vm_key'.
+  // Returns false if there is no such executor or it is full.
+  static bool submit(std::string_view vm_key, std::shared_ptr<PluginBase> plugin,
+                     std::unique_ptr<StreamSnapshot> snapshot);
+
+private:
+  struct PendingLog {
+    std::shared_ptr<PluginBase> plugin;
+    std::unique_ptr<StreamSnapshot> snapshot;
+  };
+
+  bool hasRoom();
+  bool enqueue(PendingLog log);
+  void run();
+  void runLog(PendingLog log);
+  ContextBase *rootContext(const std::shared_ptr<PluginBase> &plugin);
+
+  const std::string vm_key_;
+  const size_t max_pending_;
+  std::shared_ptr<WasmHandleBase> base_wasm_;
+  WasmHandleCloneFactory clone_factory_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<PendingLog> pending_;
+  bool stopping_ = false;
+
+  // Only accessed by the executor thread.
+  std::shared_ptr<WasmHandleBase> wasm_handle_;
+  std::set<std::string> configured_root_ids_;
+
+  std::thread thread_; // Last: started once the members above are initialized.
+};
+
+} // namespace proxy_wasm
@@ -0,0 +1,41 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+namespace proxy_wasm {
+
+/**
+ * EventLoopClock is the source of the default ContextBase times. By default every query reads the
+ * system clocks. An embedder may instead call update() once per iteration of a thread's event
+ * loop, after which queries on that thread return the time of the last update() until reset(), so
+ * a plugin which asks for the time several times per request costs one clock read per iteration.
+ */
+class EventLoopClock {
+public:
+  // Cache the current time (or the given one) for the calling thread.
+  static void update();
+  static void update(uint64_t realtime_nanoseconds, uint64_t monotonic_nanoseconds);
+  // Stop caching on the calling thread.
+  static void reset();
+
+  // Nanoseconds since the Unix epoch.
+  static uint64_t realtimeNanoseconds();
+  // Nanoseconds since an arbitrary point, never decreasing.
+  static uint64_t monotonicNanoseconds();
+};
+
+} // namespace proxy_wasm
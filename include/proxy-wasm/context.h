@@ -17,7 +17,7 @@
 
 #include <atomic>
 #include <chrono>
-#include <ctime>
+#include <deque>
 #include <functional>
 #include <iostream>
 #include <map>
@@ -25,15 +25,20 @@
 #include <string>
 #include <vector>
 
+#include "include/proxy-wasm/clock.h"
 #include "include/proxy-wasm/context_interface.h"
+#include "include/proxy-wasm/metric_registry.h"
+#include "include/proxy-wasm/watchdog.h"
 
 namespace proxy_wasm {
 
 #include "proxy_wasm_common.h"
 #include "proxy_wasm_enums.h"
 
+class ContextBase;
 class WasmBase;
 class WasmVm;
+struct StreamSnapshot;
 
 /**
  * PluginBase is container to hold plugin information which is shared with all Context(s) created
@@ -44,6 +49,22 @@ class WasmVm;
  * @param vm_id is a string used to differentiate VMs with the same code and VM configuration.
  * @param plugin_configuration is configuration for this plugin.
  * @param fail_open if true the plugin will pass traffic as opposed to close all streams.
+ * execution_timeout_ may be set by the embedder before the plugin is used to bound the time of
+ * each call into the VM (see ExecutionDeadline). On expiry the VM fails and fail_open_ applies.
+ * Runtimes which can not enforce it (see WasmVm::supportsExecutionTimeout()) reject the plugin.
+ * fuel_budget_ likewise bounds the number of instructions executed by each call. A non-zero budget
+ * enables fuel metering on VMs created for this plugin, so plugins sharing a vm_id should agree on
+ * whether it is set: createWasm() fails for a plugin with a budget whose base VM was already
+ * loaded without metering. Running out of fuel traps, failing the VM.
+ * async_log_ runs proxy_on_log on the AsyncLogExecutor for the VM, if there is one, against a
+ * snapshot of the stream's header maps and of the properties in log_properties_ (paths as passed
+ * to proxy_get_property).
+ * log_batch_size_ bounds the number of streams which are logged together when the module exports
+ * proxy_on_log_batch (see WasmBase::flushLogBatch()). Batches are flushed at the end of each event
+ * loop iteration via WasmBase::callOnThreadFunction(); embedders which do not provide one get
+ * batches of a single stream.
+ * memory_huge_pages_ and memory_prefault_ are applied to the linear memory of each thread-local VM
+ * when it is created (see WasmVm::prepareMemory()).
  */
 struct PluginBase {
   PluginBase(std::string_view name, std::string_view root_id, std::string_view vm_id,
@@ -58,8 +79,29 @@ struct PluginBase {
   const std::string runtime_;
   std::string plugin_configuration_;
   const bool fail_open_;
+  std::chrono::milliseconds execution_timeout_{0}; // 0 disables the deadline.
+  uint64_t fuel_budget_{0};                        // 0 disables fuel metering.
+  bool async_log_ = false;
+  std::vector<std::string> log_properties_;
+  uint32_t log_batch_size_{64};
+  bool memory_huge_pages_ = false;
+  bool memory_prefault_ = false;
+  // The plugin only inspects traffic: its stream callbacks run on a snapshot after the host has
+  // moved on, can not modify the stream and never stop it. See ContextBase::observe(). Bodies and
+  // data are kept with BufferInterface::copyOut(), which BufferBase implements; for buffers which
+  // do not, callbacks on them (and any queued before them) still run synchronously.
+  bool observe_only_ = false;
+  // The share of streams, in millionths, which the plugin sees at all: the others are never created
+  // in the VM (see ContextBase::onCreate()). Streams are chosen at random, or by a hash of the
+  // 'sample_key_' property if it is set and found, so that e.g. all the streams with the same
+  // request id are sampled or not together.
+  uint32_t sample_rate_per_million_{1000000};
+  std::string sample_key_;
   const std::string &log_prefix() const { return log_prefix_; }
 
+  // Whether 'stream' is to be seen by the plugin.
+  bool sampleStream(ContextBase *stream) const;
+
 private:
   std::string makeLogPrefix() const;
 
@@ -84,6 +126,14 @@ struct BufferBase : public BufferInterface {
     // Setting a string buffer not supported (no use case).
     return WasmResult::BadArgument;
   }
+  WasmResult copyOut(std::string *result) const override {
+    if (owned_data_) {
+      result->assign(owned_data_.get(), owned_data_size_);
+    } else {
+      result->assign(data_);
+    }
+    return WasmResult::Ok;
+  }
 
   virtual void clear() {
     data_ = "";
@@ -178,7 +228,16 @@ public:
   bool onDone() override;
   void onLog() override;
   void onDelete() override;
+  // Calls proxy_on_log_batch for 'context_ids', which must be streams in this context's VM. The
+  // guest selects each stream with proxy_set_effective_context to read its state.
+  void onLogBatch(const std::vector<uint32_t> &context_ids);
   void onForeignFunction(uint32_t foreign_function_id, uint32_t data_size) override;
+  // Calls proxy_on_foreign_function with 'result' as the WasmBufferType::CallData buffer, which
+  // is served here rather than by getBuffer() (see WasmBase::callAsyncForeignFunction()).
+  void onForeignFunctionResult(uint32_t token, std::string result);
+  const BufferInterface *foreignFunctionResult() const {
+    return in_foreign_function_result_ ? &foreign_function_result_ : nullptr;
+  }
 
   // Root
   bool onStart(std::shared_ptr<PluginBase> plugin) override;
@@ -223,6 +282,11 @@ public:
   bool isFailed();
   bool isFailOpen() { return plugin_->fail_open_; }
 
+  // Fuel (instructions) consumed by the most recent call into the VM for this context and by all
+  // calls so far. Always zero unless the VM is fuel metered (see PluginBase::fuel_budget_).
+  uint64_t lastCallFuelConsumed() const { return last_call_fuel_consumed_; }
+  uint64_t fuelConsumed() const { return fuel_consumed_; }
+
   //
   // General Callbacks.
   //
@@ -230,19 +294,8 @@ public:
     return unimplemented();
   }
   uint32_t getLogLevel() override { return static_cast<uint32_t>(LogLevel::info); }
-  uint64_t getCurrentTimeNanoseconds() override {
-#if !defined(_MSC_VER)
-    struct timespec tpe;
-    clock_gettime(CLOCK_REALTIME, &tpe);
-    uint64_t t = tpe.tv_sec;
-    t *= 1000000000;
-    t += tpe.tv_nsec;
-    return t;
-#else
-    unimplemented();
-    return 0;
-#endif
-  }
+  uint64_t getCurrentTimeNanoseconds() override { return EventLoopClock::realtimeNanoseconds(); }
+  uint64_t getMonotonicTimeNanoseconds() override { return EventLoopClock::monotonicNanoseconds(); }
   std::string_view getConfiguration() override {
     unimplemented();
     return "";
@@ -293,19 +346,16 @@ public:
     return unimplemented();
   }
 
-  // Metrics
-  WasmResult defineMetric(uint32_t /* type */, std::string_view /* name */,
-                          uint32_t * /* metric_id_ptr */) override {
-    return unimplemented();
+  // Metrics: kept in the process-wide MetricRegistry unless overridden.
+  WasmResult defineMetric(uint32_t type, std::string_view name, uint32_t *metric_id_ptr) override;
+  WasmResult incrementMetric(uint32_t metric_id, int64_t offset) override {
+    return MetricRegistry::increment(metric_id, offset);
   }
-  WasmResult incrementMetric(uint32_t /* metric_id */, int64_t /* offset */) override {
-    return unimplemented();
+  WasmResult recordMetric(uint32_t metric_id, uint64_t value) override {
+    return MetricRegistry::record(metric_id, value);
   }
-  WasmResult recordMetric(uint32_t /* metric_id */, uint64_t /* value */) override {
-    return unimplemented();
-  }
-  WasmResult getMetric(uint32_t /* metric_id */, uint64_t * /* value_ptr */) override {
-    return unimplemented();
+  WasmResult getMetric(uint32_t metric_id, uint64_t *value_ptr) override {
+    return MetricRegistry::get(metric_id, value_ptr);
   }
 
   // Properties
@@ -372,10 +422,52 @@ public:
 
 protected:
   friend class WasmBase;
+  friend class CallBudget;
+
+  // Takes over the id and the in-VM state of 'stream', which must not call into the VM again.
+  explicit ContextBase(ContextBase *stream);
 
   void initializeRootBase(WasmBase *wasm, std::shared_ptr<PluginBase> plugin);
+  // Hand the log for this stream to an AsyncLogExecutor. Returns false to log synchronously.
+  virtual bool deferLog();
+  // Keep this stream alive in a SnapshotContext until the next WasmBase::flushLogBatch(). Returns
+  // false to log immediately.
+  virtual bool batchLog();
   std::string makeRootLogPrefix(std::string_view vm_id) const;
 
+  // Stream callbacks of an observe-only plugin (see PluginBase::observe_only_) return Continue
+  // straight away: observe() queues the call with a StreamSnapshot of the header maps seen so far
+  // and the properties in log_properties_ (shared with the other calls queued since the last
+  // header map), plus any body it was given, and the queue is run in SnapshotContexts by a
+  // function posted with WasmBase::callOnThreadFunction(), or before any later callback which is
+  // not observed. A body is copied with BufferInterface::copyOut(); if that is not supported the
+  // queue is run at once.
+  enum class ObservedCall {
+    NewConnection,
+    DownstreamData,
+    UpstreamData,
+    RequestHeaders,
+    RequestBody,
+    RequestTrailers,
+    ResponseHeaders,
+    ResponseBody,
+    ResponseTrailers,
+  };
+  struct Observation {
+    ObservedCall call;
+    uint32_t size;
+    bool end_of_stream;
+    std::shared_ptr<const StreamSnapshot> stream;
+    std::unique_ptr<StreamSnapshot> body; // Only for body and data calls.
+  };
+  bool isObserveOnly() const { return plugin_ && plugin_->observe_only_ && parent_context_id_; }
+  void observe(ObservedCall call, uint32_t size, bool end_of_stream);
+  void runObservations();
+  // Calls proxy_on_request_headers or proxy_on_response_headers, or their _with_pairs variants,
+  // on behalf of 'context'.
+  uint64_t callOnHeaders(ContextBase *context, WasmHeaderMapType type, uint32_t headers,
+                         bool end_of_stream);
+
   WasmBase *wasm_{nullptr};
   uint32_t id_{0};
   uint32_t parent_context_id_{0};        // 0 for roots and the general context.
@@ -383,7 +475,17 @@ protected:
   std::string root_id_;                  // set only in root context.
   std::string root_log_prefix_;          // set only in root context.
   std::shared_ptr<PluginBase> plugin_;
+  std::chrono::milliseconds execution_timeout_{0}; // from the plugin, 0 for the VM context.
+  uint64_t fuel_budget_ = 0;                        // from the plugin, 0 for the VM context.
+  uint64_t last_call_fuel_consumed_ = 0;
+  uint64_t fuel_consumed_ = 0;
   bool in_vm_context_created_ = false;
+  bool sampled_ = true; // False if the plugin does not see this stream (see PluginBase).
+  bool log_batched_ = false; // proxy_on_log and proxy_on_delete are left to a SnapshotContext.
+  bool in_foreign_function_result_ = false;
+  BufferBase foreign_function_result_;
+  std::deque<Observation> observations_;
+  std::shared_ptr<const StreamSnapshot> observed_stream_;
   bool destroyed_ = false;
 };
 
@@ -396,6 +498,25 @@ private:
   WasmBase *const wasm_;
 };
 
+// Applies the plugin's limits to one call into the VM: the ExecutionDeadline and, if the VM is fuel
+// metered, the fuel budget. Declared after DeferAfterCallActions so that the deferred actions are
+// not charged to the call.
+class CallBudget {
+public:
+  CallBudget(ContextBase *context);
+  ~CallBudget();
+
+  // Fail the VM now if the deadline has passed, see ExecutionDeadline::check().
+  void checkDeadline() { deadline_.check(); }
+
+private:
+  ContextBase *const context_;
+  ExecutionDeadline deadline_;
+  bool metered_ = false;
+  bool outermost_ = false;
+  int64_t fuel_at_entry_ = 0;
+};
+
 uint32_t resolveQueueForTest(std::string_view vm_id, std::string_view queue_name);
 
 } // namespace proxy_wasm
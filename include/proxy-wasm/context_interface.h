@@ -23,6 +23,7 @@
 #include <optional>
 #include <map>
 #include <memory>
+#include <string>
 #include <vector>
 
 namespace proxy_wasm {
@@ -80,6 +81,13 @@ struct BufferInterface {
    * @return a WasmResult with any error or WasmResult::Ok.
    */
   virtual WasmResult copyFrom(size_t start, size_t length, std::string_view data) = 0;
+
+  /**
+   * Copy the bytes of the buffer to the host, e.g. to keep them after the stream has moved on.
+   * @param result receives the bytes.
+   * @return WasmResult::Unimplemented if the buffer does not support it.
+   */
+  virtual WasmResult copyOut(std::string * /* result */) const { return WasmResult::Unimplemented; }
 };
 
 /**
@@ -557,6 +565,10 @@ struct GeneralInterface {
   // Provides the current time in nanoseconds since the Unix epoch.
   virtual uint64_t getCurrentTimeNanoseconds() = 0;
 
+  // Provides the time in nanoseconds since an arbitrary point, which never decreases. For
+  // measuring intervals.
+  virtual uint64_t getMonotonicTimeNanoseconds() = 0;
+
   // Returns plugin configuration.
   virtual std::string_view getConfiguration() = 0;
 
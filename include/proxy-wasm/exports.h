@@ -82,6 +82,8 @@ Word define_metric(void *raw_context, Word metric_type, Word name_ptr, Word name
 Word increment_metric(void *raw_context, Word metric_id, int64_t offset);
 Word record_metric(void *raw_context, Word metric_id, uint64_t value);
 Word get_metric(void *raw_context, Word metric_id, Word result_uint64_ptr);
+Word define_metric_slot(void *raw_context, Word metric_type, Word name_ptr, Word name_size,
+                        Word metric_id_ptr, Word slot_ptr_ptr);
 Word grpc_call(void *raw_context, Word service_ptr, Word service_size, Word service_name_ptr,
                Word service_name_size, Word method_name_ptr, Word method_name_size,
                Word initial_metadata_ptr, Word initial_metadata_size, Word request_ptr,
@@ -95,11 +97,23 @@ Word grpc_send(void *raw_context, Word token, Word message_ptr, Word message_siz
 
 Word set_tick_period_milliseconds(void *raw_context, Word tick_period_milliseconds);
 Word get_current_time_nanoseconds(void *raw_context, Word result_uint64_ptr);
+Word get_monotonic_time_nanoseconds(void *raw_context, Word result_uint64_ptr);
+Word get_time_page(void *raw_context, Word page_ptr_ptr);
 
 Word set_effective_context(void *raw_context, Word context_id);
 Word done(void *raw_context);
 Word call_foreign_function(void *raw_context, Word function_name, Word function_name_size,
                            Word arguments, Word warguments_size, Word results, Word results_size);
+Word resolve_foreign_function(void *raw_context, Word function_name, Word function_name_size,
+                              Word id_ptr);
+// Starts an asynchronous foreign function, whose result is delivered to proxy_on_foreign_function
+// with the token stored at 'token_ptr'. The CallData buffer then holds the function's WasmResult
+// as a little-endian uint32_t, followed by its result bytes if that is WasmResult::Ok.
+Word call_foreign_function_async(void *raw_context, Word function_name, Word function_name_size,
+                                 Word arguments, Word arguments_size, Word token_ptr);
+Word call_foreign_function_by_id(void *raw_context, Word id, Word arguments, Word arguments_size,
+                                 Word results, Word results_size);
+Word release_memory(void *raw_context, Word ptr, Word size);
 
 // Runtime environment functions exported from envoy to wasm.
 
@@ -0,0 +1,45 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+
+namespace proxy_wasm {
+
+// Name of the exported mutable i64 global added by instrumentForFuel(). It holds the fuel
+// remaining for the current call.
+constexpr std::string_view kFuelGlobalName = "proxy_wasm_fuel_remaining";
+
+// Value of the fuel global outside of metered calls, and its initial value, so that calls made
+// without a budget (e.g. _start and the constructors) are not metered.
+constexpr int64_t kUnmeteredFuel = std::numeric_limits<int64_t>::max();
+
+/**
+ * Rewrite a Wasm binary for deterministic fuel metering. Every straight-line run of instructions
+ * (from function entry or a control instruction up to and including the next control instruction)
+ * is prefixed with code which subtracts its instruction count from the kFuelGlobalName global and
+ * executes 'unreachable' once the result is negative. Loop bodies are charged on every iteration,
+ * so the count of executed instructions is exact and independent of the runtime and machine.
+ * @param code the Wasm binary.
+ * @param instrumented is set to the rewritten binary on success.
+ * @return false if the binary is malformed or uses features which are not supported (SIMD,
+ * threads, exceptions, tail calls and GC).
+ */
+bool instrumentForFuel(std::string_view code, std::string *instrumented);
+
+} // namespace proxy_wasm
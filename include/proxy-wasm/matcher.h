@@ -0,0 +1,69 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "include/proxy-wasm/wasm_vm.h"
+
+namespace proxy_wasm {
+
+/**
+ * Matcher is a compiled pattern, matched natively on behalf of plugins through the
+ * "matcher_compile" and "matcher_match" foreign functions. Patterns work on bytes:
+ *
+ * Glob: the whole input must match. '*' matches any sequence, '?' any byte and '[...]' a class
+ * as in Regex. '\' escapes the next byte.
+ * PrefixSet: one prefix per line ('\n', empty lines are ignored); matches inputs which start with
+ * any of them.
+ * Regex: the whole input must match. Supports literals, '.', classes ('[a-z]', '[^...]', '\d',
+ * '\w', '\s' and their negations), groups ('(...)', '(?:...)'), '|', '*', '+', '?', '{n}',
+ * '{n,}', '{n,m}' and the '^' and '$' anchors. There are no backreferences or lookarounds, and
+ * matching runs in time linear in the input (a Pike VM over a Thompson NFA).
+ *
+ * Matchers are immutable and may be used from any thread.
+ */
+class Matcher {
+public:
+  enum class Type : uint32_t { Glob = 0, PrefixSet = 1, Regex = 2 };
+
+  virtual ~Matcher() = default;
+  virtual bool matches(std::string_view input) const = 0;
+
+  // Returns nullptr and sets 'error' if the pattern is invalid or too large.
+  static std::unique_ptr<Matcher> compile(Type type, std::string_view pattern, std::string *error);
+};
+
+/**
+ * MatcherCache holds the compiled matchers of the process, keyed by vm_id and pattern text, so a
+ * pattern is compiled once and its handle is shared by every worker's VM with that vm_id.
+ * Handles are never zero and stay valid for the lifetime of the process.
+ */
+class MatcherCache {
+public:
+  static constexpr size_t kMaxMatchersPerVmId = 4096;
+
+  // Returns WasmResult::BadExpression for an invalid pattern and WasmResult::InternalFailure once
+  // the vm_id has kMaxMatchersPerVmId matchers.
+  static WasmResult compile(std::string_view vm_id, Matcher::Type type, std::string_view pattern,
+                            uint32_t *handle);
+  // Returns nullptr if there is no such handle for 'vm_id'. Takes no lock.
+  static const Matcher *get(std::string_view vm_id, uint32_t handle);
+};
+
+} // namespace proxy_wasm
@@ -0,0 +1,60 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace proxy_wasm {
+
+#include "proxy_wasm_common.h"
+#include "proxy_wasm_enums.h"
+
+/**
+ * MetricRegistry holds the metrics of every VM in the process, keyed by vm_id and name, so that
+ * each thread-local clone of a plugin which defines a metric gets the same id. It is the default
+ * implementation of the ContextBase metrics calls, and embedders with their own stats may use the
+ * ids to index them rather than looking metrics up by name.
+ *
+ * Ids carry the MetricType in their low bits as WasmBase's do. Counters are kept in per-thread
+ * shards which are only written by their thread and summed on read, so neither updates nor reads
+ * take a lock. Gauges are a single value. Histogram samples are accepted but not kept: recording
+ * them is left to the embedder.
+ */
+class MetricRegistry {
+public:
+  struct Metric {
+    std::string vm_id;
+    std::string name;
+    MetricType type;
+    uint32_t id;
+  };
+
+  // Returns BadArgument if 'name' is defined for 'vm_id' with another type.
+  static WasmResult define(std::string_view vm_id, MetricType type, std::string_view name,
+                           uint32_t *metric_id);
+  // Add to a counter or gauge.
+  static WasmResult increment(uint32_t metric_id, int64_t offset);
+  // Set a gauge, or record a histogram sample, which is dropped.
+  static WasmResult record(uint32_t metric_id, uint64_t value);
+  // The value of a counter or gauge.
+  static WasmResult get(uint32_t metric_id, uint64_t *value);
+  // Every metric defined so far, in the order of definition.
+  static std::vector<Metric> metrics();
+};
+
+} // namespace proxy_wasm
@@ -40,6 +40,8 @@ struct NullPluginRegistry {
   void (*proxy_abi_version_0_2_0_)() = nullptr;
   void (*proxy_abi_version_0_2_1_)() = nullptr;
   void (*proxy_on_log_)(uint32_t context_id) = nullptr;
+  // 'context_ids' is allocated with malloc() and owned by the callee.
+  void (*proxy_on_log_batch_)(const uint32_t *context_ids, uint32_t count) = nullptr;
   uint32_t (*proxy_validate_configuration_)(uint32_t root_context_id,
                                             uint32_t plugin_configuration_size) = nullptr;
   void (*proxy_on_context_create_)(uint32_t context_id, uint32_t parent_context_id) = nullptr;
@@ -106,6 +108,7 @@ public:
   void onGrpcReceiveTrailingMetadata(uint64_t context_id, uint64_t token, uint64_t trailers);
 
   void onLog(uint64_t context_id);
+  void onLogBatch(uint64_t context_ids_ptr, uint64_t count);
   uint64_t onDone(uint64_t context_id);
   void onDelete(uint64_t context_id);
 
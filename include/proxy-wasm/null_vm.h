@@ -45,6 +45,10 @@ struct NullVm : public WasmVm {
   bool getWord(uint64_t pointer, Word *data) override;
   std::string_view getCustomSection(std::string_view name) override;
   std::string_view getPrecompiledSectionName() override;
+  // Null VM "linear memory" is the host heap.
+  uint64_t releaseMemory(uint64_t, uint64_t) override { return 0; }
+  std::optional<uint64_t> residentMemory() override { return std::nullopt; }
+  bool prepareMemory(bool, bool) override { return false; }
 
 #define _FORWARD_GET_FUNCTION(_T)                                                                  \
   void getFunction(std::string_view function_name, _T *f) override {                               \
@@ -0,0 +1,60 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace proxy_wasm {
+
+/**
+ * ForeignFunctionThreadPool runs the asynchronous foreign functions (see
+ * RegisterAsyncForeignFunction) called by every VM in the process. The embedder creates at most
+ * one, and while it exists proxy_call_foreign_function_async hands work to its threads. Without a
+ * pool, or when more than 'max_pending' calls are waiting, the function is run on the calling
+ * thread instead; the result is delivered asynchronously either way.
+ *
+ * The destructor runs any pending work before returning.
+ */
+class ForeignFunctionThreadPool {
+public:
+  explicit ForeignFunctionThreadPool(size_t threads, size_t max_pending = 4096);
+  ~ForeignFunctionThreadPool();
+
+  ForeignFunctionThreadPool(const ForeignFunctionThreadPool &) = delete;
+  ForeignFunctionThreadPool &operator=(const ForeignFunctionThreadPool &) = delete;
+
+  // Queue 'work' on the pool. Returns false if there is no pool or it is full.
+  static bool submit(std::function<void()> work);
+
+private:
+  bool enqueue(std::function<void()> work);
+  void run();
+
+  const size_t max_pending_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> pending_;
+  bool stopping_ = false;
+
+  std::vector<std::thread> threads_; // Last: started once the members above are initialized.
+};
+
+} // namespace proxy_wasm
@@ -0,0 +1,97 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace proxy_wasm {
+
+/**
+ * TimerWheel is a hierarchical timing wheel (4 levels of 64 slots) holding the one-shot and
+ * periodic timers of one thread, e.g. the tick timers of every root context on a worker (see
+ * WasmBase::setTimerWheel()). It is not thread-safe and does not own a thread: the embedder arms
+ * a single event loop timer for nextExpiry() and calls advance() when it fires, so all of the
+ * timers which fall due in the same tick are run by one wakeup. Scheduling and cancelling are
+ * O(1).
+ *
+ * Times are rounded up to 'resolution'. With the default of 100us the wheel covers about 28
+ * minutes, and timers further out wait in an overflow list.
+ */
+class TimerWheel {
+public:
+  using TimerId = uint64_t;
+  using Callback = std::function<void()>;
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  explicit TimerWheel(std::chrono::nanoseconds resolution = std::chrono::microseconds(100),
+                      TimePoint now = std::chrono::steady_clock::now());
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // Run 'callback' once 'delay' after the time of the last advance() or, if 'period' is non-zero,
+  // repeatedly every 'period' from then on. The callback may schedule and cancel timers,
+  // including its own. Returns an id for cancel(), never zero.
+  TimerId schedule(std::chrono::nanoseconds delay, Callback callback,
+                   std::chrono::nanoseconds period = std::chrono::nanoseconds(0));
+  // Returns false if the timer has already run (one-shot) or was cancelled.
+  bool cancel(TimerId id);
+
+  // Run every timer due at or before 'now'. Returns the number of callbacks run.
+  size_t advance(TimePoint now);
+  // The time at which the earliest timer is due or nullopt if there are no timers.
+  std::optional<TimePoint> nextExpiry() const;
+
+  size_t size() const { return timers_.size(); }
+  std::chrono::nanoseconds resolution() const { return resolution_; }
+
+private:
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 6;
+  static constexpr uint64_t kSlots = 1 << kSlotBits;
+  static constexpr uint64_t kSlotMask = kSlots - 1;
+
+  struct Timer {
+    uint64_t expiry; // In ticks.
+    uint64_t period; // In ticks, 0 for one-shot timers.
+    Callback callback;
+  };
+  // Slots hold (id, expiry) pairs. Cancelled timers are left in place and skipped when their slot
+  // is reached, as are entries whose expiry no longer matches the timer.
+  using Slot = std::vector<std::pair<TimerId, uint64_t>>;
+
+  uint64_t ticks(std::chrono::nanoseconds duration) const;
+  void insert(TimerId id, uint64_t expiry);
+  void cascade(int level);
+  size_t runSlot(uint64_t target);
+  bool live(const std::pair<TimerId, uint64_t> &entry) const;
+
+  const std::chrono::nanoseconds resolution_;
+  const TimePoint start_;
+  uint64_t now_ = 0; // Ticks since start_ which have been processed.
+  TimerId next_id_ = 1;
+  std::unordered_map<TimerId, Timer> timers_;
+  Slot slots_[kLevels][kSlots];
+  size_t level_entries_[kLevels] = {};
+  Slot overflow_;
+};
+
+} // namespace proxy_wasm
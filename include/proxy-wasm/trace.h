@@ -0,0 +1,88 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace proxy_wasm {
+
+// A completed span covering one phase of the VM lifecycle (e.g. "load" or "clone").
+struct TraceSpan {
+  std::string name;
+  std::string vm_key;
+  std::string runtime;
+  uint32_t thread_id; // Small sequential id assigned to each thread on first use.
+  std::chrono::steady_clock::time_point start;
+  std::chrono::nanoseconds duration;
+};
+
+/**
+ * TraceSink receives the spans recorded for VM lifecycle phases (createWasm, initialize, load,
+ * link, startVm, configure and clone). Spans are recorded on whichever thread runs the phase, so
+ * implementations must be thread-safe.
+ */
+class TraceSink {
+public:
+  virtual ~TraceSink() = default;
+  virtual void recordSpan(const TraceSpan &span) = 0;
+};
+
+// Install the process-wide trace sink and return the previous one. Passing nullptr disables
+// tracing, which is the default.
+std::shared_ptr<TraceSink> setTraceSink(std::shared_ptr<TraceSink> sink);
+std::shared_ptr<TraceSink> getTraceSink();
+
+/**
+ * ChromeTraceSink buffers spans in memory and writes them in the Chrome trace event format, which
+ * can be loaded into chrome://tracing or Perfetto to see where startup time goes across workers.
+ */
+class ChromeTraceSink : public TraceSink {
+public:
+  void recordSpan(const TraceSpan &span) override;
+
+  void write(std::ostream &os) const;
+  // Returns false if the file could not be written.
+  bool writeToFile(const std::string &path) const;
+
+  std::vector<TraceSpan> spans() const;
+  void clear();
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<TraceSpan> spans_;
+};
+
+// Records a span from construction to destruction if a TraceSink is installed.
+class TraceScope {
+public:
+  TraceScope(std::string_view name, std::string_view vm_key, std::string_view runtime);
+  ~TraceScope();
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  std::shared_ptr<TraceSink> sink_;
+  TraceSpan span_;
+};
+
+} // namespace proxy_wasm
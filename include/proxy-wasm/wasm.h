@@ -18,6 +18,7 @@
 #include <string.h>
 
 #include <atomic>
+#include <bitset>
 #include <deque>
 #include <map>
 #include <memory>
@@ -26,6 +27,7 @@
 
 #include "include/proxy-wasm/context.h"
 #include "include/proxy-wasm/exports.h"
+#include "include/proxy-wasm/timer_wheel.h"
 #include "include/proxy-wasm/wasm_vm.h"
 
 namespace proxy_wasm {
@@ -38,9 +40,51 @@ class WasmHandleBase;
 
 using WasmForeignFunction =
     std::function<WasmResult(WasmBase &, std::string_view, std::function<void *(size_t size)>)>;
+// Runs on a ForeignFunctionThreadPool thread: it must not touch any VM.
+using WasmAsyncForeignFunction =
+    std::function<WasmResult(std::string_view arguments, std::string *result)>;
 using WasmVmFactory = std::function<std::unique_ptr<WasmVm>()>;
 using CallOnThreadFunction = std::function<void(std::function<void()>)>;
 
+// What a module does, from the handlers it exports and the host functions it imports (see
+// WasmBase::capabilities()).
+enum class Capability : uint32_t {
+  // Exported handlers.
+  VmStart,
+  Configure,
+  Tick,
+  ContextCreate,
+  NewConnection,
+  DownstreamData,
+  UpstreamData,
+  ConnectionClose,
+  RequestHeaders,
+  RequestBody,
+  RequestTrailers,
+  RequestMetadata,
+  ResponseHeaders,
+  ResponseBody,
+  ResponseTrailers,
+  ResponseMetadata,
+  HttpCallResponse,
+  GrpcCallbacks,
+  QueueReady,
+  ForeignFunctionResult,
+  Done,
+  Log,
+  Delete,
+  // Imported host functions.
+  HttpCall,
+  GrpcCall,
+  SharedData,
+  SharedQueue,
+  Metrics,
+  Properties,
+  ForeignFunction,
+  Max,
+};
+using Capabilities = std::bitset<static_cast<size_t>(Capability::Max)>;
+
 // Wasm execution instance. Manages the host side of the Wasm interface.
 class WasmBase : public std::enable_shared_from_this<WasmBase> {
 public:
@@ -73,6 +117,7 @@ public:
   bool isFailed() { return failed_ != FailState::Ok; }
   FailState fail_state() { return failed_; }
 
+  // The module source, kept only when thread-local VMs can not be cloned from this one.
   const std::string &code() const { return code_; }
   const std::string &vm_configuration() const;
   bool allow_precompiled() const { return allow_precompiled_; }
@@ -100,9 +145,24 @@ public:
   virtual ContextBase *createContext(const std::shared_ptr<PluginBase> &plugin) {
     return new ContextBase(this, plugin);
   }
-  virtual void setTimerPeriod(uint32_t root_context_id, std::chrono::milliseconds period) {
-    timer_period_[root_context_id] = period;
-  }
+  virtual void setTimerPeriod(uint32_t root_context_id, std::chrono::milliseconds period);
+  // Run the proxy_on_tick timers of the root contexts on 'timer_wheel', which would normally be
+  // shared by all of the VMs on the calling thread. Without a wheel the embedder is responsible
+  // for the periods recorded by setTimerPeriod().
+  void setTimerWheel(std::shared_ptr<TimerWheel> timer_wheel);
+
+  // Release guest memory on behalf of proxy_release_memory (see WasmVm::releaseMemory()). Returns
+  // false if the range is out of bounds.
+  bool releaseMemory(uint64_t pointer, uint64_t size);
+  // Call the module's proxy_on_memory_reclaim export, in which the guest allocator is expected to
+  // hand the free pages of its heap back with proxy_release_memory. Returns the bytes released.
+  uint64_t reclaimMemory();
+  // Check every 'interval' on the timer wheel and reclaimMemory() if more linear memory is resident
+  // than after the last reclaim (see WasmVm::residentMemory()), or the VM has been called since if
+  // that is unknown, and the VM was not called during the interval. Zero disables the check.
+  void setMemoryReclaimInterval(std::chrono::milliseconds interval);
+  // Bytes of linear memory released to the OS so far.
+  uint64_t memoryReleased() const { return memory_released_; }
 
   // Support functions.
   //
@@ -114,6 +174,22 @@ public:
   template <typename T> bool setDatatype(uint64_t ptr, const T &t);
 
   WasmForeignFunction getForeignFunction(std::string_view function_name);
+  // Resolve a foreign function name once to an id (never 0), so that per-request calls skip the
+  // lookup by name (see proxy_resolve_foreign_function). Returns 0 if there is no such function.
+  uint32_t resolveForeignFunction(std::string_view function_name);
+  const WasmForeignFunction *getForeignFunctionById(uint32_t id);
+  // Start an asynchronous foreign function on behalf of 'context' (see
+  // proxy_call_foreign_function_async). Its status and result are delivered on this VM's thread by
+  // ContextBase::onForeignFunctionResult() with the token returned in 'token_ptr', unless the
+  // context or the VM is gone by then. Requires a callOnThreadFunction() which may be called from
+  // any thread.
+  WasmResult callAsyncForeignFunction(ContextBase *context, std::string_view function_name,
+                                      std::string_view arguments, uint32_t *token_ptr);
+  // State kept by the foreign functions registered as 'name' for this VM and destroyed with it,
+  // e.g. the zlib streams it has open. Empty until the function sets it.
+  std::shared_ptr<void> &foreignFunctionState(std::string_view name) {
+    return foreign_function_state_[std::string(name)];
+  }
 
   void fail(FailState fail_state, std::string_view message) {
     error(message);
@@ -124,6 +200,15 @@ public:
 
   AbiVersion abiVersion() { return abi_version_; }
 
+  // The capabilities of the module, computed when it is loaded and shared by its clones. An
+  // embedder may skip the work behind a phase the module has no handler for, e.g. buffering
+  // bodies or creating stream contexts. Import capabilities are all set if the VM can not list the
+  // module's imports, and SDKs which export every handler get every phase.
+  const Capabilities &capabilities() const { return capabilities_; }
+  bool hasCapability(Capability capability) const {
+    return capabilities_.test(static_cast<size_t>(capability));
+  }
+
   bool getEmscriptenVersion(uint32_t *emscripten_metadata_major_version,
                             uint32_t *emscripten_metadata_minor_version,
                             uint32_t *emscripten_abi_major_version,
@@ -151,6 +236,12 @@ public:
     }
   }
 
+  // Run proxy_on_log_batch for the streams logged since the last flush. A flush is posted with
+  // callOnThreadFunction() when the first stream of a batch is logged, so a batch normally covers
+  // one iteration of the event loop; without a callOnThreadFunction() each stream is flushed as
+  // it is logged. Embedders may also call this directly.
+  void flushLogBatch();
+
   static const uint32_t kMetricTypeMask = 0x3;    // Enough to cover the 3 types.
   static const uint32_t kMetricIdIncrement = 0x4; // Enough to cover the 3 types.
   bool isCounterMetricId(uint32_t metric_id) {
@@ -166,11 +257,38 @@ public:
   uint32_t nextGaugeMetricId() { return next_gauge_metric_id_ += kMetricIdIncrement; }
   uint32_t nextHistogramMetricId() { return next_histogram_metric_id_ += kMetricIdIncrement; }
 
+  // Metric slots let the guest update metrics with plain writes to its own memory rather than a
+  // call per update (see proxy_define_metric_slot). A counter slot is an int64 which the guest adds
+  // to, a gauge slot an int64 holding the value and a histogram slot a uint32 count of samples, 4
+  // reserved bytes and a ring of kMetricSlotSamples uint64 samples, the n-th sample going in
+  // entry n % kMetricSlotSamples. Slots are carved out of pages allocated in the VM.
+  static constexpr uint32_t kMetricSlotSamples = 16;
+  static constexpr uint64_t kMetricSlotPageSize = 4096;
+  // Define a metric with 'context' and return the guest address of its slot in 'slot_ptr'.
+  // Defining the same metric again returns the same slot.
+  WasmResult defineMetricSlot(ContextBase *context, uint32_t type, std::string_view name,
+                              uint32_t *metric_id_ptr, uint64_t *slot_ptr);
+  // Report the updates made to the slots since the last flush to 'context' and reset the
+  // counters. Called after proxy_on_log, proxy_on_log_batch and proxy_on_tick, and when a sampled
+  // context is deleted if the VM has been called since, so that updates made in any callback are
+  // reported by the end of the stream.
+  void flushMetricSlots(ContextBase *context);
+
+  // The time page holds two uint64s in guest memory, the realtime and the monotonic time in
+  // nanoseconds as returned by the calling context. Once the guest has asked for it (see
+  // proxy_get_time_page) it is rewritten on every call into the VM, so the guest can read the time
+  // as of the start of the callback without a call to the host.
+  WasmResult getTimePage(ContextBase *context, uint64_t *page_ptr);
+
 protected:
   friend class ContextBase;
+  friend class CallBudget;
   class ShutdownHandle;
 
   void establishEnvironment(); // Language specific environments.
+  void queueLog(std::unique_ptr<ContextBase> context, uint32_t batch_size);
+  void scheduleTick(uint32_t root_context_id, std::chrono::milliseconds period);
+  void computeCapabilities(); // From the functions found by getFunctions().
 
   std::string vm_id_;  // User-provided vm_id.
   std::string vm_key_; // vm_id + hash of code.
@@ -183,8 +301,21 @@ protected:
   std::unordered_map<std::string, std::unique_ptr<ContextBase>> root_contexts_;
   std::unordered_map<uint32_t, ContextBase *> contexts_;                 // Contains all contexts.
   std::unordered_map<uint32_t, std::chrono::milliseconds> timer_period_; // per root_id.
+  std::shared_ptr<TimerWheel> timer_wheel_;
+  std::unordered_map<uint32_t, TimerWheel::TimerId> tick_timers_; // per root_id.
+  uint64_t vm_calls_ = 0;                                        // Counted by CallBudget.
+  uint64_t memory_released_ = 0;
+  // Resident linear memory and vm_calls_ after the last reclaimMemory().
+  uint64_t resident_after_reclaim_ = 0;
+  uint64_t vm_calls_after_reclaim_ = 0;
+  uint64_t reclaim_check_vm_calls_ = 0;
+  std::chrono::milliseconds memory_reclaim_interval_{0};
+  TimerWheel::TimerId memory_reclaim_timer_ = 0;
   std::unique_ptr<ShutdownHandle> shutdown_handle_;
   std::unordered_set<ContextBase *> pending_done_; // Root contexts not done during shutdown.
+  std::vector<std::unique_ptr<ContextBase>> log_batch_; // Streams awaiting proxy_on_log_batch.
+  uint32_t next_foreign_function_token_ = 1;
+  std::unordered_map<std::string, std::shared_ptr<void>> foreign_function_state_;
 
   WasmCallVoid<0> _start_; /* Emscripten v1.39.0+ */
   WasmCallVoid<0> __wasm_call_ctors_;
@@ -207,12 +338,16 @@ protected:
 
   WasmCallWord<2> on_request_headers_abi_01_;
   WasmCallWord<3> on_request_headers_abi_02_;
+  // Preferred to the above if exported: also passed the request headers in the format of
+  // proxy_get_header_map_pairs, in memory the callee must free.
+  WasmCallWord<5> on_request_headers_with_pairs_;
   WasmCallWord<3> on_request_body_;
   WasmCallWord<2> on_request_trailers_;
   WasmCallWord<2> on_request_metadata_;
 
   WasmCallWord<2> on_response_headers_abi_01_;
   WasmCallWord<3> on_response_headers_abi_02_;
+  WasmCallWord<5> on_response_headers_with_pairs_;
   WasmCallWord<3> on_response_body_;
   WasmCallWord<2> on_response_trailers_;
   WasmCallWord<2> on_response_metadata_;
@@ -230,6 +365,8 @@ protected:
 
   WasmCallWord<1> on_done_;
   WasmCallVoid<1> on_log_;
+  WasmCallVoid<2> on_log_batch_;
+  WasmCallVoid<0> on_memory_reclaim_;
   WasmCallVoid<1> on_delete_;
 
   std::shared_ptr<WasmHandleBase> base_wasm_handle_;
@@ -242,6 +379,7 @@ protected:
 
   // ABI version.
   AbiVersion abi_version_ = AbiVersion::Unknown;
+  Capabilities capabilities_;
 
   bool is_emscripten_ = false;
   uint32_t emscripten_metadata_major_version_ = 0;
@@ -254,9 +392,24 @@ protected:
   uint32_t next_counter_metric_id_ = static_cast<uint32_t>(MetricType::Counter);
   uint32_t next_gauge_metric_id_ = static_cast<uint32_t>(MetricType::Gauge);
   uint32_t next_histogram_metric_id_ = static_cast<uint32_t>(MetricType::Histogram);
+  struct MetricSlot {
+    MetricType type;
+    uint32_t metric_id;
+    uint64_t address;
+    uint64_t last; // Gauge value or histogram count at the last flush.
+  };
+  std::vector<MetricSlot> metric_slots_;
+  uint64_t metric_slot_page_ = 0; // Next free address in the current page.
+  uint64_t metric_slot_page_end_ = 0;
+  uint64_t vm_calls_at_flush_ = 0; // vm_calls_ at the last flushMetricSlots().
+
+  uint64_t time_page_ = 0;
+  void publishTime(ContextBase *context);
 
   // Actions to be done after the call into the VM returns.
   std::deque<std::function<void()>> after_vm_call_actions_;
+
+  uint32_t metered_call_depth_ = 0; // Nesting of fuel metered calls (see CallBudget).
 };
 
 // Handle which enables shutdown operations to run post deletion (e.g. post listener drain).
@@ -360,4 +513,8 @@ struct RegisterForeignFunction {
   RegisterForeignFunction(std::string name, WasmForeignFunction f);
 };
 
+struct RegisterAsyncForeignFunction {
+  RegisterAsyncForeignFunction(std::string name, WasmAsyncForeignFunction f);
+};
+
 } // namespace proxy_wasm
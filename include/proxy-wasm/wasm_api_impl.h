@@ -51,6 +51,13 @@ inline WasmResult proxy_set_tick_period_milliseconds(uint64_t millisecond) {
 inline WasmResult proxy_get_current_time_nanoseconds(uint64_t *result) {
   return wordToWasmResult(exports::get_current_time_nanoseconds(current_context_, WR(result)));
 }
+inline WasmResult proxy_get_monotonic_time_nanoseconds(uint64_t *result) {
+  return wordToWasmResult(exports::get_monotonic_time_nanoseconds(current_context_, WR(result)));
+}
+// Returns the address of the time page (see WasmBase::getTimePage()).
+inline WasmResult proxy_get_time_page(const uint64_t **page) {
+  return wordToWasmResult(exports::get_time_page(current_context_, WR(page)));
+}
 
 // State accessors
 inline WasmResult proxy_get_property(const char *path_ptr, size_t path_size,
@@ -256,6 +263,14 @@ inline WasmResult proxy_record_metric(uint32_t metric_id, uint64_t value) {
 inline WasmResult proxy_get_metric(uint32_t metric_id, uint64_t *value) {
   return wordToWasmResult(exports::get_metric(current_context_, WS(metric_id), WR(value)));
 }
+// Returns a metric_id and a slot through which the metric is updated with plain writes (see
+// WasmBase::defineMetricSlot()). Updates are reported after proxy_on_log, proxy_on_log_batch and
+// proxy_on_tick and when a context is deleted (see WasmBase::flushMetricSlots()).
+inline WasmResult proxy_define_metric_slot(MetricType type, const char *name_ptr, size_t name_size,
+                                           uint32_t *metric_id, void **slot) {
+  return wordToWasmResult(exports::define_metric_slot(current_context_, WS(type), WR(name_ptr),
+                                                      WS(name_size), WR(metric_id), WR(slot)));
+}
 
 // System
 inline WasmResult proxy_set_effective_context(uint64_t context_id) {
@@ -270,6 +285,29 @@ inline WasmResult proxy_call_foreign_function(const char *function_name, size_t
       current_context_, WR(function_name), WS(function_name_size), WR(arguments),
       WS(arguments_size), WR(results), WR(results_size)));
 }
+// The CallData passed to proxy_on_foreign_function for 'token' is the function's WasmResult as a
+// uint32_t followed, if it is WasmResult::Ok, by the result.
+inline WasmResult proxy_call_foreign_function_async(const char *function_name,
+                                                    size_t function_name_size,
+                                                    const char *arguments, size_t arguments_size,
+                                                    uint32_t *token) {
+  return wordToWasmResult(exports::call_foreign_function_async(
+      current_context_, WR(function_name), WS(function_name_size), WR(arguments),
+      WS(arguments_size), WR(token)));
+}
+inline WasmResult proxy_resolve_foreign_function(const char *function_name,
+                                                 size_t function_name_size,
+                                                 uint32_t *function_id) {
+  return wordToWasmResult(exports::resolve_foreign_function(
+      current_context_, WR(function_name), WS(function_name_size), WR(function_id)));
+}
+inline WasmResult proxy_call_foreign_function_by_id(uint32_t function_id, const char *arguments,
+                                                    size_t arguments_size, char **results,
+                                                    size_t *results_size) {
+  return wordToWasmResult(exports::call_foreign_function_by_id(current_context_, WS(function_id),
+                                                               WR(arguments), WS(arguments_size),
+                                                               WR(results), WR(results_size)));
+}
 
 #undef WS
 #undef WR
@@ -15,10 +15,12 @@
 
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <string>
 #include <optional>
+#include <vector>
 
 #include "include/proxy-wasm/word.h"
 
@@ -64,7 +66,7 @@ template <size_t N> using WasmCallWord = std::function<WasmFuncType<N, Word, Con
   _f(proxy_wasm::WasmCallVoid<0>) _f(proxy_wasm::WasmCallVoid<1>) _f(proxy_wasm::WasmCallVoid<2>)  \
       _f(proxy_wasm::WasmCallVoid<3>) _f(proxy_wasm::WasmCallVoid<5>)                              \
           _f(proxy_wasm::WasmCallWord<1>) _f(proxy_wasm::WasmCallWord<2>)                          \
-              _f(proxy_wasm::WasmCallWord<3>)
+              _f(proxy_wasm::WasmCallWord<3>) _f(proxy_wasm::WasmCallWord<5>)
 
 // Calls out of the WASM VM.
 // 1st arg is always a pointer to raw_context (void*).
@@ -253,6 +255,12 @@ public:
    */
   virtual std::string_view getPrecompiledSectionName() = 0;
 
+  /**
+   * Whether a custom section only carries debug information (DWARF, names, source maps), which
+   * runtimes release after compiling rather than keep for getCustomSection().
+   */
+  static bool isDebugCustomSection(std::string_view name);
+
   /**
    * Get typed function exported by the WASM module.
    */
@@ -269,6 +277,99 @@ public:
   FOR_ALL_WASM_VM_IMPORTS(_REGISTER_CALLBACK)
 #undef _REGISTER_CALLBACK
 
+  /**
+   * Abort the guest code currently running in this VM. Only called via requestTermination(), when
+   * the thread using the VM is in guest code and not in a host call, but possibly from another
+   * thread, so implementations must be safe to call concurrently with a call into the VM. The
+   * aborted call is expected to return as if it had trapped; the VM is failed afterwards and is
+   * not used again.
+   * @return false if the runtime can not preempt running guest code (e.g. the Null VM).
+   */
+  virtual bool terminate() { return false; }
+
+  /**
+   * Whether a plugin's execution timeout (see PluginBase::execution_timeout_) can be enforced on
+   * this VM, either because terminate() preempts guest code or because, as with the Null VM, the
+   * code is native and trusted to return, the VM being failed when it does. Plugins with a timeout
+   * are rejected by createWasm() otherwise.
+   */
+  virtual bool supportsExecutionTimeout() { return true; }
+
+  /**
+   * Ask for the call running in this VM to be aborted, e.g. from the watchdog thread (see
+   * ExecutionDeadline). A host call may be reading guest memory or holding a host lock, so
+   * terminate() is used straight away only if the VM is in guest code; otherwise it is used when
+   * the outermost host call returns to the guest. Once requested, further host calls and calls
+   * into the VM fail without running.
+   */
+  void requestTermination();
+  bool terminationRequested() const;
+
+  // Bracket each call into guest code. Runtimes create one around every exported function call;
+  // entered() is false if termination has been requested and the call must not be made.
+  class GuestCallScope {
+  public:
+    explicit GuestCallScope(WasmVm *wasm_vm);
+    ~GuestCallScope();
+    bool entered() const { return entered_; }
+
+  private:
+    WasmVm *const wasm_vm_;
+    WasmVm *const saved_vm_;
+    bool entered_ = false;
+    bool tracked_ = false; // Counted in call_state_, as an ExecutionDeadline is armed.
+  };
+
+  /**
+   * Enable deterministic fuel metering. load() then instruments the module with
+   * instrumentForFuel() (see fuel.h) and ignores any precompiled code, and each call into the VM
+   * traps once the fuel set with setFuel() is exhausted. Must be called before load().
+   */
+  void enableFuelMetering() { fuel_metering_ = true; }
+  bool fuelMetering() const { return fuel_metering_; }
+
+  /**
+   * Set or get the fuel (instructions) remaining, which goes negative when a call runs out. It is
+   * kUnmeteredFuel outside of the calls metered by ContextBase.
+   * @return false if fuel metering is not enabled or not supported by the runtime (e.g. Null VM).
+   */
+  virtual bool setFuel(int64_t /* fuel */) { return false; }
+  virtual bool getFuel(int64_t * /* fuel */) { return false; }
+
+  /**
+   * Return the host pages lying wholly within [pointer, pointer + size) of linear memory to the OS
+   * with madvise(MADV_DONTNEED), e.g. after a burst of traffic grew the guest heap. The guest must
+   * no longer need their contents, which read as zero afterwards. The default implementation works
+   * for runtimes whose linear memory is an anonymous mapping (V8, WAVM).
+   * @return the number of bytes released.
+   */
+  virtual uint64_t releaseMemory(uint64_t pointer, uint64_t size);
+
+  /**
+   * The bytes of linear memory currently resident in RAM, found with mincore(). Unlike the size of
+   * linear memory, which never shrinks, this grows again when the guest reuses pages released by
+   * releaseMemory(). Like releaseMemory() the default implementation works for anonymous mappings.
+   * @return nullopt if it can not be measured, e.g. the NullVm.
+   */
+  virtual std::optional<uint64_t> residentMemory();
+
+  /**
+   * Get the names of the functions imported by the loaded module.
+   * @return false if the VM can not tell, e.g. the NullVm.
+   */
+  virtual bool getImportedFunctionNames(std::vector<std::string> * /* names */) { return false; }
+
+  /**
+   * Prepare linear memory for traffic: back it with transparent huge pages (madvise(MADV_HUGEPAGE))
+   * to cut TLB misses, and/or prefault its current pages so that a fresh VM does not take page
+   * faults during its first requests. Pages added by a later memory.grow are not affected. Like
+   * releaseMemory() the default implementation works for anonymous mappings (V8, WAVM). Must be
+   * called after the module is loaded, on the thread using the VM and not during a call into it,
+   * as prefaulting may read and write back each page in place.
+   * @return false if not supported or the OS rejected the advice.
+   */
+  virtual bool prepareMemory(bool huge_pages, bool prefault);
+
   bool isFailed() { return failed_ != FailState::Ok; }
   void fail(FailState fail_state, std::string_view message) {
     error(message);
@@ -289,6 +390,24 @@ protected:
   std::unique_ptr<WasmVmIntegration> integration_;
   FailState failed_ = FailState::Ok;
   std::function<void(FailState)> fail_callback_;
+  bool fuel_metering_ = false;
+
+private:
+  friend struct HostCallScope;
+  friend class ExecutionDeadline;
+
+  // Try to move from guest code ('state') to terminating; true if this caller must call
+  // terminate().
+  bool beginTerminate(uint64_t state);
+  // End a HostCallScope, calling terminate() if it was requested during the host call.
+  void leaveHostCall();
+
+  // Guest calls, host calls and the termination state packed into one word (see wasm.cc) so that
+  // the watchdog thread can tell from a single load whether the VM is in guest code.
+  std::atomic<uint64_t> call_state_{0};
+  // ExecutionDeadlines armed on this VM, by the thread using it. Calls are only tracked in
+  // call_state_ while there is one, so host calls without a deadline cost a thread_local load.
+  uint32_t watched_calls_ = 0;
 };
 
 // Thread local state set during a call into a WASM VM so that calls coming out of the
@@ -0,0 +1,59 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace proxy_wasm {
+
+class WasmVm;
+
+/**
+ * ExecutionDeadline bounds the wall-clock time of a single call into a VM. While it is in scope a
+ * process-wide watchdog thread tracks the deadline and, if it passes, calls
+ * WasmVm::requestTermination() to abort the guest code from the outside, once no host call is
+ * running. When the scope ends after an expiry the VM is failed
+ * with FailState::RuntimeError (if the runtime did not already fail it when the call was aborted),
+ * so a runaway plugin can not stall every other stream on its worker.
+ */
+class ExecutionDeadline {
+public:
+  // A zero 'timeout' disables the deadline, in which case this costs nothing.
+  ExecutionDeadline(WasmVm *wasm_vm, std::chrono::milliseconds timeout);
+  ~ExecutionDeadline();
+
+  ExecutionDeadline(const ExecutionDeadline &) = delete;
+  ExecutionDeadline &operator=(const ExecutionDeadline &) = delete;
+
+  bool expired() const { return expired_; }
+  // Fail the VM now if the deadline has passed, rather than when the scope ends.
+  void check();
+
+private:
+  friend class Watchdog;
+
+  WasmVm *const wasm_vm_;
+  const std::chrono::milliseconds timeout_;
+  std::chrono::steady_clock::time_point deadline_;
+  bool armed_ = false;
+  std::atomic<bool> expired_{false}; // Set by the watchdog thread under its lock.
+};
+
+// The number of calls into any VM in this process which have exceeded their deadline.
+uint64_t getExecutionTimeoutCount();
+
+} // namespace proxy_wasm
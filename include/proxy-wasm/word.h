@@ -50,6 +50,21 @@ template <typename R, typename... Args> struct ConvertFunctionTypeWordToUint32<R
 template <typename T> inline auto convertWordToUint32(T t) { return t; }
 template <> inline auto convertWordToUint32<Word>(Word t) { return static_cast<uint32_t>(t.u64_); }
 
+// Brackets a call from a VM into the host, on behalf of the VM whose WasmVm::GuestCallScope is
+// innermost on this thread (see WasmVm::requestTermination()). It does nothing unless that call
+// has an ExecutionDeadline. entered() is false if the VM is being terminated, in which case the
+// host function must not run as guest memory may be revoked.
+class WasmVm;
+struct HostCallScope {
+  HostCallScope();
+  ~HostCallScope();
+  bool entered() const { return entered_; }
+
+private:
+  WasmVm *const wasm_vm_;
+  bool entered_ = true;
+};
+
 // Convert a function of the form Word(Word...) to one of the form uint32_t(uint32_t...).
 template <typename F, F *fn> struct ConvertFunctionWordToUint32 {
   static void convertFunctionWordToUint32() {}
@@ -58,13 +73,20 @@ template <typename R, typename... Args, auto (*F)(Args...)->R>
 struct ConvertFunctionWordToUint32<R(Args...), F> {
   static typename ConvertWordTypeToUint32<R>::type
   convertFunctionWordToUint32(typename ConvertWordTypeToUint32<Args>::type... args) {
+    HostCallScope host_call;
+    if (!host_call.entered()) {
+      return convertWordToUint32(R(WasmResult::InternalFailure));
+    }
     return convertWordToUint32(F(std::forward<Args>(args)...));
   }
 };
 template <typename... Args, auto (*F)(Args...)->void>
 struct ConvertFunctionWordToUint32<void(Args...), F> {
   static void convertFunctionWordToUint32(typename ConvertWordTypeToUint32<Args>::type... args) {
-    F(std::forward<Args>(args)...);
+    HostCallScope host_call;
+    if (host_call.entered()) {
+      F(std::forward<Args>(args)...);
+    }
   }
 };
 
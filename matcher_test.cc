@@ -0,0 +1,225 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/matcher.h"
+
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+std::unique_ptr<Matcher> compile(Matcher::Type type, std::string_view pattern) {
+  std::string error;
+  auto matcher = Matcher::compile(type, pattern, &error);
+  EXPECT_TRUE(matcher) << pattern << ": " << error;
+  return matcher;
+}
+
+TEST(Matcher, Glob) {
+  auto matcher = compile(Matcher::Type::Glob, "/api/*/v?/[a-c]*.json");
+  EXPECT_TRUE(matcher->matches("/api/users/v1/a.json"));
+  EXPECT_TRUE(matcher->matches("/api//v2/cat.json"));
+  EXPECT_FALSE(matcher->matches("/api/users/v10/a.json"));
+  EXPECT_FALSE(matcher->matches("/api/users/v1/d.json"));
+  EXPECT_FALSE(matcher->matches("/api/users/v1/a.json?x"));
+
+  EXPECT_TRUE(compile(Matcher::Type::Glob, "a\\*b")->matches("a*b"));
+  EXPECT_FALSE(compile(Matcher::Type::Glob, "a\\*b")->matches("axb"));
+  // '*' crosses '/' and matches newlines.
+  EXPECT_TRUE(compile(Matcher::Type::Glob, "*")->matches("a/b\nc"));
+  EXPECT_TRUE(compile(Matcher::Type::Glob, "")->matches(""));
+  EXPECT_FALSE(compile(Matcher::Type::Glob, "")->matches("a"));
+}
+
+TEST(Matcher, PrefixSet) {
+  auto matcher = compile(Matcher::Type::PrefixSet, "/static/\n/api/v1\n\n/health");
+  EXPECT_TRUE(matcher->matches("/static/"));
+  EXPECT_TRUE(matcher->matches("/static/app.js"));
+  EXPECT_TRUE(matcher->matches("/api/v1/users"));
+  EXPECT_TRUE(matcher->matches("/healthz"));
+  EXPECT_FALSE(matcher->matches("/static"));
+  EXPECT_FALSE(matcher->matches("/api/v2"));
+  EXPECT_FALSE(matcher->matches(""));
+  EXPECT_FALSE(compile(Matcher::Type::PrefixSet, "")->matches("anything"));
+}
+
+TEST(Matcher, Regex) {
+  struct Case {
+    const char *pattern;
+    const char *input;
+    bool matches;
+  };
+  std::vector<Case> cases = {
+      {"abc", "abc", true},
+      {"abc", "abcd", false},
+      {"a.c", "abc", true},
+      {"a.c", "a\nc", false},
+      {"a|bc|d", "bc", true},
+      {"a|bc|d", "b", false},
+      {"(ab)+", "ababab", true},
+      {"(ab)+", "", false},
+      {"(?:ab)*c", "c", true},
+      {"colou?r", "color", true},
+      {"colou?r", "colouur", false},
+      {"[a-f0-9]{4}", "beef", true},
+      {"[a-f0-9]{4}", "beefs", false},
+      {"\\d{2,3}", "1", false},
+      {"\\d{2,3}", "12", true},
+      {"\\d{2,3}", "1234", false},
+      {"\\d{2,}", "1234", true},
+      {"[^/]+/\\w+", "api/user_1", true},
+      {"[^/]+/\\w+", "a/b/c", false},
+      {"\\S+\\s\\D", "ab x", true},
+      {"[\\d.-]+", "1.5-2", true},
+      {"[]a]+", "]a]", true},
+      {"a\\.b", "a.b", true},
+      {"a\\.b", "axb", false},
+      {"^a$", "a", true},
+      {"a^b", "ab", false},
+      {"(a|^)b", "b", true},
+      {"()", "", true},
+  };
+  for (auto &c : cases) {
+    auto matcher = compile(Matcher::Type::Regex, c.pattern);
+    ASSERT_TRUE(matcher);
+    EXPECT_EQ(matcher->matches(c.input), c.matches) << c.pattern << " ~ " << c.input;
+  }
+}
+
+TEST(Matcher, LinearTime) {
+  // Catastrophic for a backtracking matcher.
+  auto matcher = compile(Matcher::Type::Regex, "(a*)*(a|b)*c");
+  EXPECT_FALSE(matcher->matches(std::string(100000, 'a')));
+  EXPECT_TRUE(matcher->matches(std::string(100000, 'a') + "c"));
+}
+
+TEST(Matcher, Errors) {
+  std::string error;
+  for (auto pattern : {"(a", "a)", "[a", "a{2,1}", "a{1001}", "*a", "a|+", "\\", "\\q", "[z-a]",
+                       "^*", "(a{1000}){1000}"}) {
+    EXPECT_FALSE(Matcher::compile(Matcher::Type::Regex, pattern, &error)) << pattern;
+    EXPECT_FALSE(error.empty()) << pattern;
+  }
+  EXPECT_FALSE(Matcher::compile(Matcher::Type::Regex, std::string(100000, '('), &error));
+  EXPECT_FALSE(Matcher::compile(Matcher::Type::Glob, "a[", &error));
+  EXPECT_FALSE(Matcher::compile(static_cast<Matcher::Type>(7), "a", &error));
+}
+
+TEST(MatcherCache, SharesHandles) {
+  uint32_t first, second, other;
+  ASSERT_EQ(MatcherCache::compile("cache_vm", Matcher::Type::Glob, "*.js", &first),
+            WasmResult::Ok);
+  ASSERT_EQ(MatcherCache::compile("cache_vm", Matcher::Type::Glob, "*.js", &second),
+            WasmResult::Ok);
+  EXPECT_NE(first, 0);
+  EXPECT_EQ(first, second);
+  // The same text as a different type is a different matcher.
+  ASSERT_EQ(MatcherCache::compile("cache_vm", Matcher::Type::PrefixSet, "*.js", &other),
+            WasmResult::Ok);
+  EXPECT_NE(first, other);
+
+  ASSERT_TRUE(MatcherCache::get("cache_vm", first));
+  EXPECT_TRUE(MatcherCache::get("cache_vm", first)->matches("app.js"));
+  // Handles are not visible to other vm_ids.
+  EXPECT_FALSE(MatcherCache::get("other_vm", first));
+  EXPECT_FALSE(MatcherCache::get("cache_vm", 0));
+  EXPECT_FALSE(MatcherCache::get("cache_vm", 0xffffffff));
+
+  EXPECT_EQ(MatcherCache::compile("cache_vm", Matcher::Type::Regex, "(", &other),
+            WasmResult::BadExpression);
+}
+
+TEST(MatcherCache, ConcurrentCompileAndMatch) {
+  // Threads race to compile the same patterns while matching with the handles they get.
+  std::vector<std::vector<uint32_t>> handles(4, std::vector<uint32_t>(64));
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < handles.size(); t++) {
+    threads.emplace_back([&handles, t] {
+      for (size_t i = 0; i < handles[t].size(); i++) {
+        auto pattern = "/" + std::to_string(i) + "/(a|b)*";
+        ASSERT_EQ(MatcherCache::compile("concurrent_vm", Matcher::Type::Regex, pattern,
+                                        &handles[t][i]),
+                  WasmResult::Ok);
+        for (size_t j = 0; j <= i; j++) {
+          auto matcher = MatcherCache::get("concurrent_vm", handles[t][j]);
+          ASSERT_TRUE(matcher);
+          EXPECT_TRUE(matcher->matches("/" + std::to_string(j) + "/abba"));
+          EXPECT_FALSE(matcher->matches("/" + std::to_string(j) + "/abc"));
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (size_t t = 1; t < handles.size(); t++) {
+    EXPECT_EQ(handles[t], handles[0]);
+  }
+}
+
+TEST(MatcherCache, LimitsMatchersPerVmId) {
+  uint32_t handle;
+  for (size_t i = 0; i < MatcherCache::kMaxMatchersPerVmId; i++) {
+    ASSERT_EQ(MatcherCache::compile("limit_vm", Matcher::Type::PrefixSet, std::to_string(i),
+                                    &handle),
+              WasmResult::Ok);
+  }
+  EXPECT_EQ(MatcherCache::compile("limit_vm", Matcher::Type::PrefixSet, "new", &handle),
+            WasmResult::InternalFailure);
+  // Patterns already compiled are still found.
+  EXPECT_EQ(MatcherCache::compile("limit_vm", Matcher::Type::PrefixSet, "0", &handle),
+            WasmResult::Ok);
+  EXPECT_EQ(MatcherCache::compile("limit_vm_2", Matcher::Type::PrefixSet, "new", &handle),
+            WasmResult::Ok);
+}
+
+TEST(MatcherCache, ForeignFunctions) {
+  auto wasm = std::make_shared<WasmBase>(createNullVm(), "foreign_vm", "", "vm_key");
+  std::string result;
+  auto call = [&](std::string_view name, uint32_t word, std::string_view data) {
+    std::string arguments(sizeof(word), '\0');
+    memcpy(arguments.data(), &word, sizeof(word));
+    arguments.append(data);
+    result.clear();
+    return wasm->getForeignFunction(name)(*wasm, arguments, [&](size_t size) {
+      result.resize(size);
+      return result.data();
+    });
+  };
+  ASSERT_EQ(call("matcher_compile", static_cast<uint32_t>(Matcher::Type::Regex), "GET|HEAD"),
+            WasmResult::Ok);
+  ASSERT_EQ(result.size(), sizeof(uint32_t));
+  uint32_t handle;
+  memcpy(&handle, result.data(), sizeof(handle));
+
+  ASSERT_EQ(call("matcher_match", handle, "HEAD"), WasmResult::Ok);
+  EXPECT_EQ(result, std::string(1, '\1'));
+  ASSERT_EQ(call("matcher_match", handle, "POST"), WasmResult::Ok);
+  EXPECT_EQ(result, std::string(1, '\0'));
+  EXPECT_EQ(call("matcher_match", handle + 1000, "GET"), WasmResult::NotFound);
+  EXPECT_EQ(call("matcher_compile", static_cast<uint32_t>(Matcher::Type::Regex), "a{"),
+            WasmResult::BadExpression);
+  EXPECT_EQ(wasm->getForeignFunction("matcher_match")(*wasm, "ab", [](size_t) { return nullptr; }),
+            WasmResult::BadArgument);
+}
+
+} // namespace
+} // namespace proxy_wasm
@@ -0,0 +1,342 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/exports.h"
+#include "include/proxy-wasm/metric_registry.h"
+#include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/wasm.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+// Slots of the "requests", "active" and "latency" metrics, updated by the guest in proxy_on_log.
+// The Null VM's "linear memory" is the host heap.
+int64_t *requests_slot = nullptr;
+int64_t *active_slot = nullptr;
+struct HistogramSlot {
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t samples[WasmBase::kMetricSlotSamples];
+};
+HistogramSlot *latency_slot = nullptr;
+uint64_t next_latency = 0;
+
+// Memory allocated by the guest, released at the end of each test.
+std::vector<std::unique_ptr<char[]>> guest_heap;
+
+class MetricsNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override {
+    *f = nullptr;
+    if (function_name == "malloc") {
+      *f = [](ContextBase *, Word size) -> Word {
+        guest_heap.emplace_back(new char[size.u64_]);
+        return Word(reinterpret_cast<uint64_t>(guest_heap.back().get()));
+      };
+    } else if (function_name == "proxy_on_done") {
+      *f = [](ContextBase *, Word) -> Word {
+        *requests_slot += 2;
+        return Word(1);
+      };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_log") {
+      *f = [](ContextBase *, Word) {
+        *requests_slot += 1;
+        *active_slot -= 1;
+        auto &latency = *latency_slot;
+        latency.samples[latency.count++ % WasmBase::kMetricSlotSamples] = next_latency++;
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_metrics_plugin("metrics_test_plugin", []() {
+  return std::make_unique<MetricsNullVmPlugin>();
+});
+
+// Metrics as the embedder sees them.
+std::map<std::string, uint32_t> metric_ids;
+std::map<uint32_t, int64_t> counters;
+std::map<uint32_t, uint64_t> gauges;
+std::map<uint32_t, std::vector<uint64_t>> histograms;
+uint64_t metric_calls = 0;
+
+void resetMetrics() {
+  metric_ids.clear();
+  counters.clear();
+  gauges.clear();
+  histograms.clear();
+  metric_calls = 0;
+}
+
+class MetricsContext : public ContextBase {
+public:
+  using ContextBase::ContextBase;
+
+  WasmResult defineMetric(uint32_t type, std::string_view name, uint32_t *metric_id_ptr) override {
+    auto it = metric_ids.find(std::string(name));
+    if (it != metric_ids.end()) {
+      *metric_id_ptr = it->second;
+      return WasmResult::Ok;
+    }
+    switch (static_cast<MetricType>(type)) {
+    case MetricType::Counter:
+      *metric_id_ptr = wasm()->nextCounterMetricId();
+      break;
+    case MetricType::Gauge:
+      *metric_id_ptr = wasm()->nextGaugeMetricId();
+      break;
+    case MetricType::Histogram:
+      *metric_id_ptr = wasm()->nextHistogramMetricId();
+      break;
+    }
+    metric_ids[std::string(name)] = *metric_id_ptr;
+    return WasmResult::Ok;
+  }
+  WasmResult incrementMetric(uint32_t metric_id, int64_t offset) override {
+    metric_calls++;
+    counters[metric_id] += offset;
+    return WasmResult::Ok;
+  }
+  WasmResult recordMetric(uint32_t metric_id, uint64_t value) override {
+    metric_calls++;
+    if (wasm()->isGaugeMetricId(metric_id)) {
+      gauges[metric_id] = value;
+    } else {
+      histograms[metric_id].push_back(value);
+    }
+    return WasmResult::Ok;
+  }
+};
+
+using MetricsWasm = TestWasm<MetricsContext>;
+
+// Define a metric slot as the guest would, through proxy_define_metric_slot.
+template <typename T>
+WasmResult defineSlot(ContextBase *context, MetricType type, std::string_view name, T **slot) {
+  SaveRestoreContext saved_context(context);
+  uint32_t metric_id = 0;
+  return static_cast<WasmResult>(
+      exports::define_metric_slot(context, Word(static_cast<uint64_t>(type)),
+                                  Word(reinterpret_cast<uint64_t>(name.data())), Word(name.size()),
+                                  Word(reinterpret_cast<uint64_t>(&metric_id)),
+                                  Word(reinterpret_cast<uint64_t>(slot)))
+          .u64_);
+}
+
+TEST(Metrics, SlotsAreFlushedAfterLog) {
+  resetMetrics();
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto wasm = createTestWasm<MetricsWasm>("metrics_test_plugin", plugin);
+  ASSERT_TRUE(wasm);
+  auto root_context = wasm->getRootContext("root");
+
+  ASSERT_EQ(defineSlot(root_context, MetricType::Counter, "requests", &requests_slot),
+            WasmResult::Ok);
+  ASSERT_EQ(defineSlot(root_context, MetricType::Gauge, "active", &active_slot), WasmResult::Ok);
+  ASSERT_EQ(defineSlot(root_context, MetricType::Histogram, "latency", &latency_slot),
+            WasmResult::Ok);
+  EXPECT_EQ(*requests_slot, 0);
+  EXPECT_EQ(latency_slot->count, 0);
+  // Defining a metric again returns its slot.
+  int64_t *again = nullptr;
+  ASSERT_EQ(defineSlot(root_context, MetricType::Counter, "requests", &again), WasmResult::Ok);
+  EXPECT_EQ(again, requests_slot);
+  EXPECT_EQ(defineSlot(root_context, static_cast<MetricType>(7), "bad", &again),
+            WasmResult::BadArgument);
+
+  auto requests = metric_ids["requests"];
+  auto active = metric_ids["active"];
+  auto latency = metric_ids["latency"];
+  *active_slot = 100;
+  for (int i = 0; i < 3; i++) {
+    MetricsContext stream(wasm.get(), root_context->id(), plugin);
+    stream.onLog();
+  }
+  EXPECT_EQ(counters[requests], 3);
+  EXPECT_EQ(*requests_slot, 0);
+  EXPECT_EQ(gauges[active], 97);
+  EXPECT_EQ(histograms[latency], (std::vector<uint64_t>{0, 1, 2}));
+
+  // Nothing is reported for slots which have not changed.
+  auto calls = metric_calls;
+  wasm->flushMetricSlots(root_context);
+  EXPECT_EQ(metric_calls, calls);
+
+  // Updates between flushes are aggregated, and histogram samples older than the ring are lost.
+  for (int i = 0; i < 20; i++) {
+    *requests_slot += 1;
+    latency_slot->samples[latency_slot->count++ % WasmBase::kMetricSlotSamples] = 100 + i;
+  }
+  wasm->flushMetricSlots(root_context);
+  EXPECT_EQ(metric_calls, calls + 1 + WasmBase::kMetricSlotSamples);
+  EXPECT_EQ(counters[requests], 23);
+  ASSERT_EQ(histograms[latency].size(), 3 + WasmBase::kMetricSlotSamples);
+  EXPECT_EQ(histograms[latency][3], 104);
+  EXPECT_EQ(histograms[latency].back(), 119);
+
+  // Updates made by a stream which is not logged are reported when it is deleted.
+  {
+    MetricsContext stream(wasm.get(), root_context->id(), plugin);
+    stream.onDone();
+    stream.onDelete();
+  }
+  EXPECT_EQ(counters[requests], 25);
+
+  // A stream which is deleted right after it is logged is not flushed again.
+  {
+    MetricsContext stream(wasm.get(), root_context->id(), plugin);
+    stream.onLog();
+    EXPECT_EQ(counters[requests], 26);
+    *requests_slot += 1;
+    stream.onDelete();
+    EXPECT_EQ(counters[requests], 26);
+  }
+  // Nor is one which is not sampled, as the guest never saw it.
+  plugin->sample_rate_per_million_ = 0;
+  {
+    MetricsContext stream(wasm.get(), root_context->id(), plugin);
+    stream.onCreate();
+    stream.onDone();
+    stream.onDelete();
+    EXPECT_EQ(counters[requests], 26);
+  }
+  wasm->flushMetricSlots(root_context);
+  EXPECT_EQ(counters[requests], 27);
+  guest_heap.clear();
+}
+
+TEST(Metrics, SlotsSpanPages) {
+  resetMetrics();
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto wasm = createTestWasm<MetricsWasm>("metrics_test_plugin", plugin);
+  ASSERT_TRUE(wasm);
+  auto root_context = wasm->getRootContext("root");
+
+  const size_t n = 2 * WasmBase::kMetricSlotPageSize / sizeof(int64_t);
+  std::vector<int64_t *> slots(n);
+  for (size_t i = 0; i < n; i++) {
+    ASSERT_EQ(defineSlot(root_context, MetricType::Counter, "page_" + std::to_string(i), &slots[i]),
+              WasmResult::Ok);
+    *slots[i] = i + 1;
+  }
+  wasm->flushMetricSlots(root_context);
+  for (size_t i = 0; i < n; i++) {
+    EXPECT_EQ(counters[metric_ids["page_" + std::to_string(i)]], i + 1);
+  }
+  guest_heap.clear();
+}
+
+TEST(MetricRegistry, IdsAreSharedByVmId) {
+  // Contexts without overrides use the registry.
+  WasmBase wasm1(createNullVm(), "registry_vm", "", "vm_key");
+  WasmBase wasm2(createNullVm(), "registry_vm", "", "vm_key");
+  WasmBase other(createNullVm(), "registry_other_vm", "", "vm_key");
+  ContextBase context1(&wasm1), context2(&wasm2), other_context(&other);
+  uint32_t id1 = 0, id2 = 0, other_id = 0;
+  ASSERT_EQ(context1.defineMetric(static_cast<uint32_t>(MetricType::Counter), "hits", &id1),
+            WasmResult::Ok);
+  ASSERT_EQ(context2.defineMetric(static_cast<uint32_t>(MetricType::Counter), "hits", &id2),
+            WasmResult::Ok);
+  ASSERT_EQ(other_context.defineMetric(static_cast<uint32_t>(MetricType::Counter), "hits",
+                                       &other_id),
+            WasmResult::Ok);
+  EXPECT_EQ(id1, id2);
+  EXPECT_NE(id1, other_id);
+  EXPECT_TRUE(wasm1.isCounterMetricId(id1));
+  EXPECT_EQ(context1.defineMetric(static_cast<uint32_t>(MetricType::Gauge), "hits", &id2),
+            WasmResult::BadArgument);
+
+  EXPECT_EQ(context1.incrementMetric(id1, 2), WasmResult::Ok);
+  EXPECT_EQ(context2.incrementMetric(id1, 3), WasmResult::Ok);
+  uint64_t value = 0;
+  ASSERT_EQ(context2.getMetric(id1, &value), WasmResult::Ok);
+  EXPECT_EQ(value, 5);
+  ASSERT_EQ(other_context.getMetric(other_id, &value), WasmResult::Ok);
+  EXPECT_EQ(value, 0);
+  EXPECT_EQ(context1.recordMetric(id1, 1), WasmResult::BadArgument);
+  EXPECT_EQ(context1.getMetric(id1 + 1000 * WasmBase::kMetricIdIncrement, &value),
+            WasmResult::NotFound);
+
+  bool found = false;
+  for (auto &metric : MetricRegistry::metrics()) {
+    if (metric.id == other_id) {
+      EXPECT_EQ(metric.vm_id, "registry_other_vm");
+      EXPECT_EQ(metric.name, "hits");
+      EXPECT_EQ(metric.type, MetricType::Counter);
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+}
+
+TEST(MetricRegistry, GaugesAndHistograms) {
+  uint32_t gauge = 0, histogram = 0;
+  ASSERT_EQ(MetricRegistry::define("registry_vm", MetricType::Gauge, "connections", &gauge),
+            WasmResult::Ok);
+  ASSERT_EQ(MetricRegistry::define("registry_vm", MetricType::Histogram, "size", &histogram),
+            WasmResult::Ok);
+  uint64_t value = 1;
+  ASSERT_EQ(MetricRegistry::get(gauge, &value), WasmResult::Ok);
+  EXPECT_EQ(value, 0);
+  EXPECT_EQ(MetricRegistry::record(gauge, 10), WasmResult::Ok);
+  EXPECT_EQ(MetricRegistry::increment(gauge, -3), WasmResult::Ok);
+  ASSERT_EQ(MetricRegistry::get(gauge, &value), WasmResult::Ok);
+  EXPECT_EQ(value, 7);
+  // Histogram samples are accepted and dropped.
+  EXPECT_EQ(MetricRegistry::record(histogram, 1), WasmResult::Ok);
+  EXPECT_EQ(MetricRegistry::get(histogram, &value), WasmResult::BadArgument);
+  EXPECT_EQ(MetricRegistry::define("registry_vm", static_cast<MetricType>(3), "bad", &gauge),
+            WasmResult::BadArgument);
+}
+
+TEST(MetricRegistry, CountersSumThreadShards) {
+  uint32_t id = 0;
+  ASSERT_EQ(MetricRegistry::define("registry_vm", MetricType::Counter, "sharded", &id),
+            WasmResult::Ok);
+  // Counts from threads which have exited are kept.
+  for (int round = 0; round < 2; round++) {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+      threads.emplace_back([id] {
+        for (int j = 0; j < 10000; j++) {
+          MetricRegistry::increment(id, 1);
+        }
+      });
+    }
+    uint64_t value = 0;
+    ASSERT_EQ(MetricRegistry::get(id, &value), WasmResult::Ok);
+    EXPECT_LE(value, (round + 1) * 80000);
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    ASSERT_EQ(MetricRegistry::get(id, &value), WasmResult::Ok);
+    EXPECT_EQ(value, (round + 1) * 80000);
+  }
+}
+
+} // namespace
+} // namespace proxy_wasm
@@ -0,0 +1,212 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/async_log.h"
+#include "include/proxy-wasm/null.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+constexpr char kPluginName[] = "observe_test_plugin";
+
+// What the plugin saw, in order: "headers <path>", "body <bytes>" or "log".
+std::vector<std::string> observed;
+// The result of the header mutation attempted by proxy_on_request_headers.
+WasmResult mutation_result = WasmResult::Ok;
+
+class ObserveNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_log") {
+      *f = [](ContextBase *, Word) { observed.push_back("log"); };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallWord<3> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_request_headers") {
+      *f = [](ContextBase *context, Word, Word, Word) -> Word {
+        std::string_view path;
+        context->getHeaderMapValue(WasmHeaderMapType::RequestHeaders, "path", &path);
+        observed.push_back("headers " + std::string(path));
+        mutation_result =
+            context->addHeaderMapValue(WasmHeaderMapType::RequestHeaders, "observed", "1");
+        return Word(static_cast<uint64_t>(FilterHeadersStatus::StopIteration));
+      };
+    } else if (function_name == "proxy_on_response_headers") {
+      *f = [](ContextBase *context, Word, Word, Word) -> Word {
+        std::string_view path;
+        std::string id = "none";
+        context->getHeaderMapValue(WasmHeaderMapType::RequestHeaders, "path", &path);
+        context->getProperty("request_id", &id);
+        observed.push_back("response " + std::string(path) + " " + id);
+        return Word(static_cast<uint64_t>(FilterHeadersStatus::StopIteration));
+      };
+    } else if (function_name == "proxy_on_request_body") {
+      *f = [](ContextBase *context, Word, Word body_size, Word) -> Word {
+        auto buffer = context->getBuffer(WasmBufferType::HttpRequestBody);
+        uint64_t data = 0;
+        uint64_t size = 0;
+        if (buffer && buffer->copyTo(context->wasm(), 0, body_size.u64_,
+                                     reinterpret_cast<uint64_t>(&data),
+                                     reinterpret_cast<uint64_t>(&size)) == WasmResult::Ok) {
+          auto body = reinterpret_cast<char *>(data);
+          observed.push_back("body " + std::string(body, size));
+          ::free(body);
+        }
+        return Word(static_cast<uint64_t>(FilterDataStatus::StopIterationAndBuffer));
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_test_plugin(kPluginName, []() {
+  return std::make_unique<ObserveNullVmPlugin>();
+});
+
+class TestBuffer : public BufferBase {
+public:
+  WasmResult copyOut(std::string *result) const override {
+    if (!copyable_) {
+      return WasmResult::Unimplemented;
+    }
+    *result = std::string(data_);
+    return WasmResult::Ok;
+  }
+
+  bool copyable_ = true;
+};
+
+class ObserveContext : public TestContext {
+public:
+  using TestContext::TestContext;
+
+  BufferInterface *getBuffer(WasmBufferType type) override {
+    return type == WasmBufferType::HttpRequestBody ? body_.set(body_data_) : nullptr;
+  }
+
+  std::string body_data_;
+  TestBuffer body_;
+};
+
+class ObserveTest : public testing::Test {
+protected:
+  void SetUp() override {
+    observed.clear();
+    takePosted();
+    mutation_result = WasmResult::Ok;
+  }
+};
+
+TEST_F(ObserveTest, Blocking) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto wasm = createTestWasm(kPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  ObserveContext stream(wasm.get(), wasm->getRootContext("root")->id(), plugin);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/a");
+  stream.onCreate();
+
+  EXPECT_EQ(stream.onRequestHeaders(1, false), FilterHeadersStatus::StopIteration);
+  EXPECT_EQ(observed, std::vector<std::string>{"headers /a"});
+  EXPECT_EQ(mutation_result, WasmResult::Ok);
+  stream.onDelete();
+}
+
+TEST_F(ObserveTest, Deferred) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->observe_only_ = true;
+  auto wasm = createTestWasm(kPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  ObserveContext stream(wasm.get(), wasm->getRootContext("root")->id(), plugin);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/a");
+  stream.body_data_ = "hello";
+  stream.onCreate();
+
+  // The stream never waits: the plugin runs in the next event loop iteration, on what it was
+  // given, whatever has happened to the stream since.
+  EXPECT_EQ(stream.onRequestHeaders(1, false), FilterHeadersStatus::Continue);
+  EXPECT_EQ(stream.onRequestBody(5, true), FilterDataStatus::Continue);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/b");
+  stream.body_data_ = "bye";
+  EXPECT_TRUE(observed.empty());
+  auto posted = takePosted();
+  ASSERT_EQ(posted.size(), 1);
+  posted[0]();
+  EXPECT_EQ(observed, (std::vector<std::string>{"headers /a", "body hello"}));
+  EXPECT_EQ(mutation_result, WasmResult::Unimplemented);
+  EXPECT_EQ(wasm->getContext(stream.id()), &stream);
+
+  // Callbacks still queued are run before the log.
+  EXPECT_EQ(stream.onRequestHeaders(1, true), FilterHeadersStatus::Continue);
+  stream.onLog();
+  EXPECT_EQ(observed, (std::vector<std::string>{"headers /a", "body hello", "headers /b", "log"}));
+  posted = takePosted();
+  ASSERT_EQ(posted.size(), 1);
+  posted[0]();
+  EXPECT_EQ(observed.size(), 4);
+  stream.onDelete();
+}
+
+TEST_F(ObserveTest, StreamSoFar) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->observe_only_ = true;
+  plugin->log_properties_ = {"request_id"};
+  auto wasm = createTestWasm(kPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  ObserveContext stream(wasm.get(), wasm->getRootContext("root")->id(), plugin);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/a");
+  stream.properties_["request_id"] = "1";
+  stream.onCreate();
+
+  // The response headers callback sees the request headers and properties as they were then.
+  EXPECT_EQ(stream.onRequestHeaders(1, true), FilterHeadersStatus::Continue);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/b");
+  EXPECT_EQ(stream.onResponseHeaders(0, false), FilterHeadersStatus::Continue);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/c");
+  stream.properties_["request_id"] = "2";
+  auto posted = takePosted();
+  ASSERT_EQ(posted.size(), 1);
+  posted[0]();
+  EXPECT_EQ(observed, (std::vector<std::string>{"headers /a", "response /a 1"}));
+  stream.onDelete();
+}
+
+TEST_F(ObserveTest, UncopyableBody) {
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->observe_only_ = true;
+  auto wasm = createTestWasm(kPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  ObserveContext stream(wasm.get(), wasm->getRootContext("root")->id(), plugin);
+  stream.setHeader(WasmHeaderMapType::RequestHeaders, "path", "/a");
+  stream.body_data_ = "hello";
+  stream.body_.copyable_ = false;
+  stream.onCreate();
+
+  // The body can not be kept, so the plugin runs straight away, after the callbacks before it.
+  EXPECT_EQ(stream.onRequestHeaders(1, false), FilterHeadersStatus::Continue);
+  EXPECT_EQ(stream.onRequestBody(5, true), FilterDataStatus::Continue);
+  EXPECT_EQ(observed, (std::vector<std::string>{"headers /a", "body hello"}));
+  stream.onDelete();
+}
+
+} // namespace
+} // namespace proxy_wasm
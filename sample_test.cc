@@ -0,0 +1,143 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+constexpr char kPluginName[] = "sample_test_plugin";
+
+// Calls into the plugin for streams.
+int created = 0;
+int headers = 0;
+int logged = 0;
+int deleted = 0;
+
+class SampleNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_log") {
+      *f = [](ContextBase *, Word) { logged++; };
+    } else if (function_name == "proxy_on_delete") {
+      *f = [](ContextBase *, Word) { deleted++; };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallVoid<2> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_context_create") {
+      *f = [](ContextBase *, Word, Word parent_context_id) {
+        if (parent_context_id.u64_) {
+          created++;
+        }
+      };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallWord<3> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_request_headers") {
+      *f = [](ContextBase *, Word, Word, Word) -> Word {
+        headers++;
+        return Word(static_cast<uint64_t>(FilterHeadersStatus::StopIteration));
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_test_plugin(kPluginName, []() {
+  return std::make_unique<SampleNullVmPlugin>();
+});
+
+class SampleTest : public testing::Test {
+protected:
+  void SetUp() override {
+    plugin_ = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+    wasm_ = createTestWasm(kPluginName, plugin_);
+    ASSERT_TRUE(wasm_);
+    created = headers = logged = deleted = 0;
+  }
+
+  // Runs a stream through the plugin and returns whether the plugin saw it.
+  bool runStream(std::string request_id = "") {
+    TestContext stream(wasm_.get(), wasm_->getRootContext("root")->id(), plugin_);
+    if (!request_id.empty()) {
+      stream.properties_[std::string("request\0id", 10)] = request_id;
+    }
+    auto before = created;
+    stream.onCreate();
+    auto status = stream.onRequestHeaders(1, true);
+    stream.onLog();
+    stream.onDelete();
+    bool sampled = created != before;
+    EXPECT_EQ(status,
+              sampled ? FilterHeadersStatus::StopIteration : FilterHeadersStatus::Continue);
+    return sampled;
+  }
+
+  std::shared_ptr<PluginBase> plugin_;
+  std::shared_ptr<TestWasm<>> wasm_;
+};
+
+TEST_F(SampleTest, All) {
+  EXPECT_TRUE(runStream());
+  EXPECT_EQ(headers, 1);
+  EXPECT_EQ(logged, 1);
+  EXPECT_EQ(deleted, 1);
+}
+
+TEST_F(SampleTest, None) {
+  plugin_->sample_rate_per_million_ = 0;
+  EXPECT_FALSE(runStream());
+  EXPECT_FALSE(runStream("id"));
+  EXPECT_EQ(headers, 0);
+  EXPECT_EQ(logged, 0);
+  EXPECT_EQ(deleted, 0);
+}
+
+TEST_F(SampleTest, Random) {
+  plugin_->sample_rate_per_million_ = 250000;
+  int sampled = 0;
+  for (int i = 0; i < 4000; i++) {
+    sampled += runStream();
+  }
+  EXPECT_GT(sampled, 800);
+  EXPECT_LT(sampled, 1200);
+  EXPECT_EQ(headers, sampled);
+  EXPECT_EQ(logged, sampled);
+  EXPECT_EQ(deleted, sampled);
+}
+
+TEST_F(SampleTest, ByKey) {
+  plugin_->sample_rate_per_million_ = 500000;
+  plugin_->sample_key_ = std::string("request\0id", 10);
+  int sampled = 0;
+  for (int i = 0; i < 2000; i++) {
+    auto request_id = "request-" + std::to_string(i);
+    bool first = runStream(request_id);
+    // The same key is always sampled the same way.
+    EXPECT_EQ(runStream(request_id), first) << request_id;
+    sampled += first;
+  }
+  EXPECT_GT(sampled, 800);
+  EXPECT_LT(sampled, 1200);
+}
+
+} // namespace
+} // namespace proxy_wasm
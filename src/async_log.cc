@@ -0,0 +1,264 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/async_log.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace proxy_wasm {
+
+namespace {
+
+// Executors by vm_key. Submission holds the lock while queueing, so an executor can not be
+// destroyed underneath a worker thread.
+std::mutex executors_mutex;
+std::unordered_map<std::string, AsyncLogExecutor *> *executors = nullptr;
+
+constexpr WasmHeaderMapType kSnapshotHeaderMaps[] = {
+    WasmHeaderMapType::RequestHeaders, WasmHeaderMapType::RequestTrailers,
+    WasmHeaderMapType::ResponseHeaders, WasmHeaderMapType::ResponseTrailers};
+
+} // namespace
+
+std::unique_ptr<StreamSnapshot>
+StreamSnapshot::capture(ContextBase *context, const std::vector<std::string> &properties) {
+  auto snapshot = std::make_unique<StreamSnapshot>();
+  for (auto type : kSnapshotHeaderMaps) {
+    snapshot->captureHeaderMap(context, type);
+  }
+  snapshot->captureProperties(context, properties);
+  return snapshot;
+}
+
+void StreamSnapshot::captureProperties(ContextBase *context,
+                                       const std::vector<std::string> &properties) {
+  properties_.clear();
+  for (auto &path : properties) {
+    std::string value;
+    if (context->getProperty(path, &value) == WasmResult::Ok) {
+      properties_[path] = std::move(value);
+    }
+  }
+}
+
+void StreamSnapshot::captureHeaderMap(ContextBase *context, WasmHeaderMapType type) {
+  auto &map = header_maps_[static_cast<int32_t>(type)];
+  map.clear();
+  Pairs pairs;
+  if (context->getHeaderMapPairs(type, &pairs) != WasmResult::Ok) {
+    return;
+  }
+  map.reserve(pairs.size());
+  for (auto &p : pairs) {
+    map.emplace_back(std::string(p.first), std::string(p.second));
+  }
+}
+
+bool StreamSnapshot::captureBody(ContextBase *context, WasmBufferType type) {
+  body_type_ = type;
+  auto buffer = context->getBuffer(type);
+  if (!buffer) {
+    return true;
+  }
+  if (buffer->copyOut(&body_data_) != WasmResult::Ok) {
+    body_ = buffer;
+    return false;
+  }
+  body_ = body_copy_.set(body_data_);
+  return true;
+}
+
+const std::vector<std::pair<std::string, std::string>> *
+SnapshotContext::headerMap(WasmHeaderMapType type) {
+  auto index = static_cast<int32_t>(type);
+  if (index < 0 || index > static_cast<int32_t>(WasmHeaderMapType::ResponseTrailers)) {
+    return nullptr;
+  }
+  return &snapshot_->header_maps_[index];
+}
+
+WasmResult SnapshotContext::getProperty(std::string_view path, std::string *result) {
+  auto it = snapshot_->properties_.find(std::string(path));
+  if (it == snapshot_->properties_.end()) {
+    return WasmResult::NotFound;
+  }
+  *result = it->second;
+  return WasmResult::Ok;
+}
+
+WasmResult SnapshotContext::getHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                                              std::string_view *result) {
+  auto map = headerMap(type);
+  if (!map) {
+    return WasmResult::BadArgument;
+  }
+  for (auto &p : *map) {
+    if (p.first == key) {
+      *result = p.second;
+      return WasmResult::Ok;
+    }
+  }
+  return WasmResult::NotFound;
+}
+
+WasmResult SnapshotContext::getHeaderMapPairs(WasmHeaderMapType type, Pairs *result) {
+  auto map = headerMap(type);
+  if (!map) {
+    return WasmResult::BadArgument;
+  }
+  result->reserve(result->size() + map->size());
+  for (auto &p : *map) {
+    result->emplace_back(p.first, p.second);
+  }
+  return WasmResult::Ok;
+}
+
+WasmResult SnapshotContext::getHeaderMapSize(WasmHeaderMapType type, uint32_t *result) {
+  auto map = headerMap(type);
+  if (!map) {
+    return WasmResult::BadArgument;
+  }
+  uint32_t size = 0;
+  for (auto &p : *map) {
+    size += p.first.size() + p.second.size();
+  }
+  *result = size;
+  return WasmResult::Ok;
+}
+
+BufferInterface *SnapshotContext::getBuffer(WasmBufferType type) {
+  return body_ && type == body_->body_type_ ? body_->body_ : nullptr;
+}
+
+AsyncLogExecutor::AsyncLogExecutor(std::shared_ptr<WasmHandleBase> base_wasm,
+                                   WasmHandleCloneFactory clone_factory, size_t max_pending)
+    : vm_key_(base_wasm->wasm()->vm_key()), max_pending_(max_pending),
+      base_wasm_(std::move(base_wasm)), clone_factory_(std::move(clone_factory)),
+      thread_([this] { run(); }) {
+  std::lock_guard<std::mutex> guard(executors_mutex);
+  if (!executors) {
+    executors = new std::unordered_map<std::string, AsyncLogExecutor *>;
+  }
+  (*executors)[vm_key_] = this;
+}
+
+AsyncLogExecutor::~AsyncLogExecutor() {
+  {
+    std::lock_guard<std::mutex> guard(executors_mutex);
+    auto it = executors->find(vm_key_);
+    if (it != executors->end() && it->second == this) {
+      executors->erase(it);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+bool AsyncLogExecutor::accepting(std::string_view vm_key) {
+  std::lock_guard<std::mutex> guard(executors_mutex);
+  if (!executors) {
+    return false;
+  }
+  auto it = executors->find(std::string(vm_key));
+  return it != executors->end() && it->second->hasRoom();
+}
+
+bool AsyncLogExecutor::submit(std::string_view vm_key, std::shared_ptr<PluginBase> plugin,
+                              std::unique_ptr<StreamSnapshot> snapshot) {
+  std::lock_guard<std::mutex> guard(executors_mutex);
+  if (!executors) {
+    return false;
+  }
+  auto it = executors->find(std::string(vm_key));
+  if (it == executors->end()) {
+    return false;
+  }
+  return it->second->enqueue(PendingLog{std::move(plugin), std::move(snapshot)});
+}
+
+bool AsyncLogExecutor::hasRoom() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !stopping_ && pending_.size() < max_pending_;
+}
+
+bool AsyncLogExecutor::enqueue(PendingLog log) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || pending_.size() >= max_pending_) {
+      return false;
+    }
+    pending_.push_back(std::move(log));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void AsyncLogExecutor::run() {
+  while (true) {
+    PendingLog log;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        break;
+      }
+      log = std::move(pending_.front());
+      pending_.pop_front();
+    }
+    runLog(std::move(log));
+  }
+  // The VM is thread-local to this thread, so release it here.
+  wasm_handle_.reset();
+}
+
+ContextBase *AsyncLogExecutor::rootContext(const std::shared_ptr<PluginBase> &plugin) {
+  if (!wasm_handle_) {
+    wasm_handle_ = getOrCreateThreadLocalWasm(base_wasm_, plugin, clone_factory_);
+    if (!wasm_handle_) {
+      return nullptr;
+    }
+    configured_root_ids_.insert(plugin->root_id_);
+  }
+  auto wasm = wasm_handle_->wasm().get();
+  if (wasm->isFailed()) {
+    return nullptr;
+  }
+  if (configured_root_ids_.insert(plugin->root_id_).second) {
+    auto root_context = wasm->getOrCreateRootContext(plugin);
+    if (!root_context || !wasm->configure(root_context, plugin)) {
+      return nullptr;
+    }
+  }
+  return wasm->getRootContext(plugin->root_id_);
+}
+
+void AsyncLogExecutor::runLog(PendingLog log) {
+  auto root_context = rootContext(log.plugin);
+  if (!root_context) {
+    return;
+  }
+  SnapshotContext context(root_context->wasm(), root_context->id(), log.plugin,
+                          std::move(log.snapshot));
+  context.onCreate();
+  context.onLog();
+  context.onDelete();
+}
+
+} // namespace proxy_wasm
@@ -0,0 +1,58 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/clock.h"
+
+#include <chrono>
+
+namespace proxy_wasm {
+
+namespace {
+
+struct CachedTime {
+  bool valid = false;
+  uint64_t realtime = 0;
+  uint64_t monotonic = 0;
+};
+
+thread_local CachedTime cached_time;
+
+template <typename Clock> uint64_t nanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch())
+      .count();
+}
+
+} // namespace
+
+void EventLoopClock::update() {
+  update(nanoseconds<std::chrono::system_clock>(), nanoseconds<std::chrono::steady_clock>());
+}
+
+void EventLoopClock::update(uint64_t realtime_nanoseconds, uint64_t monotonic_nanoseconds) {
+  cached_time.valid = true;
+  cached_time.realtime = realtime_nanoseconds;
+  cached_time.monotonic = monotonic_nanoseconds;
+}
+
+void EventLoopClock::reset() { cached_time.valid = false; }
+
+uint64_t EventLoopClock::realtimeNanoseconds() {
+  return cached_time.valid ? cached_time.realtime : nanoseconds<std::chrono::system_clock>();
+}
+
+uint64_t EventLoopClock::monotonicNanoseconds() {
+  return cached_time.valid ? cached_time.monotonic : nanoseconds<std::chrono::steady_clock>();
+}
+
+} // namespace proxy_wasm
@@ -13,17 +13,26 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <deque>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <random>
 #include <unordered_map>
 #include <unordered_set>
 
+#include "include/proxy-wasm/async_log.h"
 #include "include/proxy-wasm/context.h"
+#include "include/proxy-wasm/fuel.h"
 #include "include/proxy-wasm/wasm.h"
+#include "src/pairs.h"
 
 #define CHECK_FAIL(_call, _stream_type, _return_open, _return_closed)                              \
+  if (!sampled_) {                                                                                 \
+    return _return_open;                                                                           \
+  }                                                                                                \
   if (isFailed()) {                                                                                \
     if (plugin_->fail_open_) {                                                                     \
       return _return_open;                                                                         \
@@ -37,7 +46,10 @@
     }                                                                                              \
   }
 
-#define CHECK_FAIL2(_call1, _call2, _stream_type, _return_open, _return_closed)                    \
+#define CHECK_FAIL3(_call1, _call2, _call3, _stream_type, _return_open, _return_closed)            \
+  if (!sampled_) {                                                                                 \
+    return _return_open;                                                                           \
+  }                                                                                                \
   if (isFailed()) {                                                                                \
     if (plugin_->fail_open_) {                                                                     \
       return _return_open;                                                                         \
@@ -46,17 +58,36 @@
       return _return_closed;                                                                       \
     }                                                                                              \
   } else {                                                                                         \
-    if (!wasm_->_call1 && !wasm_->_call2) {                                                        \
+    if (!wasm_->_call1 && !wasm_->_call2 && !wasm_->_call3) {                                      \
       return _return_open;                                                                         \
     }                                                                                              \
   }
 
+// A call which fails in the VM (e.g. a trap or an expired ExecutionDeadline) fails the whole VM,
+// after which the stream is handled as if the VM had already failed before the call. A deadline
+// which the runtime could not act on in time (e.g. the NullVm) fails the VM here, so that the
+// result of the late call is not used.
+#define CHECK_FAIL_AFTER_CALL(_stream_type, _return_open, _return_closed)                          \
+  budget.checkDeadline();                                                                          \
+  if (isFailed()) {                                                                                \
+    if (plugin_->fail_open_) {                                                                     \
+      return _return_open;                                                                         \
+    } else {                                                                                       \
+      failStream(_stream_type);                                                                    \
+      return _return_closed;                                                                       \
+    }                                                                                              \
+  }
+
 #define CHECK_HTTP(_call, _return_open, _return_closed)                                            \
   CHECK_FAIL(_call, WasmStreamType::Request, _return_open, _return_closed)
-#define CHECK_HTTP2(_call1, _call2, _return_open, _return_closed)                                  \
-  CHECK_FAIL2(_call1, _call2, WasmStreamType::Request, _return_open, _return_closed)
+#define CHECK_HTTP3(_call1, _call2, _call3, _return_open, _return_closed)                          \
+  CHECK_FAIL3(_call1, _call2, _call3, WasmStreamType::Request, _return_open, _return_closed)
 #define CHECK_NET(_call, _return_open, _return_closed)                                             \
   CHECK_FAIL(_call, WasmStreamType::Downstream, _return_open, _return_closed)
+#define CHECK_HTTP_AFTER_CALL(_return_open, _return_closed)                                        \
+  CHECK_FAIL_AFTER_CALL(WasmStreamType::Request, _return_open, _return_closed)
+#define CHECK_NET_AFTER_CALL(_return_open, _return_closed)                                         \
+  CHECK_FAIL_AFTER_CALL(WasmStreamType::Downstream, _return_open, _return_closed)
 
 namespace proxy_wasm {
 
@@ -227,6 +258,54 @@ SharedData global_shared_data;
 
 DeferAfterCallActions::~DeferAfterCallActions() { wasm_->doAfterVmCallActions(); }
 
+CallBudget::CallBudget(ContextBase *context)
+    : context_(context), deadline_(context->wasmVm(), context->execution_timeout_) {
+  auto *wasm = context_->wasm();
+  wasm->vm_calls_++;
+  // E.g. a callback delivered from a host call which was running when the deadline passed.
+  if (wasm->wasm_vm()->terminationRequested() && !wasm->isFailed()) {
+    wasm->wasm_vm()->fail(FailState::RuntimeError, "Function called while the VM is terminating");
+  }
+  if (wasm->time_page_) {
+    wasm->publishTime(context_);
+  }
+  if (!context_->fuel_budget_ || !wasm->wasm_vm()->getFuel(&fuel_at_entry_)) {
+    return;
+  }
+  metered_ = true;
+  // Calls made while the VM is already running (e.g. a host function delivering onQueueReady
+  // inline) are charged to the budget of the outer call.
+  outermost_ = wasm->metered_call_depth_++ == 0;
+  if (outermost_) {
+    fuel_at_entry_ = static_cast<int64_t>(context_->fuel_budget_);
+    wasm->wasm_vm()->setFuel(fuel_at_entry_);
+  }
+}
+
+CallBudget::~CallBudget() {
+  if (!metered_) {
+    return;
+  }
+  auto *wasm = context_->wasm();
+  wasm->metered_call_depth_--;
+  int64_t fuel_remaining = 0;
+  if (!wasm->wasm_vm()->getFuel(&fuel_remaining)) {
+    return;
+  }
+  auto consumed = static_cast<uint64_t>(fuel_at_entry_ - fuel_remaining);
+  context_->last_call_fuel_consumed_ = consumed;
+  context_->fuel_consumed_ += consumed;
+  if (!outermost_) {
+    return;
+  }
+  // Calls without a budget (e.g. from the VM context) must not run on the leftover fuel.
+  wasm->wasm_vm()->setFuel(kUnmeteredFuel);
+  if (fuel_remaining < 0) {
+    wasm->error("Function exceeded the fuel budget of " + std::to_string(context_->fuel_budget_) +
+                " instructions");
+  }
+}
+
 WasmResult BufferBase::copyTo(WasmBase *wasm, size_t start, size_t length, uint64_t ptr_ptr,
                               uint64_t size_ptr) const {
   if (owned_data_) {
@@ -263,6 +342,26 @@ std::string PluginBase::makeLogPrefix() const {
   return prefix;
 }
 
+bool PluginBase::sampleStream(ContextBase *stream) const {
+  constexpr uint32_t kMillion = 1000000;
+  if (sample_rate_per_million_ >= kMillion) {
+    return true;
+  }
+  uint64_t hash;
+  std::string key;
+  if (!sample_key_.empty() && stream->getProperty(sample_key_, &key) == WasmResult::Ok) {
+    // FNV-1a.
+    hash = 0xcbf29ce484222325;
+    for (auto c : key) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+    }
+  } else {
+    static thread_local std::minstd_rand random(std::random_device{}());
+    hash = random();
+  }
+  return hash % kMillion < sample_rate_per_million_;
+}
+
 ContextBase::ContextBase() : parent_context_(this) {}
 
 ContextBase::ContextBase(WasmBase *wasm) : wasm_(wasm), parent_context_(this) {
@@ -277,13 +376,23 @@ ContextBase::ContextBase(WasmBase *wasm, std::shared_ptr<PluginBase> plugin) {
 ContextBase::ContextBase(WasmBase *wasm, uint32_t parent_context_id,
                          std::shared_ptr<PluginBase> plugin)
     : wasm_(wasm), id_(wasm ? wasm->allocContextId() : 0), parent_context_id_(parent_context_id),
-      plugin_(plugin) {
+      plugin_(plugin), execution_timeout_(plugin ? plugin->execution_timeout_
+                                                 : std::chrono::milliseconds(0)),
+      fuel_budget_(plugin ? plugin->fuel_budget_ : 0) {
   if (wasm_) {
     wasm_->contexts_[id_] = this;
     parent_context_ = wasm_->contexts_[parent_context_id_];
   }
 }
 
+ContextBase::ContextBase(ContextBase *stream)
+    : wasm_(stream->wasm_), id_(stream->id_), parent_context_id_(stream->parent_context_id_),
+      parent_context_(stream->parent_context_), plugin_(stream->plugin_),
+      execution_timeout_(stream->execution_timeout_), fuel_budget_(stream->fuel_budget_),
+      in_vm_context_created_(stream->in_vm_context_created_) {
+  wasm_->contexts_[id_] = this;
+}
+
 WasmVm *ContextBase::wasmVm() const { return wasm_->wasm_vm(); }
 
 bool ContextBase::isFailed() { return !wasm_ || wasm_->isFailed(); }
@@ -293,6 +402,8 @@ void ContextBase::initializeRootBase(WasmBase *wasm, std::shared_ptr<PluginBase>
   id_ = wasm->allocContextId();
   root_id_ = plugin->root_id_;
   root_log_prefix_ = makeRootLogPrefix(plugin->vm_id_);
+  execution_timeout_ = plugin->execution_timeout_;
+  fuel_budget_ = plugin->fuel_budget_;
   parent_context_ = this;
   wasm_->contexts_[id_] = this;
 }
@@ -313,6 +424,7 @@ std::string ContextBase::makeRootLogPrefix(std::string_view vm_id) const {
 //
 bool ContextBase::onStart(std::shared_ptr<PluginBase> plugin) {
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   bool result = true;
   if (wasm_->on_context_create_) {
     plugin_ = plugin;
@@ -335,6 +447,7 @@ bool ContextBase::onConfigure(std::shared_ptr<PluginBase> plugin) {
     return true;
   }
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   plugin_ = plugin;
   auto result =
       wasm_->on_configure_(this, id_, static_cast<uint32_t>(plugin->plugin_configuration_.size()))
@@ -344,8 +457,14 @@ bool ContextBase::onConfigure(std::shared_ptr<PluginBase> plugin) {
 }
 
 void ContextBase::onCreate() {
+  if (!in_vm_context_created_ && parent_context_id_ && plugin_ && !plugin_->sampleStream(this)) {
+    // Never created in the VM: every later call into the VM for this stream is skipped.
+    sampled_ = false;
+    return;
+  }
   if (!isFailed() && !in_vm_context_created_ && wasm_->on_context_create_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     wasm_->on_context_create_(this, id_, parent_context_ ? parent_context()->id() : 0);
   }
   // NB: If no on_context_create function is registered the in-VM SDK is responsible for
@@ -403,92 +522,172 @@ void ContextBase::destroy() {
 void ContextBase::onTick(uint32_t) {
   if (!isFailed() && wasm_->on_tick_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     wasm_->on_tick_(this, id_);
+    wasm_->flushMetricSlots(this);
   }
 }
 
 void ContextBase::onForeignFunction(uint32_t foreign_function_id, uint32_t data_size) {
   if (wasm_->on_foreign_function_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     wasm_->on_foreign_function_(this, id_, foreign_function_id, data_size);
   }
 }
 
+void ContextBase::onForeignFunctionResult(uint32_t token, std::string result) {
+  foreign_function_result_.set(result);
+  in_foreign_function_result_ = true;
+  onForeignFunction(token, result.size());
+  in_foreign_function_result_ = false;
+  foreign_function_result_.clear();
+}
+
 FilterStatus ContextBase::onNetworkNewConnection() {
+  if (isObserveOnly()) {
+    observe(ObservedCall::NewConnection, 0, false);
+    return FilterStatus::Continue;
+  }
   CHECK_NET(on_new_connection_, FilterStatus::Continue, FilterStatus::StopIteration);
   DeferAfterCallActions actions(this);
-  if (wasm_->on_new_connection_(this, id_).u64_ == 0) {
+  CallBudget budget(this);
+  auto result = wasm_->on_new_connection_(this, id_).u64_;
+  CHECK_NET_AFTER_CALL(FilterStatus::Continue, FilterStatus::StopIteration);
+  if (result == 0) {
     return FilterStatus::Continue;
   }
   return FilterStatus::StopIteration;
 }
 
 FilterStatus ContextBase::onDownstreamData(uint32_t data_length, bool end_of_stream) {
+  if (isObserveOnly()) {
+    observe(ObservedCall::DownstreamData, data_length, end_of_stream);
+    return FilterStatus::Continue;
+  }
   CHECK_NET(on_downstream_data_, FilterStatus::Continue, FilterStatus::StopIteration);
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   auto result = wasm_->on_downstream_data_(this, id_, static_cast<uint32_t>(data_length),
                                            static_cast<uint32_t>(end_of_stream));
+  CHECK_NET_AFTER_CALL(FilterStatus::Continue, FilterStatus::StopIteration);
   // TODO(PiotrSikora): pull Proxy-WASM's FilterStatus values.
   return result.u64_ == 0 ? FilterStatus::Continue : FilterStatus::StopIteration;
 }
 
 FilterStatus ContextBase::onUpstreamData(uint32_t data_length, bool end_of_stream) {
+  if (isObserveOnly()) {
+    observe(ObservedCall::UpstreamData, data_length, end_of_stream);
+    return FilterStatus::Continue;
+  }
   CHECK_NET(on_upstream_data_, FilterStatus::Continue, FilterStatus::StopIteration);
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   auto result = wasm_->on_upstream_data_(this, id_, static_cast<uint32_t>(data_length),
                                          static_cast<uint32_t>(end_of_stream));
+  CHECK_NET_AFTER_CALL(FilterStatus::Continue, FilterStatus::StopIteration);
   // TODO(PiotrSikora): pull Proxy-WASM's FilterStatus values.
   return result.u64_ == 0 ? FilterStatus::Continue : FilterStatus::StopIteration;
 }
 
 void ContextBase::onDownstreamConnectionClose(CloseType close_type) {
-  if (!isFailed() && wasm_->on_downstream_connection_close_) {
+  runObservations();
+  if (sampled_ && !isFailed() && wasm_->on_downstream_connection_close_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     wasm_->on_downstream_connection_close_(this, id_, static_cast<uint32_t>(close_type));
   }
 }
 
 void ContextBase::onUpstreamConnectionClose(CloseType close_type) {
-  if (!isFailed() && wasm_->on_upstream_connection_close_) {
+  runObservations();
+  if (sampled_ && !isFailed() && wasm_->on_upstream_connection_close_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     wasm_->on_upstream_connection_close_(this, id_, static_cast<uint32_t>(close_type));
   }
 }
 
+uint64_t ContextBase::callOnHeaders(ContextBase *context, WasmHeaderMapType type, uint32_t headers,
+                                    bool end_of_stream) {
+  bool request = type == WasmHeaderMapType::RequestHeaders;
+  auto &with_pairs =
+      request ? wasm_->on_request_headers_with_pairs_ : wasm_->on_response_headers_with_pairs_;
+  if (with_pairs) {
+    // Pass the headers rather than waiting for the plugin to ask for them. If they can not be had
+    // the plugin is passed no headers and may still ask.
+    Pairs pairs;
+    uint64_t pairs_ptr = 0;
+    uint64_t pairs_size = 0;
+    if (context->getHeaderMapPairs(type, &pairs) == WasmResult::Ok) {
+      auto buffer = wasm_->allocMemory(pairsSize(pairs), &pairs_ptr);
+      if (buffer) {
+        marshalPairs(pairs, static_cast<char *>(buffer));
+        pairs_size = pairsSize(pairs);
+      } else {
+        pairs_ptr = 0;
+      }
+    }
+    return with_pairs(context, id_, headers, static_cast<uint32_t>(end_of_stream), pairs_ptr,
+                      pairs_size)
+        .u64_;
+  }
+  auto &abi_01 = request ? wasm_->on_request_headers_abi_01_ : wasm_->on_response_headers_abi_01_;
+  if (abi_01) {
+    return abi_01(context, id_, headers).u64_;
+  }
+  auto &abi_02 = request ? wasm_->on_request_headers_abi_02_ : wasm_->on_response_headers_abi_02_;
+  return abi_02(context, id_, headers, static_cast<uint32_t>(end_of_stream)).u64_;
+}
+
 // Empty headers/trailers have zero size.
 template <typename P> static uint32_t headerSize(const P &p) { return p ? p->size() : 0; }
 
 FilterHeadersStatus ContextBase::onRequestHeaders(uint32_t headers, bool end_of_stream) {
-  CHECK_HTTP2(on_request_headers_abi_01_, on_request_headers_abi_02_, FilterHeadersStatus::Continue,
+  if (isObserveOnly()) {
+    observe(ObservedCall::RequestHeaders, headers, end_of_stream);
+    return FilterHeadersStatus::Continue;
+  }
+  CHECK_HTTP3(on_request_headers_abi_01_, on_request_headers_abi_02_,
+              on_request_headers_with_pairs_, FilterHeadersStatus::Continue,
               FilterHeadersStatus::StopIteration);
   DeferAfterCallActions actions(this);
-  auto result = wasm_->on_request_headers_abi_01_
-                    ? wasm_->on_request_headers_abi_01_(this, id_, headers).u64_
-                    : wasm_
-                          ->on_request_headers_abi_02_(this, id_, headers,
-                                                       static_cast<uint32_t>(end_of_stream))
-                          .u64_;
+  CallBudget budget(this);
+  auto result = callOnHeaders(this, WasmHeaderMapType::RequestHeaders, headers, end_of_stream);
+  CHECK_HTTP_AFTER_CALL(FilterHeadersStatus::Continue, FilterHeadersStatus::StopIteration);
   if (result > static_cast<uint64_t>(FilterHeadersStatus::StopAllIterationAndWatermark))
     return FilterHeadersStatus::StopAllIterationAndWatermark;
   return static_cast<FilterHeadersStatus>(result);
 }
 
 FilterDataStatus ContextBase::onRequestBody(uint32_t data_length, bool end_of_stream) {
+  if (isObserveOnly()) {
+    observe(ObservedCall::RequestBody, data_length, end_of_stream);
+    return FilterDataStatus::Continue;
+  }
   CHECK_HTTP(on_request_body_, FilterDataStatus::Continue, FilterDataStatus::StopIterationNoBuffer);
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   auto result =
       wasm_->on_request_body_(this, id_, data_length, static_cast<uint32_t>(end_of_stream)).u64_;
+  CHECK_HTTP_AFTER_CALL(FilterDataStatus::Continue, FilterDataStatus::StopIterationNoBuffer);
   if (result > static_cast<uint64_t>(FilterDataStatus::StopIterationNoBuffer))
     return FilterDataStatus::StopIterationNoBuffer;
   return static_cast<FilterDataStatus>(result);
 }
 
 FilterTrailersStatus ContextBase::onRequestTrailers(uint32_t trailers) {
+  if (isObserveOnly()) {
+    observe(ObservedCall::RequestTrailers, trailers, true);
+    return FilterTrailersStatus::Continue;
+  }
   CHECK_HTTP(on_request_trailers_, FilterTrailersStatus::Continue,
              FilterTrailersStatus::StopIteration);
   DeferAfterCallActions actions(this);
-  if (static_cast<FilterTrailersStatus>(wasm_->on_request_trailers_(this, id_, trailers).u64_) ==
-      FilterTrailersStatus::Continue) {
+  CallBudget budget(this);
+  auto result = wasm_->on_request_trailers_(this, id_, trailers).u64_;
+  CHECK_HTTP_AFTER_CALL(FilterTrailersStatus::Continue, FilterTrailersStatus::StopIteration);
+  if (static_cast<FilterTrailersStatus>(result) == FilterTrailersStatus::Continue) {
     return FilterTrailersStatus::Continue;
   }
   return FilterTrailersStatus::StopIteration;
@@ -497,45 +696,61 @@ FilterTrailersStatus ContextBase::onRequestTrailers(uint32_t trailers) {
 FilterMetadataStatus ContextBase::onRequestMetadata(uint32_t elements) {
   CHECK_HTTP(on_request_metadata_, FilterMetadataStatus::Continue, FilterMetadataStatus::Continue);
   DeferAfterCallActions actions(this);
-  if (static_cast<FilterMetadataStatus>(wasm_->on_request_metadata_(this, id_, elements).u64_) ==
-      FilterMetadataStatus::Continue) {
+  CallBudget budget(this);
+  auto result = wasm_->on_request_metadata_(this, id_, elements).u64_;
+  CHECK_HTTP_AFTER_CALL(FilterMetadataStatus::Continue, FilterMetadataStatus::Continue);
+  if (static_cast<FilterMetadataStatus>(result) == FilterMetadataStatus::Continue) {
     return FilterMetadataStatus::Continue;
   }
   return FilterMetadataStatus::Continue; // This is currently the only return code.
 }
 
 FilterHeadersStatus ContextBase::onResponseHeaders(uint32_t headers, bool end_of_stream) {
-  CHECK_HTTP2(on_response_headers_abi_01_, on_response_headers_abi_02_,
-              FilterHeadersStatus::Continue, FilterHeadersStatus::StopIteration);
+  if (isObserveOnly()) {
+    observe(ObservedCall::ResponseHeaders, headers, end_of_stream);
+    return FilterHeadersStatus::Continue;
+  }
+  CHECK_HTTP3(on_response_headers_abi_01_, on_response_headers_abi_02_,
+              on_response_headers_with_pairs_, FilterHeadersStatus::Continue,
+              FilterHeadersStatus::StopIteration);
   DeferAfterCallActions actions(this);
-  auto result = wasm_->on_response_headers_abi_01_
-                    ? wasm_->on_response_headers_abi_01_(this, id_, headers).u64_
-                    : wasm_
-                          ->on_response_headers_abi_02_(this, id_, headers,
-                                                        static_cast<uint32_t>(end_of_stream))
-                          .u64_;
+  CallBudget budget(this);
+  auto result = callOnHeaders(this, WasmHeaderMapType::ResponseHeaders, headers, end_of_stream);
+  CHECK_HTTP_AFTER_CALL(FilterHeadersStatus::Continue, FilterHeadersStatus::StopIteration);
   if (result > static_cast<uint64_t>(FilterHeadersStatus::StopAllIterationAndWatermark))
     return FilterHeadersStatus::StopAllIterationAndWatermark;
   return static_cast<FilterHeadersStatus>(result);
 }
 
 FilterDataStatus ContextBase::onResponseBody(uint32_t body_length, bool end_of_stream) {
+  if (isObserveOnly()) {
+    observe(ObservedCall::ResponseBody, body_length, end_of_stream);
+    return FilterDataStatus::Continue;
+  }
   CHECK_HTTP(on_response_body_, FilterDataStatus::Continue,
              FilterDataStatus::StopIterationNoBuffer);
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   auto result =
       wasm_->on_response_body_(this, id_, body_length, static_cast<uint32_t>(end_of_stream)).u64_;
+  CHECK_HTTP_AFTER_CALL(FilterDataStatus::Continue, FilterDataStatus::StopIterationNoBuffer);
   if (result > static_cast<uint64_t>(FilterDataStatus::StopIterationNoBuffer))
     return FilterDataStatus::StopIterationNoBuffer;
   return static_cast<FilterDataStatus>(result);
 }
 
 FilterTrailersStatus ContextBase::onResponseTrailers(uint32_t trailers) {
+  if (isObserveOnly()) {
+    observe(ObservedCall::ResponseTrailers, trailers, true);
+    return FilterTrailersStatus::Continue;
+  }
   CHECK_HTTP(on_response_trailers_, FilterTrailersStatus::Continue,
              FilterTrailersStatus::StopIteration);
   DeferAfterCallActions actions(this);
-  if (static_cast<FilterTrailersStatus>(wasm_->on_response_trailers_(this, id_, trailers).u64_) ==
-      FilterTrailersStatus::Continue) {
+  CallBudget budget(this);
+  auto result = wasm_->on_response_trailers_(this, id_, trailers).u64_;
+  CHECK_HTTP_AFTER_CALL(FilterTrailersStatus::Continue, FilterTrailersStatus::StopIteration);
+  if (static_cast<FilterTrailersStatus>(result) == FilterTrailersStatus::Continue) {
     return FilterTrailersStatus::Continue;
   }
   return FilterTrailersStatus::StopIteration;
@@ -544,25 +759,182 @@ FilterTrailersStatus ContextBase::onResponseTrailers(uint32_t trailers) {
 FilterMetadataStatus ContextBase::onResponseMetadata(uint32_t elements) {
   CHECK_HTTP(on_response_metadata_, FilterMetadataStatus::Continue, FilterMetadataStatus::Continue);
   DeferAfterCallActions actions(this);
-  if (static_cast<FilterMetadataStatus>(wasm_->on_response_metadata_(this, id_, elements).u64_) ==
-      FilterMetadataStatus::Continue) {
+  CallBudget budget(this);
+  auto result = wasm_->on_response_metadata_(this, id_, elements).u64_;
+  CHECK_HTTP_AFTER_CALL(FilterMetadataStatus::Continue, FilterMetadataStatus::Continue);
+  if (static_cast<FilterMetadataStatus>(result) == FilterMetadataStatus::Continue) {
     return FilterMetadataStatus::Continue;
   }
   return FilterMetadataStatus::Continue; // This is currently the only return code.
 }
 
+void ContextBase::observe(ObservedCall call, uint32_t size, bool end_of_stream) {
+  if (!sampled_ || isFailed()) {
+    return;
+  }
+  std::optional<WasmHeaderMapType> header_map;
+  std::optional<WasmBufferType> body_type;
+  switch (call) {
+  case ObservedCall::NewConnection:
+    if (!wasm_->on_new_connection_) {
+      return;
+    }
+    break;
+  case ObservedCall::DownstreamData:
+    if (!wasm_->on_downstream_data_) {
+      return;
+    }
+    body_type = WasmBufferType::NetworkDownstreamData;
+    break;
+  case ObservedCall::UpstreamData:
+    if (!wasm_->on_upstream_data_) {
+      return;
+    }
+    body_type = WasmBufferType::NetworkUpstreamData;
+    break;
+  case ObservedCall::RequestHeaders:
+    if (!wasm_->on_request_headers_abi_01_ && !wasm_->on_request_headers_abi_02_ &&
+        !wasm_->on_request_headers_with_pairs_) {
+      return;
+    }
+    header_map = WasmHeaderMapType::RequestHeaders;
+    break;
+  case ObservedCall::RequestBody:
+    if (!wasm_->on_request_body_) {
+      return;
+    }
+    body_type = WasmBufferType::HttpRequestBody;
+    break;
+  case ObservedCall::RequestTrailers:
+    if (!wasm_->on_request_trailers_) {
+      return;
+    }
+    header_map = WasmHeaderMapType::RequestTrailers;
+    break;
+  case ObservedCall::ResponseHeaders:
+    if (!wasm_->on_response_headers_abi_01_ && !wasm_->on_response_headers_abi_02_ &&
+        !wasm_->on_response_headers_with_pairs_) {
+      return;
+    }
+    header_map = WasmHeaderMapType::ResponseHeaders;
+    break;
+  case ObservedCall::ResponseBody:
+    if (!wasm_->on_response_body_) {
+      return;
+    }
+    body_type = WasmBufferType::HttpResponseBody;
+    break;
+  case ObservedCall::ResponseTrailers:
+    if (!wasm_->on_response_trailers_) {
+      return;
+    }
+    header_map = WasmHeaderMapType::ResponseTrailers;
+    break;
+  }
+  // Queued calls share the version of the stream they were given, so a new version is made, with
+  // the properties as they are now, only when a header map is seen.
+  if (!observed_stream_ || header_map) {
+    auto stream = std::make_shared<StreamSnapshot>();
+    if (observed_stream_) {
+      std::copy(std::begin(observed_stream_->header_maps_),
+                std::end(observed_stream_->header_maps_), std::begin(stream->header_maps_));
+    }
+    if (header_map) {
+      stream->captureHeaderMap(this, *header_map);
+    }
+    stream->captureProperties(this, plugin_->log_properties_);
+    observed_stream_ = std::move(stream);
+  }
+  std::unique_ptr<StreamSnapshot> body;
+  bool copied = true;
+  if (body_type) {
+    body = std::make_unique<StreamSnapshot>();
+    copied = body->captureBody(this, *body_type);
+  }
+  observations_.push_back(
+      Observation{call, size, end_of_stream, observed_stream_, std::move(body)});
+  if (!copied) {
+    // The callback reads the stream's own buffer, so it can not wait.
+    runObservations();
+    return;
+  }
+  if (observations_.size() > 1) {
+    return; // Already posted.
+  }
+  auto call_on_thread = wasm_->callOnThreadFunction();
+  if (!call_on_thread) {
+    runObservations();
+    return;
+  }
+  call_on_thread([weak_wasm = wasm_->weak_from_this(), id = id_] {
+    auto wasm = weak_wasm.lock();
+    auto context = wasm ? wasm->getContext(id) : nullptr;
+    if (context) {
+      context->runObservations();
+    }
+  });
+}
+
+void ContextBase::runObservations() {
+  while (!observations_.empty() && !isFailed()) {
+    auto observation = std::move(observations_.front());
+    observations_.pop_front();
+    {
+      SnapshotContext context(this, std::move(observation.stream), std::move(observation.body));
+      DeferAfterCallActions actions(&context);
+      CallBudget budget(&context);
+      auto size = observation.size;
+      auto end_of_stream = static_cast<uint32_t>(observation.end_of_stream);
+      switch (observation.call) {
+      case ObservedCall::NewConnection:
+        wasm_->on_new_connection_(&context, id_);
+        break;
+      case ObservedCall::DownstreamData:
+        wasm_->on_downstream_data_(&context, id_, size, end_of_stream);
+        break;
+      case ObservedCall::UpstreamData:
+        wasm_->on_upstream_data_(&context, id_, size, end_of_stream);
+        break;
+      case ObservedCall::RequestHeaders:
+        callOnHeaders(&context, WasmHeaderMapType::RequestHeaders, size, end_of_stream);
+        break;
+      case ObservedCall::RequestBody:
+        wasm_->on_request_body_(&context, id_, size, end_of_stream);
+        break;
+      case ObservedCall::RequestTrailers:
+        wasm_->on_request_trailers_(&context, id_, size);
+        break;
+      case ObservedCall::ResponseHeaders:
+        callOnHeaders(&context, WasmHeaderMapType::ResponseHeaders, size, end_of_stream);
+        break;
+      case ObservedCall::ResponseBody:
+        wasm_->on_response_body_(&context, id_, size, end_of_stream);
+        break;
+      case ObservedCall::ResponseTrailers:
+        wasm_->on_response_trailers_(&context, id_, size);
+        break;
+      }
+    }
+    // The SnapshotContext took over this stream's id while it ran.
+    wasm_->contexts_[id_] = this;
+  }
+  observations_.clear();
+}
+
 void ContextBase::onHttpCallResponse(uint32_t token, uint32_t headers, uint32_t body_size,
                                      uint32_t trailers) {
   if (isFailed() || !wasm_->on_http_call_response_) {
     return;
   }
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   wasm_->on_http_call_response_(this, id_, token, headers, body_size, trailers);
 }
 
 void ContextBase::onQueueReady(uint32_t token) {
   if (!isFailed() && wasm_->on_queue_ready_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     wasm_->on_queue_ready_(this, id_, token);
   }
 }
@@ -572,6 +944,7 @@ void ContextBase::onGrpcReceiveInitialMetadata(uint32_t token, uint32_t elements
     return;
   }
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   wasm_->on_grpc_receive_initial_metadata_(this, id_, token, elements);
 }
 
@@ -580,6 +953,7 @@ void ContextBase::onGrpcReceiveTrailingMetadata(uint32_t token, uint32_t trailer
     return;
   }
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   wasm_->on_grpc_receive_trailing_metadata_(this, id_, token, trailers);
 }
 
@@ -588,6 +962,7 @@ void ContextBase::onGrpcReceive(uint32_t token, uint32_t response_size) {
     return;
   }
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   wasm_->on_grpc_receive_(this, id_, token, response_size);
 }
 
@@ -596,29 +971,95 @@ void ContextBase::onGrpcClose(uint32_t token, uint32_t status_code) {
     return;
   }
   DeferAfterCallActions actions(this);
+  CallBudget budget(this);
   wasm_->on_grpc_close_(this, id_, token, status_code);
 }
 
 bool ContextBase::onDone() {
-  if (!isFailed() && wasm_->on_done_) {
+  if (sampled_ && !isFailed() && wasm_->on_done_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     return wasm_->on_done_(this, id_).u64_ != 0;
   }
   return true;
 }
 
 void ContextBase::onLog() {
-  if (!isFailed() && wasm_->on_log_) {
-    DeferAfterCallActions actions(this);
-    wasm_->on_log_(this, id_);
+  runObservations();
+  if (!sampled_ || isFailed() || (!wasm_->on_log_ && !wasm_->on_log_batch_) || deferLog()) {
+    return;
+  }
+  if (wasm_->on_log_batch_ && batchLog()) {
+    return;
   }
+  if (!wasm_->on_log_) {
+    onLogBatch({id_});
+    return;
+  }
+  DeferAfterCallActions actions(this);
+  CallBudget budget(this);
+  wasm_->on_log_(this, id_);
+  wasm_->flushMetricSlots(this);
+}
+
+void ContextBase::onLogBatch(const std::vector<uint32_t> &context_ids) {
+  if (isFailed() || !wasm_->on_log_batch_ || context_ids.empty()) {
+    return;
+  }
+  DeferAfterCallActions actions(this);
+  CallBudget budget(this);
+  uint64_t size = context_ids.size() * sizeof(uint32_t);
+  uint64_t context_ids_ptr = 0;
+  auto p = wasm_->allocMemory(size, &context_ids_ptr);
+  if (!p) {
+    return;
+  }
+  memcpy(p, context_ids.data(), size);
+  wasm_->on_log_batch_(this, context_ids_ptr, static_cast<uint32_t>(context_ids.size()));
+  wasm_->flushMetricSlots(this);
+}
+
+bool ContextBase::deferLog() {
+  if (!plugin_ || !plugin_->async_log_ || !AsyncLogExecutor::accepting(wasm_->vm_key())) {
+    return false;
+  }
+  return AsyncLogExecutor::submit(wasm_->vm_key(), plugin_,
+                                  StreamSnapshot::capture(this, plugin_->log_properties_));
+}
+
+bool ContextBase::batchLog() {
+  if (!plugin_ || isRootContext()) {
+    return false;
+  }
+  log_batched_ = true;
+  auto snapshot = StreamSnapshot::capture(this, plugin_->log_properties_);
+  wasm_->queueLog(std::make_unique<SnapshotContext>(this, std::move(snapshot)),
+                  plugin_->log_batch_size_);
+  return true;
 }
 
 void ContextBase::onDelete() {
-  if (in_vm_context_created_ && !isFailed() && wasm_->on_delete_) {
+  runObservations();
+  if (in_vm_context_created_ && !isFailed() && wasm_->on_delete_ && !log_batched_) {
     DeferAfterCallActions actions(this);
+    CallBudget budget(this);
     wasm_->on_delete_(this, id_);
   }
+  // Report slot updates made by callbacks which are not followed by a flush, e.g. those of a
+  // stream which was not logged. The guest only writes its slots during a call, and an unsampled
+  // stream never calls into the VM.
+  if (sampled_ && !isFailed() && wasm_->vm_calls_ != wasm_->vm_calls_at_flush_) {
+    wasm_->flushMetricSlots(this);
+  }
+}
+
+WasmResult ContextBase::defineMetric(uint32_t type, std::string_view name,
+                                     uint32_t *metric_id_ptr) {
+  if (!wasm_) {
+    return unimplemented();
+  }
+  return MetricRegistry::define(wasm_->vm_id(), static_cast<MetricType>(type), name,
+                                metric_id_ptr);
 }
 
 WasmResult ContextBase::setTimerPeriod(std::chrono::milliseconds period,
@@ -630,8 +1071,12 @@ WasmResult ContextBase::setTimerPeriod(std::chrono::milliseconds period,
 
 ContextBase::~ContextBase() {
   // Do not remove vm or root contexts which have the same lifetime as wasm_.
+  // A stream handed over to a SnapshotContext no longer owns its id.
   if (parent_context_id_) {
-    wasm_->contexts_.erase(id_);
+    auto it = wasm_->contexts_.find(id_);
+    if (it != wasm_->contexts_.end() && it->second == this) {
+      wasm_->contexts_.erase(it);
+    }
   }
 }
 
@@ -14,6 +14,7 @@
 // limitations under the License.
 //
 #include "include/proxy-wasm/wasm.h"
+#include "src/pairs.h"
 
 #define WASM_CONTEXT(_c)                                                                           \
   (ContextOrEffectiveContext(static_cast<ContextBase *>((void)_c, current_context_)))
@@ -67,36 +68,6 @@ Pairs toPairs(std::string_view buffer) {
   return result;
 }
 
-template <typename Pairs> size_t pairsSize(const Pairs &result) {
-  size_t size = 4; // number of headers
-  for (auto &p : result) {
-    size += 8;                   // size of key, size of value
-    size += p.first.size() + 1;  // null terminated key
-    size += p.second.size() + 1; // null terminated value
-  }
-  return size;
-}
-
-template <typename Pairs> void marshalPairs(const Pairs &result, char *buffer) {
-  char *b = buffer;
-  *reinterpret_cast<uint32_t *>(b) = result.size();
-  b += sizeof(uint32_t);
-  for (auto &p : result) {
-    *reinterpret_cast<uint32_t *>(b) = p.first.size();
-    b += sizeof(uint32_t);
-    *reinterpret_cast<uint32_t *>(b) = p.second.size();
-    b += sizeof(uint32_t);
-  }
-  for (auto &p : result) {
-    memcpy(b, p.first.data(), p.first.size());
-    b += p.first.size();
-    *b++ = 0;
-    memcpy(b, p.second.data(), p.second.size());
-    b += p.second.size();
-    *b++ = 0;
-  }
-}
-
 template <typename Pairs>
 bool getPairs(ContextBase *context, const Pairs &result, uint64_t ptr_ptr, uint64_t size_ptr) {
   if (result.empty()) {
@@ -115,6 +86,55 @@ bool getPairs(ContextBase *context, const Pairs &result, uint64_t ptr_ptr, uint6
   return true;
 }
 
+const BufferInterface *getBuffer(ContextBase *context, WasmBufferType type) {
+  if (type == WasmBufferType::CallData) {
+    auto result = context->foreignFunctionResult();
+    if (result) {
+      return result;
+    }
+  }
+  return context->getBuffer(type);
+}
+
+// Where a foreign function's result went. The allocator passed to the function captures only a
+// pointer to this, so it fits in std::function's inline storage and does not allocate.
+struct ForeignFunctionResult {
+  WasmBase *wasm;
+  bool to_vm;
+  uint64_t address = 0;
+  void *data = nullptr;
+  size_t size = 0;
+};
+
+Word callForeignFunction(ContextBase *context, const WasmForeignFunction &f, Word arguments,
+                         Word arguments_size, Word results, Word results_size) {
+  auto args = context->wasmVm()->getMemory(arguments, arguments_size);
+  if (!args) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  ForeignFunctionResult result{context->wasm(), results != 0};
+  auto res = f(*context->wasm(), args.value(), [r = &result](size_t s) -> void * {
+    if (r->to_vm) {
+      r->data = r->wasm->allocMemory(s, &r->address);
+    } else {
+      // If the caller does not want the results, allocate a temporary buffer for them.
+      r->data = ::malloc(s);
+    }
+    r->size = s;
+    return r->data;
+  });
+  if (results && !context->wasmVm()->setWord(results, Word(result.address))) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  if (results_size && !context->wasmVm()->setWord(results_size, Word(result.size))) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  if (!results) {
+    ::free(result.data);
+  }
+  return res;
+}
+
 } // namespace
 
 // General ABI.
@@ -246,39 +266,69 @@ Word call_foreign_function(void *raw_context, Word function_name, Word function_
   if (!function) {
     return WasmResult::InvalidMemoryAccess;
   }
-  auto args_opt = context->wasmVm()->getMemory(arguments, arguments_size);
-  if (!args_opt) {
-    return WasmResult::InvalidMemoryAccess;
-  }
   auto f = context->wasm()->getForeignFunction(function.value());
   if (!f) {
     return WasmResult::NotFound;
   }
-  auto &wasm = *context->wasm();
-  auto &args = args_opt.value();
-  uint64_t address = 0;
-  void *result = nullptr;
-  size_t result_size = 0;
-  auto res = f(wasm, args, [&wasm, &address, &result, &result_size, results](size_t s) -> void * {
-    if (results) {
-      result = wasm.allocMemory(s, &address);
-    } else {
-      // If the caller does not want the results, allocate a temporary buffer for them.
-      result = ::malloc(s);
-    }
-    result_size = s;
+  return callForeignFunction(context, f, arguments, arguments_size, results, results_size);
+}
+
+Word call_foreign_function_async(void *raw_context, Word function_name, Word function_name_size,
+                                 Word arguments, Word arguments_size, Word token_ptr) {
+  auto context = WASM_CONTEXT(raw_context);
+  auto function = context->wasmVm()->getMemory(function_name, function_name_size);
+  if (!function) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  auto args = context->wasmVm()->getMemory(arguments, arguments_size);
+  if (!args) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  uint32_t token = 0;
+  auto result =
+      context->wasm()->callAsyncForeignFunction(context, function.value(), args.value(), &token);
+  if (result != WasmResult::Ok) {
     return result;
-  });
-  if (results && !context->wasmVm()->setWord(results, Word(address))) {
+  }
+  if (!context->wasm()->setDatatype(token_ptr, token)) {
     return WasmResult::InvalidMemoryAccess;
   }
-  if (results_size && !context->wasmVm()->setWord(results_size, Word(result_size))) {
+  return WasmResult::Ok;
+}
+
+Word resolve_foreign_function(void *raw_context, Word function_name, Word function_name_size,
+                              Word id_ptr) {
+  auto context = WASM_CONTEXT(raw_context);
+  auto function = context->wasmVm()->getMemory(function_name, function_name_size);
+  if (!function) {
     return WasmResult::InvalidMemoryAccess;
   }
-  if (!results) {
-    ::free(result);
+  auto id = context->wasm()->resolveForeignFunction(function.value());
+  if (!id) {
+    return WasmResult::NotFound;
   }
-  return res;
+  if (!context->wasm()->setDatatype(id_ptr, id)) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  return WasmResult::Ok;
+}
+
+Word call_foreign_function_by_id(void *raw_context, Word id, Word arguments, Word arguments_size,
+                                 Word results, Word results_size) {
+  auto context = WASM_CONTEXT(raw_context);
+  auto f = context->wasm()->getForeignFunctionById(id.u32());
+  if (!f) {
+    return WasmResult::NotFound;
+  }
+  return callForeignFunction(context, *f, arguments, arguments_size, results, results_size);
+}
+
+Word release_memory(void *raw_context, Word ptr, Word size) {
+  auto context = WASM_CONTEXT(raw_context);
+  if (!context->wasm()->releaseMemory(ptr, size)) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  return WasmResult::Ok;
 }
 
 // SharedData
@@ -490,7 +540,7 @@ Word get_buffer_bytes(void *raw_context, Word type, Word start, Word length, Wor
     return WasmResult::BadArgument;
   }
   auto context = WASM_CONTEXT(raw_context);
-  auto buffer = context->getBuffer(static_cast<WasmBufferType>(type.u64_));
+  auto buffer = getBuffer(context, static_cast<WasmBufferType>(type.u64_));
   if (!buffer) {
     return WasmResult::NotFound;
   }
@@ -513,7 +563,7 @@ Word get_buffer_status(void *raw_context, Word type, Word length_ptr, Word flags
     return WasmResult::BadArgument;
   }
   auto context = WASM_CONTEXT(raw_context);
-  auto buffer = context->getBuffer(static_cast<WasmBufferType>(type.u64_));
+  auto buffer = getBuffer(context, static_cast<WasmBufferType>(type.u64_));
   if (!buffer) {
     return WasmResult::NotFound;
   }
@@ -612,6 +662,27 @@ Word get_metric(void *raw_context, Word metric_id, Word result_uint64_ptr) {
   return WasmResult::Ok;
 }
 
+Word define_metric_slot(void *raw_context, Word metric_type, Word name_ptr, Word name_size,
+                        Word metric_id_ptr, Word slot_ptr_ptr) {
+  auto context = WASM_CONTEXT(raw_context);
+  auto name = context->wasmVm()->getMemory(name_ptr, name_size);
+  if (!name) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  uint32_t metric_id = 0;
+  uint64_t slot = 0;
+  auto result = context->wasm()->defineMetricSlot(context, metric_type.u32(), name.value(),
+                                                  &metric_id, &slot);
+  if (result != WasmResult::Ok) {
+    return result;
+  }
+  if (!context->wasm()->setDatatype(metric_id_ptr, metric_id) ||
+      !context->wasmVm()->setWord(slot_ptr_ptr, Word(slot))) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  return WasmResult::Ok;
+}
+
 Word grpc_call(void *raw_context, Word service_ptr, Word service_size, Word service_name_ptr,
                Word service_name_size, Word method_name_ptr, Word method_name_size,
                Word initial_metadata_ptr, Word initial_metadata_size, Word request_ptr,
@@ -851,6 +922,28 @@ Word get_current_time_nanoseconds(void *raw_context, Word result_uint64_ptr) {
   return WasmResult::Ok;
 }
 
+Word get_monotonic_time_nanoseconds(void *raw_context, Word result_uint64_ptr) {
+  auto context = WASM_CONTEXT(raw_context);
+  uint64_t result = context->getMonotonicTimeNanoseconds();
+  if (!context->wasm()->setDatatype(result_uint64_ptr, result)) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  return WasmResult::Ok;
+}
+
+Word get_time_page(void *raw_context, Word page_ptr_ptr) {
+  auto context = WASM_CONTEXT(raw_context);
+  uint64_t page = 0;
+  auto result = context->wasm()->getTimePage(context, &page);
+  if (result != WasmResult::Ok) {
+    return result;
+  }
+  if (!context->wasmVm()->setWord(page_ptr_ptr, Word(page))) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  return WasmResult::Ok;
+}
+
 Word log(void *raw_context, Word level, Word address, Word size) {
   if (level > static_cast<uint64_t>(LogLevel::Max)) {
     return WasmResult::BadArgument;
@@ -15,6 +15,17 @@
 
 #include "include/proxy-wasm/wasm.h"
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "include/proxy-wasm/matcher.h"
+#include "src/sha256.h"
+#include "src/third_party/base64.h"
+
 #ifndef WITHOUT_ZLIB
 #include "zlib.h"
 #endif
@@ -22,7 +33,358 @@
 namespace proxy_wasm {
 namespace {
 
+WasmResult returnOutput(std::string_view output,
+                        const std::function<void *(size_t size)> &alloc_result) {
+  auto result = alloc_result(output.size());
+  if (!output.empty()) {
+    memcpy(result, output.data(), output.size());
+  }
+  return WasmResult::Ok;
+}
+
+// Hashing and encoding: "sha256" and "hmac_sha256" return the raw digest. The arguments to
+// "hmac_sha256" are the uint32 key size, the key and then the message. "base64_encode",
+// "base64url_encode" and "hex_encode" and their "*_decode" counterparts convert between bytes and
+// text. base64url is encoded without padding and decoded with or without it.
+
+const char kHexDigits[] = "0123456789abcdef";
+
+// Maps each byte to its value in 'alphabet' or -1.
+struct DecodeTable {
+  explicit DecodeTable(const char *alphabet) {
+    memset(values, -1, sizeof(values));
+    for (int i = 0; alphabet[i]; i++) {
+      values[static_cast<uint8_t>(alphabet[i])] = i;
+    }
+  }
+  int8_t operator[](char c) const { return values[static_cast<uint8_t>(c)]; }
+
+  int8_t values[256];
+};
+
+std::string encodeHex(std::string_view input) {
+  std::string output(input.size() * 2, '\0');
+  for (size_t i = 0; i < input.size(); i++) {
+    auto byte = static_cast<uint8_t>(input[i]);
+    output[2 * i] = kHexDigits[byte >> 4];
+    output[2 * i + 1] = kHexDigits[byte & 15];
+  }
+  return output;
+}
+
+bool decodeHex(std::string_view input, std::string *output) {
+  static const DecodeTable lower(kHexDigits);
+  static const DecodeTable upper("0123456789ABCDEF");
+  if (input.size() % 2) {
+    return false;
+  }
+  output->resize(input.size() / 2);
+  for (size_t i = 0; i < output->size(); i++) {
+    int high = std::max(lower[input[2 * i]], upper[input[2 * i]]);
+    int low = std::max(lower[input[2 * i + 1]], upper[input[2 * i + 1]]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    (*output)[i] = static_cast<char>(high << 4 | low);
+  }
+  return true;
+}
+
+using Codec = std::function<bool(std::string_view input, std::string *output)>;
+
+WasmForeignFunction codecFunction(Codec codec) {
+  return [codec](WasmBase &, std::string_view arguments,
+                 std::function<void *(size_t size)> alloc_result) -> WasmResult {
+    std::string output;
+    if (!codec(arguments, &output)) {
+      return WasmResult::BadArgument;
+    }
+    return returnOutput(output, alloc_result);
+  };
+}
+
+RegisterForeignFunction sha256Function("sha256", codecFunction([](std::string_view input,
+                                                                  std::string *output) {
+                                         *output = Sha256::digest(input);
+                                         return true;
+                                       }));
+
+RegisterForeignFunction hmacSha256Function(
+    "hmac_sha256", codecFunction([](std::string_view input, std::string *output) {
+      uint32_t key_size;
+      if (input.size() < sizeof(key_size)) {
+        return false;
+      }
+      memcpy(&key_size, input.data(), sizeof(key_size));
+      input.remove_prefix(sizeof(key_size));
+      if (key_size > input.size()) {
+        return false;
+      }
+      *output = hmacSha256(input.substr(0, key_size), input.substr(key_size));
+      return true;
+    }));
+
+RegisterForeignFunction base64EncodeFunction(
+    "base64_encode", codecFunction([](std::string_view input, std::string *output) {
+      *output = base64Encode(input, base64Alphabet, true);
+      return true;
+    }));
+
+RegisterForeignFunction base64DecodeFunction(
+    "base64_decode", codecFunction([](std::string_view input, std::string *output) {
+      return base64Decode(input, base64Alphabet, true, output);
+    }));
+
+RegisterForeignFunction base64UrlEncodeFunction(
+    "base64url_encode", codecFunction([](std::string_view input, std::string *output) {
+      *output = base64Encode(input, base64UrlAlphabet, false);
+      return true;
+    }));
+
+RegisterForeignFunction base64UrlDecodeFunction(
+    "base64url_decode", codecFunction([](std::string_view input, std::string *output) {
+      return base64Decode(input, base64UrlAlphabet, false, output);
+    }));
+
+RegisterForeignFunction hexEncodeFunction("hex_encode",
+                                          codecFunction([](std::string_view input,
+                                                           std::string *output) {
+                                            *output = encodeHex(input);
+                                            return true;
+                                          }));
+
+RegisterForeignFunction hexDecodeFunction("hex_decode", codecFunction(decodeHex));
+
+// Pattern matching: "matcher_compile" takes the uint32 Matcher::Type followed by the pattern and
+// returns a uint32 handle shared by every VM with the same vm_id. "matcher_match" takes the handle
+// followed by the input and returns one byte, 1 on a match and 0 otherwise.
+
+RegisterForeignFunction
+    matcherCompileFunction("matcher_compile",
+                           [](WasmBase &wasm, std::string_view arguments,
+                              std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                             uint32_t type;
+                             if (arguments.size() < sizeof(type)) {
+                               return WasmResult::BadArgument;
+                             }
+                             memcpy(&type, arguments.data(), sizeof(type));
+                             uint32_t handle;
+                             auto result = MatcherCache::compile(
+                                 wasm.vm_id(), static_cast<Matcher::Type>(type),
+                                 arguments.substr(sizeof(type)), &handle);
+                             if (result != WasmResult::Ok) {
+                               return result;
+                             }
+                             memcpy(alloc_result(sizeof(handle)), &handle, sizeof(handle));
+                             return WasmResult::Ok;
+                           });
+
+RegisterForeignFunction
+    matcherMatchFunction("matcher_match",
+                         [](WasmBase &wasm, std::string_view arguments,
+                            std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                           uint32_t handle;
+                           if (arguments.size() < sizeof(handle)) {
+                             return WasmResult::BadArgument;
+                           }
+                           memcpy(&handle, arguments.data(), sizeof(handle));
+                           auto matcher = MatcherCache::get(wasm.vm_id(), handle);
+                           if (!matcher) {
+                             return WasmResult::NotFound;
+                           }
+                           *static_cast<uint8_t *>(alloc_result(1)) =
+                               matcher->matches(arguments.substr(sizeof(handle))) ? 1 : 0;
+                           return WasmResult::Ok;
+                         });
+
 #ifndef WITHOUT_ZLIB
+
+// Streaming compression: "deflate_init" (arguments: an optional int32 level) and "inflate_init"
+// (zlib or gzip input) return a uint32 handle. "deflate_chunk", "inflate_chunk",
+// "deflate_finish" and "inflate_finish" take the handle followed by the next piece of input and
+// return the output produced so far. "*_finish" closes the stream, as does any error. Handles are
+// local to the VM which opened them, and streams left open are freed with it.
+
+constexpr size_t kOutputChunkSize = 16384;
+constexpr size_t kMaxPooledStreams = 16;
+
+struct ZlibStream {
+  explicit ZlibStream(bool compress) : compress(compress) {}
+  ~ZlibStream() {
+    if (initialized) {
+      compress ? deflateEnd(&stream) : inflateEnd(&stream);
+    }
+  }
+
+  const bool compress;
+  bool initialized = false;
+  z_stream stream{};
+};
+
+// Per-thread pool of finished streams, which are reset and kept for reuse, as initializing a
+// deflate stream allocates about 256KB. Indexed by ZlibStream::compress.
+thread_local std::vector<std::unique_ptr<ZlibStream>> zlib_stream_pool[2];
+
+// The streams a VM has open, kept in its WasmBase::foreignFunctionState().
+struct OpenZlibStreams {
+  std::unordered_map<uint32_t, std::unique_ptr<ZlibStream>> streams;
+  uint32_t next_handle = 1;
+};
+
+OpenZlibStreams &openZlibStreams(WasmBase &wasm) {
+  auto &state = wasm.foreignFunctionState("zlib");
+  if (!state) {
+    state = std::make_shared<OpenZlibStreams>();
+  }
+  return *static_cast<OpenZlibStreams *>(state.get());
+}
+
+std::unique_ptr<ZlibStream> acquireZlibStream(bool compress, int level) {
+  auto &pool = zlib_stream_pool[compress];
+  if (!pool.empty()) {
+    auto zlib = std::move(pool.back());
+    pool.pop_back();
+    if (!compress || deflateParams(&zlib->stream, level, Z_DEFAULT_STRATEGY) == Z_OK) {
+      return zlib;
+    }
+  }
+  auto zlib = std::make_unique<ZlibStream>(compress);
+  // 15 + 32: a 32KB window, and inflate accepts both the zlib and gzip formats.
+  if ((compress ? deflateInit(&zlib->stream, level) : inflateInit2(&zlib->stream, 15 + 32)) !=
+      Z_OK) {
+    return nullptr;
+  }
+  zlib->initialized = true;
+  return zlib;
+}
+
+void releaseZlibStream(std::unique_ptr<ZlibStream> zlib) {
+  auto &pool = zlib_stream_pool[zlib->compress];
+  if (pool.size() < kMaxPooledStreams &&
+      (zlib->compress ? deflateReset(&zlib->stream) : inflateReset(&zlib->stream)) == Z_OK) {
+    pool.push_back(std::move(zlib));
+  }
+}
+
+// Run 'input' through the stream, appending the output. Returns Z_STREAM_END at the end of the
+// stream, Z_OK if more input is needed or a zlib error.
+int runZlibStream(ZlibStream *zlib, std::string_view input, int flush, std::string *output) {
+  auto &stream = zlib->stream;
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+  stream.avail_in = input.size();
+  while (true) {
+    auto used = output->size();
+    output->resize(used + kOutputChunkSize);
+    stream.next_out = reinterpret_cast<Bytef *>(&(*output)[used]);
+    stream.avail_out = kOutputChunkSize;
+    auto r = zlib->compress ? deflate(&stream, flush) : inflate(&stream, flush);
+    output->resize(used + kOutputChunkSize - stream.avail_out);
+    if (r != Z_OK && r != Z_BUF_ERROR) {
+      return r;
+    }
+    // Z_BUF_ERROR: no progress was possible, e.g. inflate needs more input.
+    if (stream.avail_out != 0 && (stream.avail_in == 0 || r == Z_BUF_ERROR)) {
+      return Z_OK;
+    }
+  }
+}
+
+WasmResult initZlibStream(WasmBase &wasm, bool compress, int level,
+                          const std::function<void *(size_t size)> &alloc_result) {
+  auto zlib = acquireZlibStream(compress, level);
+  if (!zlib) {
+    return WasmResult::SerializationFailure;
+  }
+  auto &open = openZlibStreams(wasm);
+  auto handle = open.next_handle++;
+  if (open.next_handle == 0) {
+    open.next_handle = 1;
+  }
+  open.streams[handle] = std::move(zlib);
+  memcpy(alloc_result(sizeof(handle)), &handle, sizeof(handle));
+  return WasmResult::Ok;
+}
+
+WasmResult continueZlibStream(WasmBase &wasm, bool compress, bool finish,
+                             std::string_view arguments,
+                             const std::function<void *(size_t size)> &alloc_result) {
+  uint32_t handle;
+  if (arguments.size() < sizeof(handle)) {
+    return WasmResult::BadArgument;
+  }
+  memcpy(&handle, arguments.data(), sizeof(handle));
+  auto &open = openZlibStreams(wasm);
+  auto it = open.streams.find(handle);
+  if (it == open.streams.end() || it->second->compress != compress) {
+    return WasmResult::NotFound;
+  }
+  std::string output;
+  auto r = runZlibStream(it->second.get(), arguments.substr(sizeof(handle)),
+                         compress && finish ? Z_FINISH : Z_NO_FLUSH, &output);
+  bool ok = r == Z_OK || r == Z_STREAM_END;
+  if (finish && r != Z_STREAM_END) {
+    // Truncated input.
+    ok = false;
+  }
+  if (finish || !ok) {
+    releaseZlibStream(std::move(it->second));
+    open.streams.erase(it);
+  }
+  if (!ok) {
+    return WasmResult::SerializationFailure;
+  }
+  return returnOutput(output, alloc_result);
+}
+
+RegisterForeignFunction
+    deflateInitFunction("deflate_init",
+                        [](WasmBase &wasm, std::string_view arguments,
+                           std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                          int32_t level = Z_DEFAULT_COMPRESSION;
+                          if (arguments.size() >= sizeof(level)) {
+                            memcpy(&level, arguments.data(), sizeof(level));
+                          }
+                          if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+                            return WasmResult::BadArgument;
+                          }
+                          return initZlibStream(wasm, true, level, alloc_result);
+                        });
+
+RegisterForeignFunction
+    inflateInitFunction("inflate_init",
+                        [](WasmBase &wasm, std::string_view,
+                           std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                          return initZlibStream(wasm, false, 0, alloc_result);
+                        });
+
+RegisterForeignFunction
+    deflateChunkFunction("deflate_chunk",
+                         [](WasmBase &wasm, std::string_view arguments,
+                            std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                           return continueZlibStream(wasm, true, false, arguments, alloc_result);
+                         });
+
+RegisterForeignFunction
+    deflateFinishFunction("deflate_finish",
+                          [](WasmBase &wasm, std::string_view arguments,
+                             std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                            return continueZlibStream(wasm, true, true, arguments, alloc_result);
+                          });
+
+RegisterForeignFunction
+    inflateChunkFunction("inflate_chunk",
+                         [](WasmBase &wasm, std::string_view arguments,
+                            std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                           return continueZlibStream(wasm, false, false, arguments, alloc_result);
+                         });
+
+RegisterForeignFunction
+    inflateFinishFunction("inflate_finish",
+                          [](WasmBase &wasm, std::string_view arguments,
+                             std::function<void *(size_t size)> alloc_result) -> WasmResult {
+                            return continueZlibStream(wasm, false, true, arguments, alloc_result);
+                          });
+
 RegisterForeignFunction compressFunction(
     "compress",
     [](WasmBase &, std::string_view arguments,
@@ -38,27 +400,22 @@ RegisterForeignFunction compressFunction(
       return WasmResult::Ok;
     });
 
+// Inflate in one pass with a pooled stream rather than guessing the output size.
 RegisterForeignFunction
     uncompressFunction("uncompress",
                        [](WasmBase &, std::string_view arguments,
                           std::function<void *(size_t size)> alloc_result) -> WasmResult {
-                         unsigned long dest_len = arguments.size() * 2 + 2; // output estimate.
-                         while (1) {
-                           std::unique_ptr<unsigned char[]> b(new unsigned char[dest_len]);
-                           auto r =
-                               uncompress(b.get(), &dest_len,
-                                          reinterpret_cast<const unsigned char *>(arguments.data()),
-                                          arguments.size());
-                           if (r == Z_OK) {
-                             auto result = alloc_result(dest_len);
-                             memcpy(result, b.get(), dest_len);
-                             return WasmResult::Ok;
-                           }
-                           if (r != Z_MEM_ERROR) {
-                             return WasmResult::SerializationFailure;
-                           }
-                           dest_len = dest_len * 2;
+                         auto zlib = acquireZlibStream(false, 0);
+                         if (!zlib) {
+                           return WasmResult::SerializationFailure;
+                         }
+                         std::string output;
+                         auto r = runZlibStream(zlib.get(), arguments, Z_NO_FLUSH, &output);
+                         releaseZlibStream(std::move(zlib));
+                         if (r != Z_STREAM_END) {
+                           return WasmResult::SerializationFailure;
                          }
+                         return returnOutput(output, alloc_result);
                        });
 #endif
 
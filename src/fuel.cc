@@ -0,0 +1,542 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/fuel.h"
+
+#include <string.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace proxy_wasm {
+
+namespace {
+
+// See https://webassembly.github.io/spec/core/binary/modules.html for the sections.
+enum SectionId : uint8_t {
+  Custom = 0,
+  Type = 1,
+  Import = 2,
+  Function = 3,
+  Table = 4,
+  Memory = 5,
+  Global = 6,
+  Export = 7,
+  Start = 8,
+  Element = 9,
+  Code = 10,
+  Data = 11,
+  DataCount = 12,
+};
+
+// Position of a known section in the required order (DataCount precedes Code), 0 if unknown.
+int sectionOrder(uint8_t id) {
+  switch (id) {
+  case Type:
+  case Import:
+  case Function:
+  case Table:
+  case Memory:
+  case Global:
+  case Export:
+  case Start:
+  case Element:
+    return id;
+  case DataCount:
+    return 10;
+  case Code:
+    return 11;
+  case Data:
+    return 12;
+  default:
+    return 0;
+  }
+}
+
+class Reader {
+public:
+  Reader(std::string_view data)
+      : pos_(reinterpret_cast<const uint8_t *>(data.data())), end_(pos_ + data.size()) {}
+
+  bool done() const { return pos_ >= end_; }
+  const char *pos() const { return reinterpret_cast<const char *>(pos_); }
+
+  bool byte(uint8_t *b) {
+    if (pos_ >= end_) {
+      return false;
+    }
+    *b = *pos_++;
+    return true;
+  }
+  bool peek(uint8_t *b) {
+    if (pos_ >= end_) {
+      return false;
+    }
+    *b = *pos_;
+    return true;
+  }
+  bool u32(uint32_t *v) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      uint8_t b;
+      if (!byte(&b)) {
+        return false;
+      }
+      result |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        if (result > UINT32_MAX) {
+          return false;
+        }
+        *v = static_cast<uint32_t>(result);
+        return true;
+      }
+    }
+    return false;
+  }
+  // Skip a LEB128 of up to 'max_bytes' bytes, signed or not.
+  bool leb(int max_bytes) {
+    for (int i = 0; i < max_bytes; i++) {
+      uint8_t b;
+      if (!byte(&b)) {
+        return false;
+      }
+      if (!(b & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  bool skip(size_t n) {
+    if (static_cast<size_t>(end_ - pos_) < n) {
+      return false;
+    }
+    pos_ += n;
+    return true;
+  }
+  bool bytes(size_t n, std::string_view *result) {
+    auto start = pos();
+    if (!skip(n)) {
+      return false;
+    }
+    *result = std::string_view(start, n);
+    return true;
+  }
+  bool name() {
+    uint32_t size;
+    return u32(&size) && skip(size);
+  }
+  bool limits() {
+    uint8_t flags;
+    if (!byte(&flags) || !leb(10)) {
+      return false;
+    }
+    return !(flags & 0x01) || leb(10);
+  }
+
+private:
+  const uint8_t *pos_;
+  const uint8_t *end_;
+};
+
+void putU32(std::string *out, uint32_t value) {
+  do {
+    uint8_t b = value & 0x7f;
+    value >>= 7;
+    if (value) {
+      b |= 0x80;
+    }
+    out->push_back(static_cast<char>(b));
+  } while (value);
+}
+
+void putS64(std::string *out, int64_t value) {
+  while (true) {
+    uint8_t b = value & 0x7f;
+    value >>= 7;
+    if ((value == 0 && !(b & 0x40)) || (value == -1 && (b & 0x40))) {
+      out->push_back(static_cast<char>(b));
+      return;
+    }
+    out->push_back(static_cast<char>(b | 0x80));
+  }
+}
+
+void putSection(std::string *out, uint8_t id, std::string_view contents) {
+  out->push_back(static_cast<char>(id));
+  putU32(out, contents.size());
+  out->append(contents.data(), contents.size());
+}
+
+// (global (mut i64) (i64.const kUnmeteredFuel))
+void putFuelGlobal(std::string *out) {
+  out->append("\x7e\x01\x42", 3);
+  putS64(out, kUnmeteredFuel);
+  out->push_back(0x0b);
+}
+
+void putFuelExport(std::string *out, uint32_t fuel_global) {
+  putU32(out, kFuelGlobalName.size());
+  out->append(kFuelGlobalName.data(), kFuelGlobalName.size());
+  out->push_back(0x03); // Global.
+  putU32(out, fuel_global);
+}
+
+// fuel -= cost; if (fuel < 0) unreachable;
+void putCharge(std::string *out, uint32_t fuel_global, uint32_t cost) {
+  out->push_back(0x23); // global.get
+  putU32(out, fuel_global);
+  out->push_back(0x42); // i64.const
+  putS64(out, cost);
+  out->push_back(0x7d); // i64.sub
+  out->push_back(0x24); // global.set
+  putU32(out, fuel_global);
+  out->push_back(0x23); // global.get
+  putU32(out, fuel_global);
+  out->append("\x42\x00", 2); // i64.const 0
+  out->push_back(0x53);       // i64.lt_s
+  out->append("\x04\x40", 2); // if
+  out->push_back(0x00);       // unreachable
+  out->push_back(0x0b);       // end
+}
+
+bool blockType(Reader *r) {
+  uint8_t b;
+  if (!r->peek(&b)) {
+    return false;
+  }
+  switch (b) {
+  case 0x40: // Empty.
+  case 0x7f: // i32
+  case 0x7e: // i64
+  case 0x7d: // f32
+  case 0x7c: // f64
+  case 0x70: // funcref
+  case 0x6f: // externref
+    return r->skip(1);
+  default:
+    return r->leb(5); // Type index (s33).
+  }
+}
+
+enum class Opcode { Plain, Control, Block, End, Unsupported };
+
+// Skips the immediates of the instruction 'opcode' and classifies it. Control instructions end a
+// metered run of instructions.
+Opcode decodeInstruction(uint8_t opcode, Reader *r) {
+  if (opcode >= 0x45 && opcode <= 0xc4) {
+    return Opcode::Plain; // Numeric instructions have no immediates.
+  }
+  switch (opcode) {
+  case 0x00: // unreachable
+  case 0x0f: // return
+    return Opcode::Control;
+  case 0x01: // nop
+  case 0x1a: // drop
+  case 0x1b: // select
+  case 0xd1: // ref.is_null
+    return Opcode::Plain;
+  case 0x02: // block
+  case 0x03: // loop
+  case 0x04: // if
+    return blockType(r) ? Opcode::Block : Opcode::Unsupported;
+  case 0x05: // else
+    return Opcode::Control;
+  case 0x0b: // end
+    return Opcode::End;
+  case 0x0c: // br
+  case 0x0d: // br_if
+    return r->leb(5) ? Opcode::Control : Opcode::Unsupported;
+  case 0x0e: { // br_table
+    uint32_t count;
+    if (!r->u32(&count)) {
+      return Opcode::Unsupported;
+    }
+    for (uint64_t i = 0; i <= count; i++) {
+      if (!r->leb(5)) {
+        return Opcode::Unsupported;
+      }
+    }
+    return Opcode::Control;
+  }
+  case 0x10: // call
+  case 0x20: // local.get
+  case 0x21: // local.set
+  case 0x22: // local.tee
+  case 0x23: // global.get
+  case 0x24: // global.set
+  case 0x25: // table.get
+  case 0x26: // table.set
+  case 0xd2: // ref.func
+    return r->leb(5) ? Opcode::Plain : Opcode::Unsupported;
+  case 0x11: // call_indirect
+    return r->leb(5) && r->leb(5) ? Opcode::Plain : Opcode::Unsupported;
+  case 0x1c: { // select t*
+    uint32_t count;
+    return r->u32(&count) && r->skip(count) ? Opcode::Plain : Opcode::Unsupported;
+  }
+  case 0x3f: // memory.size
+  case 0x40: // memory.grow
+  case 0xd0: // ref.null
+    return r->skip(1) ? Opcode::Plain : Opcode::Unsupported;
+  case 0x41: // i32.const
+    return r->leb(5) ? Opcode::Plain : Opcode::Unsupported;
+  case 0x42: // i64.const
+    return r->leb(10) ? Opcode::Plain : Opcode::Unsupported;
+  case 0x43: // f32.const
+    return r->skip(4) ? Opcode::Plain : Opcode::Unsupported;
+  case 0x44: // f64.const
+    return r->skip(8) ? Opcode::Plain : Opcode::Unsupported;
+  case 0xfc: { // Saturating truncation, bulk memory and table instructions.
+    uint32_t sub;
+    if (!r->u32(&sub)) {
+      return Opcode::Unsupported;
+    }
+    if (sub <= 7) {
+      return Opcode::Plain;
+    }
+    switch (sub) {
+    case 8: // memory.init
+      return r->leb(5) && r->skip(1) ? Opcode::Plain : Opcode::Unsupported;
+    case 9: // data.drop
+      return r->leb(5) ? Opcode::Plain : Opcode::Unsupported;
+    case 10: // memory.copy
+      return r->skip(2) ? Opcode::Plain : Opcode::Unsupported;
+    case 11: // memory.fill
+      return r->skip(1) ? Opcode::Plain : Opcode::Unsupported;
+    case 12: // table.init
+    case 14: // table.copy
+      return r->leb(5) && r->leb(5) ? Opcode::Plain : Opcode::Unsupported;
+    case 13: // elem.drop
+    case 15: // table.grow
+    case 16: // table.size
+    case 17: // table.fill
+      return r->leb(5) ? Opcode::Plain : Opcode::Unsupported;
+    default:
+      return Opcode::Unsupported;
+    }
+  }
+  default:
+    if (opcode >= 0x28 && opcode <= 0x3e) { // Loads and stores: memarg.
+      return r->leb(5) && r->leb(10) ? Opcode::Plain : Opcode::Unsupported;
+    }
+    return Opcode::Unsupported; // Including SIMD (0xfd), threads (0xfe) and exceptions.
+  }
+}
+
+bool instrumentBody(std::string_view body, uint32_t fuel_global, std::string *out) {
+  Reader r(body);
+  uint32_t local_groups;
+  if (!r.u32(&local_groups)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < local_groups; i++) {
+    if (!r.leb(5) || !r.skip(1)) {
+      return false;
+    }
+  }
+  out->append(body.data(), r.pos() - body.data());
+
+  int depth = 0;
+  const char *run_start = r.pos();
+  uint32_t run_length = 0;
+  while (!r.done()) {
+    uint8_t opcode;
+    r.byte(&opcode);
+    auto kind = decodeInstruction(opcode, &r);
+    if (kind == Opcode::Unsupported) {
+      return false;
+    }
+    run_length++;
+    if (kind == Opcode::Block) {
+      depth++;
+    } else if (kind == Opcode::End) {
+      depth--;
+    }
+    if (kind != Opcode::Plain) {
+      putCharge(out, fuel_global, run_length);
+      out->append(run_start, r.pos() - run_start);
+      run_start = r.pos();
+      run_length = 0;
+    }
+    if (depth < 0) {
+      return r.done(); // The final 'end' must close the body.
+    }
+  }
+  return false;
+}
+
+bool instrumentCode(std::string_view section, uint32_t fuel_global, std::string *out) {
+  Reader r(section);
+  uint32_t count;
+  if (!r.u32(&count)) {
+    return false;
+  }
+  putU32(out, count);
+  std::string instrumented;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t size;
+    std::string_view body;
+    if (!r.u32(&size) || !r.bytes(size, &body)) {
+      return false;
+    }
+    instrumented.clear();
+    if (!instrumentBody(body, fuel_global, &instrumented)) {
+      return false;
+    }
+    putU32(out, instrumented.size());
+    out->append(instrumented);
+  }
+  return r.done();
+}
+
+// Copies a vector section, appending one more entry.
+bool appendEntry(std::string_view section, const std::string &entry, std::string *out) {
+  Reader r(section);
+  uint32_t count;
+  if (!r.u32(&count)) {
+    return false;
+  }
+  putU32(out, count + 1);
+  out->append(r.pos(), section.data() + section.size() - r.pos());
+  out->append(entry);
+  return true;
+}
+
+bool countImportedGlobals(std::string_view section, uint32_t *globals) {
+  Reader r(section);
+  uint32_t count;
+  if (!r.u32(&count)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t kind;
+    if (!r.name() || !r.name() || !r.byte(&kind)) {
+      return false;
+    }
+    bool ok = false;
+    switch (kind) {
+    case 0x00: // Function.
+      ok = r.leb(5);
+      break;
+    case 0x01: // Table.
+      ok = r.skip(1) && r.limits();
+      break;
+    case 0x02: // Memory.
+      ok = r.limits();
+      break;
+    case 0x03: // Global.
+      ok = r.skip(2);
+      (*globals)++;
+      break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+bool instrumentForFuel(std::string_view code, std::string *instrumented) {
+  static const char magic_number[4] = {0x00, 0x61, 0x73, 0x6d};
+  if (code.size() < 8 || ::memcmp(code.data(), magic_number, 4) != 0) {
+    return false;
+  }
+  struct Section {
+    uint8_t id;
+    std::string_view contents;
+  };
+  std::vector<Section> sections;
+  uint32_t fuel_global = 0;
+  Reader r(code.substr(8));
+  while (!r.done()) {
+    Section section;
+    uint32_t size;
+    if (!r.byte(&section.id) || !r.u32(&size) || !r.bytes(size, &section.contents)) {
+      return false;
+    }
+    if (section.id != Custom && !sectionOrder(section.id)) {
+      return false;
+    }
+    if (section.id == Import && !countImportedGlobals(section.contents, &fuel_global)) {
+      return false;
+    }
+    if (section.id == Global) {
+      uint32_t defined_globals;
+      if (!Reader(section.contents).u32(&defined_globals)) {
+        return false;
+      }
+      fuel_global += defined_globals;
+    }
+    sections.push_back(section);
+  }
+
+  std::string global_entry, export_entry;
+  putFuelGlobal(&global_entry);
+  putFuelExport(&export_entry, fuel_global);
+
+  std::string &out = *instrumented;
+  out.assign(code.data(), 8);
+  bool global_done = false;
+  bool export_done = false;
+  std::string contents;
+  for (auto &section : sections) {
+    int order = sectionOrder(section.id);
+    if (section.id != Custom) {
+      // Add the sections if the module does not have them, in their required position.
+      if (!global_done && order > Global) {
+        putSection(&out, Global, "\x01" + global_entry);
+        global_done = true;
+      }
+      if (!export_done && order > Export) {
+        putSection(&out, Export, "\x01" + export_entry);
+        export_done = true;
+      }
+    }
+    contents.clear();
+    switch (section.id) {
+    case Global:
+      if (!appendEntry(section.contents, global_entry, &contents)) {
+        return false;
+      }
+      global_done = true;
+      break;
+    case Export:
+      if (!appendEntry(section.contents, export_entry, &contents)) {
+        return false;
+      }
+      export_done = true;
+      break;
+    case Code:
+      if (!instrumentCode(section.contents, fuel_global, &contents)) {
+        return false;
+      }
+      break;
+    default:
+      contents.assign(section.contents.data(), section.contents.size());
+      break;
+    }
+    putSection(&out, section.id, contents);
+  }
+  if (!global_done) {
+    putSection(&out, Global, "\x01" + global_entry);
+  }
+  if (!export_done) {
+    putSection(&out, Export, "\x01" + export_entry);
+  }
+  return true;
+}
+
+} // namespace proxy_wasm
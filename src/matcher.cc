@@ -0,0 +1,806 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/matcher.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace proxy_wasm {
+
+namespace {
+
+// Bounds on the compiled program, which counted repetition expands.
+constexpr size_t kMaxInstructions = 10000;
+constexpr int kMaxRepeat = 1000;
+// Bound on group nesting, which the parser and compiler recurse on.
+constexpr int kMaxDepth = 1000;
+
+using ByteSet = std::bitset<256>;
+
+// Regular expression syntax tree. Globs are translated to the same tree.
+struct Node {
+  enum class Kind { Bytes, Concat, Alternate, Repeat, BeginText, EndText };
+
+  explicit Node(Kind kind) : kind(kind) {}
+
+  Kind kind;
+  ByteSet bytes;                              // Bytes.
+  std::vector<std::unique_ptr<Node>> children; // Concat, Alternate and Repeat (one child).
+  int min = 0;                                // Repeat.
+  int max = -1;                               // Repeat, -1 for no limit.
+};
+
+std::unique_ptr<Node> makeBytes(const ByteSet &bytes) {
+  auto node = std::make_unique<Node>(Node::Kind::Bytes);
+  node->bytes = bytes;
+  return node;
+}
+
+ByteSet byteRange(uint8_t first, uint8_t last) {
+  ByteSet bytes;
+  for (int c = first; c <= last; c++) {
+    bytes.set(c);
+  }
+  return bytes;
+}
+
+// Sets 'byte' if 'bytes' holds exactly one byte.
+bool singleByte(const ByteSet &bytes, uint8_t *byte) {
+  if (bytes.count() != 1) {
+    return false;
+  }
+  for (int c = 0; c < 256; c++) {
+    if (bytes.test(c)) {
+      *byte = c;
+    }
+  }
+  return true;
+}
+
+class Parser {
+public:
+  Parser(std::string_view pattern, std::string *error) : pattern_(pattern), error_(error) {}
+
+  std::unique_ptr<Node> parseRegex() {
+    auto node = parseAlternate();
+    if (node && pos_ < pattern_.size()) {
+      return fail("unmatched ')'");
+    }
+    return node;
+  }
+
+  std::unique_ptr<Node> parseGlob() {
+    auto concat = std::make_unique<Node>(Node::Kind::Concat);
+    while (pos_ < pattern_.size()) {
+      auto c = pattern_[pos_++];
+      if (c == '*') {
+        auto star = std::make_unique<Node>(Node::Kind::Repeat);
+        star->children.push_back(makeBytes(ByteSet().set()));
+        concat->children.push_back(std::move(star));
+      } else if (c == '?') {
+        concat->children.push_back(makeBytes(ByteSet().set()));
+      } else if (c == '[') {
+        ByteSet bytes;
+        if (!parseClass(&bytes)) {
+          return nullptr;
+        }
+        concat->children.push_back(makeBytes(bytes));
+      } else {
+        if (c == '\\') {
+          if (pos_ == pattern_.size()) {
+            return fail("trailing '\\'");
+          }
+          c = pattern_[pos_++];
+        }
+        concat->children.push_back(makeBytes(ByteSet().set(static_cast<uint8_t>(c))));
+      }
+    }
+    return concat;
+  }
+
+private:
+  std::unique_ptr<Node> fail(std::string_view message) {
+    if (error_->empty()) {
+      *error_ = std::string(message) + " at offset " + std::to_string(pos_);
+    }
+    return nullptr;
+  }
+
+  bool more() const { return pos_ < pattern_.size(); }
+  char peek() const { return pattern_[pos_]; }
+
+  std::unique_ptr<Node> parseAlternate() {
+    auto first = parseConcat();
+    if (!first || !more() || peek() != '|') {
+      return first;
+    }
+    auto alternate = std::make_unique<Node>(Node::Kind::Alternate);
+    alternate->children.push_back(std::move(first));
+    while (more() && peek() == '|') {
+      pos_++;
+      auto next = parseConcat();
+      if (!next) {
+        return nullptr;
+      }
+      alternate->children.push_back(std::move(next));
+    }
+    return alternate;
+  }
+
+  std::unique_ptr<Node> parseConcat() {
+    auto concat = std::make_unique<Node>(Node::Kind::Concat);
+    while (more() && peek() != '|' && peek() != ')') {
+      auto atom = parseRepeat();
+      if (!atom) {
+        return nullptr;
+      }
+      concat->children.push_back(std::move(atom));
+    }
+    return concat;
+  }
+
+  std::unique_ptr<Node> parseRepeat() {
+    auto atom = parseAtom();
+    while (atom && more()) {
+      int min, max;
+      auto c = peek();
+      if (c == '*') {
+        min = 0, max = -1;
+      } else if (c == '+') {
+        min = 1, max = -1;
+      } else if (c == '?') {
+        min = 0, max = 1;
+      } else if (c == '{') {
+        if (!parseCount(&min, &max)) {
+          return nullptr;
+        }
+        pos_--; // parseCount() consumed the '}'.
+      } else {
+        break;
+      }
+      pos_++;
+      if (atom->kind == Node::Kind::BeginText || atom->kind == Node::Kind::EndText) {
+        return fail("repeated anchor");
+      }
+      auto repeat = std::make_unique<Node>(Node::Kind::Repeat);
+      repeat->min = min;
+      repeat->max = max;
+      repeat->children.push_back(std::move(atom));
+      atom = std::move(repeat);
+    }
+    return atom;
+  }
+
+  // Parses "{n}", "{n,}" or "{n,m}".
+  bool parseCount(int *min, int *max) {
+    pos_++;
+    auto number = [this](int *value) {
+      auto start = pos_;
+      *value = 0;
+      while (more() && peek() >= '0' && peek() <= '9' && *value <= kMaxRepeat) {
+        *value = *value * 10 + (pattern_[pos_++] - '0');
+      }
+      return pos_ > start;
+    };
+    if (!number(min)) {
+      fail("bad repetition count");
+      return false;
+    }
+    *max = *min;
+    if (more() && peek() == ',') {
+      pos_++;
+      *max = -1;
+      if (more() && peek() != '}' && !number(max)) {
+        fail("bad repetition count");
+        return false;
+      }
+    }
+    if (!more() || peek() != '}') {
+      fail("bad repetition count");
+      return false;
+    }
+    pos_++;
+    if (*min > kMaxRepeat || *max > kMaxRepeat || (*max >= 0 && *max < *min)) {
+      fail("bad repetition count");
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<Node> parseAtom() {
+    auto c = pattern_[pos_++];
+    switch (c) {
+    case '(': {
+      if (pattern_.substr(pos_, 2) == "?:") {
+        pos_ += 2;
+      }
+      if (++depth_ > kMaxDepth) {
+        return fail("groups nested too deeply");
+      }
+      auto group = parseAlternate();
+      depth_--;
+      if (!group) {
+        return nullptr;
+      }
+      if (!more() || peek() != ')') {
+        return fail("missing ')'");
+      }
+      pos_++;
+      return group;
+    }
+    case '[': {
+      ByteSet bytes;
+      if (!parseClass(&bytes)) {
+        return nullptr;
+      }
+      return makeBytes(bytes);
+    }
+    case '.':
+      return makeBytes(ByteSet().set().reset('\n'));
+    case '^':
+      return std::make_unique<Node>(Node::Kind::BeginText);
+    case '$':
+      return std::make_unique<Node>(Node::Kind::EndText);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      return fail("missing argument to repetition operator");
+    case '\\': {
+      ByteSet bytes;
+      if (!parseEscape(&bytes)) {
+        return nullptr;
+      }
+      return makeBytes(bytes);
+    }
+    default:
+      return makeBytes(ByteSet().set(static_cast<uint8_t>(c)));
+    }
+  }
+
+  // Parses the escape after a '\'.
+  bool parseEscape(ByteSet *bytes) {
+    if (!more()) {
+      fail("trailing '\\'");
+      return false;
+    }
+    auto c = pattern_[pos_++];
+    switch (c) {
+    case 'd':
+    case 'D':
+      *bytes = byteRange('0', '9');
+      break;
+    case 'w':
+    case 'W':
+      *bytes = byteRange('0', '9') | byteRange('a', 'z') | byteRange('A', 'Z');
+      bytes->set('_');
+      break;
+    case 's':
+    case 'S':
+      for (auto s : {' ', '\t', '\n', '\r', '\f', '\v'}) {
+        bytes->set(static_cast<uint8_t>(s));
+      }
+      break;
+    case 'n':
+      bytes->set('\n');
+      break;
+    case 'r':
+      bytes->set('\r');
+      break;
+    case 't':
+      bytes->set('\t');
+      break;
+    default:
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        fail("unsupported escape");
+        return false;
+      }
+      bytes->set(static_cast<uint8_t>(c));
+      return true;
+    }
+    if (c == 'D' || c == 'W' || c == 'S') {
+      bytes->flip();
+    }
+    return true;
+  }
+
+  // Parses a class after its '['.
+  bool parseClass(ByteSet *bytes) {
+    bool negate = more() && peek() == '^';
+    if (negate) {
+      pos_++;
+    }
+    bool first = true;
+    while (more() && (peek() != ']' || first)) {
+      first = false;
+      ByteSet item;
+      uint8_t low = pattern_[pos_++];
+      if (low == '\\') {
+        if (!parseEscape(&item)) {
+          return false;
+        }
+        if (!singleByte(item, &low)) {
+          *bytes |= item;
+          continue;
+        }
+      }
+      uint8_t high = low;
+      if (pos_ + 1 < pattern_.size() && peek() == '-' && pattern_[pos_ + 1] != ']') {
+        pos_++;
+        high = pattern_[pos_++];
+        if (high == '\\') {
+          item.reset();
+          if (!parseEscape(&item) || !singleByte(item, &high)) {
+            fail("bad class range");
+            return false;
+          }
+        }
+        if (high < low) {
+          fail("bad class range");
+          return false;
+        }
+      }
+      *bytes |= byteRange(low, high);
+    }
+    if (!more()) {
+      fail("missing ']'");
+      return false;
+    }
+    pos_++;
+    if (negate) {
+      bytes->flip();
+    }
+    return true;
+  }
+
+  std::string_view pattern_;
+  std::string *error_;
+  size_t pos_ = 0;
+  int depth_ = 0;
+};
+
+// Pike VM program.
+struct Instruction {
+  enum class Op : uint8_t { Bytes, Split, Jump, BeginText, EndText, Match };
+
+  Op op;
+  uint32_t x = 0; // Split and Jump target.
+  uint32_t y = 0; // Split second target.
+  uint32_t bytes = 0; // Bytes: index into Program::byte_sets.
+};
+
+struct Program {
+  std::vector<Instruction> instructions;
+  std::vector<ByteSet> byte_sets;
+};
+
+class Compiler {
+public:
+  explicit Compiler(Program *program) : program_(program) {}
+
+  bool compile(const Node &node) {
+    if (!emit(node)) {
+      return false;
+    }
+    return add(Instruction::Op::Match) >= 0;
+  }
+
+private:
+  int64_t add(Instruction::Op op) {
+    if (program_->instructions.size() >= kMaxInstructions) {
+      return -1;
+    }
+    program_->instructions.push_back(Instruction{op});
+    return program_->instructions.size() - 1;
+  }
+  uint32_t next() const { return program_->instructions.size(); }
+  Instruction &at(int64_t pc) { return program_->instructions[pc]; }
+
+  bool emit(const Node &node) {
+    switch (node.kind) {
+    case Node::Kind::Bytes: {
+      auto pc = add(Instruction::Op::Bytes);
+      if (pc < 0) {
+        return false;
+      }
+      auto &sets = program_->byte_sets;
+      auto it = std::find(sets.begin(), sets.end(), node.bytes);
+      at(pc).bytes = it - sets.begin();
+      if (it == sets.end()) {
+        sets.push_back(node.bytes);
+      }
+      return true;
+    }
+    case Node::Kind::BeginText:
+      return add(Instruction::Op::BeginText) >= 0;
+    case Node::Kind::EndText:
+      return add(Instruction::Op::EndText) >= 0;
+    case Node::Kind::Concat:
+      for (auto &child : node.children) {
+        if (!emit(*child)) {
+          return false;
+        }
+      }
+      return true;
+    case Node::Kind::Alternate: {
+      // split L1, L2; L1: e1; jmp end; L2: split ...; en; end:
+      std::vector<int64_t> jumps;
+      for (size_t i = 0; i < node.children.size(); i++) {
+        int64_t split = -1;
+        if (i + 1 < node.children.size()) {
+          split = add(Instruction::Op::Split);
+          if (split < 0) {
+            return false;
+          }
+          at(split).x = next();
+        }
+        if (!emit(*node.children[i])) {
+          return false;
+        }
+        if (split >= 0) {
+          auto jump = add(Instruction::Op::Jump);
+          if (jump < 0) {
+            return false;
+          }
+          jumps.push_back(jump);
+          at(split).y = next();
+        }
+      }
+      for (auto jump : jumps) {
+        at(jump).x = next();
+      }
+      return true;
+    }
+    case Node::Kind::Repeat:
+      return emitRepeat(*node.children[0], node.min, node.max);
+    }
+    return false;
+  }
+
+  bool emitRepeat(const Node &child, int min, int max) {
+    for (int i = 0; i < min; i++) {
+      if (!emit(child)) {
+        return false;
+      }
+    }
+    if (max < 0) {
+      // L1: split L2, L3; L2: e; jmp L1; L3:
+      auto split = add(Instruction::Op::Split);
+      if (split < 0) {
+        return false;
+      }
+      at(split).x = next();
+      if (!emit(child)) {
+        return false;
+      }
+      auto jump = add(Instruction::Op::Jump);
+      if (jump < 0) {
+        return false;
+      }
+      at(jump).x = split;
+      at(split).y = next();
+      return true;
+    }
+    // Nested optionals: split L1, end; L1: e; split L2, end; ...
+    std::vector<int64_t> splits;
+    for (int i = min; i < max; i++) {
+      auto split = add(Instruction::Op::Split);
+      if (split < 0) {
+        return false;
+      }
+      at(split).x = next();
+      splits.push_back(split);
+      if (!emit(child)) {
+        return false;
+      }
+    }
+    for (auto split : splits) {
+      at(split).y = next();
+    }
+    return true;
+  }
+
+  Program *program_;
+};
+
+class ProgramMatcher : public Matcher {
+public:
+  explicit ProgramMatcher(Program program) : program_(std::move(program)) {}
+
+  bool matches(std::string_view input) const override {
+    auto size = program_.instructions.size();
+    // Matching never nests, so each thread reuses one set of lists across matchers and calls.
+    thread_local Scratch scratch;
+    auto *current = &scratch.lists[0];
+    auto *next = &scratch.lists[1];
+    current->reset(size);
+    next->reset(size);
+    auto *stack = &scratch.stack;
+    addThread(current, 0, 0, input.size(), stack);
+    for (size_t pos = 0; pos < input.size(); pos++) {
+      if (current->pcs.empty()) {
+        return false;
+      }
+      next->clear();
+      auto c = static_cast<uint8_t>(input[pos]);
+      for (auto pc : current->pcs) {
+        auto &instruction = program_.instructions[pc];
+        if (instruction.op == Instruction::Op::Bytes &&
+            program_.byte_sets[instruction.bytes].test(c)) {
+          addThread(next, pc + 1, pos + 1, input.size(), stack);
+        }
+      }
+      std::swap(current, next);
+    }
+    for (auto pc : current->pcs) {
+      if (program_.instructions[pc].op == Instruction::Op::Match) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  // Sparse set of program counters, in insertion order. Stale entries in 'index' are harmless, so
+  // it only ever grows.
+  struct ThreadList {
+    void reset(size_t size) {
+      if (index.size() < size) {
+        index.resize(size);
+        pcs.reserve(size);
+      }
+      pcs.clear();
+    }
+    bool contains(uint32_t pc) const { return index[pc] < pcs.size() && pcs[index[pc]] == pc; }
+    void add(uint32_t pc) {
+      index[pc] = pcs.size();
+      pcs.push_back(pc);
+    }
+    void clear() { pcs.clear(); }
+
+    std::vector<uint32_t> index;
+    std::vector<uint32_t> pcs;
+  };
+
+  struct Scratch {
+    ThreadList lists[2];
+    std::vector<uint32_t> stack;
+  };
+
+  // Adds 'pc' and everything reachable from it without consuming input.
+  void addThread(ThreadList *list, uint32_t pc, size_t pos, size_t size,
+                 std::vector<uint32_t> *stack) const {
+    stack->push_back(pc);
+    while (!stack->empty()) {
+      pc = stack->back();
+      stack->pop_back();
+      if (list->contains(pc)) {
+        continue;
+      }
+      list->add(pc);
+      auto &instruction = program_.instructions[pc];
+      switch (instruction.op) {
+      case Instruction::Op::Jump:
+        stack->push_back(instruction.x);
+        break;
+      case Instruction::Op::Split:
+        stack->push_back(instruction.y);
+        stack->push_back(instruction.x);
+        break;
+      case Instruction::Op::BeginText:
+        if (pos == 0) {
+          stack->push_back(pc + 1);
+        }
+        break;
+      case Instruction::Op::EndText:
+        if (pos == size) {
+          stack->push_back(pc + 1);
+        }
+        break;
+      case Instruction::Op::Bytes:
+      case Instruction::Op::Match:
+        break;
+      }
+    }
+  }
+
+  const Program program_;
+};
+
+class PrefixSetMatcher : public Matcher {
+public:
+  explicit PrefixSetMatcher(std::string_view prefixes) : nodes_(1) {
+    while (true) {
+      auto end = prefixes.find('\n');
+      add(prefixes.substr(0, end));
+      if (end == std::string_view::npos) {
+        break;
+      }
+      prefixes.remove_prefix(end + 1);
+    }
+    for (auto &node : nodes_) {
+      std::sort(node.children.begin(), node.children.end());
+    }
+  }
+
+  bool matches(std::string_view input) const override {
+    uint32_t node = 0;
+    for (size_t pos = 0;; pos++) {
+      if (nodes_[node].terminal) {
+        return true;
+      }
+      if (pos == input.size()) {
+        return false;
+      }
+      auto &children = nodes_[node].children;
+      auto it = std::lower_bound(children.begin(), children.end(),
+                                 std::make_pair(static_cast<uint8_t>(input[pos]), uint32_t(0)));
+      if (it == children.end() || it->first != static_cast<uint8_t>(input[pos])) {
+        return false;
+      }
+      node = it->second;
+    }
+  }
+
+private:
+  struct TrieNode {
+    bool terminal = false;
+    std::vector<std::pair<uint8_t, uint32_t>> children;
+  };
+
+  void add(std::string_view prefix) {
+    if (prefix.empty()) {
+      return;
+    }
+    uint32_t node = 0;
+    for (auto c : prefix) {
+      auto &children = nodes_[node].children;
+      auto it = std::find_if(children.begin(), children.end(),
+                             [c](const auto &child) { return child.first == uint8_t(c); });
+      if (it != children.end()) {
+        node = it->second;
+        continue;
+      }
+      children.emplace_back(static_cast<uint8_t>(c), nodes_.size());
+      node = nodes_.size();
+      nodes_.emplace_back();
+    }
+    nodes_[node].terminal = true;
+  }
+
+  std::vector<TrieNode> nodes_;
+};
+
+struct CachedMatcher {
+  std::string vm_id;
+  std::unique_ptr<Matcher> matcher;
+};
+
+// Matchers by handle - 1, in chunks which are allocated on demand and, like the matchers in them,
+// never freed or moved, so that get() needs no lock: an entry is published with a release store
+// once the matcher is complete.
+constexpr size_t kChunkSize = 1024;
+constexpr size_t kMaxChunks = 1024;
+struct MatcherChunk {
+  std::atomic<const CachedMatcher *> entries[kChunkSize];
+};
+std::atomic<MatcherChunk *> matcher_chunks[kMaxChunks];
+
+// Handles by (vm_id, type, pattern), guarded by the lock, which is only taken to compile.
+std::mutex matchers_mutex;
+size_t matcher_count = 0;
+std::unordered_map<std::string, uint32_t> *matcher_handles = nullptr;
+std::unordered_map<std::string, size_t> *matchers_per_vm_id = nullptr;
+
+} // namespace
+
+std::unique_ptr<Matcher> Matcher::compile(Type type, std::string_view pattern,
+                                          std::string *error) {
+  if (type == Type::PrefixSet) {
+    return std::make_unique<PrefixSetMatcher>(pattern);
+  }
+  if (type != Type::Glob && type != Type::Regex) {
+    *error = "unknown matcher type";
+    return nullptr;
+  }
+  error->clear();
+  Parser parser(pattern, error);
+  auto node = type == Type::Glob ? parser.parseGlob() : parser.parseRegex();
+  if (!node) {
+    return nullptr;
+  }
+  Program program;
+  if (!Compiler(&program).compile(*node)) {
+    *error = "pattern too large";
+    return nullptr;
+  }
+  return std::make_unique<ProgramMatcher>(std::move(program));
+}
+
+WasmResult MatcherCache::compile(std::string_view vm_id, Matcher::Type type,
+                                 std::string_view pattern, uint32_t *handle) {
+  std::string key(vm_id);
+  key.push_back('\0');
+  key.append(std::to_string(static_cast<uint32_t>(type)));
+  key.push_back('\0');
+  key.append(pattern);
+  // Returns true if the result is known without compiling.
+  auto lookup = [&](WasmResult *result) {
+    if (!matcher_handles) {
+      matcher_handles = new std::remove_reference<decltype(*matcher_handles)>::type;
+      matchers_per_vm_id = new std::remove_reference<decltype(*matchers_per_vm_id)>::type;
+    }
+    auto it = matcher_handles->find(key);
+    if (it != matcher_handles->end()) {
+      *handle = it->second;
+      *result = WasmResult::Ok;
+      return true;
+    }
+    if ((*matchers_per_vm_id)[std::string(vm_id)] >= kMaxMatchersPerVmId ||
+        matcher_count >= kChunkSize * kMaxChunks) {
+      *result = WasmResult::InternalFailure;
+      return true;
+    }
+    return false;
+  };
+  WasmResult result;
+  {
+    std::lock_guard<std::mutex> guard(matchers_mutex);
+    if (lookup(&result)) {
+      return result;
+    }
+  }
+  // Compile without the lock, so other VMs are not held up by a large pattern.
+  std::string error;
+  auto matcher = Matcher::compile(type, pattern, &error);
+  if (!matcher) {
+    return WasmResult::BadExpression;
+  }
+  std::lock_guard<std::mutex> guard(matchers_mutex);
+  // Another thread may have compiled the same pattern meanwhile.
+  if (lookup(&result)) {
+    return result;
+  }
+  (*matchers_per_vm_id)[std::string(vm_id)]++;
+  auto index = matcher_count++;
+  auto &chunk = matcher_chunks[index / kChunkSize];
+  if (!chunk.load(std::memory_order_relaxed)) {
+    chunk.store(new MatcherChunk(), std::memory_order_release);
+  }
+  chunk.load(std::memory_order_relaxed)->entries[index % kChunkSize].store(
+      new CachedMatcher{std::string(vm_id), std::move(matcher)}, std::memory_order_release);
+  *handle = index + 1;
+  (*matcher_handles)[key] = *handle;
+  return WasmResult::Ok;
+}
+
+const Matcher *MatcherCache::get(std::string_view vm_id, uint32_t handle) {
+  if (handle == 0 || handle > kChunkSize * kMaxChunks) {
+    return nullptr;
+  }
+  auto index = handle - 1;
+  auto *chunk = matcher_chunks[index / kChunkSize].load(std::memory_order_acquire);
+  if (!chunk) {
+    return nullptr;
+  }
+  auto *cached = chunk->entries[index % kChunkSize].load(std::memory_order_acquire);
+  return cached && cached->vm_id == vm_id ? cached->matcher.get() : nullptr;
+}
+
+} // namespace proxy_wasm
@@ -0,0 +1,226 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/metric_registry.h"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+namespace proxy_wasm {
+
+namespace {
+
+// Ids are (index << kTypeBits) | type, as with WasmBase::kMetricIdIncrement.
+constexpr uint32_t kTypeBits = 2;
+constexpr uint32_t kTypeMask = (1 << kTypeBits) - 1;
+
+// Values are stored in blocks allocated on first use, which bounds the number of metrics.
+constexpr size_t kBlockSize = 1024;
+constexpr size_t kMaxBlocks = 1024;
+// Threads beyond kMaxShards share the last shard.
+constexpr size_t kMaxShards = 256;
+
+// Shards are never freed.
+class Shard {
+public:
+  // Returns nullptr if the value has never been written.
+  std::atomic<int64_t> *find(uint32_t index) const {
+    auto block = blocks_[index / kBlockSize].load(std::memory_order_acquire);
+    return block ? &block[index % kBlockSize] : nullptr;
+  }
+
+  std::atomic<int64_t> &at(uint32_t index) {
+    auto &slot = blocks_[index / kBlockSize];
+    auto block = slot.load(std::memory_order_acquire);
+    if (!block) {
+      auto fresh = new std::atomic<int64_t>[kBlockSize]();
+      if (slot.compare_exchange_strong(block, fresh, std::memory_order_acq_rel)) {
+        block = fresh;
+      } else {
+        delete[] fresh;
+      }
+    }
+    return block[index % kBlockSize];
+  }
+
+private:
+  std::atomic<std::atomic<int64_t> *> blocks_[kMaxBlocks] = {};
+};
+
+std::mutex definitions_mutex;
+std::unordered_map<std::string, uint32_t> *metric_ids = nullptr; // By vm_id + '\0' + name.
+std::vector<MetricRegistry::Metric> *definitions = nullptr;
+// Number of metrics defined, for lock-free id validation.
+std::atomic<uint32_t> metric_count{0};
+
+// Counter shards, of which only the first 'shard_count' are in use. A shard outlives its thread
+// and is handed to the next thread which starts, so its counts are never lost.
+std::atomic<Shard *> shards[kMaxShards] = {};
+std::atomic<size_t> shard_count{0};
+std::mutex free_shards_mutex;
+std::vector<Shard *> *free_shards = nullptr;
+
+Shard *gauges = new Shard;
+
+class ThreadShard {
+public:
+  ThreadShard() {
+    {
+      std::lock_guard<std::mutex> guard(free_shards_mutex);
+      if (free_shards && !free_shards->empty()) {
+        shard_ = free_shards->back();
+        free_shards->pop_back();
+        return;
+      }
+    }
+    auto n = shard_count.load(std::memory_order_relaxed);
+    while (n < kMaxShards) {
+      if (shard_count.compare_exchange_weak(n, n + 1, std::memory_order_relaxed)) {
+        shard_ = new Shard;
+        shards[n].store(shard_, std::memory_order_release);
+        return;
+      }
+    }
+    shared_ = true;
+    shard_ = sharedShard();
+  }
+  ~ThreadShard() {
+    if (shared_) {
+      return;
+    }
+    std::lock_guard<std::mutex> guard(free_shards_mutex);
+    if (!free_shards) {
+      free_shards = new std::vector<Shard *>;
+    }
+    free_shards->push_back(shard_);
+  }
+
+  Shard &shard() { return *shard_; }
+
+private:
+  static Shard *sharedShard() {
+    // The last shard: every slot is taken by now, but its store may not have landed yet.
+    Shard *shard;
+    while (!(shard = shards[kMaxShards - 1].load(std::memory_order_acquire))) {
+    }
+    return shard;
+  }
+
+  Shard *shard_ = nullptr;
+  bool shared_ = false;
+};
+
+// The index of 'metric_id' if it is defined with 'type'.
+bool metricIndex(uint32_t metric_id, MetricType type, uint32_t *index) {
+  *index = metric_id >> kTypeBits;
+  return (metric_id & kTypeMask) == static_cast<uint32_t>(type) && *index > 0 &&
+         *index <= metric_count.load(std::memory_order_acquire);
+}
+
+MetricType metricType(uint32_t metric_id) { return static_cast<MetricType>(metric_id & kTypeMask); }
+
+} // namespace
+
+WasmResult MetricRegistry::define(std::string_view vm_id, MetricType type, std::string_view name,
+                                  uint32_t *metric_id) {
+  if (type != MetricType::Counter && type != MetricType::Gauge && type != MetricType::Histogram) {
+    return WasmResult::BadArgument;
+  }
+  std::string key(vm_id);
+  key.push_back('\0');
+  key.append(name);
+  std::lock_guard<std::mutex> guard(definitions_mutex);
+  if (!metric_ids) {
+    metric_ids = new std::remove_reference<decltype(*metric_ids)>::type;
+    definitions = new std::remove_reference<decltype(*definitions)>::type;
+  }
+  auto it = metric_ids->find(key);
+  if (it != metric_ids->end()) {
+    if (metricType(it->second) != type) {
+      return WasmResult::BadArgument;
+    }
+    *metric_id = it->second;
+    return WasmResult::Ok;
+  }
+  uint32_t index = definitions->size() + 1;
+  if (index >= kBlockSize * kMaxBlocks) {
+    return WasmResult::InternalFailure;
+  }
+  *metric_id = (index << kTypeBits) | static_cast<uint32_t>(type);
+  (*metric_ids)[key] = *metric_id;
+  definitions->push_back(Metric{std::string(vm_id), std::string(name), type, *metric_id});
+  metric_count.store(index, std::memory_order_release);
+  return WasmResult::Ok;
+}
+
+WasmResult MetricRegistry::increment(uint32_t metric_id, int64_t offset) {
+  uint32_t index;
+  if (metricIndex(metric_id, MetricType::Counter, &index)) {
+    static thread_local ThreadShard thread_shard;
+    thread_shard.shard().at(index).fetch_add(offset, std::memory_order_relaxed);
+    return WasmResult::Ok;
+  }
+  if (metricIndex(metric_id, MetricType::Gauge, &index)) {
+    gauges->at(index).fetch_add(offset, std::memory_order_relaxed);
+    return WasmResult::Ok;
+  }
+  return metricIndex(metric_id, MetricType::Histogram, &index) ? WasmResult::BadArgument
+                                                               : WasmResult::NotFound;
+}
+
+WasmResult MetricRegistry::record(uint32_t metric_id, uint64_t value) {
+  uint32_t index;
+  if (metricIndex(metric_id, MetricType::Gauge, &index)) {
+    gauges->at(index).store(value, std::memory_order_relaxed);
+    return WasmResult::Ok;
+  }
+  if (metricIndex(metric_id, MetricType::Histogram, &index)) {
+    // Recording a sample is valid, the registry just does not keep it.
+    return WasmResult::Ok;
+  }
+  return metricIndex(metric_id, MetricType::Counter, &index) ? WasmResult::BadArgument
+                                                             : WasmResult::NotFound;
+}
+
+WasmResult MetricRegistry::get(uint32_t metric_id, uint64_t *value) {
+  uint32_t index;
+  if (metricIndex(metric_id, MetricType::Counter, &index)) {
+    int64_t sum = 0;
+    auto n = shard_count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; i++) {
+      auto shard = shards[i].load(std::memory_order_acquire);
+      auto counter = shard ? shard->find(index) : nullptr;
+      if (counter) {
+        sum += counter->load(std::memory_order_relaxed);
+      }
+    }
+    *value = sum;
+    return WasmResult::Ok;
+  }
+  if (metricIndex(metric_id, MetricType::Gauge, &index)) {
+    auto gauge = gauges->find(index);
+    *value = gauge ? gauge->load(std::memory_order_relaxed) : 0;
+    return WasmResult::Ok;
+  }
+  return metricIndex(metric_id, MetricType::Histogram, &index) ? WasmResult::BadArgument
+                                                               : WasmResult::NotFound;
+}
+
+std::vector<MetricRegistry::Metric> MetricRegistry::metrics() {
+  std::lock_guard<std::mutex> guard(definitions_mutex);
+  return definitions ? *definitions : std::vector<Metric>();
+}
+
+} // namespace proxy_wasm
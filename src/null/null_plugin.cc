@@ -37,6 +37,8 @@ void NullPlugin::getFunction(std::string_view function_name, WasmCallVoid<0> *f)
     *f = nullptr;
   } else if (function_name == "__wasm_call_ctors") {
     *f = nullptr;
+  } else if (function_name == "proxy_on_memory_reclaim") {
+    *f = nullptr;
   } else if (!wasm_vm_->integration()->getNullVmFunction(function_name, false, 0, this, f)) {
     error("Missing getFunction for: " + std::string(function_name));
     *f = nullptr;
@@ -88,6 +90,15 @@ void NullPlugin::getFunction(std::string_view function_name, WasmCallVoid<2> *f)
       SaveRestoreContext saved_context(context);
       plugin->onQueueReady(context_id, token);
     };
+  } else if (function_name == "proxy_on_log_batch") {
+    // Optional: streams are logged one at a time unless the plugin registers a batch handler.
+    *f = nullptr;
+    if (registry_->proxy_on_log_batch_) {
+      *f = [plugin](ContextBase *context, Word context_ids_ptr, Word count) {
+        SaveRestoreContext saved_context(context);
+        plugin->onLogBatch(context_ids_ptr, count);
+      };
+    }
   } else if (!wasm_vm_->integration()->getNullVmFunction(function_name, false, 2, this, f)) {
     error("Missing getFunction for: " + std::string(function_name));
     *f = nullptr;
@@ -248,6 +259,17 @@ void NullPlugin::getFunction(std::string_view function_name, WasmCallWord<3> *f)
   }
 }
 
+void NullPlugin::getFunction(std::string_view function_name, WasmCallWord<5> *f) {
+  if (function_name == "proxy_on_request_headers_with_pairs" ||
+      function_name == "proxy_on_response_headers_with_pairs") {
+    // Null plugins read headers from the host without copying, so have no use for these.
+    *f = nullptr;
+  } else if (!wasm_vm_->integration()->getNullVmFunction(function_name, true, 5, this, f)) {
+    error("Missing getFunction for: " + std::string(function_name));
+    *f = nullptr;
+  }
+}
+
 null_plugin::Context *NullPlugin::ensureContext(uint64_t context_id, uint64_t root_context_id) {
   auto e = context_map_.insert(std::make_pair(context_id, nullptr));
   if (e.second) {
@@ -475,6 +497,11 @@ void NullPlugin::onLog(uint64_t context_id) {
   getContextBase(context_id)->onLog();
 }
 
+void NullPlugin::onLogBatch(uint64_t context_ids_ptr, uint64_t count) {
+  registry_->proxy_on_log_batch_(reinterpret_cast<const uint32_t *>(context_ids_ptr),
+                                 static_cast<uint32_t>(count));
+}
+
 uint64_t NullPlugin::onDone(uint64_t context_id) {
   if (registry_->proxy_on_done_) {
     return registry_->proxy_on_done_(context_id);
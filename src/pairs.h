@@ -0,0 +1,56 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace proxy_wasm {
+
+// The format of header maps in VM memory, as returned by proxy_get_header_map_pairs: the number of
+// pairs, the sizes of each key and value, then the keys and values, each null terminated.
+
+template <typename Pairs> size_t pairsSize(const Pairs &result) {
+  size_t size = 4; // number of headers
+  for (auto &p : result) {
+    size += 8;                   // size of key, size of value
+    size += p.first.size() + 1;  // null terminated key
+    size += p.second.size() + 1; // null terminated value
+  }
+  return size;
+}
+
+template <typename Pairs> void marshalPairs(const Pairs &result, char *buffer) {
+  char *b = buffer;
+  *reinterpret_cast<uint32_t *>(b) = result.size();
+  b += sizeof(uint32_t);
+  for (auto &p : result) {
+    *reinterpret_cast<uint32_t *>(b) = p.first.size();
+    b += sizeof(uint32_t);
+    *reinterpret_cast<uint32_t *>(b) = p.second.size();
+    b += sizeof(uint32_t);
+  }
+  for (auto &p : result) {
+    memcpy(b, p.first.data(), p.first.size());
+    b += p.first.size();
+    *b++ = 0;
+    memcpy(b, p.second.data(), p.second.size());
+    b += p.second.size();
+    *b++ = 0;
+  }
+}
+
+} // namespace proxy_wasm
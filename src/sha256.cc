@@ -0,0 +1,236 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/sha256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PROXY_WASM_SHA_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace proxy_wasm {
+
+namespace {
+
+alignas(16) const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void blocksPortable(uint32_t state[8], const uint8_t *data, size_t blocks) {
+  uint32_t w[64];
+  for (; blocks > 0; blocks--, data += 64) {
+    for (int t = 0; t < 16; t++) {
+      w[t] = uint32_t(data[4 * t]) << 24 | uint32_t(data[4 * t + 1]) << 16 |
+             uint32_t(data[4 * t + 2]) << 8 | uint32_t(data[4 * t + 3]);
+    }
+    for (int t = 16; t < 64; t++) {
+      auto s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+      auto s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+      w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int t = 0; t < 64; t++) {
+      auto t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                kRoundConstants[t] + w[t];
+      auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#ifdef PROXY_WASM_SHA_NI
+
+bool cpuHasShaExtensions() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+    return false;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (ebx & (1 << 29)) != 0; // SHA
+}
+
+// The state is kept as the ABEF and CDGH halves used by sha256rnds2. Each group of four rounds
+// extends the message schedule with sha256msg1/sha256msg2.
+__attribute__((target("sha,sse4.1"))) void blocksShaNi(uint32_t state[8], const uint8_t *data,
+                                                       size_t blocks) {
+  const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i *>(&state[0])), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i *>(&state[4])), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (; blocks > 0; blocks--, data += 64) {
+    const __m128i abef = state0;
+    const __m128i cdgh = state1;
+    __m128i w[4];
+    for (int i = 0; i < 16; i++) {
+      if (i < 4) {
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i)),
+                                byte_swap);
+      } else {
+        auto next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+        next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+        w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+      }
+      auto k = _mm_load_si128(reinterpret_cast<const __m128i *>(&kRoundConstants[4 * i]));
+      auto message = _mm_add_epi32(w[i & 3], k);
+      state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0E));
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+
+#endif
+
+Sha256::BlocksFunction selectBlocksFunction() {
+#ifdef PROXY_WASM_SHA_NI
+  if (cpuHasShaExtensions()) {
+    return blocksShaNi;
+  }
+#endif
+  return blocksPortable;
+}
+
+std::atomic<bool> force_portable{false};
+
+Sha256::BlocksFunction blocksFunction() {
+  static const Sha256::BlocksFunction blocks = selectBlocksFunction();
+  return force_portable.load(std::memory_order_relaxed) ? blocksPortable : blocks;
+}
+
+} // namespace
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab,
+             0x5be0cd19},
+      blocks_(blocksFunction()) {}
+
+void Sha256::update(std::string_view data) {
+  auto p = reinterpret_cast<const uint8_t *>(data.data());
+  auto size = data.size();
+  length_ += size;
+  if (buffered_ > 0) {
+    auto n = std::min(size, kBlockSize - buffered_);
+    memcpy(buffer_ + buffered_, p, n);
+    buffered_ += n;
+    p += n;
+    size -= n;
+    if (buffered_ < kBlockSize) {
+      return;
+    }
+    blocks_(state_, buffer_, 1);
+    buffered_ = 0;
+  }
+  if (size >= kBlockSize) {
+    blocks_(state_, p, size / kBlockSize);
+    p += size / kBlockSize * kBlockSize;
+    size %= kBlockSize;
+  }
+  memcpy(buffer_, p, size);
+  buffered_ = size;
+}
+
+std::string Sha256::finish() {
+  uint64_t bits = length_ * 8;
+  uint8_t padding[kBlockSize * 2] = {0x80};
+  auto padding_size = (buffered_ < 56 ? 56 : 120) - buffered_;
+  for (int i = 0; i < 8; i++) {
+    padding[padding_size + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+  }
+  update(std::string_view(reinterpret_cast<char *>(padding), padding_size + 8));
+  std::string digest(kDigestSize, '\0');
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 4; j++) {
+      digest[4 * i + j] = static_cast<char>(state_[i] >> (24 - 8 * j));
+    }
+  }
+  return digest;
+}
+
+std::string Sha256::digest(std::string_view data) {
+  Sha256 sha;
+  sha.update(data);
+  return sha.finish();
+}
+
+bool Sha256::accelerated() { return blocksFunction() != blocksPortable; }
+
+bool Sha256::forcePortable(bool force) { return force_portable.exchange(force); }
+
+std::string hmacSha256(std::string_view key, std::string_view message) {
+  uint8_t block[Sha256::kBlockSize] = {};
+  if (key.size() > Sha256::kBlockSize) {
+    auto hashed = Sha256::digest(key);
+    memcpy(block, hashed.data(), hashed.size());
+  } else {
+    memcpy(block, key.data(), key.size());
+  }
+  uint8_t pad[Sha256::kBlockSize];
+  auto padded = [&](uint8_t value) {
+    for (size_t i = 0; i < Sha256::kBlockSize; i++) {
+      pad[i] = block[i] ^ value;
+    }
+    return std::string_view(reinterpret_cast<char *>(pad), sizeof(pad));
+  };
+  Sha256 inner;
+  inner.update(padded(0x36));
+  inner.update(message);
+  auto inner_digest = inner.finish();
+  Sha256 outer;
+  outer.update(padded(0x5c));
+  outer.update(inner_digest);
+  return outer.finish();
+}
+
+} // namespace proxy_wasm
@@ -0,0 +1,56 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace proxy_wasm {
+
+// SHA-256 (FIPS 180-4). Uses the x86 SHA extensions when the CPU has them.
+class Sha256 {
+public:
+  static constexpr size_t kDigestSize = 32;
+  static constexpr size_t kBlockSize = 64;
+
+  Sha256();
+  void update(std::string_view data);
+  // Returns the raw digest. The object must not be used afterwards.
+  std::string finish();
+
+  static std::string digest(std::string_view data);
+  // True if the hardware implementation is in use.
+  static bool accelerated();
+  // Use the portable implementation for objects created from now on even if the hardware one is
+  // available, e.g. to compare the two. Returns the previous setting.
+  static bool forcePortable(bool force);
+
+  using BlocksFunction = void (*)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+private:
+  uint32_t state_[8];
+  uint8_t buffer_[kBlockSize];
+  size_t buffered_ = 0;
+  uint64_t length_ = 0;
+  // Chosen when the object is created, so that a hash never mixes implementations.
+  const BlocksFunction blocks_;
+};
+
+// HMAC-SHA256 (RFC 2104) of 'message' with 'key', as a raw digest.
+std::string hmacSha256(std::string_view key, std::string_view message);
+
+} // namespace proxy_wasm
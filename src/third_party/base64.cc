@@ -16,93 +16,88 @@
 // https://en.wikibooks.org/wiki/Algorithm_Implementation/Miscellaneous/Base64
 #include "base64.h"
 
-const static char encodeLookup[] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-const static char padCharacter = '=';
+#include <algorithm>
+#include <cstring>
+
+const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const char base64UrlAlphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
 std::string base64Encode(const uint8_t *start, const uint8_t *end) {
-  std::string encodedString;
-  size_t size = end - start;
-  encodedString.reserve(((size / 3) + (size % 3 > 0)) * 4);
-  uint32_t temp;
-  auto cursor = start;
-  for (size_t idx = 0; idx < size / 3; idx++) {
-    temp = (*cursor++) << 16; // Convert to big endian
-    temp += (*cursor++) << 8;
-    temp += (*cursor++);
-    encodedString.append(1, encodeLookup[(temp & 0x00FC0000) >> 18]);
-    encodedString.append(1, encodeLookup[(temp & 0x0003F000) >> 12]);
-    encodedString.append(1, encodeLookup[(temp & 0x00000FC0) >> 6]);
-    encodedString.append(1, encodeLookup[(temp & 0x0000003F)]);
+  return base64Encode(std::string_view(reinterpret_cast<const char *>(start), end - start),
+                      base64Alphabet, true);
+}
+
+bool base64Decode(const std::string &input, std::vector<uint8_t> *output) {
+  std::string decoded;
+  if (!base64Decode(input, base64Alphabet, true, &decoded)) {
+    return false;
   }
-  switch (size % 3) {
-  case 1:
-    temp = (*cursor++) << 16; // Convert to big endian
-    encodedString.append(1, encodeLookup[(temp & 0x00FC0000) >> 18]);
-    encodedString.append(1, encodeLookup[(temp & 0x0003F000) >> 12]);
-    encodedString.append(2, padCharacter);
-    break;
-  case 2:
-    temp = (*cursor++) << 16; // Convert to big endian
-    temp += (*cursor++) << 8;
-    encodedString.append(1, encodeLookup[(temp & 0x00FC0000) >> 18]);
-    encodedString.append(1, encodeLookup[(temp & 0x0003F000) >> 12]);
-    encodedString.append(1, encodeLookup[(temp & 0x00000FC0) >> 6]);
-    encodedString.append(1, padCharacter);
-    break;
+  output->assign(decoded.begin(), decoded.end());
+  return true;
+}
+
+std::string base64Encode(std::string_view input, const char *alphabet, bool pad) {
+  std::string output((input.size() + 2) / 3 * 4, '=');
+  auto in = reinterpret_cast<const uint8_t *>(input.data());
+  auto out = &output[0];
+  size_t i = 0;
+  for (; i + 3 <= input.size(); i += 3, out += 4) {
+    uint32_t v = in[i] << 16 | in[i + 1] << 8 | in[i + 2]; // Convert to big endian
+    out[0] = alphabet[v >> 18];
+    out[1] = alphabet[(v >> 12) & 63];
+    out[2] = alphabet[(v >> 6) & 63];
+    out[3] = alphabet[v & 63];
+  }
+  auto remaining = input.size() - i;
+  if (remaining > 0) {
+    uint32_t v = in[i] << 16 | (remaining == 2 ? in[i + 1] << 8 : 0);
+    *out++ = alphabet[v >> 18];
+    *out++ = alphabet[(v >> 12) & 63];
+    if (remaining == 2) {
+      *out++ = alphabet[(v >> 6) & 63];
+    }
   }
-  return encodedString;
+  if (!pad) {
+    output.resize(out - &output[0]);
+  }
+  return output;
 }
 
-bool base64Decode(const std::basic_string<char> &input, std::vector<uint8_t> *output) {
-  if (input.length() % 4)
-    return false;
+bool base64Decode(std::string_view input, const char *alphabet, bool require_padding,
+                  std::string *output) {
+  int8_t table[256];
+  memset(table, -1, sizeof(table));
+  for (int i = 0; alphabet[i]; i++) {
+    table[static_cast<uint8_t>(alphabet[i])] = i;
+  }
+  auto size = input.size();
   size_t padding = 0;
-  if (input.length()) {
-    if (input[input.length() - 1] == padCharacter)
-      padding++;
-    if (input[input.length() - 2] == padCharacter)
-      padding++;
+  while (padding < 2 && size > 0 && input[size - 1] == '=') {
+    size--;
+    padding++;
+  }
+  if ((padding > 0 || require_padding) && input.size() % 4 != 0) {
+    return false;
+  }
+  if (size % 4 == 1) {
+    return false;
   }
-  // Setup a vector to hold the result
-  std::vector<unsigned char> decodedBytes;
-  decodedBytes.reserve(((input.length() / 4) * 3) - padding);
-  uint32_t temp = 0; // Holds decoded quanta
-  std::basic_string<char>::const_iterator cursor = input.begin();
-  while (cursor < input.end()) {
-    for (size_t quantumPosition = 0; quantumPosition < 4; quantumPosition++) {
-      temp <<= 6;
-      if (*cursor >= 0x41 && *cursor <= 0x5A) // This area will need tweaking if
-        temp |= *cursor - 0x41;               // you are using an alternate alphabet
-      else if (*cursor >= 0x61 && *cursor <= 0x7A)
-        temp |= *cursor - 0x47;
-      else if (*cursor >= 0x30 && *cursor <= 0x39)
-        temp |= *cursor + 0x04;
-      else if (*cursor == 0x2B)
-        temp |= 0x3E; // change to 0x2D for URL alphabet
-      else if (*cursor == 0x2F)
-        temp |= 0x3F;                     // change to 0x5F for URL alphabet
-      else if (*cursor == padCharacter) { // pad
-        switch (input.end() - cursor) {
-        case 1: // One pad character
-          decodedBytes.push_back((temp >> 16) & 0x000000FF);
-          decodedBytes.push_back((temp >> 8) & 0x000000FF);
-          goto Ldone;
-        case 2: // Two pad characters
-          decodedBytes.push_back((temp >> 10) & 0x000000FF);
-          goto Ldone;
-        default:
-          return false;
-        }
-      } else
-        return false;
-      cursor++;
+  output->resize(size / 4 * 3 + (size % 4 ? size % 4 - 1 : 0));
+  auto out = &(*output)[0];
+  auto value = [&](size_t i) -> int32_t {
+    return i < size ? table[static_cast<uint8_t>(input[i])] : 0;
+  };
+  for (size_t i = 0; i < size; i += 4) {
+    int32_t a = value(i), b = value(i + 1), c = value(i + 2), d = value(i + 3);
+    if ((a | b | c | d) < 0) {
+      return false;
+    }
+    uint32_t v = a << 18 | b << 12 | c << 6 | d;
+    auto n = std::min<size_t>(3, size - i - 1);
+    for (size_t j = 0; j < n; j++) {
+      *out++ = static_cast<char>(v >> (16 - 8 * j));
     }
-    decodedBytes.push_back((temp >> 16) & 0x000000FF);
-    decodedBytes.push_back((temp >> 8) & 0x000000FF);
-    decodedBytes.push_back((temp)&0x000000FF);
   }
-Ldone:
-  *output = std::move(decodedBytes);
   return true;
 }
@@ -19,7 +19,18 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// The standard alphabet and the URL and filename safe one (RFC 4648).
+extern const char base64Alphabet[];
+extern const char base64UrlAlphabet[];
+
 std::string base64Encode(const uint8_t *start, const uint8_t *end);
 bool base64Decode(const std::string &input, std::vector<uint8_t> *output);
+
+// Encode with 'alphabet', padding the output with '=' to a multiple of 4 characters if 'pad'.
+std::string base64Encode(std::string_view input, const char *alphabet, bool pad);
+// Decode with 'alphabet'. Padding is accepted, and required if 'require_padding'.
+bool base64Decode(std::string_view input, const char *alphabet, bool require_padding,
+                  std::string *output);
@@ -0,0 +1,93 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/thread_pool.h"
+
+#include <algorithm>
+
+namespace proxy_wasm {
+
+namespace {
+
+// The pool, if any. Submission holds the lock while queueing, so the pool can not be destroyed
+// underneath a worker thread.
+std::mutex pool_mutex;
+ForeignFunctionThreadPool *pool = nullptr;
+
+} // namespace
+
+ForeignFunctionThreadPool::ForeignFunctionThreadPool(size_t threads, size_t max_pending)
+    : max_pending_(max_pending) {
+  threads = std::max<size_t>(threads, 1);
+  for (size_t i = 0; i < threads; i++) {
+    threads_.emplace_back([this] { run(); });
+  }
+  std::lock_guard<std::mutex> guard(pool_mutex);
+  pool = this;
+}
+
+ForeignFunctionThreadPool::~ForeignFunctionThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(pool_mutex);
+    if (pool == this) {
+      pool = nullptr;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+bool ForeignFunctionThreadPool::submit(std::function<void()> work) {
+  std::lock_guard<std::mutex> guard(pool_mutex);
+  if (!pool) {
+    return false;
+  }
+  return pool->enqueue(std::move(work));
+}
+
+bool ForeignFunctionThreadPool::enqueue(std::function<void()> work) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || pending_.size() >= max_pending_) {
+      return false;
+    }
+    pending_.push_back(std::move(work));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void ForeignFunctionThreadPool::run() {
+  while (true) {
+    std::function<void()> work;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        break;
+      }
+      work = std::move(pending_.front());
+      pending_.pop_front();
+    }
+    work();
+  }
+}
+
+} // namespace proxy_wasm
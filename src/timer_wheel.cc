@@ -0,0 +1,177 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/timer_wheel.h"
+
+#include <algorithm>
+
+namespace proxy_wasm {
+
+// Level L holds the timers which expire in a later level L-1 block (64^L ticks) of the current
+// level L block than the current tick. A timer moves down a level ("cascades") when the wheel
+// reaches its block, so every timer is touched at most once per level.
+
+TimerWheel::TimerWheel(std::chrono::nanoseconds resolution, TimePoint now)
+    : resolution_(std::max(resolution, std::chrono::nanoseconds(1))), start_(now) {}
+
+uint64_t TimerWheel::ticks(std::chrono::nanoseconds duration) const {
+  if (duration.count() <= 0) {
+    return 1;
+  }
+  return std::max<uint64_t>(1, (duration.count() + resolution_.count() - 1) / resolution_.count());
+}
+
+TimerWheel::TimerId TimerWheel::schedule(std::chrono::nanoseconds delay, Callback callback,
+                                         std::chrono::nanoseconds period) {
+  auto id = next_id_++;
+  uint64_t expiry = now_ + ticks(delay);
+  timers_[id] = Timer{expiry, period.count() > 0 ? ticks(period) : 0, std::move(callback)};
+  insert(id, expiry);
+  return id;
+}
+
+bool TimerWheel::cancel(TimerId id) { return timers_.erase(id) != 0; }
+
+void TimerWheel::insert(TimerId id, uint64_t expiry) {
+  for (int level = 0; level < kLevels; level++) {
+    int shift = kSlotBits * (level + 1);
+    if ((expiry >> shift) == (now_ >> shift)) {
+      slots_[level][(expiry >> (shift - kSlotBits)) & kSlotMask].emplace_back(id, expiry);
+      level_entries_[level]++;
+      return;
+    }
+  }
+  overflow_.emplace_back(id, expiry);
+}
+
+bool TimerWheel::live(const std::pair<TimerId, uint64_t> &entry) const {
+  auto it = timers_.find(entry.first);
+  return it != timers_.end() && it->second.expiry == entry.second;
+}
+
+void TimerWheel::cascade(int level) {
+  Slot entries;
+  if (level == kLevels) {
+    entries.swap(overflow_);
+  } else {
+    entries.swap(slots_[level][(now_ >> (kSlotBits * level)) & kSlotMask]);
+    level_entries_[level] -= entries.size();
+  }
+  for (auto &entry : entries) {
+    if (live(entry)) {
+      insert(entry.first, entry.second);
+    }
+  }
+}
+
+size_t TimerWheel::runSlot(uint64_t target) {
+  Slot entries;
+  entries.swap(slots_[0][now_ & kSlotMask]);
+  level_entries_[0] -= entries.size();
+  size_t run = 0;
+  for (auto &entry : entries) {
+    if (!live(entry)) {
+      continue;
+    }
+    auto it = timers_.find(entry.first);
+    auto &timer = it->second;
+    Callback callback;
+    if (timer.period) {
+      // Skip periods missed while the event loop was not advancing the wheel rather than running
+      // them back to back.
+      timer.expiry += ((target - timer.expiry) / timer.period + 1) * timer.period;
+      insert(entry.first, timer.expiry);
+      callback = timer.callback;
+    } else {
+      callback = std::move(timer.callback);
+      timers_.erase(it);
+    }
+    callback();
+    run++;
+  }
+  return run;
+}
+
+size_t TimerWheel::advance(TimePoint now) {
+  if (now <= start_) {
+    return 0;
+  }
+  uint64_t target = (now - start_) / resolution_;
+  size_t run = 0;
+  while (now_ < target) {
+    // Jump over ticks on which nothing can happen: up to the next block boundary of the lowest
+    // level which has entries.
+    int lowest = 0;
+    while (lowest < kLevels && level_entries_[lowest] == 0) {
+      lowest++;
+    }
+    if (lowest == kLevels && overflow_.empty()) {
+      now_ = target;
+      break;
+    }
+    if (lowest > 0) {
+      uint64_t next = ((now_ >> (kSlotBits * lowest)) + 1) << (kSlotBits * lowest);
+      if (next > target) {
+        now_ = target;
+        break;
+      }
+      now_ = next - 1;
+    }
+    now_++;
+    // Cascade from the highest level whose block starts at this tick down to level 1.
+    int level = 0;
+    while (level < kLevels && ((now_ >> (kSlotBits * (level + 1))) << (kSlotBits * (level + 1))) ==
+                                  now_) {
+      level++;
+    }
+    for (; level > 0; level--) {
+      cascade(level);
+    }
+    run += runSlot(target);
+  }
+  return run;
+}
+
+std::optional<TimerWheel::TimePoint> TimerWheel::nextExpiry() const {
+  auto earliest = [this](const Slot &slot, uint64_t *expiry) {
+    bool found = false;
+    for (auto &entry : slot) {
+      if (live(entry) && (!found || entry.second < *expiry)) {
+        *expiry = entry.second;
+        found = true;
+      }
+    }
+    return found;
+  };
+  uint64_t expiry = 0;
+  // Every timer in a level expires before those in the levels above it, and within a level the
+  // slots after the current one are in order.
+  for (int level = 0; level < kLevels; level++) {
+    if (level_entries_[level] == 0) {
+      continue;
+    }
+    uint64_t current = (now_ >> (kSlotBits * level)) & kSlotMask;
+    for (uint64_t slot = current + 1; slot < kSlots; slot++) {
+      if (earliest(slots_[level][slot], &expiry)) {
+        return start_ + resolution_ * expiry;
+      }
+    }
+  }
+  if (earliest(overflow_, &expiry)) {
+    return start_ + resolution_ * expiry;
+  }
+  return std::nullopt;
+}
+
+} // namespace proxy_wasm
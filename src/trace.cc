@@ -0,0 +1,157 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/trace.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <fstream>
+
+namespace proxy_wasm {
+
+namespace {
+
+std::mutex trace_sink_mutex;
+std::shared_ptr<TraceSink> *trace_sink = nullptr;
+// Avoids taking trace_sink_mutex when tracing is disabled.
+std::atomic<bool> tracing_enabled{false};
+
+std::atomic<uint32_t> next_thread_id{1};
+thread_local uint32_t thread_id = 0;
+
+uint32_t currentThreadId() {
+  if (!thread_id) {
+    thread_id = next_thread_id++;
+  }
+  return thread_id;
+}
+
+void writeJsonString(std::ostream &os, std::string_view s) {
+  os << '"';
+  for (char c : s) {
+    switch (c) {
+    case '"':
+      os << "\\\"";
+      break;
+    case '\\':
+      os << "\\\\";
+      break;
+    case '\n':
+      os << "\\n";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        os << buf;
+      } else {
+        os << c;
+      }
+    }
+  }
+  os << '"';
+}
+
+} // namespace
+
+std::shared_ptr<TraceSink> setTraceSink(std::shared_ptr<TraceSink> sink) {
+  std::lock_guard<std::mutex> guard(trace_sink_mutex);
+  if (!trace_sink) {
+    trace_sink = new std::shared_ptr<TraceSink>;
+  }
+  auto previous = std::move(*trace_sink);
+  tracing_enabled = sink != nullptr;
+  *trace_sink = std::move(sink);
+  return previous;
+}
+
+std::shared_ptr<TraceSink> getTraceSink() {
+  if (!tracing_enabled) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> guard(trace_sink_mutex);
+  return trace_sink ? *trace_sink : nullptr;
+}
+
+void ChromeTraceSink::recordSpan(const TraceSpan &span) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  spans_.push_back(span);
+}
+
+std::vector<TraceSpan> ChromeTraceSink::spans() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return spans_;
+}
+
+void ChromeTraceSink::clear() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  spans_.clear();
+}
+
+// See https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU for the
+// format. Complete ("X") events carry both the start and the duration in microseconds.
+void ChromeTraceSink::write(std::ostream &os) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  os << "{\"traceEvents\":[";
+  bool first = true;
+  for (auto &span : spans_) {
+    if (!first) {
+      os << ",";
+    }
+    first = false;
+    auto ts = std::chrono::duration_cast<std::chrono::microseconds>(span.start.time_since_epoch());
+    auto dur = std::chrono::duration<double, std::micro>(span.duration);
+    os << "\n{\"name\":";
+    writeJsonString(os, span.name);
+    os << ",\"cat\":\"proxy_wasm\",\"ph\":\"X\",\"pid\":1,\"tid\":" << span.thread_id
+       << ",\"ts\":" << ts.count() << ",\"dur\":" << dur.count() << ",\"args\":{\"vm_key\":";
+    writeJsonString(os, span.vm_key);
+    os << ",\"runtime\":";
+    writeJsonString(os, span.runtime);
+    os << "}}";
+  }
+  os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+bool ChromeTraceSink::writeToFile(const std::string &path) const {
+  std::ofstream file(path, std::ios::out | std::ios::trunc);
+  if (!file) {
+    return false;
+  }
+  write(file);
+  return file.good();
+}
+
+TraceScope::TraceScope(std::string_view name, std::string_view vm_key, std::string_view runtime)
+    : sink_(getTraceSink()) {
+  if (!sink_) {
+    return;
+  }
+  span_.name = std::string(name);
+  span_.vm_key = std::string(vm_key);
+  span_.runtime = std::string(runtime);
+  span_.thread_id = currentThreadId();
+  span_.start = std::chrono::steady_clock::now();
+}
+
+TraceScope::~TraceScope() {
+  if (!sink_) {
+    return;
+  }
+  span_.duration = std::chrono::steady_clock::now() - span_.start;
+  sink_->recordSpan(span_);
+}
+
+} // namespace proxy_wasm
@@ -22,6 +22,7 @@
 #include <utility>
 #include <vector>
 
+#include "include/proxy-wasm/fuel.h"
 #include "v8-version.h"
 #include "wasm-api/wasm.hh"
 
@@ -67,6 +68,12 @@ public:
   bool setMemory(uint64_t pointer, uint64_t size, const void *data) override;
   bool getWord(uint64_t pointer, Word *word) override;
   bool setWord(uint64_t pointer, Word word) override;
+  // The wasm-c-api exposes neither the isolate nor a way to interrupt a call, and does not enter
+  // the isolate, so there is no public way to reach Isolate::TerminateExecution().
+  bool supportsExecutionTimeout() override { return false; }
+  bool setFuel(int64_t fuel) override;
+  bool getFuel(int64_t *fuel) override;
+  bool getImportedFunctionNames(std::vector<std::string> *names) override;
 
 #define _REGISTER_HOST_FUNCTION(T)                                                                 \
   void registerCallback(std::string_view module_name, std::string_view function_name, T,           \
@@ -84,7 +91,11 @@ public:
 #undef _GET_MODULE_FUNCTION
 
 private:
-  wasm::vec<byte_t> getStrippedSource();
+  using CustomSections = absl::flat_hash_map<std::string, std::string>;
+  using Section = std::pair<std::string_view, std::string_view>;
+
+  bool parseSections(std::string_view source, std::vector<byte_t> *stripped,
+                     std::vector<Section> *custom_sections);
 
   template <typename... Args>
   void registerHostFunctionImpl(std::string_view module_name, std::string_view function_name,
@@ -102,13 +113,15 @@ private:
   void getModuleFunctionImpl(std::string_view function_name,
                              std::function<R(ContextBase *, Args...)> *function);
 
-  wasm::vec<byte_t> source_ = wasm::vec<byte_t>::invalid();
+  // Custom sections kept after the source is released, shared with clones.
+  std::shared_ptr<const CustomSections> custom_sections_;
   wasm::own<wasm::Store> store_;
   wasm::own<wasm::Module> module_;
   wasm::own<wasm::Shared<wasm::Module>> shared_module_;
   wasm::own<wasm::Instance> instance_;
   wasm::own<wasm::Memory> memory_;
   wasm::own<wasm::Table> table_;
+  wasm::own<wasm::Global> fuel_global_;
 
   absl::flat_hash_map<std::string, FuncDataPtr> host_functions_;
   absl::flat_hash_map<std::string, wasm::own<wasm::Func>> module_functions_;
@@ -232,30 +245,53 @@ bool V8::load(const std::string &code, bool allow_precompiled) {
     return false;
   }
 
-  source_ = wasm::vec<byte_t>::make_uninitialized(code.size());
-  ::memcpy(source_.get(), code.data(), code.size());
-
-  if (allow_precompiled) {
-    const auto section_name = getPrecompiledSectionName();
-    if (!section_name.empty()) {
-      const auto precompiled = getCustomSection(section_name);
-      if (!precompiled.empty()) {
-        auto vec = wasm::vec<byte_t>::make_uninitialized(precompiled.size());
-        ::memcpy(vec.get(), precompiled.data(), precompiled.size());
-
-        module_ = wasm::Module::deserialize(store_.get(), vec);
-        if (!module_) {
-          // Precompiled module that cannot be loaded is considered a hard error,
-          // so don't fallback to compiling the bytecode.
-          return false;
-        }
+  std::string instrumented;
+  if (fuel_metering_) {
+    if (!instrumentForFuel(code, &instrumented)) {
+      fail(FailState::UnableToInitializeCode, "Failed to instrument Wasm module for fuel metering");
+      return false;
+    }
+    allow_precompiled = false;
+  }
+  const std::string &source = fuel_metering_ ? instrumented : code;
+
+  // The source is not kept: compile without the custom sections and hold on only to those which
+  // getCustomSection() may be asked for, which leaves out debug info.
+  std::vector<byte_t> stripped;
+  std::vector<Section> sections;
+  if (!parseSections(source, &stripped, &sections)) {
+    fail(FailState::UnableToInitializeCode, "Failed to parse corrupted Wasm module");
+    return false;
+  }
+  const auto precompiled_section_name = getPrecompiledSectionName();
+  auto custom_sections = std::make_shared<CustomSections>();
+  std::string_view precompiled;
+  for (const auto &section : sections) {
+    if (!precompiled_section_name.empty() && section.first == precompiled_section_name) {
+      if (precompiled.empty()) {
+        precompiled = section.second;
       }
+    } else if (!isDebugCustomSection(section.first)) {
+      custom_sections->emplace(section.first, section.second);
+    }
+  }
+  custom_sections_ = std::move(custom_sections);
+
+  if (allow_precompiled && !precompiled.empty()) {
+    auto vec = wasm::vec<byte_t>::make(precompiled.size(), const_cast<char *>(precompiled.data()));
+    module_ = wasm::Module::deserialize(store_.get(), vec);
+    if (!module_) {
+      // Precompiled module that cannot be loaded is considered a hard error,
+      // so don't fallback to compiling the bytecode.
+      return false;
     }
   }
 
   if (!module_) {
-    const auto stripped_source = getStrippedSource();
-    module_ = wasm::Module::make(store_.get(), stripped_source ? stripped_source : source_);
+    auto vec = stripped.empty()
+                   ? wasm::vec<byte_t>::make(source.size(), const_cast<char *>(source.data()))
+                   : wasm::vec<byte_t>::make(stripped.size(), stripped.data());
+    module_ = wasm::Module::make(store_.get(), vec);
   }
 
   if (module_) {
@@ -271,6 +307,8 @@ std::unique_ptr<WasmVm> V8::clone() {
 
   auto clone = std::make_unique<V8>();
   clone->integration().reset(integration()->clone());
+  clone->fuel_metering_ = fuel_metering_;
+  clone->custom_sections_ = custom_sections_;
   clone->store_ = wasm::Store::make(engine());
 
   clone->module_ = wasm::Module::obtain(clone->store_.get(), shared_module_.get());
@@ -278,77 +316,52 @@ std::unique_ptr<WasmVm> V8::clone() {
   return clone;
 }
 
-// Get Wasm module without Custom Sections to save some memory in workers.
-wasm::vec<byte_t> V8::getStrippedSource() {
-  assert(source_.get() != nullptr);
-
-  std::vector<byte_t> stripped;
-
-  const byte_t *pos = source_.get() + 8 /* Wasm header */;
-  const byte_t *end = source_.get() + source_.size();
+// Split a Wasm module into the module without its custom sections (left empty if there are none)
+// and the (name, contents) of each custom section.
+bool V8::parseSections(std::string_view source, std::vector<byte_t> *stripped,
+                       std::vector<Section> *custom_sections) {
+  const byte_t *begin = source.data();
+  const byte_t *pos = begin + 8 /* Wasm header */;
+  const byte_t *end = begin + source.size();
   while (pos < end) {
     const auto section_start = pos;
     if (pos + 1 > end) {
-      return wasm::vec<byte_t>::invalid();
+      return false;
     }
     const auto section_type = *pos++;
     const auto section_len = parseVarint(pos, end);
     if (section_len == static_cast<uint32_t>(-1) || pos + section_len > end) {
-      return wasm::vec<byte_t>::invalid();
+      return false;
     }
-    pos += section_len;
+    const auto section_end = pos + section_len;
     if (section_type == 0 /* custom section */) {
-      if (stripped.empty()) {
-        const byte_t *start = source_.get();
-        stripped.insert(stripped.end(), start, section_start);
+      const auto section_name_len = parseVarint(pos, end);
+      if (section_name_len == static_cast<uint32_t>(-1) || pos + section_name_len > section_end) {
+        return false;
       }
-    } else if (!stripped.empty()) {
-      stripped.insert(stripped.end(), section_start, pos /* section end */);
+      custom_sections->emplace_back(
+          std::string_view(pos, section_name_len),
+          std::string_view(pos + section_name_len, section_end - pos - section_name_len));
+      if (stripped->empty()) {
+        stripped->insert(stripped->end(), begin, section_start);
+      }
+    } else if (!stripped->empty()) {
+      stripped->insert(stripped->end(), section_start, section_end);
     }
+    pos = section_end;
   }
-
-  // No custom sections found, use the original source.
-  if (stripped.empty()) {
-    return wasm::vec<byte_t>::invalid();
-  }
-
-  // Return stripped source, without custom sections.
-  return wasm::vec<byte_t>::make(stripped.size(), stripped.data());
+  return true;
 }
 
 std::string_view V8::getCustomSection(std::string_view name) {
-  assert(source_.get() != nullptr);
-
-  const byte_t *pos = source_.get() + 8 /* Wasm header */;
-  const byte_t *end = source_.get() + source_.size();
-  while (pos < end) {
-    if (pos + 1 > end) {
-      fail(FailState::UnableToInitializeCode, "Failed to parse corrupted Wasm module");
-      return "";
-    }
-    const auto section_type = *pos++;
-    const auto section_len = parseVarint(pos, end);
-    if (section_len == static_cast<uint32_t>(-1) || pos + section_len > end) {
-      fail(FailState::UnableToInitializeCode, "Failed to parse corrupted Wasm module");
-      return "";
-    }
-    if (section_type == 0 /* custom section */) {
-      const auto section_data_start = pos;
-      const auto section_name_len = parseVarint(pos, end);
-      if (section_name_len == static_cast<uint32_t>(-1) || pos + section_name_len > end) {
-        fail(FailState::UnableToInitializeCode, "Failed to parse corrupted Wasm module");
-        return "";
-      }
-      if (section_name_len == name.size() && ::memcmp(pos, name.data(), section_name_len) == 0) {
-        pos += section_name_len;
-        return {pos, static_cast<size_t>(section_data_start + section_len - pos)};
-      }
-      pos = section_data_start + section_len;
-    } else {
-      pos += section_len;
-    }
+  if (!custom_sections_) {
+    return "";
+  }
+  auto it = custom_sections_->find(name);
+  if (it == custom_sections_->end()) {
+    return "";
   }
-  return "";
+  return it->second;
 }
 
 #if defined(__linux__) && defined(__x86_64__)
@@ -367,6 +380,16 @@ std::string_view V8::getPrecompiledSectionName() {
   return name;
 }
 
+bool V8::getImportedFunctionNames(std::vector<std::string> *names) {
+  assert(module_ != nullptr);
+  for (auto &import_type : module_.get()->imports()) {
+    if (import_type->type()->kind() == wasm::EXTERN_FUNC) {
+      names->emplace_back(import_type->name().get(), import_type->name().size());
+    }
+  }
+  return true;
+}
+
 AbiVersion V8::getAbiVersion() {
   assert(module_ != nullptr);
 
@@ -472,7 +495,9 @@ bool V8::link(std::string_view debug_name) {
     } break;
 
     case wasm::EXTERN_GLOBAL: {
-      // TODO(PiotrSikora): add support when/if needed.
+      if (fuel_metering_ && name == kFuelGlobalName) {
+        fuel_global_ = export_item->global()->copy();
+      }
     } break;
 
     case wasm::EXTERN_MEMORY: {
@@ -489,6 +514,22 @@ bool V8::link(std::string_view debug_name) {
   return !isFailed();
 }
 
+bool V8::setFuel(int64_t fuel) {
+  if (!fuel_global_) {
+    return false;
+  }
+  fuel_global_->set(wasm::Val::i64(fuel));
+  return true;
+}
+
+bool V8::getFuel(int64_t *fuel) {
+  if (!fuel_global_) {
+    return false;
+  }
+  *fuel = fuel_global_->get().i64();
+  return true;
+}
+
 uint64_t V8::getMemorySize() { return memory_->data_size(); }
 
 std::optional<std::string_view> V8::getMemory(uint64_t pointer, uint64_t size) {
@@ -597,6 +638,12 @@ void V8::getModuleFunctionImpl(std::string_view function_name,
   *function = [func, function_name, this](ContextBase *context, Args... args) -> void {
     wasm::Val params[] = {makeVal(args)...};
     SaveRestoreContext saved_context(context);
+    GuestCallScope guest_call(this);
+    if (!guest_call.entered()) {
+      fail(FailState::RuntimeError,
+           "Function: " + std::string(function_name) + " failed: VM is terminating");
+      return;
+    }
     auto trap = func->call(params, nullptr);
     if (trap) {
       fail(FailState::RuntimeError, "Function: " + std::string(function_name) + " failed: " +
@@ -625,6 +672,12 @@ void V8::getModuleFunctionImpl(std::string_view function_name,
     wasm::Val params[] = {makeVal(args)...};
     wasm::Val results[1];
     SaveRestoreContext saved_context(context);
+    GuestCallScope guest_call(this);
+    if (!guest_call.entered()) {
+      fail(FailState::RuntimeError,
+           "Function: " + std::string(function_name) + " failed: VM is terminating");
+      return R{};
+    }
     auto trap = func->call(params, results);
     if (trap) {
       fail(FailState::RuntimeError, "Function: " + std::string(function_name) + " failed: " +
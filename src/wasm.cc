@@ -14,11 +14,17 @@
 // limitations under the License.
 
 #include "include/proxy-wasm/wasm.h"
+#include "include/proxy-wasm/thread_pool.h"
+#include "include/proxy-wasm/trace.h"
+#include "src/sha256.h"
 #include "src/third_party/base64.h"
-#include "src/third_party/picosha2.h"
 
 #include <cassert>
 #include <stdio.h>
+#if !defined(_MSC_VER)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include <algorithm>
 #include <cctype>
@@ -27,6 +33,7 @@
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace proxy_wasm {
 
@@ -35,12 +42,195 @@ thread_local uint32_t effective_context_id_ = 0;
 
 namespace {
 
+// The VM of the innermost WasmVm::GuestCallScope on this thread, to which host calls belong.
+thread_local WasmVm *current_guest_vm = nullptr;
+
+// WasmVm::call_state_: the depth of guest calls and of host calls, whether termination has been
+// requested and whether terminate() has been (or is being) called. The VM is in guest code when
+// there is a guest call and no host call. Every change is a single read-modify-write of this word,
+// so the watchdog and the VM's thread always see each other's latest update.
+constexpr uint64_t kGuestCall = 1;
+constexpr uint64_t kGuestCallMask = 0xffff;
+constexpr uint64_t kHostCall = 1 << 16;
+constexpr uint64_t kHostCallMask = 0xffff0000;
+constexpr uint64_t kTerminating = uint64_t(1) << 32;
+constexpr uint64_t kTerminationRequested = uint64_t(1) << 33;
+
+} // namespace
+
+WasmVm::GuestCallScope::GuestCallScope(WasmVm *wasm_vm)
+    : wasm_vm_(wasm_vm), saved_vm_(current_guest_vm) {
+  if (wasm_vm_->terminationRequested()) {
+    return;
+  }
+  entered_ = true;
+  // Without an armed ExecutionDeadline nothing can request termination during this call, so
+  // neither it nor its host calls need to be tracked.
+  if (!wasm_vm_->watched_calls_) {
+    return;
+  }
+  wasm_vm_->call_state_.fetch_add(kGuestCall, std::memory_order_acq_rel);
+  current_guest_vm = wasm_vm_;
+  tracked_ = true;
+}
+
+WasmVm::GuestCallScope::~GuestCallScope() {
+  if (tracked_) {
+    wasm_vm_->call_state_.fetch_sub(kGuestCall, std::memory_order_acq_rel);
+    current_guest_vm = saved_vm_;
+  }
+}
+
+HostCallScope::HostCallScope() : wasm_vm_(current_guest_vm) {
+  if (!wasm_vm_) {
+    return;
+  }
+  // If the add lands first the watchdog sees the host call and leaves terminate() to the last
+  // host call to return; otherwise termination is already under way and memory may be gone.
+  auto state = wasm_vm_->call_state_.fetch_add(kHostCall, std::memory_order_acq_rel);
+  if (state & kTerminationRequested) {
+    wasm_vm_->leaveHostCall();
+    entered_ = false;
+  }
+}
+
+HostCallScope::~HostCallScope() {
+  if (wasm_vm_ && entered_) {
+    wasm_vm_->leaveHostCall();
+  }
+}
+
+void WasmVm::leaveHostCall() {
+  auto state = call_state_.fetch_sub(kHostCall, std::memory_order_acq_rel) - kHostCall;
+  if ((state & kTerminationRequested) && beginTerminate(state)) {
+    terminate();
+  }
+}
+
+bool WasmVm::beginTerminate(uint64_t state) {
+  while (!(state & kTerminating) && !(state & kHostCallMask) && (state & kGuestCallMask)) {
+    if (call_state_.compare_exchange_weak(state, state | kTerminating,
+                                          std::memory_order_acq_rel)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void WasmVm::requestTermination() {
+  auto state = call_state_.fetch_or(kTerminationRequested, std::memory_order_acq_rel) |
+               kTerminationRequested;
+  if (beginTerminate(state)) {
+    terminate();
+  }
+}
+
+bool WasmVm::terminationRequested() const {
+  return call_state_.load(std::memory_order_relaxed) & kTerminationRequested;
+}
+
+uint64_t WasmVm::releaseMemory(uint64_t pointer, uint64_t size) {
+#if !defined(_MSC_VER)
+  auto memory = getMemory(pointer, size);
+  if (!memory || size == 0) {
+    return 0;
+  }
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  auto start = reinterpret_cast<uintptr_t>(memory.value().data());
+  auto begin = (start + page_size - 1) & ~(page_size - 1);
+  auto end = (start + size) & ~(page_size - 1);
+  if (end <= begin || madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+  return end - begin;
+#else
+  return 0;
+#endif
+}
+
+bool WasmVm::isDebugCustomSection(std::string_view name) {
+  return name.substr(0, 7) == ".debug_" || name == "name" || name == "sourceMappingURL" ||
+         name == "external_debug_info" || name == "producers";
+}
+
+std::optional<uint64_t> WasmVm::residentMemory() {
+#if !defined(_MSC_VER)
+  auto size = getMemorySize();
+  auto memory = getMemory(0, size);
+  if (!memory || size == 0) {
+    return std::nullopt;
+  }
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  auto start = reinterpret_cast<uintptr_t>(memory.value().data());
+  auto begin = start & ~(page_size - 1);
+  auto end = (start + size + page_size - 1) & ~(page_size - 1);
+  std::vector<unsigned char> resident((end - begin) / page_size);
+  if (mincore(reinterpret_cast<void *>(begin), end - begin, resident.data()) != 0) {
+    return std::nullopt;
+  }
+  uint64_t pages = 0;
+  for (auto page : resident) {
+    pages += page & 1;
+  }
+  return pages * page_size;
+#else
+  return std::nullopt;
+#endif
+}
+
+bool WasmVm::prepareMemory(bool huge_pages, bool prefault) {
+#if !defined(_MSC_VER)
+  auto size = getMemorySize();
+  auto memory = getMemory(0, size);
+  if (!memory || size == 0) {
+    return false;
+  }
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  auto start = reinterpret_cast<uintptr_t>(memory.value().data());
+  auto begin = (start + page_size - 1) & ~(page_size - 1);
+  auto end = (start + size) & ~(page_size - 1);
+  if (end <= begin) {
+    return false;
+  }
+  auto pages = reinterpret_cast<char *>(begin);
+  bool ok = true;
+  if (huge_pages) {
+#if defined(MADV_HUGEPAGE)
+    ok = madvise(pages, end - begin, MADV_HUGEPAGE) == 0;
+#else
+    ok = false;
+#endif
+  }
+  if (prefault) {
+#if defined(MADV_POPULATE_WRITE)
+    if (madvise(pages, end - begin, MADV_POPULATE_WRITE) == 0) {
+      return ok;
+    }
+#endif
+    // Not called during a call into the VM (see the declaration), so writing back what was read
+    // is safe.
+    for (auto p = pages; p < reinterpret_cast<char *>(end); p += page_size) {
+      auto page = reinterpret_cast<volatile char *>(p);
+      *page = *page;
+    }
+  }
+  return ok;
+#else
+  return false;
+#endif
+}
+
+namespace {
+
 // Map from Wasm Key to the local Wasm instance.
 thread_local std::unordered_map<std::string, std::weak_ptr<WasmHandleBase>> local_wasms;
 // Map from Wasm Key to the base Wasm instance, using a pointer to avoid the initialization fiasco.
 std::mutex base_wasms_mutex;
 std::unordered_map<std::string, std::weak_ptr<WasmHandleBase>> *base_wasms = nullptr;
-std::unordered_map<std::string, WasmForeignFunction> *foreign_functions = nullptr;
+// Foreign functions by id - 1, and their ids by name.
+std::vector<WasmForeignFunction> *foreign_functions = nullptr;
+std::unordered_map<std::string, uint32_t> *foreign_function_ids = nullptr;
+std::unordered_map<std::string, WasmAsyncForeignFunction> *async_foreign_functions = nullptr;
 
 const std::string INLINE_STRING = "<inline>";
 
@@ -60,12 +250,6 @@ const uint8_t *decodeVarint(const uint8_t *pos, const uint8_t *end, uint32_t *ou
   return pos;
 }
 
-std::string Sha256(std::string_view data) {
-  std::vector<unsigned char> hash(picosha2::k_digest_size);
-  picosha2::hash256(data.begin(), data.end(), hash.begin(), hash.end());
-  return std::string(reinterpret_cast<const char *>(&hash[0]), hash.size());
-}
-
 std::string Xor(std::string_view a, std::string_view b) {
   assert(a.size() == b.size());
   std::string result;
@@ -80,9 +264,9 @@ std::string Xor(std::string_view a, std::string_view b) {
 
 std::string makeVmKey(std::string_view vm_id, std::string_view vm_configuration,
                       std::string_view code) {
-  std::string vm_key = Sha256(vm_id);
-  vm_key = Xor(vm_key, Sha256(vm_configuration));
-  vm_key = Xor(vm_key, Sha256(code));
+  std::string vm_key = Sha256::digest(vm_id);
+  vm_key = Xor(vm_key, Sha256::digest(vm_configuration));
+  vm_key = Xor(vm_key, Sha256::digest(code));
   auto start = reinterpret_cast<uint8_t *>(&*vm_key.begin());
   auto end = start + vm_key.size();
   return base64Encode(start, end);
@@ -100,8 +284,24 @@ private:
 RegisterForeignFunction::RegisterForeignFunction(std::string name, WasmForeignFunction f) {
   if (!foreign_functions) {
     foreign_functions = new std::remove_reference<decltype(*foreign_functions)>::type;
+    foreign_function_ids = new std::remove_reference<decltype(*foreign_function_ids)>::type;
+  }
+  auto it = foreign_function_ids->find(name);
+  if (it != foreign_function_ids->end()) {
+    (*foreign_functions)[it->second - 1] = f;
+    return;
+  }
+  foreign_functions->push_back(f);
+  (*foreign_function_ids)[name] = foreign_functions->size();
+}
+
+RegisterAsyncForeignFunction::RegisterAsyncForeignFunction(std::string name,
+                                                           WasmAsyncForeignFunction f) {
+  if (!async_foreign_functions) {
+    async_foreign_functions =
+        new std::remove_reference<decltype(*async_foreign_functions)>::type;
   }
-  (*foreign_functions)[name] = f;
+  (*async_foreign_functions)[name] = f;
 }
 
 void WasmBase::registerCallbacks() {
@@ -179,8 +379,11 @@ void WasmBase::registerCallbacks() {
 
   _REGISTER_PROXY(set_tick_period_milliseconds);
   _REGISTER_PROXY(get_current_time_nanoseconds);
+  _REGISTER_PROXY(get_monotonic_time_nanoseconds);
+  _REGISTER_PROXY(get_time_page);
 
   _REGISTER_PROXY(define_metric);
+  _REGISTER_PROXY(define_metric_slot);
   _REGISTER_PROXY(increment_metric);
   _REGISTER_PROXY(record_metric);
   _REGISTER_PROXY(get_metric);
@@ -188,6 +391,10 @@ void WasmBase::registerCallbacks() {
   _REGISTER_PROXY(set_effective_context);
   _REGISTER_PROXY(done);
   _REGISTER_PROXY(call_foreign_function);
+  _REGISTER_PROXY(resolve_foreign_function);
+  _REGISTER_PROXY(call_foreign_function_by_id);
+  _REGISTER_PROXY(call_foreign_function_async);
+  _REGISTER_PROXY(release_memory);
 
   if (abiVersion() == AbiVersion::ProxyWasm_0_1_0) {
     _REGISTER_PROXY(get_configuration);
@@ -245,6 +452,8 @@ void WasmBase::getFunctions() {
   _GET_PROXY(on_queue_ready);
   _GET_PROXY(on_done);
   _GET_PROXY(on_log);
+  _GET_PROXY(on_log_batch);
+  _GET_PROXY(on_memory_reclaim);
   _GET_PROXY(on_delete);
 
   if (abiVersion() == AbiVersion::ProxyWasm_0_1_0) {
@@ -254,21 +463,95 @@ void WasmBase::getFunctions() {
              abiVersion() == AbiVersion::ProxyWasm_0_2_1) {
     _GET_PROXY_ABI(on_request_headers, _abi_02);
     _GET_PROXY_ABI(on_response_headers, _abi_02);
+    _GET_PROXY(on_request_headers_with_pairs);
+    _GET_PROXY(on_response_headers_with_pairs);
     _GET_PROXY(on_foreign_function);
   }
 #undef _GET_PROXY_ABI
 #undef _GET_PROXY
 }
 
+void WasmBase::computeCapabilities() {
+  capabilities_.reset();
+  auto set = [this](Capability capability, bool value) {
+    capabilities_.set(static_cast<size_t>(capability), value);
+  };
+  set(Capability::VmStart, static_cast<bool>(on_vm_start_));
+  set(Capability::Configure, static_cast<bool>(on_configure_));
+  set(Capability::Tick, static_cast<bool>(on_tick_));
+  set(Capability::ContextCreate, static_cast<bool>(on_context_create_));
+  set(Capability::NewConnection, static_cast<bool>(on_new_connection_));
+  set(Capability::DownstreamData, static_cast<bool>(on_downstream_data_));
+  set(Capability::UpstreamData, static_cast<bool>(on_upstream_data_));
+  set(Capability::ConnectionClose,
+      on_downstream_connection_close_ || on_upstream_connection_close_);
+  set(Capability::RequestHeaders, on_request_headers_abi_01_ || on_request_headers_abi_02_ ||
+                                      on_request_headers_with_pairs_);
+  set(Capability::RequestBody, static_cast<bool>(on_request_body_));
+  set(Capability::RequestTrailers, static_cast<bool>(on_request_trailers_));
+  set(Capability::RequestMetadata, static_cast<bool>(on_request_metadata_));
+  set(Capability::ResponseHeaders, on_response_headers_abi_01_ || on_response_headers_abi_02_ ||
+                                       on_response_headers_with_pairs_);
+  set(Capability::ResponseBody, static_cast<bool>(on_response_body_));
+  set(Capability::ResponseTrailers, static_cast<bool>(on_response_trailers_));
+  set(Capability::ResponseMetadata, static_cast<bool>(on_response_metadata_));
+  set(Capability::HttpCallResponse, static_cast<bool>(on_http_call_response_));
+  set(Capability::GrpcCallbacks, on_grpc_receive_ || on_grpc_close_ ||
+                                     on_grpc_create_initial_metadata_ ||
+                                     on_grpc_receive_initial_metadata_ ||
+                                     on_grpc_receive_trailing_metadata_);
+  set(Capability::QueueReady, static_cast<bool>(on_queue_ready_));
+  set(Capability::ForeignFunctionResult, static_cast<bool>(on_foreign_function_));
+  set(Capability::Done, static_cast<bool>(on_done_));
+  set(Capability::Log, on_log_ || on_log_batch_);
+  set(Capability::Delete, static_cast<bool>(on_delete_));
+
+  static const std::unordered_map<std::string_view, Capability> imports = {
+      {"proxy_http_call", Capability::HttpCall},
+      {"proxy_grpc_call", Capability::GrpcCall},
+      {"proxy_grpc_stream", Capability::GrpcCall},
+      {"proxy_get_shared_data", Capability::SharedData},
+      {"proxy_set_shared_data", Capability::SharedData},
+      {"proxy_register_shared_queue", Capability::SharedQueue},
+      {"proxy_resolve_shared_queue", Capability::SharedQueue},
+      {"proxy_enqueue_shared_queue", Capability::SharedQueue},
+      {"proxy_dequeue_shared_queue", Capability::SharedQueue},
+      {"proxy_define_metric", Capability::Metrics},
+      {"proxy_define_metric_slot", Capability::Metrics},
+      {"proxy_get_property", Capability::Properties},
+      {"proxy_set_property", Capability::Properties},
+      {"proxy_call_foreign_function", Capability::ForeignFunction},
+      {"proxy_resolve_foreign_function", Capability::ForeignFunction},
+      {"proxy_call_foreign_function_async", Capability::ForeignFunction},
+  };
+  std::vector<std::string> names;
+  if (!wasm_vm_->getImportedFunctionNames(&names)) {
+    for (auto &p : imports) {
+      set(p.second, true);
+    }
+    return;
+  }
+  for (auto &name : names) {
+    auto it = imports.find(name);
+    if (it != imports.end()) {
+      set(it->second, true);
+    }
+  }
+}
+
 WasmBase::WasmBase(const std::shared_ptr<WasmHandleBase> &base_wasm_handle, WasmVmFactory factory)
     : std::enable_shared_from_this<WasmBase>(*base_wasm_handle->wasm()),
       vm_id_(base_wasm_handle->wasm()->vm_id_), vm_key_(base_wasm_handle->wasm()->vm_key_),
       started_from_(base_wasm_handle->wasm()->wasm_vm()->cloneable()),
       base_wasm_handle_(base_wasm_handle) {
   if (started_from_ != Cloneable::NotCloneable) {
+    TraceScope trace("clone", vm_key_, base_wasm_handle->wasm()->wasm_vm()->runtime());
     wasm_vm_ = base_wasm_handle->wasm()->wasm_vm()->clone();
   } else {
     wasm_vm_ = factory();
+    if (wasm_vm_ && base_wasm_handle->wasm()->wasm_vm()->fuelMetering()) {
+      wasm_vm_->enableFuelMetering();
+    }
   }
   if (!wasm_vm_) {
     failed_ = FailState::UnableToCreateVM;
@@ -288,15 +571,27 @@ WasmBase::WasmBase(std::unique_ptr<WasmVm> wasm_vm, std::string_view vm_id,
   }
 }
 
-WasmBase::~WasmBase() {}
+WasmBase::~WasmBase() {
+  if (timer_wheel_) {
+    for (auto &p : tick_timers_) {
+      timer_wheel_->cancel(p.second);
+    }
+    timer_wheel_->cancel(memory_reclaim_timer_);
+  }
+}
 
 bool WasmBase::initialize(const std::string &code, bool allow_precompiled) {
   if (!wasm_vm_) {
     return false;
   }
+  TraceScope trace("initialize", vm_key_, wasm_vm_->runtime());
 
   if (started_from_ == Cloneable::NotCloneable) {
-    auto ok = wasm_vm_->load(code, allow_precompiled);
+    bool ok;
+    {
+      TraceScope load_trace("load", vm_key_, wasm_vm_->runtime());
+      ok = wasm_vm_->load(code, allow_precompiled);
+    }
     if (!ok) {
       return false;
     }
@@ -330,7 +625,10 @@ bool WasmBase::initialize(const std::string &code, bool allow_precompiled) {
       }
     }
 
-    code_ = code;
+    // Only a VM which can not be cloned needs the source again, to create the thread-local VMs.
+    if (!base_wasm_handle_ && wasm_vm_->cloneable() == Cloneable::NotCloneable) {
+      code_ = code;
+    }
     allow_precompiled_ = allow_precompiled;
   }
 
@@ -341,6 +639,7 @@ bool WasmBase::initialize(const std::string &code, bool allow_precompiled) {
 
   if (started_from_ != Cloneable::InstantiatedModule) {
     registerCallbacks();
+    TraceScope link_trace("link", vm_key_, wasm_vm_->runtime());
     if (!wasm_vm_->link(vm_id_)) {
       return false;
     }
@@ -348,6 +647,11 @@ bool WasmBase::initialize(const std::string &code, bool allow_precompiled) {
 
   vm_context_.reset(createVmContext());
   getFunctions();
+  if (base_wasm_handle_) {
+    capabilities_ = base_wasm_handle_->wasm()->capabilities_;
+  } else {
+    computeCapabilities();
+  }
 
   if (started_from_ != Cloneable::InstantiatedModule) {
     // Base VM was already started, so don't try to start cloned VMs again.
@@ -368,6 +672,7 @@ ContextBase *WasmBase::getOrCreateRootContext(const std::shared_ptr<PluginBase>
 }
 
 void WasmBase::startVm(ContextBase *root_context) {
+  TraceScope trace("startVm", vm_key_, wasm_vm_->runtime());
   /* Call "_start" function, and fallback to "__wasm_call_ctors" if the former is not available. */
   if (_start_) {
     _start_(root_context);
@@ -377,6 +682,7 @@ void WasmBase::startVm(ContextBase *root_context) {
 }
 
 bool WasmBase::configure(ContextBase *root_context, std::shared_ptr<PluginBase> plugin) {
+  TraceScope trace("configure", vm_key_, wasm_vm_->runtime());
   return root_context->onConfigure(plugin);
 }
 
@@ -396,6 +702,110 @@ ContextBase *WasmBase::start(std::shared_ptr<PluginBase> plugin) {
   return context_ptr;
 };
 
+void WasmBase::setTimerPeriod(uint32_t root_context_id, std::chrono::milliseconds period) {
+  timer_period_[root_context_id] = period;
+  if (timer_wheel_) {
+    scheduleTick(root_context_id, period);
+  }
+}
+
+void WasmBase::setTimerWheel(std::shared_ptr<TimerWheel> timer_wheel) {
+  if (timer_wheel_) {
+    for (auto &p : tick_timers_) {
+      timer_wheel_->cancel(p.second);
+    }
+    tick_timers_.clear();
+    timer_wheel_->cancel(memory_reclaim_timer_);
+    memory_reclaim_timer_ = 0;
+  }
+  timer_wheel_ = std::move(timer_wheel);
+  if (timer_wheel_) {
+    for (auto &p : timer_period_) {
+      scheduleTick(p.first, p.second);
+    }
+    setMemoryReclaimInterval(memory_reclaim_interval_);
+  }
+}
+
+void WasmBase::scheduleTick(uint32_t root_context_id, std::chrono::milliseconds period) {
+  auto it = tick_timers_.find(root_context_id);
+  if (it != tick_timers_.end()) {
+    timer_wheel_->cancel(it->second);
+    tick_timers_.erase(it);
+  }
+  if (period.count() == 0) {
+    return;
+  }
+  tick_timers_[root_context_id] = timer_wheel_->schedule(
+      period,
+      [weak_wasm = weak_from_this(), root_context_id] {
+        auto wasm = weak_wasm.lock();
+        auto root_context = wasm ? wasm->getContext(root_context_id) : nullptr;
+        if (root_context) {
+          root_context->onTick(0);
+        }
+      },
+      period);
+}
+
+bool WasmBase::releaseMemory(uint64_t pointer, uint64_t size) {
+  if (!wasm_vm_->getMemory(pointer, size)) {
+    return false;
+  }
+  memory_released_ += wasm_vm_->releaseMemory(pointer, size);
+  return true;
+}
+
+uint64_t WasmBase::reclaimMemory() {
+  if (isFailed() || !on_memory_reclaim_) {
+    return 0;
+  }
+  auto released = memory_released_;
+  {
+    DeferAfterCallActions actions(vm_context());
+    CallBudget budget(vm_context());
+    on_memory_reclaim_(vm_context());
+  }
+  resident_after_reclaim_ = wasm_vm_->residentMemory().value_or(0);
+  vm_calls_after_reclaim_ = vm_calls_;
+  return memory_released_ - released;
+}
+
+void WasmBase::setMemoryReclaimInterval(std::chrono::milliseconds interval) {
+  memory_reclaim_interval_ = interval;
+  if (!timer_wheel_) {
+    return;
+  }
+  timer_wheel_->cancel(memory_reclaim_timer_);
+  memory_reclaim_timer_ = 0;
+  if (interval.count() == 0) {
+    return;
+  }
+  memory_reclaim_timer_ = timer_wheel_->schedule(
+      interval,
+      [weak_wasm = weak_from_this()] {
+        auto wasm = weak_wasm.lock();
+        if (!wasm) {
+          return;
+        }
+        bool idle = wasm->vm_calls_ == wasm->reclaim_check_vm_calls_;
+        wasm->reclaim_check_vm_calls_ = wasm->vm_calls_;
+        if (!idle || wasm->isFailed()) {
+          return;
+        }
+        // Reclaim once the VM goes idle after the guest has touched more pages than were left
+        // resident by the last reclaim or, if that can not be measured, after any call since.
+        // The size of linear memory can not tell, as it stays at the peak of the first burst.
+        auto resident = wasm->wasm_vm()->residentMemory();
+        if (resident ? *resident > wasm->resident_after_reclaim_
+                     : wasm->vm_calls_ != wasm->vm_calls_after_reclaim_) {
+          wasm->reclaimMemory();
+          wasm->reclaim_check_vm_calls_ = wasm->vm_calls_;
+        }
+      },
+      interval);
+}
+
 uint32_t WasmBase::allocContextId() {
   while (true) {
     auto id = next_context_id_++;
@@ -406,7 +816,46 @@ uint32_t WasmBase::allocContextId() {
   }
 }
 
+void WasmBase::queueLog(std::unique_ptr<ContextBase> context, uint32_t batch_size) {
+  log_batch_.push_back(std::move(context));
+  if (log_batch_.size() >= batch_size) {
+    flushLogBatch();
+    return;
+  }
+  if (log_batch_.size() == 1) {
+    auto call_on_thread = callOnThreadFunction();
+    if (!call_on_thread) {
+      // Nothing would flush a partial batch until it filled up.
+      flushLogBatch();
+      return;
+    }
+    call_on_thread([weak_wasm = weak_from_this()] {
+      if (auto wasm = weak_wasm.lock()) {
+        wasm->flushLogBatch();
+      }
+    });
+  }
+}
+
+void WasmBase::flushLogBatch() {
+  if (log_batch_.empty()) {
+    return;
+  }
+  auto batch = std::move(log_batch_);
+  log_batch_.clear();
+  std::vector<uint32_t> context_ids;
+  context_ids.reserve(batch.size());
+  for (auto &context : batch) {
+    context_ids.push_back(context->id());
+  }
+  batch.front()->onLogBatch(context_ids);
+  for (auto &context : batch) {
+    context->onDelete();
+  }
+}
+
 void WasmBase::startShutdown() {
+  flushLogBatch();
   bool all_done = true;
   for (auto &p : root_contexts_) {
     if (!p.second->onDone()) {
@@ -441,19 +890,185 @@ void WasmBase::finishShutdown() {
   }
 }
 
+WasmResult WasmBase::defineMetricSlot(ContextBase *context, uint32_t type, std::string_view name,
+                                      uint32_t *metric_id_ptr, uint64_t *slot_ptr) {
+  if (type > static_cast<uint32_t>(MetricType::Max)) {
+    return WasmResult::BadArgument;
+  }
+  auto result = context->defineMetric(type, name, metric_id_ptr);
+  if (result != WasmResult::Ok) {
+    return result;
+  }
+  for (auto &slot : metric_slots_) {
+    if (slot.metric_id == *metric_id_ptr) {
+      *slot_ptr = slot.address;
+      return WasmResult::Ok;
+    }
+  }
+  auto metric_type = static_cast<MetricType>(type);
+  uint64_t size = sizeof(uint64_t);
+  if (metric_type == MetricType::Histogram) {
+    size += kMetricSlotSamples * sizeof(uint64_t);
+  }
+  if (metric_slot_page_end_ - metric_slot_page_ < size) {
+    uint64_t page = 0;
+    if (!allocMemory(kMetricSlotPageSize, &page)) {
+      return WasmResult::InvalidMemoryAccess;
+    }
+    metric_slot_page_ = page;
+    metric_slot_page_end_ = page + kMetricSlotPageSize;
+  }
+  auto memory = wasm_vm_->getMemory(metric_slot_page_, size);
+  if (!memory) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  memset(const_cast<char *>(memory->data()), 0, size);
+  metric_slots_.push_back(MetricSlot{metric_type, *metric_id_ptr, metric_slot_page_, 0});
+  *slot_ptr = metric_slot_page_;
+  metric_slot_page_ += size;
+  return WasmResult::Ok;
+}
+
+void WasmBase::flushMetricSlots(ContextBase *context) {
+  vm_calls_at_flush_ = vm_calls_;
+  for (auto &slot : metric_slots_) {
+    if (slot.type == MetricType::Histogram) {
+      auto memory = wasm_vm_->getMemory(slot.address, (1 + kMetricSlotSamples) * sizeof(uint64_t));
+      if (!memory) {
+        continue;
+      }
+      uint32_t count;
+      memcpy(&count, memory->data(), sizeof(count));
+      // Samples older than the ring have been overwritten.
+      uint32_t n = std::min<uint32_t>(count - static_cast<uint32_t>(slot.last), kMetricSlotSamples);
+      for (uint32_t i = count - n; i != count; i++) {
+        uint64_t sample;
+        memcpy(&sample, memory->data() + (1 + i % kMetricSlotSamples) * sizeof(uint64_t),
+               sizeof(sample));
+        context->recordMetric(slot.metric_id, sample);
+      }
+      slot.last = count;
+      continue;
+    }
+    auto memory = wasm_vm_->getMemory(slot.address, sizeof(uint64_t));
+    if (!memory) {
+      continue;
+    }
+    int64_t value;
+    memcpy(&value, memory->data(), sizeof(value));
+    if (slot.type == MetricType::Counter) {
+      if (value != 0) {
+        context->incrementMetric(slot.metric_id, value);
+        memset(const_cast<char *>(memory->data()), 0, sizeof(value));
+      }
+    } else if (static_cast<uint64_t>(value) != slot.last) {
+      context->recordMetric(slot.metric_id, value);
+      slot.last = value;
+    }
+  }
+}
+
+WasmResult WasmBase::getTimePage(ContextBase *context, uint64_t *page_ptr) {
+  if (!time_page_ && !allocMemory(2 * sizeof(uint64_t), &time_page_)) {
+    return WasmResult::InvalidMemoryAccess;
+  }
+  publishTime(context);
+  *page_ptr = time_page_;
+  return WasmResult::Ok;
+}
+
+void WasmBase::publishTime(ContextBase *context) {
+  uint64_t now[2] = {context->getCurrentTimeNanoseconds(), context->getMonotonicTimeNanoseconds()};
+  wasm_vm_->setMemory(time_page_, sizeof(now), now);
+}
+
 WasmForeignFunction WasmBase::getForeignFunction(std::string_view function_name) {
-  auto it = foreign_functions->find(std::string(function_name));
-  if (it != foreign_functions->end()) {
-    return it->second;
+  auto f = getForeignFunctionById(resolveForeignFunction(function_name));
+  return f ? *f : nullptr;
+}
+
+uint32_t WasmBase::resolveForeignFunction(std::string_view function_name) {
+  if (!foreign_function_ids) {
+    return 0;
   }
-  return nullptr;
+  auto it = foreign_function_ids->find(std::string(function_name));
+  return it != foreign_function_ids->end() ? it->second : 0;
 }
 
+const WasmForeignFunction *WasmBase::getForeignFunctionById(uint32_t id) {
+  if (!foreign_functions || id == 0 || id > foreign_functions->size()) {
+    return nullptr;
+  }
+  return &(*foreign_functions)[id - 1];
+}
+
+WasmResult WasmBase::callAsyncForeignFunction(ContextBase *context, std::string_view function_name,
+                                              std::string_view arguments, uint32_t *token_ptr) {
+  if (!async_foreign_functions) {
+    return WasmResult::NotFound;
+  }
+  auto it = async_foreign_functions->find(std::string(function_name));
+  if (it == async_foreign_functions->end()) {
+    return WasmResult::NotFound;
+  }
+  auto call_on_thread = callOnThreadFunction();
+  if (!call_on_thread) {
+    return WasmResult::Unimplemented;
+  }
+  auto token = next_foreign_function_token_++;
+  if (next_foreign_function_token_ == 0) {
+    next_foreign_function_token_ = 1;
+  }
+  std::function<void()> work = [f = it->second, arguments = std::string(arguments),
+                                call_on_thread, weak = weak_from_this(),
+                                context_id = context->id(), token]() {
+    auto result = std::make_shared<std::string>();
+    auto status = f(arguments, result.get());
+    if (status != WasmResult::Ok) {
+      result->clear();
+    }
+    // The CallData starts with the status, see proxy_call_foreign_function_async.
+    auto code = static_cast<uint32_t>(status);
+    result->insert(0, reinterpret_cast<const char *>(&code), sizeof(code));
+    call_on_thread([weak, context_id, token, result] {
+      auto wasm = weak.lock();
+      if (!wasm || wasm->isFailed()) {
+        return;
+      }
+      auto context = wasm->getContext(context_id);
+      if (context) {
+        context->onForeignFunctionResult(token, std::move(*result));
+      }
+    });
+  };
+  *token_ptr = token;
+  if (!ForeignFunctionThreadPool::submit(work)) {
+    work();
+  }
+  return WasmResult::Ok;
+}
+
+namespace {
+
+// Report and return false if the VM can not enforce the plugin's execution timeout.
+bool checkExecutionTimeout(WasmBase *wasm, const PluginBase &plugin) {
+  auto *wasm_vm = wasm->wasm_vm();
+  if (plugin.execution_timeout_.count() <= 0 || !wasm_vm || wasm_vm->supportsExecutionTimeout()) {
+    return true;
+  }
+  wasm->error("Plugin " + plugin.name_ + " has an execution timeout but the " +
+              std::string(wasm_vm->runtime()) + " runtime can not enforce it");
+  return false;
+}
+
+} // namespace
+
 std::shared_ptr<WasmHandleBase> createWasm(std::string vm_key, std::string code,
                                            std::shared_ptr<PluginBase> plugin,
                                            WasmHandleFactory factory,
                                            WasmHandleCloneFactory clone_factory,
                                            bool allow_precompiled) {
+  TraceScope trace("createWasm", vm_key, plugin->runtime_);
   std::shared_ptr<WasmHandleBase> wasm_handle;
   {
     std::lock_guard<std::mutex> guard(base_wasms_mutex);
@@ -468,15 +1083,29 @@ std::shared_ptr<WasmHandleBase> createWasm(std::string vm_key, std::string code,
       }
     }
     if (wasm_handle) {
+      // Metering is decided when the base VM is loaded, by the first plugin for the vm_key.
+      auto wasm_vm = wasm_handle->wasm()->wasm_vm();
+      if (plugin->fuel_budget_ && wasm_vm && !wasm_vm->fuelMetering()) {
+        wasm_handle->wasm()->error("Plugin " + plugin->name_ +
+                                   " has a fuel budget but its VM is not fuel metered");
+        return nullptr;
+      }
+      if (!checkExecutionTimeout(wasm_handle->wasm().get(), *plugin)) {
+        return nullptr;
+      }
       return wasm_handle;
     }
     wasm_handle = factory(vm_key);
-    if (!wasm_handle) {
+    if (!wasm_handle || !checkExecutionTimeout(wasm_handle->wasm().get(), *plugin)) {
       return nullptr;
     }
     (*base_wasms)[vm_key] = wasm_handle;
   }
 
+  if (plugin->fuel_budget_ && wasm_handle->wasm()->wasm_vm()) {
+    wasm_handle->wasm()->wasm_vm()->enableFuelMetering();
+  }
+
   if (!wasm_handle->wasm()->initialize(code, allow_precompiled)) {
     wasm_handle->wasm()->fail(FailState::UnableToInitializeCode, "Failed to initialize Wasm code");
     return nullptr;
@@ -512,11 +1141,17 @@ createThreadLocalWasm(std::shared_ptr<WasmHandleBase> &base_wasm,
     wasm_handle->wasm()->fail(FailState::UnableToCloneVM, "Failed to clone Base Wasm");
     return nullptr;
   }
-  if (!wasm_handle->wasm()->initialize(wasm_handle->wasm()->code(),
-                                       wasm_handle->wasm()->allow_precompiled())) {
+  if (!wasm_handle->wasm()->initialize(base_wasm->wasm()->code(),
+                                       base_wasm->wasm()->allow_precompiled())) {
     wasm_handle->wasm()->fail(FailState::UnableToInitializeCode, "Failed to initialize Wasm code");
     return nullptr;
   }
+  // Before the plugin starts handling traffic. initialize() has run the module's _start or
+  // constructors, but no other thread can reach the VM yet, so the guest is not running.
+  if (plugin->memory_huge_pages_ || plugin->memory_prefault_) {
+    wasm_handle->wasm()->wasm_vm()->prepareMemory(plugin->memory_huge_pages_,
+                                                  plugin->memory_prefault_);
+  }
   ContextBase *root_context = wasm_handle->wasm()->start(plugin);
   if (!root_context) {
     base_wasm->wasm()->fail(FailState::StartFailed, "Failed to start thread-local Wasm");
@@ -0,0 +1,129 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/watchdog.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "include/proxy-wasm/wasm_vm.h"
+
+namespace proxy_wasm {
+
+namespace {
+
+std::atomic<uint64_t> execution_timeout_count{0};
+
+} // namespace
+
+// A single background thread which sleeps until the earliest armed deadline. Termination of expired
+// deadlines is requested while holding the lock, and disarming takes the same lock, so the VM can
+// not be destroyed while requestTermination() is running on it.
+class Watchdog {
+public:
+  static Watchdog &get() {
+    // Never destroyed: the thread may still be waiting when static destructors run.
+    static Watchdog *watchdog = new Watchdog;
+    return *watchdog;
+  }
+
+  void arm(ExecutionDeadline *deadline) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_started_) {
+      std::thread([this] { run(); }).detach();
+      thread_started_ = true;
+    }
+    bool earliest = deadlines_.empty() || deadline->deadline_ < deadlines_.begin()->first;
+    deadlines_.emplace(deadline->deadline_, deadline);
+    deadline->armed_ = true;
+    if (earliest) {
+      cv_.notify_one();
+    }
+  }
+
+  void disarm(ExecutionDeadline *deadline) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!deadline->expired_) {
+      deadlines_.erase(std::make_pair(deadline->deadline_, deadline));
+    }
+    deadline->armed_ = false;
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (deadlines_.empty()) {
+        cv_.wait(lock);
+        continue;
+      }
+      auto now = std::chrono::steady_clock::now();
+      auto next = deadlines_.begin();
+      if (next->first > now) {
+        // By value: the deadline may be disarmed, and its entry erased, while waiting.
+        auto wake_up = next->first;
+        cv_.wait_until(lock, wake_up);
+        continue;
+      }
+      auto *deadline = next->second;
+      deadlines_.erase(next);
+      deadline->expired_ = true;
+      execution_timeout_count++;
+      deadline->wasm_vm_->requestTermination();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool thread_started_ = false;
+  std::set<std::pair<std::chrono::steady_clock::time_point, ExecutionDeadline *>> deadlines_;
+};
+
+ExecutionDeadline::ExecutionDeadline(WasmVm *wasm_vm, std::chrono::milliseconds timeout)
+    : wasm_vm_(wasm_vm), timeout_(timeout) {
+  if (timeout_.count() <= 0 || !wasm_vm_) {
+    return;
+  }
+  deadline_ = std::chrono::steady_clock::now() + timeout_;
+  // Before arming, so that the call is tracked by the time the watchdog can request termination.
+  wasm_vm_->watched_calls_++;
+  Watchdog::get().arm(this);
+}
+
+ExecutionDeadline::~ExecutionDeadline() {
+  if (!armed_) {
+    return;
+  }
+  Watchdog::get().disarm(this);
+  wasm_vm_->watched_calls_--;
+  check();
+}
+
+void ExecutionDeadline::check() {
+  // The runtime normally fails the VM when the aborted call unwinds, but the deadline may also
+  // have passed just as the call returned, or the runtime may be unable to preempt (e.g. NullVm).
+  if (expired_ && !wasm_vm_->isFailed()) {
+    wasm_vm_->fail(FailState::RuntimeError, "Function exceeded the execution deadline of " +
+                                                std::to_string(timeout_.count()) + "ms");
+  }
+}
+
+uint64_t getExecutionTimeoutCount() { return execution_timeout_count; }
+
+} // namespace proxy_wasm
@@ -24,6 +24,7 @@
 #include <utility>
 #include <vector>
 
+#include "include/proxy-wasm/fuel.h"
 #include "include/proxy-wasm/wasm_vm.h"
 
 #include "WAVM/IR/Module.h"
@@ -88,6 +89,12 @@ namespace {
   do {                                                                                             \
     try {                                                                                          \
       SaveRestoreContext _saved_context(static_cast<ContextBase *>(_context));                     \
+      WasmVm::GuestCallScope _guest_call(_wavm);                                                   \
+      if (!_guest_call.entered()) {                                                                \
+        _wavm->fail(FailState::RuntimeError,                                                       \
+                    "Function: " + std::string(function_name) + " failed: VM is terminating");     \
+        throw std::exception();                                                                    \
+      }                                                                                            \
       WAVM::Runtime::catchRuntimeExceptions(                                                       \
           [&] { _x; },                                                                             \
           [&](WAVM::Runtime::Exception *exception) {                                               \
@@ -209,6 +216,11 @@ struct Wavm : public WasmVm {
   std::string_view getCustomSection(std::string_view name) override;
   std::string_view getPrecompiledSectionName() override;
   AbiVersion getAbiVersion() override;
+  // WAVM has no way to interrupt a running thread.
+  bool supportsExecutionTimeout() override { return false; }
+  bool setFuel(int64_t fuel) override;
+  bool getFuel(int64_t *fuel) override;
+  bool getImportedFunctionNames(std::vector<std::string> *names) override;
 
 #define _GET_FUNCTION(_T)                                                                          \
   void getFunction(std::string_view function_name, _T *f) override {                               \
@@ -237,6 +249,7 @@ struct Wavm : public WasmVm {
       intrinsic_module_instances_;
   std::vector<std::unique_ptr<Intrinsics::Function>> envoyFunctions_;
   uint8_t *memory_base_ = nullptr;
+  WAVM::Runtime::Global *fuel_global_ = nullptr;
   AbiVersion abi_version_ = AbiVersion::Unknown;
 };
 
@@ -264,6 +277,10 @@ std::unique_ptr<WasmVm> Wavm::clone() {
   }
   wavm->module_instance_ =
       WAVM::Runtime::remapToClonedCompartment(module_instance_, wavm->compartment_);
+  wavm->fuel_metering_ = fuel_metering_;
+  if (fuel_global_) {
+    wavm->fuel_global_ = WAVM::Runtime::remapToClonedCompartment(fuel_global_, wavm->compartment_);
+  }
   return wavm;
 }
 
@@ -272,23 +289,45 @@ bool Wavm::load(const std::string &code, bool allow_precompiled) {
   has_instantiated_module_ = true;
   compartment_ = WAVM::Runtime::createCompartment();
   context_ = WAVM::Runtime::createContext(compartment_);
-  if (!loadModule(code, ir_module_)) {
+  std::string instrumented;
+  if (fuel_metering_) {
+    if (!instrumentForFuel(code, &instrumented)) {
+      fail(FailState::UnableToInitializeCode, "Failed to instrument Wasm module for fuel metering");
+      return false;
+    }
+    allow_precompiled = false;
+  }
+  if (!loadModule(fuel_metering_ ? instrumented : code, ir_module_)) {
     return false;
   }
   getAbiVersion(); // Cache ABI version.
-  const CustomSection *precompiled_object_section = nullptr;
-  if (allow_precompiled) {
-    for (const CustomSection &customSection : ir_module_.customSections) {
-      if (customSection.name == getPrecompiledSectionName()) {
-        precompiled_object_section = &customSection;
-        break;
+  // Keep only the custom sections which getCustomSection() may be asked for: debug info and the
+  // precompiled object are dropped before compiling, as the compiled module holds a copy of the IR.
+  std::vector<U8> precompiled_object;
+  bool has_precompiled_object = false;
+  std::vector<CustomSection> custom_sections;
+  for (CustomSection &customSection : ir_module_.customSections) {
+    if (customSection.name == getPrecompiledSectionName()) {
+      if (allow_precompiled && !has_precompiled_object) {
+        precompiled_object = std::move(customSection.data);
+        has_precompiled_object = true;
       }
+    } else if (!isDebugCustomSection(customSection.name)) {
+      custom_sections.push_back(std::move(customSection));
     }
   }
-  if (!precompiled_object_section) {
+  ir_module_.customSections = std::move(custom_sections);
+  if (!has_precompiled_object) {
     module_ = WAVM::Runtime::compileModule(ir_module_);
   } else {
-    module_ = WAVM::Runtime::loadPrecompiledModule(ir_module_, precompiled_object_section->data);
+    module_ = WAVM::Runtime::loadPrecompiledModule(ir_module_, precompiled_object);
+  }
+  return true;
+}
+
+bool Wavm::getImportedFunctionNames(std::vector<std::string> *names) {
+  for (auto &i : ir_module_.functions.imports) {
+    names->push_back(i.exportName);
   }
   return true;
 }
@@ -334,6 +373,10 @@ bool Wavm::link(std::string_view debug_name) {
       compartment_, module_, std::move(link_result.resolvedImports), std::string(debug_name));
   memory_ = getDefaultMemory(module_instance_);
   memory_base_ = WAVM::Runtime::getMemoryBaseAddress(memory_);
+  if (fuel_metering_) {
+    fuel_global_ =
+        asGlobalNullable(getInstanceExport(module_instance_, std::string(kFuelGlobalName)));
+  }
   return true;
 }
 
@@ -374,6 +417,22 @@ bool Wavm::setWord(uint64_t pointer, Word data) {
   return setMemory(pointer, sizeof(uint32_t), &data32);
 }
 
+bool Wavm::setFuel(int64_t fuel) {
+  if (!fuel_global_) {
+    return false;
+  }
+  WAVM::Runtime::setGlobalValue(context_, fuel_global_, Value(I64(fuel)));
+  return true;
+}
+
+bool Wavm::getFuel(int64_t *fuel) {
+  if (!fuel_global_) {
+    return false;
+  }
+  *fuel = WAVM::Runtime::getGlobalValue(context_, fuel_global_).i64;
+  return true;
+}
+
 std::string_view Wavm::getCustomSection(std::string_view name) {
   for (auto &section : ir_module_.customSections) {
     if (section.name == name) {
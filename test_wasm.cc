@@ -0,0 +1,115 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "test_wasm.h"
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <mutex>
+
+#include "include/proxy-wasm/null.h"
+
+namespace proxy_wasm {
+
+namespace {
+
+std::mutex posted_mutex;
+std::vector<std::function<void()>> posted;
+
+} // namespace
+
+void TestIntegration::error(std::string_view message) {
+  std::cerr << message << "\n";
+  last_error_ = std::string(message);
+}
+
+std::unique_ptr<WasmVm> createTestVm() {
+  auto wasm_vm = createNullVm();
+  wasm_vm->integration().reset(new TestIntegration());
+  return wasm_vm;
+}
+
+void TestNullVmPlugin::getFunction(std::string_view function_name, WasmCallWord<1> *f) {
+  *f = nullptr;
+  if (function_name == "malloc") {
+    *f = [](ContextBase *, Word size) -> Word {
+      return Word(reinterpret_cast<uint64_t>(::malloc(size.u64_)));
+    };
+  }
+}
+
+void post(std::function<void()> f) {
+  std::lock_guard<std::mutex> lock(posted_mutex);
+  posted.push_back(std::move(f));
+}
+
+std::vector<std::function<void()>> takePosted() {
+  std::lock_guard<std::mutex> lock(posted_mutex);
+  return std::move(posted);
+}
+
+void TestContext::setHeader(WasmHeaderMapType type, std::string_view key, std::string_view value) {
+  auto &map = header_maps_[type];
+  for (auto &p : map) {
+    if (p.first == key) {
+      p.second = std::string(value);
+      return;
+    }
+  }
+  map.emplace_back(std::string(key), std::string(value));
+}
+
+WasmResult TestContext::getProperty(std::string_view path, std::string *result) {
+  auto it = properties_.find(path);
+  if (it == properties_.end()) {
+    return WasmResult::NotFound;
+  }
+  *result = it->second;
+  return WasmResult::Ok;
+}
+
+WasmResult TestContext::getHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                                          std::string_view *result) {
+  auto it = header_maps_.find(type);
+  if (it == header_maps_.end()) {
+    return WasmResult::NotFound;
+  }
+  for (auto &p : it->second) {
+    if (p.first == key) {
+      *result = p.second;
+      return WasmResult::Ok;
+    }
+  }
+  return WasmResult::NotFound;
+}
+
+WasmResult TestContext::getHeaderMapPairs(WasmHeaderMapType type, Pairs *result) {
+  auto it = header_maps_.find(type);
+  if (it == header_maps_.end()) {
+    return WasmResult::NotFound;
+  }
+  for (auto &p : it->second) {
+    result->emplace_back(p.first, p.second);
+  }
+  return WasmResult::Ok;
+}
+
+WasmResult TestContext::addHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                                          std::string_view value) {
+  header_maps_[type].emplace_back(std::string(key), std::string(value));
+  return WasmResult::Ok;
+}
+
+} // namespace proxy_wasm
@@ -0,0 +1,115 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "include/proxy-wasm/null_vm_plugin.h"
+#include "include/proxy-wasm/wasm.h"
+
+namespace proxy_wasm {
+
+// Integration which reports errors on stderr, keeping the last one, and provides no NullPlugin
+// functions. A NullVm without an integration can not report a failure.
+struct TestIntegration : public WasmVmIntegration {
+  WasmVmIntegration *clone() override { return new TestIntegration(); }
+  void error(std::string_view message) override;
+  bool getNullVmFunction(std::string_view, bool, int, NullPlugin *, void *) override {
+    return false;
+  }
+
+  std::string last_error_;
+};
+
+// A NullVm with a TestIntegration.
+std::unique_ptr<WasmVm> createTestVm();
+
+// A NullVm plugin which only exports malloc, backed by the native heap which is the NullVm's
+// "linear memory". Tests derive from it for the callbacks they exercise.
+class TestNullVmPlugin : public NullVmPlugin {
+public:
+  using NullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override;
+};
+
+// Functions posted with a TestWasm's callOnThreadFunction(), which tests run as the next event
+// loop iteration. post() may be called from any thread.
+void post(std::function<void()> f);
+// Returns the functions posted so far and forgets them.
+std::vector<std::function<void()>> takePosted();
+
+// A ContextBase with in-memory header maps and properties, standing in for a proxy. Header maps
+// which are not in header_maps_ are NotFound.
+class TestContext : public ContextBase {
+public:
+  using HeaderMap = std::vector<std::pair<std::string, std::string>>;
+
+  using ContextBase::ContextBase;
+
+  // Set 'key' in the map of 'type', replacing its value if it is there, creating the map if not.
+  void setHeader(WasmHeaderMapType type, std::string_view key, std::string_view value);
+
+  WasmResult log(uint32_t, std::string_view) override { return WasmResult::Ok; }
+  WasmResult getProperty(std::string_view path, std::string *result) override;
+  WasmResult getHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                               std::string_view *result) override;
+  WasmResult getHeaderMapPairs(WasmHeaderMapType type, Pairs *result) override;
+  WasmResult addHeaderMapValue(WasmHeaderMapType type, std::string_view key,
+                               std::string_view value) override;
+
+  std::map<WasmHeaderMapType, HeaderMap> header_maps_;
+  std::map<std::string, std::string, std::less<>> properties_;
+};
+
+// A WasmBase whose VM and root contexts are 'Context's and which posts functions with post(), or
+// provides no callOnThreadFunction() if post_ is false.
+template <typename Context = TestContext> class TestWasm : public WasmBase {
+public:
+  using WasmBase::WasmBase;
+
+  CallOnThreadFunction callOnThreadFunction() override {
+    if (!post_) {
+      return nullptr;
+    }
+    return [](std::function<void()> f) { post(std::move(f)); };
+  }
+  ContextBase *createVmContext() override { return new Context(this); }
+  ContextBase *createRootContext(const std::shared_ptr<PluginBase> &plugin) override {
+    return new Context(this, plugin);
+  }
+
+  bool post_ = true;
+};
+
+// Create a 'Wasm' on a test VM, load the NullVm plugin 'code' and start 'plugin'. Returns nullptr
+// on failure.
+template <typename Wasm = TestWasm<>>
+std::shared_ptr<Wasm> createTestWasm(std::string_view code,
+                                     const std::shared_ptr<PluginBase> &plugin) {
+  auto wasm = std::make_shared<Wasm>(createTestVm(), plugin->vm_id_, "",
+                                     makeVmKey(plugin->vm_id_, "", code));
+  if (!wasm->initialize(std::string(code), false) || !wasm->start(plugin)) {
+    return nullptr;
+  }
+  return wasm;
+}
+
+} // namespace proxy_wasm
@@ -0,0 +1,184 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/timer_wheel.h"
+
+#include <random>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/wasm.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::minutes;
+using std::chrono::seconds;
+
+const TimerWheel::TimePoint kStart;
+
+TEST(TimerWheel, OneShotAndPeriodic) {
+  TimerWheel wheel(microseconds(100), kStart);
+  int one_shot = 0;
+  int periodic = 0;
+  wheel.schedule(milliseconds(1), [&] { one_shot++; });
+  wheel.schedule(microseconds(250), [&] { periodic++; }, microseconds(500));
+  EXPECT_EQ(wheel.size(), 2);
+  // 250us is rounded up to 300us.
+  EXPECT_EQ(wheel.nextExpiry(), kStart + microseconds(300));
+  EXPECT_EQ(wheel.advance(kStart + microseconds(299)), 0);
+  EXPECT_EQ(wheel.advance(kStart + microseconds(300)), 1);
+  EXPECT_EQ(wheel.nextExpiry(), kStart + microseconds(800));
+  EXPECT_EQ(wheel.advance(kStart + milliseconds(1)), 2);
+  EXPECT_EQ(one_shot, 1);
+  EXPECT_EQ(periodic, 2);
+  EXPECT_EQ(wheel.size(), 1);
+  EXPECT_EQ(wheel.nextExpiry(), kStart + microseconds(1300));
+}
+
+TEST(TimerWheel, Cancel) {
+  TimerWheel wheel(microseconds(100), kStart);
+  int fired = 0;
+  auto id = wheel.schedule(milliseconds(1), [&] { fired++; });
+  auto self = wheel.schedule(
+      milliseconds(1), [&] { fired++; }, milliseconds(1));
+  EXPECT_TRUE(wheel.cancel(id));
+  EXPECT_FALSE(wheel.cancel(id));
+  EXPECT_EQ(wheel.advance(kStart + milliseconds(1)), 1);
+  EXPECT_TRUE(wheel.cancel(self));
+  EXPECT_EQ(wheel.advance(kStart + seconds(1)), 0);
+  EXPECT_EQ(fired, 1);
+  EXPECT_EQ(wheel.size(), 0);
+  EXPECT_FALSE(wheel.nextExpiry());
+}
+
+TEST(TimerWheel, CallbackCancelsItself) {
+  TimerWheel wheel(microseconds(100), kStart);
+  int fired = 0;
+  TimerWheel::TimerId id = 0;
+  id = wheel.schedule(
+      milliseconds(1),
+      [&] {
+        fired++;
+        wheel.cancel(id);
+      },
+      milliseconds(1));
+  EXPECT_EQ(wheel.advance(kStart + seconds(1)), 1);
+  EXPECT_EQ(fired, 1);
+}
+
+TEST(TimerWheel, LongDelaysCascade) {
+  TimerWheel wheel(microseconds(100), kStart);
+  // Level 1, level 2, level 3 and (beyond ~28 minutes) the overflow list.
+  std::vector<std::chrono::nanoseconds> delays = {milliseconds(50), seconds(1), minutes(10),
+                                                  minutes(45)};
+  std::vector<int> fired(delays.size());
+  for (size_t i = 0; i < delays.size(); i++) {
+    wheel.schedule(delays[i], [&fired, i] { fired[i]++; });
+  }
+  for (size_t i = 0; i < delays.size(); i++) {
+    EXPECT_EQ(wheel.nextExpiry(), kStart + delays[i]);
+    EXPECT_EQ(wheel.advance(kStart + delays[i] - microseconds(1)), 0);
+    EXPECT_EQ(fired[i], 0);
+    EXPECT_EQ(wheel.advance(kStart + delays[i]), 1);
+    EXPECT_EQ(fired[i], 1);
+  }
+}
+
+TEST(TimerWheel, CoalescesWakeups) {
+  TimerWheel wheel(microseconds(100), kStart);
+  int fired = 0;
+  for (int i = 0; i < 100; i++) {
+    wheel.schedule(
+        milliseconds(10), [&] { fired++; }, milliseconds(10));
+  }
+  EXPECT_EQ(wheel.nextExpiry(), kStart + milliseconds(10));
+  EXPECT_EQ(wheel.advance(kStart + milliseconds(10)), 100);
+  EXPECT_EQ(fired, 100);
+  // Periods missed while the loop was stalled are skipped.
+  EXPECT_EQ(wheel.advance(kStart + milliseconds(95)), 100);
+  EXPECT_EQ(wheel.nextExpiry(), kStart + milliseconds(100));
+}
+
+TEST(TimerWheel, MatchesReference) {
+  TimerWheel wheel(microseconds(1), kStart);
+  std::mt19937_64 random(7);
+  std::vector<uint64_t> due;   // In microseconds.
+  std::vector<uint64_t> fired; // The time of the advance() which ran each timer.
+  uint64_t now = 0;
+  for (int i = 0; i < 2000; i++) {
+    uint64_t delay = 1 + random() % (uint64_t(1) << (random() % 28));
+    due.push_back(now + delay);
+    fired.push_back(0);
+    wheel.schedule(microseconds(delay), [&fired, &now, i] { fired[i] = now; });
+    if (random() % 4 == 0) {
+      now += random() % (uint64_t(1) << (random() % 26));
+      wheel.advance(kStart + microseconds(now));
+    }
+  }
+  while (wheel.size()) {
+    auto next = wheel.nextExpiry();
+    ASSERT_TRUE(next);
+    now = std::chrono::duration_cast<microseconds>(*next - kStart).count();
+    EXPECT_EQ(wheel.advance(kStart + microseconds(now - 1)), 0);
+    EXPECT_GT(wheel.advance(kStart + microseconds(now)), 0);
+  }
+  for (size_t i = 0; i < due.size(); i++) {
+    // Run by the first advance() at or after the due time.
+    EXPECT_GE(fired[i], due[i]);
+  }
+}
+
+class TickContext : public ContextBase {
+public:
+  using ContextBase::ContextBase;
+  void onTick(TimerToken) override { ticks++; }
+  int ticks = 0;
+};
+
+using TickWasm = TestWasm<TickContext>;
+
+RegisterNullVmPluginFactory register_malloc_plugin("timer_wheel_test_plugin", []() {
+  return std::make_unique<TestNullVmPlugin>();
+});
+
+TEST(TimerWheel, DrivesRootContextTicks) {
+  auto wheel = std::make_shared<TimerWheel>(microseconds(100), kStart);
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto wasm = createTestWasm<TickWasm>("timer_wheel_test_plugin", plugin);
+  ASSERT_TRUE(wasm);
+  auto root_context = static_cast<TickContext *>(wasm->getRootContext("root"));
+
+  // A period set before the wheel is attached is picked up by setTimerWheel().
+  wasm->setTimerPeriod(root_context->id(), milliseconds(10));
+  wasm->setTimerWheel(wheel);
+  for (int i = 1; i <= 3; i++) {
+    wheel->advance(kStart + milliseconds(10 * i));
+  }
+  EXPECT_EQ(root_context->ticks, 3);
+
+  wasm->setTimerPeriod(root_context->id(), milliseconds(0));
+  wheel->advance(kStart + milliseconds(100));
+  EXPECT_EQ(root_context->ticks, 3);
+
+  wasm->setTimerPeriod(root_context->id(), milliseconds(5));
+  wasm.reset();
+  EXPECT_EQ(wheel->size(), 0);
+}
+
+} // namespace
+} // namespace proxy_wasm
@@ -0,0 +1,69 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/trace.h"
+
+#include <sstream>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace proxy_wasm {
+namespace {
+
+TEST(Trace, DisabledByDefault) {
+  EXPECT_EQ(getTraceSink(), nullptr);
+  TraceScope trace("load", "key", "null");
+}
+
+TEST(Trace, RecordsSpans) {
+  auto sink = std::make_shared<ChromeTraceSink>();
+  setTraceSink(sink);
+  { TraceScope trace("load", "key", "null"); }
+  std::thread([] { TraceScope trace("clone", "key", "null"); }).join();
+  setTraceSink(nullptr);
+  { TraceScope trace("ignored", "key", "null"); }
+
+  auto spans = sink->spans();
+  ASSERT_EQ(spans.size(), 2);
+  EXPECT_EQ(spans[0].name, "load");
+  EXPECT_EQ(spans[0].vm_key, "key");
+  EXPECT_EQ(spans[0].runtime, "null");
+  EXPECT_EQ(spans[1].name, "clone");
+  EXPECT_NE(spans[0].thread_id, spans[1].thread_id);
+}
+
+TEST(Trace, ChromeTraceFormat) {
+  ChromeTraceSink sink;
+  TraceSpan span;
+  span.name = "link";
+  span.vm_key = "a\"b";
+  span.runtime = "v8";
+  span.thread_id = 3;
+  span.start = std::chrono::steady_clock::time_point(std::chrono::microseconds(10));
+  span.duration = std::chrono::microseconds(5);
+  sink.recordSpan(span);
+
+  std::stringstream out;
+  sink.write(out);
+  auto json = out.str();
+  EXPECT_NE(json.find("\"name\":\"link\""), std::string::npos);
+  EXPECT_NE(json.find("\"ph\":\"X\""), std::string::npos);
+  EXPECT_NE(json.find("\"tid\":3,\"ts\":10,\"dur\":5"), std::string::npos);
+  EXPECT_NE(json.find("\"vm_key\":\"a\\\"b\""), std::string::npos);
+  EXPECT_NE(json.find("\"runtime\":\"v8\""), std::string::npos);
+}
+
+} // namespace
+} // namespace proxy_wasm
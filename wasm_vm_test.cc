@@ -14,9 +14,15 @@
 
 #include "include/proxy-wasm/wasm_vm.h"
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "gtest/gtest.h"
+#include "include/proxy-wasm/exports.h"
 #include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/null_vm.h"
 #include "include/proxy-wasm/null_vm_plugin.h"
+#include "include/proxy-wasm/wasm.h"
 
 namespace proxy_wasm {
 
@@ -71,6 +77,402 @@ TEST_F(BaseVmTest, NullVmStartup) {
   EXPECT_TRUE(wasm_vm->getCustomSection("user").empty());
   EXPECT_TRUE(wasm_vm->load("test_null_vm_plugin", true));
   EXPECT_NE(test_null_vm_plugin, nullptr);
+  EXPECT_EQ(wasm_vm->releaseMemory(0, 1 << 20), 0);
+  EXPECT_FALSE(wasm_vm->prepareMemory(true, true));
+}
+
+TEST_F(BaseVmTest, DebugCustomSections) {
+  EXPECT_TRUE(WasmVm::isDebugCustomSection(".debug_info"));
+  EXPECT_TRUE(WasmVm::isDebugCustomSection("name"));
+  EXPECT_TRUE(WasmVm::isDebugCustomSection("sourceMappingURL"));
+  EXPECT_FALSE(WasmVm::isDebugCustomSection("emscripten_metadata"));
+  EXPECT_FALSE(WasmVm::isDebugCustomSection(".debug"));
+}
+
+RegisterForeignFunction register_echo("wasm_vm_test_echo",
+                                      [](WasmBase &, std::string_view arguments,
+                                         std::function<void *(size_t size)> alloc_result) {
+                                        auto result = alloc_result(arguments.size());
+                                        memcpy(result, arguments.data(), arguments.size());
+                                        return WasmResult::Ok;
+                                      });
+
+TEST_F(BaseVmTest, ForeignFunctionById) {
+  WasmBase wasm(createNullVm(), "vm", "", "vm_key");
+  auto id = wasm.resolveForeignFunction("wasm_vm_test_echo");
+  EXPECT_NE(id, 0);
+  EXPECT_EQ(wasm.resolveForeignFunction("wasm_vm_test_echo"), id);
+  EXPECT_EQ(wasm.resolveForeignFunction("missing"), 0);
+  EXPECT_EQ(wasm.getForeignFunctionById(0), nullptr);
+  EXPECT_EQ(wasm.getForeignFunctionById(id + 1000), nullptr);
+
+  auto f = wasm.getForeignFunctionById(id);
+  ASSERT_NE(f, nullptr);
+  std::string result;
+  EXPECT_EQ((*f)(wasm, "echo",
+                 [&result](size_t size) {
+                   result.resize(size);
+                   return result.data();
+                 }),
+            WasmResult::Ok);
+  EXPECT_EQ(result, "echo");
+}
+
+// A plugin whose malloc is the native heap, which is the NullVm's "linear memory".
+class ForeignNullVmPlugin : public NullVmPlugin {
+public:
+  using NullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override {
+    *f = nullptr;
+    if (function_name == "malloc") {
+      *f = [](ContextBase *, Word size) -> Word {
+        return Word(reinterpret_cast<uint64_t>(::malloc(size.u64_)));
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_foreign_plugin("foreign_test_plugin", []() {
+  return std::make_unique<ForeignNullVmPlugin>();
+});
+
+Word address(const void *p) { return Word(reinterpret_cast<uint64_t>(p)); }
+
+TEST_F(BaseVmTest, ForeignFunctionByIdFromGuest) {
+  WasmBase wasm(createNullVm(), "vm", "", "vm_key");
+  ASSERT_TRUE(wasm.initialize("foreign_test_plugin", false));
+  auto *context = wasm.vm_context();
+  SaveRestoreContext saved_context(context);
+
+  std::string_view name = "wasm_vm_test_echo";
+  uint32_t id = 0;
+  ASSERT_EQ(exports::resolve_foreign_function(context, address(name.data()), Word(name.size()),
+                                              address(&id))
+                .u64_,
+            static_cast<uint64_t>(WasmResult::Ok));
+  EXPECT_EQ(id, wasm.resolveForeignFunction(name));
+  std::string_view missing = "missing";
+  EXPECT_EQ(exports::resolve_foreign_function(context, address(missing.data()),
+                                              Word(missing.size()), address(&id))
+                .u64_,
+            static_cast<uint64_t>(WasmResult::NotFound));
+
+  // The result is allocated in the VM.
+  std::string_view arguments = "echo";
+  char *results = nullptr;
+  size_t results_size = 0;
+  ASSERT_EQ(exports::call_foreign_function_by_id(context, Word(id), address(arguments.data()),
+                                                 Word(arguments.size()), address(&results),
+                                                 address(&results_size))
+                .u64_,
+            static_cast<uint64_t>(WasmResult::Ok));
+  ASSERT_NE(results, nullptr);
+  EXPECT_EQ(std::string_view(results, results_size), "echo");
+  ::free(results);
+
+  // Without a results pointer the result goes to a temporary buffer, only its size is returned.
+  results_size = 0;
+  EXPECT_EQ(exports::call_foreign_function_by_id(context, Word(id), address(arguments.data()),
+                                                 Word(arguments.size()), Word(0),
+                                                 address(&results_size))
+                .u64_,
+            static_cast<uint64_t>(WasmResult::Ok));
+  EXPECT_EQ(results_size, arguments.size());
+  EXPECT_EQ(exports::call_foreign_function_by_id(context, Word(0), address(arguments.data()),
+                                                 Word(arguments.size()), Word(0), Word(0))
+                .u64_,
+            static_cast<uint64_t>(WasmResult::NotFound));
+}
+
+// A VM whose linear memory is an anonymous mapping, as with V8 and WAVM.
+class MappedMemoryVm : public NullVm {
+public:
+  explicit MappedMemoryVm(size_t size) : size_(size) {
+    memory_ = static_cast<char *>(
+        mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  }
+  ~MappedMemoryVm() override { munmap(memory_, size_); }
+
+  uint64_t getMemorySize() override { return size_; }
+  std::optional<std::string_view> getMemory(uint64_t pointer, uint64_t size) override {
+    if (pointer + size > size_) {
+      return std::nullopt;
+    }
+    return std::string_view(memory_ + pointer, size);
+  }
+  uint64_t releaseMemory(uint64_t pointer, uint64_t size) override {
+    return WasmVm::releaseMemory(pointer, size);
+  }
+  std::optional<uint64_t> residentMemory() override { return WasmVm::residentMemory(); }
+  bool prepareMemory(bool huge_pages, bool prefault) override {
+    return WasmVm::prepareMemory(huge_pages, prefault);
+  }
+
+  char *memory_;
+  const size_t size_;
+};
+
+TEST_F(BaseVmTest, ReleaseMemory) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  MappedMemoryVm wasm_vm(8 * page);
+  memset(wasm_vm.memory_, 0xab, 8 * page);
+
+  // Only the pages wholly inside the range are released.
+  EXPECT_EQ(wasm_vm.releaseMemory(page / 2, 3 * page), 2 * page);
+  EXPECT_EQ(wasm_vm.memory_[page - 1], '\xab');
+  EXPECT_EQ(wasm_vm.memory_[page], 0);
+  EXPECT_EQ(wasm_vm.memory_[3 * page - 1], 0);
+  EXPECT_EQ(wasm_vm.memory_[3 * page], '\xab');
+
+  EXPECT_EQ(wasm_vm.releaseMemory(page, page - 1), 0);
+  EXPECT_EQ(wasm_vm.releaseMemory(0, 9 * page), 0);
+}
+
+TEST_F(BaseVmTest, ResidentMemory) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  MappedMemoryVm wasm_vm(8 * page);
+  EXPECT_EQ(wasm_vm.residentMemory(), 0u);
+  memset(wasm_vm.memory_, 0xab, 3 * page);
+  EXPECT_EQ(wasm_vm.residentMemory(), 3 * page);
+  EXPECT_EQ(wasm_vm.releaseMemory(0, 2 * page), 2 * page);
+  EXPECT_EQ(wasm_vm.residentMemory(), page);
+  // Reusing released pages makes them resident again, although linear memory did not grow.
+  memset(wasm_vm.memory_, 0xab, 2 * page);
+  EXPECT_EQ(wasm_vm.residentMemory(), 3 * page);
+
+  EXPECT_EQ(createNullVm()->residentMemory(), std::nullopt);
+}
+
+int memory_reclaims = 0;
+
+class ReclaimNullVmPlugin : public NullVmPlugin {
+public:
+  using NullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override {
+    *f = nullptr;
+    if (function_name == "malloc") {
+      *f = [](ContextBase *, Word) -> Word { return 0; };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallVoid<0> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_memory_reclaim") {
+      // The whole of linear memory is free.
+      *f = [](ContextBase *context) {
+        memory_reclaims++;
+        auto *wasm = context->wasm();
+        wasm->releaseMemory(0, wasm->wasm_vm()->getMemorySize());
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_reclaim_plugin("reclaim_test_plugin", []() {
+  return std::make_unique<ReclaimNullVmPlugin>();
+});
+
+TEST_F(BaseVmTest, IdleMemoryReclaim) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  auto wasm_vm = std::make_unique<MappedMemoryVm>(8 * page);
+  auto *memory = wasm_vm->memory_;
+  auto wasm = std::make_shared<WasmBase>(std::move(wasm_vm), "vm", "", "vm_key");
+  ASSERT_TRUE(wasm->initialize("reclaim_test_plugin", false));
+  std::chrono::steady_clock::time_point now;
+  auto timer_wheel = std::make_shared<TimerWheel>(std::chrono::milliseconds(1), now);
+  wasm->setTimerWheel(timer_wheel);
+  wasm->setMemoryReclaimInterval(std::chrono::milliseconds(10));
+  memory_reclaims = 0;
+  // Not idle: the VM was called by initialize().
+  timer_wheel->advance(now += std::chrono::milliseconds(10));
+
+  memset(memory, 0xab, 4 * page);
+  timer_wheel->advance(now += std::chrono::milliseconds(10));
+  EXPECT_EQ(memory_reclaims, 1);
+  EXPECT_EQ(wasm->memoryReleased(), 8 * page);
+  // Nothing has been touched since.
+  timer_wheel->advance(now += std::chrono::milliseconds(10));
+  EXPECT_EQ(memory_reclaims, 1);
+
+  // A second burst to the same peak is reclaimed too.
+  memset(memory, 0xab, 4 * page);
+  timer_wheel->advance(now += std::chrono::milliseconds(10));
+  EXPECT_EQ(memory_reclaims, 2);
+}
+
+TEST_F(BaseVmTest, PrefaultMemory) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  MappedMemoryVm wasm_vm(64 * page);
+  std::vector<unsigned char> resident(64);
+  ASSERT_EQ(mincore(wasm_vm.memory_, 64 * page, resident.data()), 0);
+  EXPECT_EQ(resident[10] & 1, 0);
+
+  EXPECT_TRUE(wasm_vm.prepareMemory(false, true));
+  ASSERT_EQ(mincore(wasm_vm.memory_, 64 * page, resident.data()), 0);
+  for (auto r : resident) {
+    EXPECT_EQ(r & 1, 1);
+  }
+  EXPECT_EQ(wasm_vm.memory_[10 * page], 0);
+}
+
+class CapabilitiesNullVmPlugin : public NullVmPlugin {
+public:
+  using NullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override {
+    *f = nullptr;
+    if (function_name == "malloc") {
+      *f = [](ContextBase *, Word) -> Word { return 0; };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallVoid<1> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_log") {
+      *f = [](ContextBase *, Word) {};
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallWord<3> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_request_headers") {
+      *f = [](ContextBase *, Word, Word, Word) -> Word { return 0; };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_capabilities_plugin("capabilities_test_plugin", []() {
+  return std::make_unique<CapabilitiesNullVmPlugin>();
+});
+
+// A NullVm which reports the imports of a module, as V8 and WAVM do.
+class ImportListingVm : public NullVm {
+public:
+  bool getImportedFunctionNames(std::vector<std::string> *names) override {
+    *names = {"proxy_log", "proxy_http_call", "proxy_get_property"};
+    return true;
+  }
+};
+
+TEST_F(BaseVmTest, Capabilities) {
+  WasmBase wasm(createNullVm(), "vm", "", "vm_key");
+  ASSERT_TRUE(wasm.initialize("capabilities_test_plugin", false));
+  EXPECT_TRUE(wasm.hasCapability(Capability::Log));
+  EXPECT_TRUE(wasm.hasCapability(Capability::RequestHeaders));
+  EXPECT_FALSE(wasm.hasCapability(Capability::RequestBody));
+  EXPECT_FALSE(wasm.hasCapability(Capability::ResponseHeaders));
+  EXPECT_FALSE(wasm.hasCapability(Capability::Tick));
+  // The NullVm can not list imports, so every import is assumed.
+  EXPECT_TRUE(wasm.hasCapability(Capability::HttpCall));
+  EXPECT_TRUE(wasm.hasCapability(Capability::SharedQueue));
+
+  WasmBase listed(std::make_unique<ImportListingVm>(), "vm", "", "vm_key");
+  ASSERT_TRUE(listed.initialize("capabilities_test_plugin", false));
+  EXPECT_TRUE(listed.hasCapability(Capability::Log));
+  EXPECT_TRUE(listed.hasCapability(Capability::HttpCall));
+  EXPECT_TRUE(listed.hasCapability(Capability::Properties));
+  EXPECT_FALSE(listed.hasCapability(Capability::SharedData));
+  EXPECT_FALSE(listed.hasCapability(Capability::GrpcCall));
+  EXPECT_FALSE(listed.hasCapability(Capability::Metrics));
+}
+
+TEST_F(BaseVmTest, FuelBudgetNeedsMeteredBaseVm) {
+  auto factory = [](std::string_view vm_key) {
+    return std::make_shared<WasmHandleBase>(
+        std::make_shared<WasmBase>(createNullVm(), "vm", "", vm_key));
+  };
+  auto clone_factory = [](std::shared_ptr<WasmHandleBase> base_wasm) {
+    return std::make_shared<WasmHandleBase>(
+        std::make_shared<WasmBase>(base_wasm, []() { return createNullVm(); }));
+  };
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto metered_plugin = std::make_shared<PluginBase>("metered", "root", "vm", "null", "", false);
+  metered_plugin->fuel_budget_ = 1000;
+  auto vm_key = makeVmKey("vm", "", "capabilities_test_plugin");
+
+  auto base_wasm = createWasm(vm_key, "capabilities_test_plugin", plugin, factory, clone_factory,
+                              false);
+  ASSERT_TRUE(base_wasm);
+  EXPECT_FALSE(base_wasm->wasm()->wasm_vm()->fuelMetering());
+  // The budget could not be applied to the cached, unmetered, VM.
+  EXPECT_FALSE(createWasm(vm_key, "capabilities_test_plugin", metered_plugin, factory,
+                          clone_factory, false));
+  EXPECT_EQ(createWasm(vm_key, "capabilities_test_plugin", plugin, factory, clone_factory, false),
+            base_wasm);
+  base_wasm.reset();
+
+  base_wasm = createWasm(vm_key, "capabilities_test_plugin", metered_plugin, factory,
+                         clone_factory, false);
+  ASSERT_TRUE(base_wasm);
+  EXPECT_TRUE(base_wasm->wasm()->wasm_vm()->fuelMetering());
+  EXPECT_EQ(createWasm(vm_key, "capabilities_test_plugin", metered_plugin, factory, clone_factory,
+                       false),
+            base_wasm);
+  base_wasm.reset();
+  clearWasmCachesForTesting();
+}
+
+// The order in which the VM's memory is prepared and guest code runs.
+std::vector<std::string> memory_events;
+
+class PrepareMemoryNullVmPlugin : public NullVmPlugin {
+public:
+  using NullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallVoid<0> *f) override {
+    *f = nullptr;
+    if (function_name == "_start") {
+      *f = [](ContextBase *) { memory_events.push_back("_start"); };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallWord<1> *f) override {
+    *f = nullptr;
+    if (function_name == "malloc") {
+      *f = [](ContextBase *, Word) -> Word { return 0; };
+    }
+  }
+  void getFunction(std::string_view function_name, WasmCallVoid<2> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_context_create") {
+      *f = [](ContextBase *, Word, Word) { memory_events.push_back("proxy_on_context_create"); };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_prepare_memory_plugin("prepare_memory_test_plugin", []() {
+  return std::make_unique<PrepareMemoryNullVmPlugin>();
+});
+
+// A NullVm which records when its memory is prepared.
+class PrepareRecordingVm : public NullVm {
+public:
+  // Clones are made with the factory, so that they record too.
+  Cloneable cloneable() override { return Cloneable::NotCloneable; }
+  bool prepareMemory(bool, bool) override {
+    memory_events.push_back("prepare");
+    return true;
+  }
+};
+
+TEST_F(BaseVmTest, PrepareMemoryBeforePluginStart) {
+  auto factory = [](std::string_view vm_key) {
+    return std::make_shared<WasmHandleBase>(
+        std::make_shared<WasmBase>(std::make_unique<PrepareRecordingVm>(), "vm", "", vm_key));
+  };
+  auto clone_factory = [](std::shared_ptr<WasmHandleBase> base_wasm) {
+    return std::make_shared<WasmHandleBase>(std::make_shared<WasmBase>(
+        base_wasm, []() { return std::make_unique<PrepareRecordingVm>(); }));
+  };
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  plugin->memory_prefault_ = true;
+  auto base_wasm = createWasm(makeVmKey("vm", "", "prepare_memory_test_plugin"),
+                              "prepare_memory_test_plugin", plugin, factory, clone_factory, false);
+  ASSERT_TRUE(base_wasm);
+  memory_events.clear();
+  auto wasm_handle = getOrCreateThreadLocalWasm(base_wasm, plugin, clone_factory);
+  ASSERT_TRUE(wasm_handle);
+  // The constructors run in initialize(), before the memory is prepared, but the plugin is only
+  // started after.
+  EXPECT_EQ(memory_events,
+            (std::vector<std::string>{"_start", "prepare", "proxy_on_context_create"}));
+  wasm_handle.reset();
+  base_wasm.reset();
+  clearWasmCachesForTesting();
 }
 
 } // namespace proxy_wasm
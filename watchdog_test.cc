@@ -0,0 +1,231 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "include/proxy-wasm/watchdog.h"
+
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "include/proxy-wasm/null.h"
+#include "include/proxy-wasm/null_vm.h"
+#include "include/proxy-wasm/wasm.h"
+#include "include/proxy-wasm/wasm_vm.h"
+#include "test_wasm.h"
+
+namespace proxy_wasm {
+namespace {
+
+TEST(ExecutionDeadline, Disabled) {
+  auto wasm_vm = createTestVm();
+  auto count = getExecutionTimeoutCount();
+  {
+    ExecutionDeadline deadline(wasm_vm.get(), std::chrono::milliseconds(0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_FALSE(deadline.expired());
+  }
+  EXPECT_FALSE(wasm_vm->isFailed());
+  EXPECT_EQ(getExecutionTimeoutCount(), count);
+}
+
+TEST(ExecutionDeadline, NotExpired) {
+  auto wasm_vm = createTestVm();
+  auto count = getExecutionTimeoutCount();
+  { ExecutionDeadline deadline(wasm_vm.get(), std::chrono::milliseconds(60000)); }
+  EXPECT_FALSE(wasm_vm->isFailed());
+  EXPECT_EQ(getExecutionTimeoutCount(), count);
+}
+
+TEST(ExecutionDeadline, ExpiredFailsVm) {
+  auto wasm_vm = createTestVm();
+  auto count = getExecutionTimeoutCount();
+  {
+    ExecutionDeadline later(wasm_vm.get(), std::chrono::milliseconds(60000));
+    ExecutionDeadline deadline(wasm_vm.get(), std::chrono::milliseconds(1));
+    while (!deadline.expired()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_FALSE(later.expired());
+  }
+  EXPECT_TRUE(wasm_vm->isFailed());
+  EXPECT_EQ(getExecutionTimeoutCount(), count + 1);
+  auto *integration = static_cast<TestIntegration *>(wasm_vm->integration().get());
+  EXPECT_EQ(integration->last_error_, "Function exceeded the execution deadline of 1ms");
+}
+
+// A VM which records terminate() rather than aborting anything.
+struct TerminateVm : public NullVm {
+  bool terminate() override {
+    terminated++;
+    return true;
+  }
+  int terminated = 0;
+};
+
+TEST(RequestTermination, Idle) {
+  TerminateVm wasm_vm;
+  wasm_vm.requestTermination();
+  EXPECT_EQ(wasm_vm.terminated, 0);
+  EXPECT_FALSE(WasmVm::GuestCallScope(&wasm_vm).entered());
+}
+
+TEST(RequestTermination, InGuestCode) {
+  TerminateVm wasm_vm;
+  // Calls are only tracked while a deadline is armed; this one does not expire.
+  ExecutionDeadline deadline(&wasm_vm, std::chrono::hours(1));
+  {
+    WasmVm::GuestCallScope guest_call(&wasm_vm);
+    ASSERT_TRUE(guest_call.entered());
+    wasm_vm.requestTermination();
+    EXPECT_EQ(wasm_vm.terminated, 1);
+    wasm_vm.requestTermination();
+    EXPECT_EQ(wasm_vm.terminated, 1);
+    EXPECT_FALSE(HostCallScope().entered());
+  }
+  EXPECT_EQ(wasm_vm.terminated, 1);
+}
+
+TEST(RequestTermination, DeferredDuringHostCall) {
+  TerminateVm wasm_vm;
+  ExecutionDeadline deadline(&wasm_vm, std::chrono::hours(1));
+  {
+    WasmVm::GuestCallScope guest_call(&wasm_vm);
+    {
+      HostCallScope host_call;
+      ASSERT_TRUE(host_call.entered());
+      {
+        // e.g. malloc() called by the host to copy data into the VM.
+        WasmVm::GuestCallScope nested_guest_call(&wasm_vm);
+        ASSERT_TRUE(nested_guest_call.entered());
+        HostCallScope nested_host_call;
+        ASSERT_TRUE(nested_host_call.entered());
+        wasm_vm.requestTermination();
+        EXPECT_EQ(wasm_vm.terminated, 0);
+        EXPECT_FALSE(HostCallScope().entered());
+        EXPECT_FALSE(WasmVm::GuestCallScope(&wasm_vm).entered());
+      }
+      // Still below the outer host call.
+      EXPECT_EQ(wasm_vm.terminated, 0);
+    }
+    // Back in guest code.
+    EXPECT_EQ(wasm_vm.terminated, 1);
+  }
+  EXPECT_EQ(wasm_vm.terminated, 1);
+}
+
+TEST(RequestTermination, HostCallOutsideGuestCall) {
+  TerminateVm wasm_vm;
+  wasm_vm.requestTermination();
+  // Not a call from a VM, e.g. a Null VM plugin calling the host directly.
+  EXPECT_TRUE(HostCallScope().entered());
+}
+
+constexpr char kPluginName[] = "watchdog_test_plugin";
+
+// How long proxy_on_request_headers runs for.
+std::chrono::milliseconds headers_time(0);
+
+class DeadlineNullVmPlugin : public TestNullVmPlugin {
+public:
+  using TestNullVmPlugin::getFunction;
+  void getFunction(std::string_view function_name, WasmCallWord<3> *f) override {
+    *f = nullptr;
+    if (function_name == "proxy_on_request_headers") {
+      *f = [](ContextBase *, Word, Word, Word) -> Word {
+        std::this_thread::sleep_for(headers_time);
+        return Word(static_cast<uint64_t>(FilterHeadersStatus::StopAllIterationAndBuffer));
+      };
+    }
+  }
+};
+
+RegisterNullVmPluginFactory register_test_plugin(kPluginName, []() {
+  return std::make_unique<DeadlineNullVmPlugin>();
+});
+
+class DeadlineContext : public TestContext {
+public:
+  using TestContext::TestContext;
+
+  void failStream(WasmStreamType) override { failed_streams_++; }
+
+  int failed_streams_ = 0;
+};
+
+// The Null VM can not be preempted, so the plugin overruns and the deadline is acted on when the
+// call returns: its result is not used and the stream fails open or closed.
+class ContextDeadlineTest : public testing::TestWithParam<bool> {};
+
+TEST_P(ContextDeadlineTest, Expired) {
+  bool fail_open = GetParam();
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", fail_open);
+  plugin->execution_timeout_ = std::chrono::milliseconds(1);
+  auto wasm = createTestWasm<WasmBase>(kPluginName, plugin);
+  ASSERT_TRUE(wasm);
+  auto count = getExecutionTimeoutCount();
+
+  DeadlineContext stream(wasm.get(), wasm->getRootContext("root")->id(), plugin);
+  stream.onCreate();
+  headers_time = std::chrono::milliseconds(0);
+  EXPECT_EQ(stream.onRequestHeaders(1, false), FilterHeadersStatus::StopAllIterationAndBuffer);
+  EXPECT_FALSE(wasm->isFailed());
+
+  headers_time = std::chrono::milliseconds(50);
+  EXPECT_EQ(stream.onRequestHeaders(1, false), fail_open ? FilterHeadersStatus::Continue
+                                                         : FilterHeadersStatus::StopIteration);
+  EXPECT_TRUE(wasm->isFailed());
+  EXPECT_EQ(stream.failed_streams_, fail_open ? 0 : 1);
+  EXPECT_EQ(getExecutionTimeoutCount(), count + 1);
+
+  // Later calls are not made.
+  headers_time = std::chrono::milliseconds(0);
+  EXPECT_EQ(stream.onRequestHeaders(1, true), fail_open ? FilterHeadersStatus::Continue
+                                                        : FilterHeadersStatus::StopIteration);
+  EXPECT_EQ(stream.failed_streams_, fail_open ? 0 : 2);
+}
+
+INSTANTIATE_TEST_SUITE_P(FailOpen, ContextDeadlineTest, testing::Bool());
+
+// Stands in for WAVM, which can not preempt guest code.
+struct UnpreemptibleVm : public NullVm {
+  bool supportsExecutionTimeout() override { return false; }
+};
+
+TEST(ExecutionDeadline, RejectedByRuntimeWhichCanNotEnforceIt) {
+  auto factory = [](std::string_view vm_key) {
+    auto wasm_vm = std::make_unique<UnpreemptibleVm>();
+    wasm_vm->integration().reset(new TestIntegration());
+    return std::make_shared<WasmHandleBase>(
+        std::make_shared<TestWasm<>>(std::move(wasm_vm), "vm", "", vm_key));
+  };
+  auto clone_factory = [](std::shared_ptr<WasmHandleBase> base_wasm) {
+    return std::make_shared<WasmHandleBase>(std::make_shared<TestWasm<>>(base_wasm, [] {
+      auto wasm_vm = std::make_unique<UnpreemptibleVm>();
+      wasm_vm->integration().reset(new TestIntegration());
+      return std::unique_ptr<WasmVm>(std::move(wasm_vm));
+    }));
+  };
+  auto vm_key = makeVmKey("unpreemptible", "", kPluginName);
+  auto plugin = std::make_shared<PluginBase>("plugin", "root", "vm", "null", "", false);
+  auto limited_plugin = std::make_shared<PluginBase>("limited", "root", "vm", "null", "", false);
+  limited_plugin->execution_timeout_ = std::chrono::milliseconds(1000);
+
+  EXPECT_FALSE(createWasm(vm_key, kPluginName, limited_plugin, factory, clone_factory, false));
+  auto base_wasm = createWasm(vm_key, kPluginName, plugin, factory, clone_factory, false);
+  ASSERT_TRUE(base_wasm);
+  EXPECT_FALSE(createWasm(vm_key, kPluginName, limited_plugin, factory, clone_factory, false));
+  EXPECT_EQ(createWasm(vm_key, kPluginName, plugin, factory, clone_factory, false), base_wasm);
+}
+
+} // namespace
+} // namespace proxy_wasm